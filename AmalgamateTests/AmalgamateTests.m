@@ -8,6 +8,7 @@
 
 #import <XCTest/XCTest.h>
 #include "amg.h"
+#include <locale.h>
 
 @interface AmalgamateTests : XCTestCase
 
@@ -38,4 +39,1311 @@
     }
 }
 
+static size_t enumerated_record_count;
+
+static void count_record(ds_record_t *record)
+{
+    (void)record;
+    ++enumerated_record_count;
+}
+
+- (void)testCursorMatchesEnumeration
+{
+    NSArray *paths = [[NSBundle bundleForClass:self.class] pathsForResourcesOfType:@"DS_Store" inDirectory:nil];
+    for (NSString *path in paths) {
+        ds_store_t *store = ds_store_open_mapped(path.fileSystemRepresentation);
+        XCTAssertTrue(store != NULL);
+
+        enumerated_record_count = 0;
+        XCTAssertEqual(ds_store_enum_records(store, count_record), 0);
+
+        ds_store_cursor_t *cursor = ds_store_cursor_create(store);
+        ds_record_t *record = ds_record_create();
+
+        // Stop after the first record, then resume where we left off
+        size_t count = 0;
+        XCTAssertEqual(ds_store_cursor_next(cursor, record), 1);
+        ++count;
+        int status;
+        while ((status = ds_store_cursor_next(cursor, record)) > 0)
+            ++count;
+        XCTAssertEqual(status, 0);
+        XCTAssertEqual(count, enumerated_record_count);
+
+        ds_record_free(record);
+        ds_store_cursor_free(cursor);
+        ds_store_free(store);
+    }
+}
+
+static ds_store_cursor_t *expected_cursor;
+static ds_record_t *expected_record;
+static size_t out_of_order_count;
+
+static void check_record_order(ds_record_t *record)
+{
+    if (ds_store_cursor_next(expected_cursor, expected_record) != 1 || ds_record_compare(record, expected_record) != 0)
+        ++out_of_order_count;
+}
+
+- (void)testParallelEnumerationOrder
+{
+    NSArray *paths = [[NSBundle bundleForClass:self.class] pathsForResourcesOfType:@"DS_Store" inDirectory:nil];
+    for (NSString *path in paths) {
+        ds_store_t *store = ds_store_open_mapped(path.fileSystemRepresentation);
+        XCTAssertTrue(store != NULL);
+
+        expected_cursor = ds_store_cursor_create(store);
+        expected_record = ds_record_create();
+        out_of_order_count = 0;
+        XCTAssertEqual(ds_store_enum_records_parallel(store, 4, check_record_order), 0);
+        XCTAssertEqual(out_of_order_count, 0);
+        XCTAssertEqual(ds_store_cursor_next(expected_cursor, expected_record), 0);
+
+        ds_record_free(expected_record);
+        ds_store_cursor_free(expected_cursor);
+        ds_store_free(store);
+    }
+}
+
+static size_t icvp_record_count;
+static size_t icvp_lookup_failure_count;
+
+static void check_icvp_keys(ds_record_t *record)
+{
+    if (ds_record_get_type(record) != ds_record_type_icvp)
+        return;
+
+    ++icvp_record_count;
+
+    bplist_t plist;
+    uint64_t value;
+    if (bplist_open(&plist, ds_record_get_data_as_blob_ptr(record), ds_record_get_data_as_blob_size(record)) != 0
+        || bplist_dict_find(&plist, plist.top_object, "arrangeBy", &value) != 1
+        || bplist_get_type(&plist, value) != bplist_type_string
+        || bplist_dict_find(&plist, plist.top_object, "gridSpacing", &value) != 1
+        || bplist_get_type(&plist, value) != bplist_type_int
+        || bplist_dict_find(&plist, plist.top_object, "noSuchKey", &value) != 0)
+        ++icvp_lookup_failure_count;
+}
+
+- (void)testBinaryPlistKeyLookup
+{
+    NSArray *paths = [[NSBundle bundleForClass:self.class] pathsForResourcesOfType:@"DS_Store" inDirectory:nil];
+    icvp_record_count = 0;
+    icvp_lookup_failure_count = 0;
+    for (NSString *path in paths) {
+        ds_store_t *store = ds_store_open_mapped(path.fileSystemRepresentation);
+        XCTAssertTrue(store != NULL);
+        XCTAssertEqual(ds_store_enum_records(store, check_icvp_keys), 0);
+        ds_store_free(store);
+    }
+
+    XCTAssertTrue(icvp_record_count > 0);
+    XCTAssertEqual(icvp_lookup_failure_count, 0);
+}
+
+- (void)testBinaryPlistSharedObjects
+{
+    // A chain of arrays that each refer twice to the next: 2^40 objects if
+    // every reference were expanded
+    enum { levels = 40 };
+    unsigned char plist[8 + levels * 3 + 2 + levels + 1 + 32] = "bplist00";
+    size_t size = 8, offsets[levels + 1];
+    for (size_t i = 0; i < levels; ++i) {
+        offsets[i] = size;
+        plist[size++] = 0xA2;
+        plist[size++] = (unsigned char)(i + 1);
+        plist[size++] = (unsigned char)(i + 1);
+    }
+    offsets[levels] = size;
+    plist[size++] = 0x10;
+    plist[size++] = 0;
+    const size_t offset_table = size;
+    for (size_t i = 0; i <= levels; ++i)
+        plist[size++] = (unsigned char)offsets[i];
+    memset(plist + size, 0, 32);
+    plist[size + 6] = 1;
+    plist[size + 7] = 1;
+    plist[size + 15] = levels + 1;
+    plist[size + 31] = (unsigned char)offset_table;
+    size += 32;
+
+    const uint16_t dot[] = { '.' };
+    ds_record_t *record = ds_record_create();
+    ds_record_set_filename(record, dot, 1);
+    ds_record_set_type(record, ds_record_type_bwsp);
+    ds_record_set_data_type(record, ds_record_data_type_blob);
+    ds_record_set_data_as_blob(record, plist, size);
+
+    // Decoding gives up and the blob is written as data instead
+    FILE *file = tmpfile();
+    XCTAssertEqual(amg_convert_record(record, "json", file), 0);
+    XCTAssertTrue(ftell(file) < 1024);
+    fclose(file);
+    ds_record_free(record);
+}
+
+static size_t iloc_record_count;
+static size_t filtered_record_count;
+static size_t filtered_mismatch_count;
+
+static void count_iloc_record(ds_record_t *record)
+{
+    if (ds_record_get_type(record) == ds_record_type_Iloc)
+        ++iloc_record_count;
+}
+
+static void check_filtered_record(ds_record_t *record)
+{
+    ++filtered_record_count;
+    if (ds_record_get_type(record) != ds_record_type_Iloc || ds_record_get_data_as_blob_size(record) != 0)
+        ++filtered_mismatch_count;
+}
+
+- (void)testFilteredEnumeration
+{
+    NSArray *paths = [[NSBundle bundleForClass:self.class] pathsForResourcesOfType:@"DS_Store" inDirectory:nil];
+    for (NSString *path in paths) {
+        ds_store_t *store = ds_store_open_mapped(path.fileSystemRepresentation);
+        XCTAssertTrue(store != NULL);
+
+        iloc_record_count = 0;
+        XCTAssertEqual(ds_store_enum_records(store, count_iloc_record), 0);
+
+        const ds_record_type types[] = { ds_record_type_Iloc };
+        ds_record_filter_t filter;
+        ds_record_filter_init(&filter);
+        filter.record_types = types;
+        filter.record_type_count = 1;
+        filter.fields = ds_record_field_filename;
+
+        filtered_record_count = 0;
+        filtered_mismatch_count = 0;
+        XCTAssertEqual(ds_store_enum_records_filtered(store, &filter, check_filtered_record), 0);
+        XCTAssertEqual(filtered_record_count, iloc_record_count);
+        XCTAssertEqual(filtered_mismatch_count, 0);
+
+        ds_store_free(store);
+    }
+}
+
+- (void)testFindEveryRecord
+{
+    NSArray *paths = [[NSBundle bundleForClass:self.class] pathsForResourcesOfType:@"DS_Store" inDirectory:nil];
+    for (NSString *path in paths) {
+        ds_store_t *store = ds_store_open_mapped(path.fileSystemRepresentation);
+        XCTAssertTrue(store != NULL);
+
+        ds_store_cursor_t *cursor = ds_store_cursor_create(store);
+        ds_record_t *record = ds_record_create();
+        ds_record_t *found = ds_record_create();
+        while (ds_store_cursor_next(cursor, record) > 0) {
+            XCTAssertEqual(ds_store_find(store, ds_record_get_filename_ptr(record), ds_record_get_filename_len(record), ds_record_get_type(record), found), 1);
+            XCTAssertEqual(ds_record_compare(record, found), 0);
+        }
+
+        const uint16_t missing[] = { 'z', 'z', 'z' };
+        XCTAssertEqual(ds_store_find(store, missing, 3, ds_record_type_Iloc, found), 0);
+
+        ds_record_free(found);
+        ds_record_free(record);
+        ds_store_cursor_free(cursor);
+        ds_store_free(store);
+    }
+}
+
+- (void)testFindFoldsCase
+{
+    // Names that differ in the case of a non-ASCII letter are the same key,
+    // whatever the locale
+    setlocale(LC_ALL, "C");
+    const uint16_t stored[] = { 0xC9, 'c', 'l', 'a', 'i', 'r' };
+    const uint16_t folded[] = { 0xE9, 'C', 'L', 'A', 'I', 'R' };
+
+    ds_store_t *store = ds_store_create();
+    ds_record_t *record = ds_record_create();
+    ds_record_set_filename(record, stored, 6);
+    ds_record_set_type(record, ds_record_type_cmmt);
+    ds_record_set_data_type(record, ds_record_data_type_ustr);
+    ds_record_set_data_as_ustr(record, stored, 6);
+    XCTAssertEqual(ds_store_insert_record(store, record), 0);
+    XCTAssertEqual(ds_store_insert_record(store, record), 1);
+
+    ds_record_set_filename(record, folded, 6);
+    XCTAssertEqual(ds_store_insert_record(store, record), 1);
+
+    ds_record_t *found = ds_record_create();
+    XCTAssertEqual(ds_store_find(store, folded, 6, ds_record_type_cmmt, found), 1);
+    XCTAssertEqual(ds_record_get_filename_ptr(found)[0], 0xC9);
+    XCTAssertEqual(amg_utf16_fold_case(0x0394), 0x03B4);
+    XCTAssertEqual(amg_utf16_fold_case(0x03B4), 0x03B4);
+
+    ds_record_free(found);
+    ds_record_free(record);
+    ds_store_free(store);
+}
+
+- (void)testFilenameUTF8
+{
+    // ASCII long enough for the vector path, then a two-byte character, a
+    // surrogate pair and an unpaired surrogate
+    const uint16_t filename[] = { 'F', 'i', 'l', 'e', 'n', 'a', 'm', 'e', '-', '1', 0x00E9, 0xD83D, 0xDE00, 0xD800 };
+    const char expected[] = "Filename-1\xC3\xA9\xF0\x9F\x98\x80\xEF\xBF\xBD";
+
+    ds_record_t *record = ds_record_create();
+    ds_record_set_filename(record, filename, sizeof(filename) / sizeof(filename[0]));
+    XCTAssertEqual(ds_record_get_filename_utf8_len(record), strlen(expected));
+    XCTAssertEqual(strcmp(ds_record_get_filename_utf8(record), expected), 0);
+
+    ds_record_set_filename(record, filename, 4);
+    XCTAssertEqual(strcmp(ds_record_get_filename_utf8(record), "File"), 0);
+    ds_record_free(record);
+}
+
+- (void)testRecordViews
+{
+    NSArray *paths = [[NSBundle bundleForClass:self.class] pathsForResourcesOfType:@"DS_Store" inDirectory:nil];
+    for (NSString *path in paths) {
+        ds_store_t *store = ds_store_open_mapped(path.fileSystemRepresentation);
+        XCTAssertTrue(store != NULL);
+
+        ds_store_cursor_t *cursor = ds_store_cursor_create(store);
+        ds_store_cursor_t *view_cursor = ds_store_cursor_create(store);
+        ds_record_t *record = ds_record_create();
+        ds_record_t *copy = ds_record_create();
+        ds_record_view_t view;
+        while (ds_store_cursor_next(cursor, record) > 0) {
+            XCTAssertEqual(ds_store_cursor_next_view(view_cursor, &view), 1);
+            XCTAssertEqual(view.record_type, ds_record_get_type(record));
+            XCTAssertEqual(view.data_type, ds_record_get_data_type(record));
+
+            char filename[1024 * 3];
+            const size_t filename_len = ds_record_view_copy_filename_utf8(&view, filename);
+            XCTAssertEqual(filename_len, ds_record_get_filename_utf8_len(record));
+            XCTAssertEqual(memcmp(filename, ds_record_get_filename_utf8(record), filename_len), 0);
+
+            XCTAssertEqual(ds_record_set_from_view(copy, &view), 0);
+            XCTAssertEqual(ds_record_compare(copy, record), 0);
+        }
+        XCTAssertEqual(ds_store_cursor_next_view(view_cursor, &view), 0);
+
+        ds_record_free(copy);
+        ds_record_free(record);
+        ds_store_cursor_free(view_cursor);
+        ds_store_cursor_free(cursor);
+        ds_store_free(store);
+    }
+}
+
+- (void)testBookmark
+{
+    // A header, the offset of the first table of contents, one string item
+    // and two chained tables of contents of one entry each
+    const unsigned char data[] = {
+        'b', 'o', 'o', 'k', 0x84, 0, 0, 0, 0, 0, 0x04, 0x10, 0x30, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0x14, 0, 0, 0,
+        0x05, 0, 0, 0, 0x01, 0x01, 0, 0, 'h', 'e', 'l', 'l', 'o', 0, 0, 0,
+        0x20, 0, 0, 0, 0xfe, 0xff, 0xff, 0xff, 0x01, 0, 0, 0, 0x34, 0, 0, 0, 0x01, 0, 0, 0,
+        0x02, 0x10, 0, 0, 0x04, 0, 0, 0, 0, 0, 0, 0,
+        0x20, 0, 0, 0, 0xfe, 0xff, 0xff, 0xff, 0x02, 0, 0, 0, 0, 0, 0, 0, 0x01, 0, 0, 0,
+        0x20, 0x20, 0, 0, 0x04, 0, 0, 0, 0, 0, 0, 0,
+    };
+
+    bookmark_t bookmark;
+    XCTAssertEqual(bookmark_open(&bookmark, data, sizeof(data)), 0);
+    XCTAssertEqual(bookmark.header_size, 48u);
+
+    bookmark_toc_t toc;
+    XCTAssertEqual(bookmark_first_toc(&bookmark, &toc), 1);
+    XCTAssertEqual(toc.count, 1u);
+    XCTAssertEqual(bookmark_next_toc(&bookmark, &toc, &toc), 1);
+    XCTAssertEqual(toc.identifier, 2u);
+    XCTAssertEqual(bookmark_next_toc(&bookmark, &toc, &toc), 0);
+
+    bookmark_item_t item;
+    XCTAssertEqual(bookmark_find(&bookmark, 0x2020, &item), 1);
+    XCTAssertEqual(item.type, (uint32_t)pBBk_string);
+    XCTAssertEqual(item.value_size, 5u);
+    XCTAssertEqual(memcmp(item.value, "hello", 5), 0);
+    XCTAssertEqual(bookmark_find(&bookmark, 0x3030, &item), 0);
+
+    // Cut off inside the second table of contents
+    XCTAssertEqual(bookmark_open(&bookmark, data, sizeof(data) - 8), 0);
+    XCTAssertEqual(bookmark_first_toc(&bookmark, &toc), 1);
+    XCTAssertEqual(bookmark_next_toc(&bookmark, &toc, &toc), -1);
+}
+
+- (void)testAliasMetadata
+{
+    NSString *path = [[NSBundle bundleForClass:self.class] pathForResource:@"Silverlock2" ofType:@"DS_Store"];
+    ds_store_t *store = ds_store_open_mapped(path.fileSystemRepresentation);
+    XCTAssertTrue(store != NULL);
+
+    const uint16_t dot[] = { '.' };
+    ds_record_t *record = ds_record_create();
+    XCTAssertEqual(ds_store_find(store, dot, 1, ds_record_type_pict, record), 1);
+
+    alias_t *alias = alias_create_from_data(ds_record_get_data_as_blob_ptr(record), ds_record_get_data_as_blob_size(record));
+    XCTAssertTrue(alias != NULL);
+    XCTAssertEqual(alias_get_metadata_count(alias), 10u);
+
+    // The entries refer into the alias, not into the record it was read from
+    ds_record_free(record);
+
+    const unsigned char *value;
+    size_t length;
+    XCTAssertEqual(alias_find_metadata(alias, alias_tag_posix_path, &value, &length), 1);
+    XCTAssertEqual(length, strlen("/.background/backgroundImage.tiff"));
+    XCTAssertEqual(memcmp(value, "/.background/backgroundImage.tiff", length), 0);
+
+    XCTAssertEqual(alias_find_metadata(alias, alias_tag_cnid_path, &value, &length), 1);
+    XCTAssertEqual(length, 4u);
+    XCTAssertEqual(value[3], 19);
+
+    int16_t tag;
+    XCTAssertEqual(alias_get_metadata(alias, 9, &tag, &value, &length), 0);
+    XCTAssertEqual(tag, (int16_t)alias_tag_recursive_alias);
+    XCTAssertEqual(alias_get_metadata(alias, 10, &tag, &value, &length), 1);
+    XCTAssertEqual(alias_find_metadata(alias, alias_tag_dialup_info, &value, &length), 0);
+
+    alias_free(alias);
+    ds_store_free(store);
+}
+
+- (void)testDecodeCache
+{
+    NSString *path = [[NSBundle bundleForClass:self.class] pathForResource:@"Silverlock2" ofType:@"DS_Store"];
+    ds_store_t *store = ds_store_open_mapped(path.fileSystemRepresentation);
+    XCTAssertTrue(store != NULL);
+
+    const uint16_t dot[] = { '.' };
+    ds_record_t *record = ds_record_create();
+    XCTAssertEqual(ds_store_find(store, dot, 1, ds_record_type_pict, record), 1);
+
+    // Uncached, then decoded into the cache, then read back from it
+    FILE *file = tmpfile();
+    long ends[3];
+    for (int i = 0; i < 3; ++i) {
+        if (i == 1)
+            amg_decode_cache_enable(1 << 20);
+        XCTAssertEqual(amg_convert_record(record, "json", file), 0);
+        ends[i] = ftell(file);
+    }
+
+    amg_decode_cache_stats_t stats;
+    amg_decode_cache_get_stats(&stats);
+    XCTAssertEqual(stats.hits, 1u);
+    XCTAssertEqual(stats.misses, 1u);
+    XCTAssertEqual(stats.entries, 1u);
+    amg_decode_cache_disable();
+
+    const long length = ends[0];
+    XCTAssertEqual(ends[1], 2 * length);
+    XCTAssertEqual(ends[2], 3 * length);
+    char *json = malloc(ends[2]);
+    rewind(file);
+    XCTAssertEqual(fread(json, 1, ends[2], file), (size_t)ends[2]);
+    XCTAssertEqual(memcmp(json, json + length, length), 0);
+    XCTAssertEqual(memcmp(json, json + 2 * length, length), 0);
+    free(json);
+    fclose(file);
+
+    ds_record_free(record);
+    ds_store_free(store);
+}
+
+- (void)testStoreStats
+{
+    NSString *path = [[NSBundle bundleForClass:self.class] pathForResource:@"Silverlock2" ofType:@"DS_Store"];
+    ds_store_stats_t stats;
+
+    ds_store_t *unmeasured = ds_store_open_mapped(path.fileSystemRepresentation);
+    XCTAssertEqual(ds_store_get_stats(unmeasured, &stats), 1);
+    ds_store_free(unmeasured);
+
+    ds_store_set_stats_enabled(1);
+    ds_store_t *store = ds_store_open_mapped(path.fileSystemRepresentation);
+    ds_store_set_stats_enabled(0);
+    XCTAssertTrue(store != NULL);
+
+    enumerated_record_count = 0;
+    XCTAssertEqual(ds_store_enum_records(store, count_record), 0);
+
+    const uint16_t dot[] = { '.' };
+    ds_record_t *record = ds_record_create();
+    XCTAssertEqual(ds_store_find(store, dot, 1, ds_record_type_pict, record), 1);
+
+    XCTAssertEqual(ds_store_get_stats(store, &stats), 0);
+    XCTAssertEqual(stats.stores, 1u);
+    XCTAssertEqual(stats.file_reads, 0u);
+    XCTAssertTrue(stats.bytes_read > 0);
+    XCTAssertEqual(stats.nodes_visited, 2u);
+    XCTAssertEqual(stats.records_decoded, enumerated_record_count + 1);
+
+    uint64_t records = 0, blob_bytes = 0;
+    for (size_t i = 0; i < stats.type_count; ++i) {
+        records += stats.types[i].records;
+        blob_bytes += stats.types[i].blob_bytes;
+        if (stats.types[i].record_type == ds_record_type_pict)
+            XCTAssertEqual(stats.types[i].records, 2u);
+    }
+    XCTAssertEqual(records, stats.records_decoded);
+    XCTAssertEqual(blob_bytes, stats.blob_bytes);
+
+    ds_record_free(record);
+    ds_store_free(store);
+}
+
+- (void)testStoreStatsManyTypes
+{
+    NSString *outputPath = [NSTemporaryDirectory() stringByAppendingPathComponent:@"AmalgamateTests.types.DS_Store"];
+    const size_t type_count = DS_STORE_STATS_MAX_TYPES + 6;
+
+    // One record of each of more types than get an entry of their own
+    ds_store_t *created = ds_store_create();
+    ds_record_t *record = ds_record_create();
+    const uint16_t dot[] = { '.' };
+    ds_record_set_filename(record, dot, 1);
+    ds_record_set_data_type(record, ds_record_data_type_bool);
+    for (size_t i = 0; i < type_count; ++i) {
+        ds_record_set_type(record, (ds_record_type)(FOUR_CHAR_CODE('xx00') + ((i / 10) << 8) + i % 10));
+        XCTAssertEqual(ds_store_insert_record(created, record), 0);
+    }
+    ds_record_free(record);
+
+    FILE *file = fopen(outputPath.fileSystemRepresentation, "wb");
+    XCTAssertTrue(file != NULL);
+    XCTAssertEqual(ds_store_fwrite(created, file), 0);
+    fclose(file);
+    ds_store_free(created);
+
+    ds_store_set_stats_enabled(1);
+    ds_store_t *store = ds_store_open_mapped(outputPath.fileSystemRepresentation);
+    ds_store_set_stats_enabled(0);
+    XCTAssertTrue(store != NULL);
+    XCTAssertEqual(ds_store_enum_records(store, NULL), 0);
+
+    ds_store_stats_t stats;
+    XCTAssertEqual(ds_store_get_stats(store, &stats), 0);
+    XCTAssertEqual(stats.records_decoded, type_count);
+    XCTAssertEqual(stats.type_count, (size_t)DS_STORE_STATS_MAX_TYPES);
+    XCTAssertEqual(stats.types[DS_STORE_STATS_MAX_TYPES - 1].record_type, 0);
+    XCTAssertEqual(stats.types[DS_STORE_STATS_MAX_TYPES - 1].records, 7u);
+    ds_store_free(store);
+
+    [[NSFileManager defaultManager] removeItemAtPath:outputPath error:nil];
+}
+
+- (void)testTrace
+{
+    NSString *path = [[NSBundle bundleForClass:self.class] pathForResource:@"Silverlock2" ofType:@"DS_Store"];
+
+    amg_trace_start(0);
+    ds_store_t *store = ds_store_open_mapped(path.fileSystemRepresentation);
+    XCTAssertTrue(store != NULL);
+    XCTAssertEqual(ds_store_enum_records(store, NULL), 0);
+    ds_store_free(store);
+    amg_trace_stop();
+
+    FILE *file = tmpfile();
+    XCTAssertEqual(amg_trace_fwrite(file), 0);
+    const long length = ftell(file);
+    char *json = calloc(1, length + 1);
+    rewind(file);
+    XCTAssertEqual(fread(json, 1, length, file), (size_t)length);
+    fclose(file);
+
+    XCTAssertTrue(strncmp(json, "{\"traceEvents\":[", 16) == 0);
+    XCTAssertTrue(strstr(json, "\"name\":\"ds_store_open_mapped\"") != NULL);
+    XCTAssertTrue(strstr(json, "\"name\":\"ds_store_read_node\"") != NULL);
+    XCTAssertTrue(strstr(json, "\"name\":\"ds_record_mread\",\"cat\":\"decode\"") != NULL);
+    XCTAssertTrue(strstr(json, "\"args\":{\"type\":\"pict\"}") != NULL);
+    free(json);
+}
+
+static void assert_stores_equal(XCTestCase *self, ds_store_t *a, ds_store_t *b)
+{
+    ds_store_cursor_t *a_cursor = ds_store_cursor_create(a);
+    ds_store_cursor_t *b_cursor = ds_store_cursor_create(b);
+    ds_record_t *a_record = ds_record_create();
+    ds_record_t *b_record = ds_record_create();
+    while (ds_store_cursor_next(a_cursor, a_record) > 0) {
+        XCTAssertEqual(ds_store_cursor_next(b_cursor, b_record), 1);
+        XCTAssertEqual(ds_record_compare(a_record, b_record), 0);
+        XCTAssertEqual(ds_record_get_data_type(a_record), ds_record_get_data_type(b_record));
+    }
+    XCTAssertEqual(ds_store_cursor_next(b_cursor, b_record), 0);
+    ds_record_free(b_record);
+    ds_record_free(a_record);
+    ds_store_cursor_free(b_cursor);
+    ds_store_cursor_free(a_cursor);
+}
+
+/*!
+ * Creates comment records for the filenames file0000, file0001 and so on,
+ * sorted as the store keeps them.
+ */
+static void create_numbered_records(ds_record_t **records, size_t count)
+{
+    for (size_t i = 0; i < count; ++i) {
+        char name[16];
+        uint16_t filename[16];
+        const int len = snprintf(name, sizeof(name), "file%04zu", i);
+        for (int j = 0; j < len; ++j)
+            filename[j] = (uint16_t)name[j];
+        records[i] = ds_record_create();
+        ds_record_set_filename(records[i], filename, (size_t)len);
+        ds_record_set_type(records[i], ds_record_type_cmmt);
+        ds_record_set_data_type(records[i], ds_record_data_type_ustr);
+        ds_record_set_data_as_ustr(records[i], filename, (size_t)len);
+    }
+}
+
+- (void)testParseCache
+{
+    NSString *path = [[NSBundle bundleForClass:self.class] pathForResource:@"Silverlock2" ofType:@"DS_Store"];
+    NSString *storePath = [NSTemporaryDirectory() stringByAppendingPathComponent:@"AmalgamateTests.cached.DS_Store"];
+    NSString *cachePath = [NSTemporaryDirectory() stringByAppendingPathComponent:@"AmalgamateTests.cache"];
+    [[NSFileManager defaultManager] removeItemAtPath:storePath error:nil];
+    [[NSFileManager defaultManager] removeItemAtPath:cachePath error:nil];
+    XCTAssertTrue([[NSFileManager defaultManager] copyItemAtPath:path toPath:storePath error:nil]);
+
+    amg_parse_cache_stats_t stats;
+    XCTAssertEqual(amg_parse_cache_enable(cachePath.fileSystemRepresentation, 0), 0);
+    ds_store_t *store = amg_parse_cache_open_store(storePath.fileSystemRepresentation);
+    XCTAssertTrue(store != NULL);
+    amg_parse_cache_get_stats(&stats);
+    XCTAssertEqual(stats.hits, 0);
+    XCTAssertEqual(stats.misses, 1);
+    XCTAssertEqual(amg_parse_cache_save(0), 0);
+    amg_parse_cache_disable();
+
+    // A new session serves the unchanged store from the cache file
+    XCTAssertEqual(amg_parse_cache_enable(cachePath.fileSystemRepresentation, 0), 0);
+    ds_store_t *cached = amg_parse_cache_open_store(storePath.fileSystemRepresentation);
+    XCTAssertTrue(cached != NULL);
+    amg_parse_cache_get_stats(&stats);
+    XCTAssertEqual(stats.hits, 1);
+    XCTAssertEqual(stats.entries, 1);
+
+    assert_stores_equal(self, store, cached);
+    ds_store_free(cached);
+    ds_store_free(store);
+
+    // A changed modification time makes it a miss
+    XCTAssertTrue([[NSFileManager defaultManager] setAttributes:@{ NSFileModificationDate: [NSDate dateWithTimeIntervalSince1970:0] } ofItemAtPath:storePath error:nil]);
+    store = amg_parse_cache_open_store(storePath.fileSystemRepresentation);
+    XCTAssertTrue(store != NULL);
+    ds_store_free(store);
+    amg_parse_cache_get_stats(&stats);
+    XCTAssertEqual(stats.misses, 1);
+    XCTAssertEqual(amg_parse_cache_save(1), 0);
+    amg_parse_cache_disable();
+
+    // Damaged record data is not served
+    FILE *file = fopen(cachePath.fileSystemRepresentation, "r+b");
+    XCTAssertTrue(file != NULL);
+    XCTAssertEqual(fseek(file, -16, SEEK_END), 0);
+    XCTAssertEqual(fwrite("damaged records!", 1, 16, file), 16u);
+    fclose(file);
+
+    XCTAssertEqual(amg_parse_cache_enable(cachePath.fileSystemRepresentation, 0), 0);
+    store = amg_parse_cache_open_store(storePath.fileSystemRepresentation);
+    XCTAssertTrue(store != NULL);
+    XCTAssertEqual(ds_store_enum_records(store, NULL), 0);
+    ds_store_free(store);
+    amg_parse_cache_get_stats(&stats);
+    XCTAssertEqual(stats.hits, 0);
+    XCTAssertEqual(stats.misses, 1);
+    amg_parse_cache_disable();
+
+    [[NSFileManager defaultManager] removeItemAtPath:storePath error:nil];
+    [[NSFileManager defaultManager] removeItemAtPath:cachePath error:nil];
+}
+
+- (void)testParseCacheModify
+{
+    NSString *storePath = [NSTemporaryDirectory() stringByAppendingPathComponent:@"AmalgamateTests.modified.DS_Store"];
+    NSString *cachePath = [NSTemporaryDirectory() stringByAppendingPathComponent:@"AmalgamateTests.modified.cache"];
+    [[NSFileManager defaultManager] removeItemAtPath:storePath error:nil];
+    [[NSFileManager defaultManager] removeItemAtPath:cachePath error:nil];
+
+    // Far more records than fit in one node
+    const size_t count = 2000;
+    ds_record_t *records[2000];
+    create_numbered_records(records, count);
+
+    // Committed record by record, so its blocks are laid out differently
+    // from the store the cache rebuilds
+    ds_store_t *created = ds_store_create();
+    for (size_t i = 0; i < count; ++i)
+        XCTAssertEqual(ds_store_insert_record(created, records[(i * 7) % count]), 0);
+    FILE *file = fopen(storePath.fileSystemRepresentation, "w+b");
+    XCTAssertTrue(file != NULL);
+    XCTAssertEqual(ds_store_fcommit(created, file), 0);
+    fclose(file);
+    ds_store_free(created);
+
+    amg_parse_cache_stats_t stats;
+    XCTAssertEqual(amg_parse_cache_enable(cachePath.fileSystemRepresentation, 0), 0);
+    ds_store_free(amg_parse_cache_open_store(storePath.fileSystemRepresentation));
+    ds_store_t *store = amg_parse_cache_open_store(storePath.fileSystemRepresentation);
+    XCTAssertTrue(store != NULL);
+    amg_parse_cache_get_stats(&stats);
+    XCTAssertEqual(stats.hits, 1);
+    amg_parse_cache_disable();
+
+    // The cached store changes and commits like one read from the file,
+    // leaving most of its nodes as they were
+    const uint16_t added[] = { 'a', 'd', 'd', 'e', 'd' };
+    ds_record_t *record = ds_record_create();
+    ds_record_set_filename(record, added, 5);
+    ds_record_set_type(record, ds_record_type_cmmt);
+    ds_record_set_data_type(record, ds_record_data_type_ustr);
+    ds_record_set_data_as_ustr(record, added, 5);
+    XCTAssertEqual(ds_store_insert_record(store, record), 0);
+    ds_record_set_data_as_ustr(records[1001], added, 5);
+    XCTAssertEqual(ds_store_replace_record(store, records[1001]), 0);
+    for (size_t i = 0; i < 100; i += 2)
+        XCTAssertEqual(ds_store_delete_record(store, ds_record_get_filename_ptr(records[i]), ds_record_get_filename_len(records[i]), ds_record_type_cmmt), 0);
+
+    file = fopen(storePath.fileSystemRepresentation, "r+b");
+    XCTAssertTrue(file != NULL);
+    XCTAssertEqual(ds_store_fcommit(store, file), 0);
+    fclose(file);
+
+    ds_store_t *committed = ds_store_open_mapped(storePath.fileSystemRepresentation);
+    XCTAssertTrue(committed != NULL);
+    assert_stores_equal(self, store, committed);
+
+    ds_record_t *found = ds_record_create();
+    XCTAssertEqual(ds_store_find(committed, added, 5, ds_record_type_cmmt, found), 1);
+    XCTAssertEqual(ds_store_find(committed, ds_record_get_filename_ptr(records[0]), ds_record_get_filename_len(records[0]), ds_record_type_cmmt, found), 0);
+    XCTAssertEqual(ds_store_find(committed, ds_record_get_filename_ptr(records[1001]), ds_record_get_filename_len(records[1001]), ds_record_type_cmmt, found), 1);
+    XCTAssertEqual(ds_record_get_data_as_ustr_len(found), 5u);
+    XCTAssertEqual(ds_store_find(committed, ds_record_get_filename_ptr(records[1003]), ds_record_get_filename_len(records[1003]), ds_record_type_cmmt, found), 1);
+    ds_record_free(found);
+
+    size_t committed_count = 0;
+    ds_store_cursor_t *cursor = ds_store_cursor_create(committed);
+    while (ds_store_cursor_next(cursor, record) > 0)
+        ++committed_count;
+    ds_store_cursor_free(cursor);
+    XCTAssertEqual(committed_count, count - 50 + 1);
+
+    ds_record_free(record);
+    for (size_t i = 0; i < count; ++i)
+        ds_record_free(records[i]);
+    ds_store_free(committed);
+    ds_store_free(store);
+
+    [[NSFileManager defaultManager] removeItemAtPath:storePath error:nil];
+    [[NSFileManager defaultManager] removeItemAtPath:cachePath error:nil];
+}
+
+- (void)testEmptyRecordData
+{
+    NSString *outputPath = [NSTemporaryDirectory() stringByAppendingPathComponent:@"AmalgamateTests.empty.DS_Store"];
+    const uint16_t dot[] = { '.' };
+    const unsigned char blob[] = { 0 };
+    ds_record_t *record = ds_record_create();
+    ds_record_set_filename(record, dot, 1);
+    ds_record_set_type(record, ds_record_type_cmmt);
+
+    // Empty blob and ustr data cannot be read back, so neither is written
+    for (int i = 0; i < 2; ++i) {
+        if (i == 0) {
+            ds_record_set_data_type(record, ds_record_data_type_blob);
+            ds_record_set_data_as_blob(record, blob, 0);
+        } else {
+            ds_record_set_data_type(record, ds_record_data_type_ustr);
+            ds_record_set_data_as_ustr(record, dot, 0);
+        }
+
+        FILE *file = fopen(outputPath.fileSystemRepresentation, "wb");
+        XCTAssertTrue(file != NULL);
+        XCTAssertEqual(ds_store_fwrite_records(file, &record, 1), 1);
+        fclose(file);
+
+        ds_store_t *store = ds_store_create();
+        XCTAssertEqual(ds_store_insert_record(store, record), 1);
+        ds_store_free(store);
+    }
+
+    ds_record_set_data_as_ustr(record, dot, 1);
+    ds_store_t *store = ds_store_create();
+    XCTAssertEqual(ds_store_insert_record(store, record), 0);
+    ds_store_free(store);
+
+    ds_record_free(record);
+    [[NSFileManager defaultManager] removeItemAtPath:outputPath error:nil];
+}
+
+- (void)testWriteRoundTrip
+{
+    NSArray *paths = [[NSBundle bundleForClass:self.class] pathsForResourcesOfType:@"DS_Store" inDirectory:nil];
+    NSString *outputPath = [NSTemporaryDirectory() stringByAppendingPathComponent:@"AmalgamateTests.out.DS_Store"];
+    for (NSString *path in paths) {
+        ds_store_t *store = ds_store_open_mapped(path.fileSystemRepresentation);
+        XCTAssertTrue(store != NULL);
+
+        FILE *file = fopen(outputPath.fileSystemRepresentation, "wb");
+        XCTAssertTrue(file != NULL);
+        XCTAssertEqual(ds_store_fwrite(store, file), 0);
+        fclose(file);
+
+        ds_store_t *written = ds_store_open_mapped(outputPath.fileSystemRepresentation);
+        XCTAssertTrue(written != NULL);
+
+        assert_stores_equal(self, store, written);
+        ds_store_free(written);
+        ds_store_free(store);
+    }
+
+    [[NSFileManager defaultManager] removeItemAtPath:outputPath error:nil];
+}
+
+- (void)testIncrementalCommit
+{
+    NSArray *paths = [[NSBundle bundleForClass:self.class] pathsForResourcesOfType:@"DS_Store" inDirectory:nil];
+    NSString *outputPath = [NSTemporaryDirectory() stringByAppendingPathComponent:@"AmalgamateTests.commit.DS_Store"];
+    for (NSString *path in paths) {
+        [[NSFileManager defaultManager] removeItemAtPath:outputPath error:nil];
+        XCTAssertTrue([[NSFileManager defaultManager] copyItemAtPath:path toPath:outputPath error:nil]);
+
+        ds_store_t *store = ds_store_open_mapped(outputPath.fileSystemRepresentation);
+        XCTAssertTrue(store != NULL);
+
+        // Remove the first record, then put it back under a different name
+        ds_store_cursor_t *cursor = ds_store_cursor_create(store);
+        ds_record_t *record = ds_record_create();
+        XCTAssertEqual(ds_store_cursor_next(cursor, record), 1);
+        ds_store_cursor_free(cursor);
+
+        uint16_t filename[256];
+        size_t filename_len = ds_record_get_filename_len(record);
+        XCTAssertTrue(filename_len < sizeof(filename) / sizeof(filename[0]));
+        memcpy(filename, ds_record_get_filename_ptr(record), filename_len * sizeof(uint16_t));
+        XCTAssertEqual(ds_store_delete_record(store, filename, filename_len, ds_record_get_type(record)), 0);
+        filename[filename_len++] = '~';
+        ds_record_set_filename(record, filename, filename_len);
+        XCTAssertEqual(ds_store_insert_record(store, record), 0);
+        XCTAssertEqual(ds_store_insert_record(store, record), 1);
+
+        FILE *file = fopen(outputPath.fileSystemRepresentation, "r+b");
+        XCTAssertTrue(file != NULL);
+        XCTAssertEqual(ds_store_fcommit(store, file), 0);
+        fclose(file);
+        ds_store_free(store);
+
+        ds_store_t *committed = ds_store_open_mapped(outputPath.fileSystemRepresentation);
+        XCTAssertTrue(committed != NULL);
+        ds_record_t *found = ds_record_create();
+        XCTAssertEqual(ds_store_find(committed, filename, filename_len, ds_record_get_type(record), found), 1);
+        ds_record_free(found);
+        ds_record_free(record);
+        ds_store_free(committed);
+    }
+
+    [[NSFileManager defaultManager] removeItemAtPath:outputPath error:nil];
+}
+
+- (void)testCommitRetry
+{
+    NSString *outputPath = [NSTemporaryDirectory() stringByAppendingPathComponent:@"AmalgamateTests.retry.DS_Store"];
+    const size_t count = 500;
+    ds_record_t *records[500];
+    create_numbered_records(records, count);
+
+    FILE *file = fopen(outputPath.fileSystemRepresentation, "wb");
+    XCTAssertTrue(file != NULL);
+    XCTAssertEqual(ds_store_fwrite_records(file, records, count), 0);
+    fclose(file);
+
+    ds_store_t *store = ds_store_open_mapped(outputPath.fileSystemRepresentation);
+    XCTAssertTrue(store != NULL);
+    for (size_t i = 0; i < 400; ++i)
+        XCTAssertEqual(ds_store_delete_record(store, ds_record_get_filename_ptr(records[i]), ds_record_get_filename_len(records[i]), ds_record_type_cmmt), 0);
+
+    // A commit that cannot write leaves the store as it was, to be retried
+    file = fopen(outputPath.fileSystemRepresentation, "rb");
+    XCTAssertTrue(file != NULL);
+    XCTAssertEqual(ds_store_fcommit(store, file), 1);
+    fclose(file);
+
+    file = fopen(outputPath.fileSystemRepresentation, "r+b");
+    XCTAssertTrue(file != NULL);
+    XCTAssertEqual(ds_store_fcommit(store, file), 0);
+    fclose(file);
+
+    ds_store_t *committed = ds_store_open_mapped(outputPath.fileSystemRepresentation);
+    XCTAssertTrue(committed != NULL);
+    assert_stores_equal(self, store, committed);
+    ds_record_t *found = ds_record_create();
+    XCTAssertEqual(ds_store_find(committed, ds_record_get_filename_ptr(records[399]), ds_record_get_filename_len(records[399]), ds_record_type_cmmt, found), 0);
+    XCTAssertEqual(ds_store_find(committed, ds_record_get_filename_ptr(records[400]), ds_record_get_filename_len(records[400]), ds_record_type_cmmt, found), 1);
+    ds_record_free(found);
+
+    for (size_t i = 0; i < count; ++i)
+        ds_record_free(records[i]);
+    ds_store_free(committed);
+    ds_store_free(store);
+
+    [[NSFileManager defaultManager] removeItemAtPath:outputPath error:nil];
+}
+
+- (void)testNodeBounds
+{
+    NSString *outputPath = [NSTemporaryDirectory() stringByAppendingPathComponent:@"AmalgamateTests.bounds.DS_Store"];
+    const size_t count = 500;
+    ds_record_t *records[500];
+    create_numbered_records(records, count);
+
+    FILE *file = fopen(outputPath.fileSystemRepresentation, "w+b");
+    XCTAssertTrue(file != NULL);
+    XCTAssertEqual(ds_store_fwrite_records(file, records, count), 0);
+    for (size_t i = 0; i < count; ++i)
+        ds_record_free(records[i]);
+
+    // Halve the block of the first leaf, which the bulk loader fills to well
+    // over half a page, in the allocator's address table
+    unsigned char header[12];
+    rewind(file);
+    XCTAssertEqual(fread(header, 1, sizeof(header), file), sizeof(header));
+    const long allocator_offset = 4 + (long)((uint32_t)header[8] << 24 | (uint32_t)header[9] << 16 | (uint32_t)header[10] << 8 | header[11]);
+    unsigned char address[4];
+    XCTAssertEqual(fseek(file, allocator_offset + 8 + 2 * 4, SEEK_SET), 0);
+    XCTAssertEqual(fread(address, 1, sizeof(address), file), sizeof(address));
+    XCTAssertEqual(address[3] & 0x1F, 12);
+    address[3] = (address[3] & ~0x1F) | 11;
+    XCTAssertEqual(fseek(file, allocator_offset + 8 + 2 * 4, SEEK_SET), 0);
+    XCTAssertEqual(fwrite(address, 1, sizeof(address), file), sizeof(address));
+    fclose(file);
+
+    // Its records no longer fit, and are not read from beyond the block
+    ds_store_t *store = ds_store_open_mapped(outputPath.fileSystemRepresentation);
+    XCTAssertTrue(store != NULL);
+    XCTAssertEqual(ds_store_enum_records(store, NULL), 1);
+    ds_store_free(store);
+
+    [[NSFileManager defaultManager] removeItemAtPath:outputPath error:nil];
+}
+
+static NSData *file_contents(FILE *file)
+{
+    const long length = ftell(file);
+    NSMutableData *data = [NSMutableData dataWithLength:(NSUInteger)length];
+    rewind(file);
+    if (fread(data.mutableBytes, 1, (size_t)length, file) != (size_t)length)
+        return nil;
+    return data;
+}
+
+static NSData *json_for_store(ds_store_t *store, const char *format)
+{
+    FILE *file = tmpfile();
+    amg_json_writer_t *writer = amg_json_writer_create(file, format);
+    ds_store_cursor_t *cursor = store ? ds_store_cursor_create(store) : NULL;
+    ds_record_t *record = ds_record_create();
+    int status = 0;
+    while (cursor && ds_store_cursor_next(cursor, record) > 0)
+        status |= amg_json_writer_write_record(writer, record);
+    status |= amg_json_writer_finish(writer);
+
+    NSData *data = status == 0 ? file_contents(file) : nil;
+    ds_record_free(record);
+    ds_store_cursor_free(cursor);
+    amg_json_writer_free(writer);
+    fclose(file);
+    return data;
+}
+
+- (void)testJSONWriter
+{
+    XCTAssertTrue(amg_json_writer_create(stdout, "xml") == NULL);
+
+    NSArray *paths = [[NSBundle bundleForClass:self.class] pathsForResourcesOfType:@"DS_Store" inDirectory:nil];
+    for (NSString *path in paths) {
+        ds_store_t *store = ds_store_open_mapped(path.fileSystemRepresentation);
+        XCTAssertTrue(store != NULL);
+        enumerated_record_count = 0;
+        XCTAssertEqual(ds_store_enum_records(store, count_record), 0);
+
+        // One array of records...
+        NSData *json = json_for_store(store, "json");
+        XCTAssertTrue(json != nil);
+        NSArray *records = [NSJSONSerialization JSONObjectWithData:json options:0 error:nil];
+        XCTAssertTrue([records isKindOfClass:[NSArray class]]);
+        XCTAssertEqual(records.count, enumerated_record_count);
+        XCTAssertTrue([records.firstObject isKindOfClass:[NSDictionary class]]);
+        XCTAssertTrue([records.firstObject objectForKey:@"filename"] != nil);
+
+        // ...or one record per line, each the same as in the array
+        NSData *ndjson = json_for_store(store, "ndjson");
+        XCTAssertTrue(ndjson != nil);
+        NSString *text = [[NSString alloc] initWithData:ndjson encoding:NSUTF8StringEncoding];
+        XCTAssertTrue([text hasSuffix:@"\n"]);
+        NSArray *lines = [[text substringToIndex:text.length - 1] componentsSeparatedByString:@"\n"];
+        XCTAssertEqual(lines.count, enumerated_record_count);
+        for (NSUInteger i = 0; i < lines.count && i < records.count; ++i) {
+            NSData *line = [lines[i] dataUsingEncoding:NSUTF8StringEncoding];
+            XCTAssertEqualObjects([NSJSONSerialization JSONObjectWithData:line options:0 error:nil], records[i]);
+        }
+
+        ds_store_free(store);
+    }
+
+    // An empty store is an empty array, or nothing at all
+    NSData *empty = json_for_store(NULL, "json");
+    XCTAssertEqualObjects([NSJSONSerialization JSONObjectWithData:empty options:0 error:nil], @[]);
+    XCTAssertEqual(json_for_store(NULL, "ndjson").length, 0u);
+}
+
+/*
+ * Just enough of a FlatBuffers and Arrow IPC reader to read back the files
+ * of the columnar writer, which only writes little-endian files.
+ */
+static uint32_t fb_read_u32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static int64_t fb_read_i64(const unsigned char *p)
+{
+    return (int64_t)((uint64_t)fb_read_u32(p) | (uint64_t)fb_read_u32(p + 4) << 32);
+}
+
+static const unsigned char *fb_field(const unsigned char *table, unsigned field)
+{
+    const unsigned char *vtable = table - (int32_t)fb_read_u32(table);
+    const unsigned vtable_size = vtable[0] | vtable[1] << 8;
+    if (4 + 2 * field >= vtable_size)
+        return NULL;
+    const unsigned offset = vtable[4 + 2 * field] | vtable[5 + 2 * field] << 8;
+    return offset ? table + offset : NULL;
+}
+
+static const unsigned char *fb_object(const unsigned char *table, unsigned field)
+{
+    const unsigned char *p = fb_field(table, field);
+    return p ? p + fb_read_u32(p) : NULL;
+}
+
+typedef struct {
+    const unsigned char *body;
+    const unsigned char *nodes; // length and null count of each column
+    const unsigned char *buffers; // offset and length of each buffer
+    size_t next_buffer;
+    int64_t length;
+    int64_t dictionary_id; // -1 for a record batch
+    int delta;
+} arrow_batch_t;
+
+/*!
+ * Reads the message of a Block in the file footer.
+ */
+static arrow_batch_t arrow_read_batch(const unsigned char *file, const unsigned char *block)
+{
+    const int64_t offset = fb_read_i64(block);
+    const unsigned char *message = file + offset + 8;
+    message += fb_read_u32(message);
+
+    arrow_batch_t batch;
+    const unsigned char *header = fb_object(message, 2);
+    batch.body = file + offset + (int32_t)fb_read_u32(block + 8);
+    batch.dictionary_id = -1;
+    batch.delta = 0;
+    if (*fb_field(message, 1) == 2) {
+        batch.dictionary_id = fb_read_i64(fb_field(header, 0));
+        batch.delta = fb_field(header, 2) && *fb_field(header, 2);
+        header = fb_object(header, 1);
+    }
+
+    batch.length = fb_read_i64(fb_field(header, 0));
+    batch.nodes = fb_object(header, 1) + 4;
+    batch.buffers = fb_object(header, 2) + 4;
+    batch.next_buffer = 0;
+    return batch;
+}
+
+static const unsigned char *arrow_next_buffer(arrow_batch_t *batch, int64_t *size)
+{
+    const unsigned char *buffer = batch->buffers + 16 * batch->next_buffer++;
+    *size = fb_read_i64(buffer + 8);
+    return batch->body + fb_read_i64(buffer);
+}
+
+static int arrow_is_valid(const unsigned char *validity, int64_t size, int64_t row)
+{
+    return size == 0 || (validity[row / 8] >> (row % 8)) & 1;
+}
+
+typedef struct {
+    const char *data;
+    size_t size;
+} arrow_string_t;
+
+static arrow_string_t arrow_string(const unsigned char *offsets, const unsigned char *data, int64_t row)
+{
+    const int32_t begin = (int32_t)fb_read_u32(offsets + 4 * row);
+    arrow_string_t s = { (const char *)data + begin, (size_t)((int32_t)fb_read_u32(offsets + 4 * row + 4) - begin) };
+    return s;
+}
+
+static int arrow_string_equals(arrow_string_t s, const void *data, size_t size)
+{
+    return s.size == size && memcmp(s.data, data, size) == 0;
+}
+
+static int arrow_string_equals_fourcc(arrow_string_t s, uint32_t code)
+{
+    const char chars[4] = { (char)(code >> 24), (char)(code >> 16), (char)(code >> 8), (char)code };
+    return arrow_string_equals(s, chars, sizeof(chars));
+}
+
+static size_t copy_records(ds_store_t *store, ds_record_t **records, size_t max)
+{
+    size_t count = 0;
+    ds_store_cursor_t *cursor = ds_store_cursor_create(store);
+    while (count < max) {
+        records[count] = ds_record_create();
+        if (ds_store_cursor_next(cursor, records[count]) <= 0) {
+            ds_record_free(records[count]);
+            break;
+        }
+        ++count;
+    }
+    ds_store_cursor_free(cursor);
+    return count;
+}
+
+- (void)testColumnarWriter
+{
+    NSString *firstPath = [[NSBundle bundleForClass:self.class] pathForResource:@"Silverlock2" ofType:@"DS_Store"];
+    NSString *secondPath = [[NSBundle bundleForClass:self.class] pathForResource:@"Firefox31" ofType:@"DS_Store"];
+    ds_store_t *first = ds_store_open_mapped(firstPath.fileSystemRepresentation);
+    ds_store_t *second = ds_store_open_mapped(secondPath.fileSystemRepresentation);
+    XCTAssertTrue(first != NULL && second != NULL);
+
+    ds_record_t *first_records[64], *second_records[64];
+    const size_t first_count = copy_records(first, first_records, 64);
+    const size_t second_count = copy_records(second, second_records, 64);
+    XCTAssertTrue(first_count > 0 && second_count > 0);
+
+    // Enough rows of the first store for a full batch, then the second
+    // store, whose new record types go out as delta dictionaries
+    const size_t repeats = amg_columnar_batch_rows / first_count + 1;
+    const int64_t first_rows = (int64_t)(repeats * first_count);
+    const int64_t rows = first_rows + (int64_t)second_count;
+    FILE *file = tmpfile();
+    amg_columnar_writer_t *writer = amg_columnar_writer_create(file);
+    XCTAssertTrue(writer != NULL);
+    for (size_t i = 0; i < repeats; ++i)
+        XCTAssertEqual(amg_columnar_writer_write_store(writer, "first", first), 0);
+    XCTAssertEqual(amg_columnar_writer_write_store(writer, "second", second), 0);
+    XCTAssertEqual(amg_columnar_writer_finish(writer), 0);
+    amg_columnar_writer_free(writer);
+
+    NSData *contents = file_contents(file);
+    fclose(file);
+    const unsigned char *data = contents.bytes;
+    const size_t size = contents.length;
+    XCTAssertTrue(size > 18 && memcmp(data, "ARROW1\0\0", 8) == 0 && memcmp(data + size - 6, "ARROW1", 6) == 0);
+
+    const unsigned char *footer = data + size - 10 - fb_read_u32(data + size - 10);
+    footer += fb_read_u32(footer);
+    const unsigned char *dictionary_blocks = fb_object(footer, 2);
+    const unsigned char *batch_blocks = fb_object(footer, 3);
+    const uint32_t dictionary_count = fb_read_u32(dictionary_blocks);
+    const uint32_t batch_count = fb_read_u32(batch_blocks);
+    XCTAssertEqual(batch_count, 2u);
+
+    // Dictionaries of paths, record types, data types and type values
+    arrow_string_t dictionaries[4][64];
+    size_t dictionary_sizes[4] = { 0, 0, 0, 0 };
+    size_t deltas = 0;
+    for (uint32_t i = 0; i < dictionary_count; ++i) {
+        arrow_batch_t batch = arrow_read_batch(data, dictionary_blocks + 4 + 24 * i);
+        XCTAssertTrue(batch.dictionary_id >= 0 && batch.dictionary_id < 4);
+        size_t *dictionary_size = &dictionary_sizes[batch.dictionary_id];
+        XCTAssertEqual(batch.delta != 0, *dictionary_size != 0);
+        deltas += batch.delta != 0;
+
+        int64_t validity_size, offsets_size, strings_size;
+        arrow_next_buffer(&batch, &validity_size);
+        const unsigned char *offsets = arrow_next_buffer(&batch, &offsets_size);
+        const unsigned char *strings = arrow_next_buffer(&batch, &strings_size);
+        for (int64_t row = 0; row < batch.length && *dictionary_size < 64; ++row)
+            dictionaries[batch.dictionary_id][(*dictionary_size)++] = arrow_string(offsets, strings, row);
+    }
+    XCTAssertTrue(deltas > 0);
+    XCTAssertEqual(dictionary_sizes[0], 2u);
+
+    // Every column of every row, batch by batch
+    int64_t row_base = 0;
+    for (uint32_t i = 0; i < batch_count; ++i) {
+        arrow_batch_t batch = arrow_read_batch(data, batch_blocks + 4 + 24 * i);
+        const unsigned char *buffers[27];
+        int64_t sizes[27];
+        for (size_t b = 0; b < 27; ++b)
+            buffers[b] = arrow_next_buffer(&batch, &sizes[b]);
+
+        for (int64_t row = 0; row < batch.length; ++row) {
+            const int64_t n = row_base + row;
+            ds_record_t *record = n < first_rows ? first_records[n % first_count] : second_records[n - first_rows];
+            const ds_record_data_type data_type = ds_record_get_data_type(record);
+
+            XCTAssertTrue(arrow_string_equals(dictionaries[0][fb_read_u32(buffers[1] + 4 * row)], n < first_rows ? "first" : "second", n < first_rows ? 5 : 6));
+            XCTAssertTrue(arrow_string_equals(arrow_string(buffers[3], buffers[4], row), ds_record_get_filename_utf8(record), ds_record_get_filename_utf8_len(record)));
+            XCTAssertTrue(arrow_string_equals_fourcc(dictionaries[1][fb_read_u32(buffers[6] + 4 * row)], ds_record_get_type(record)));
+            XCTAssertTrue(arrow_string_equals_fourcc(dictionaries[2][fb_read_u32(buffers[8] + 4 * row)], data_type));
+
+            // Value columns: validity bitmap first, set for one data type
+            XCTAssertEqual(arrow_is_valid(buffers[9], sizes[9], row), data_type == ds_record_data_type_long);
+            XCTAssertEqual(arrow_is_valid(buffers[11], sizes[11], row), data_type == ds_record_data_type_shor);
+            XCTAssertEqual(arrow_is_valid(buffers[13], sizes[13], row), data_type == ds_record_data_type_bool);
+            XCTAssertEqual(arrow_is_valid(buffers[15], sizes[15], row), data_type == ds_record_data_type_type);
+            XCTAssertEqual(arrow_is_valid(buffers[17], sizes[17], row), data_type == ds_record_data_type_ustr);
+            XCTAssertEqual(arrow_is_valid(buffers[20], sizes[20], row), data_type == ds_record_data_type_comp);
+            XCTAssertEqual(arrow_is_valid(buffers[22], sizes[22], row), data_type == ds_record_data_type_dutc);
+            XCTAssertEqual(arrow_is_valid(buffers[24], sizes[24], row), data_type == ds_record_data_type_blob);
+
+            if (data_type == ds_record_data_type_long)
+                XCTAssertEqual(fb_read_u32(buffers[10] + 4 * row), ds_record_get_data_as_long(record));
+            if (data_type == ds_record_data_type_shor)
+                XCTAssertEqual(buffers[12][2 * row] | buffers[12][2 * row + 1] << 8, ds_record_get_data_as_shor(record));
+            if (data_type == ds_record_data_type_bool)
+                XCTAssertEqual((buffers[14][row / 8] >> (row % 8)) & 1, ds_record_get_data_as_bool(record) ? 1 : 0);
+            if (data_type == ds_record_data_type_type)
+                XCTAssertTrue(arrow_string_equals_fourcc(dictionaries[3][fb_read_u32(buffers[16] + 4 * row)], ds_record_get_data_as_type(record)));
+            if (data_type == ds_record_data_type_ustr) {
+                char utf8[3 * 1024];
+                const size_t len = ds_record_get_data_as_ustr_len(record);
+                XCTAssertTrue(len <= 1024);
+                const size_t utf8_len = amg_utf8_from_utf16(utf8, ds_record_get_data_as_ustr_ptr(record), len < 1024 ? len : 1024);
+                XCTAssertTrue(arrow_string_equals(arrow_string(buffers[18], buffers[19], row), utf8, utf8_len));
+            }
+            if (data_type == ds_record_data_type_comp)
+                XCTAssertEqual((uint64_t)fb_read_i64(buffers[21] + 8 * row), ds_record_get_data_as_comp(record));
+            if (data_type == ds_record_data_type_blob)
+                XCTAssertTrue(arrow_string_equals(arrow_string(buffers[25], buffers[26], row), ds_record_get_data_as_blob_ptr(record), ds_record_get_data_as_blob_size(record)));
+        }
+        row_base += batch.length;
+    }
+    XCTAssertEqual(row_base, rows);
+
+    for (size_t i = 0; i < first_count; ++i)
+        ds_record_free(first_records[i]);
+    for (size_t i = 0; i < second_count; ++i)
+        ds_record_free(second_records[i]);
+    ds_store_free(second);
+    ds_store_free(first);
+}
+
+static void *count_records(const char *path, ds_store_t *store, void *context)
+{
+    if (!store)
+        return NULL;
+    size_t *count = malloc(sizeof(*count));
+    *count = 0;
+    ds_store_cursor_t *cursor = ds_store_cursor_create(store);
+    ds_record_t *record = ds_record_create();
+    while (ds_store_cursor_next(cursor, record) > 0)
+        ++*count;
+    ds_record_free(record);
+    ds_store_cursor_free(cursor);
+    return count;
+}
+
+static void append_record_count(const char *path, void *result, void *context)
+{
+    NSMutableArray *lines = (__bridge NSMutableArray *)context;
+    [lines addObject:[NSString stringWithFormat:@"%s\t%zu", path, result ? *(size_t *)result : (size_t)-1]];
+    free(result);
+}
+
+- (void)testOrderedScan
+{
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    NSString *root = [NSTemporaryDirectory() stringByAppendingPathComponent:@"AmalgamateTests.scan"];
+    NSArray *fixtures = @[ @"AmalgamateTests", @"Firefox31", @"Silverlock2", @"Xcode6b6" ];
+    [fileManager removeItemAtPath:root error:nil];
+
+    // Enough stores in nested directories to keep eight threads busy
+    for (NSUInteger i = 0; i < 32; ++i) {
+        NSString *directory = [root stringByAppendingPathComponent:[NSString stringWithFormat:@"%lu/%lu", (unsigned long)i % 4, (unsigned long)i]];
+        NSString *fixture = [[NSBundle bundleForClass:self.class] pathForResource:fixtures[i % fixtures.count] ofType:@"DS_Store"];
+        XCTAssertTrue([fileManager createDirectoryAtPath:directory withIntermediateDirectories:YES attributes:nil error:nil]);
+        XCTAssertTrue([fileManager copyItemAtPath:fixture toPath:[directory stringByAppendingPathComponent:@".DS_Store"] error:nil]);
+    }
+
+    NSMutableArray *serial = [NSMutableArray array];
+    NSMutableArray *parallel = [NSMutableArray array];
+    XCTAssertEqual(amg_scan(root.fileSystemRepresentation, 1, 1, count_records, append_record_count, (__bridge void *)serial), 0);
+    XCTAssertEqual(amg_scan(root.fileSystemRepresentation, 8, 1, count_records, append_record_count, (__bridge void *)parallel), 0);
+    XCTAssertEqual(serial.count, 32u);
+    XCTAssertEqualObjects(serial, parallel);
+
+    [fileManager removeItemAtPath:root error:nil];
+}
+
+/*!
+ * Builds a version 2 alias with an empty header and a single POSIX path
+ * entry, and returns its size.
+ */
+static size_t create_alias_with_posix_path(unsigned char *alias, const char *path, size_t len)
+{
+    const size_t padded_len = len + len % 2;
+    const size_t size = 150 + 4 + padded_len + 4;
+    memset(alias, 0, size);
+    alias[4] = (unsigned char)(size >> 8);
+    alias[5] = (unsigned char)size;
+    alias[7] = 2;
+    alias[151] = alias_tag_posix_path;
+    alias[153] = (unsigned char)len;
+    memcpy(alias + 154, path, len);
+    alias[154 + padded_len] = 0xFF;
+    alias[155 + padded_len] = 0xFF;
+    return size;
+}
+
+- (void)testAliasPOSIXPath
+{
+    const char path[] = "/Volumes/Caf\xC3\xA9/\xE2\x98\x95.tiff";
+    const char garbled[] = "/Volumes/Caf\xE9";
+    XCTAssertEqual(amg_utf8_valid(path, strlen(path)), 1);
+    XCTAssertEqual(amg_utf8_valid(garbled, strlen(garbled)), 0);
+    XCTAssertEqual(amg_utf8_valid("\xC3", 1), 0);
+    XCTAssertEqual(amg_utf8_valid("\xC0\xAF", 2), 0);
+    XCTAssertEqual(amg_utf8_valid("\xED\xA0\x80", 3), 0);
+    XCTAssertEqual(amg_utf8_valid("\xF4\x90\x80\x80", 4), 0);
+    XCTAssertEqual(amg_utf8_valid("\xF0\x9F\x98\x80", 4), 1);
+
+    // The path is UTF-8, unlike the Mac Roman names in the header; bytes
+    // that are not are kept as data
+    const uint16_t dot[] = { '.' };
+    ds_record_t *record = ds_record_create();
+    ds_record_set_filename(record, dot, 1);
+    ds_record_set_type(record, ds_record_type_pict);
+    ds_record_set_data_type(record, ds_record_data_type_blob);
+    for (int i = 0; i < 2; ++i) {
+        unsigned char alias[256];
+        const char *value = i == 0 ? path : garbled;
+        ds_record_set_data_as_blob(record, alias, create_alias_with_posix_path(alias, value, strlen(value)));
+
+        FILE *file = tmpfile();
+        XCTAssertEqual(amg_convert_record(record, "json", file), 0);
+        NSData *contents = file_contents(file);
+        fclose(file);
+        NSString *json = [[NSString alloc] initWithData:contents encoding:NSUTF8StringEncoding];
+        XCTAssertTrue(json != nil);
+        NSString *expected = i == 0 ? @"{\"tag\":18,\"value\":\"/Volumes/Café/☕.tiff\"}" : @"{\"tag\":18,\"value\":\"L1ZvbHVtZXMvQ2Fm6Q==\"}";
+        XCTAssertTrue([json rangeOfString:expected].location != NSNotFound);
+    }
+    ds_record_free(record);
+}
+
 @end
@@ -0,0 +1,558 @@
+/*
+ * Copyright (c) 2015 Jake Petroules. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "amgbenchcorpus.h"
+#include "dsio.h"
+#include "dsstore.h"
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <random>
+
+/*!
+ * Largest encoded record that fits in a node, as enforced by the writer.
+ */
+static const size_t amg_bench_max_record_size = 2040;
+static const size_t amg_bench_node_size = 4096;
+
+/*!
+ * Length of the generated filenames before padding, e.g. "file-00000001.txt".
+ */
+static const size_t amg_bench_filename_len = 17;
+
+typedef std::vector<unsigned char> amg_bench_bytes_t;
+
+static void amg_bench_put_be(amg_bench_bytes_t &out, uint64_t value, size_t size)
+{
+    for (size_t i = size; i > 0; --i)
+        out.push_back(static_cast<unsigned char>(value >> (8 * (i - 1))));
+}
+
+static void amg_bench_put_le(amg_bench_bytes_t &out, uint64_t value, size_t size)
+{
+    for (size_t i = 0; i < size; ++i)
+        out.push_back(static_cast<unsigned char>(value >> (8 * i)));
+}
+
+static void amg_bench_put_string(amg_bench_bytes_t &out, const std::string &s)
+{
+    out.insert(out.end(), s.begin(), s.end());
+}
+
+/*!
+ * A path of about \a size bytes below a fixed home folder.
+ */
+static std::string amg_bench_path(size_t index, size_t size)
+{
+    std::string path = "/Users/bench/Projects";
+    while (path.size() + 16 < size)
+        path += "/Folder " + std::to_string(path.size() % 97);
+    return path + "/item-" + std::to_string(index);
+}
+
+/*!
+ * A binary property list holding one dictionary of the given members, whose
+ * values are already encoded objects.
+ */
+static amg_bench_bytes_t amg_bench_bplist(const std::vector<std::pair<std::string, amg_bench_bytes_t>> &members)
+{
+    const auto marker = [](amg_bench_bytes_t &out, unsigned char type, size_t count) {
+        if (count < 15) {
+            out.push_back(static_cast<unsigned char>(type | count));
+        } else {
+            out.push_back(static_cast<unsigned char>(type | 0x0f));
+            out.push_back(0x12);
+            amg_bench_put_be(out, count, 4);
+        }
+    };
+
+    amg_bench_bytes_t out;
+    amg_bench_put_string(out, "bplist00");
+
+    // The dictionary is object 0, its keys come next and its values last
+    const size_t count = members.size();
+    std::vector<uint64_t> offsets;
+    offsets.push_back(out.size());
+    marker(out, 0xd0, count);
+    for (size_t i = 0; i < 2 * count; ++i)
+        out.push_back(static_cast<unsigned char>(1 + i));
+
+    for (const auto &member : members) {
+        offsets.push_back(out.size());
+        marker(out, 0x50, member.first.size());
+        amg_bench_put_string(out, member.first);
+    }
+
+    for (const auto &member : members) {
+        offsets.push_back(out.size());
+        out.insert(out.end(), member.second.begin(), member.second.end());
+    }
+
+    const uint64_t offset_table_offset = out.size();
+    for (const uint64_t offset : offsets)
+        amg_bench_put_be(out, offset, 4);
+
+    out.insert(out.end(), 6, 0);
+    out.push_back(4); // offset size
+    out.push_back(1); // object reference size
+    amg_bench_put_be(out, offsets.size(), 8);
+    amg_bench_put_be(out, 0, 8);
+    amg_bench_put_be(out, offset_table_offset, 8);
+    return out;
+}
+
+static amg_bench_bytes_t amg_bench_bplist_int(uint16_t value)
+{
+    amg_bench_bytes_t out(1, 0x11);
+    amg_bench_put_be(out, value, 2);
+    return out;
+}
+
+static amg_bench_bytes_t amg_bench_bplist_real(double value)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    amg_bench_bytes_t out(1, 0x23);
+    amg_bench_put_be(out, bits, 8);
+    return out;
+}
+
+static amg_bench_bytes_t amg_bench_bplist_blob(unsigned char type, const amg_bench_bytes_t &bytes)
+{
+    amg_bench_bytes_t out;
+    if (bytes.size() < 15) {
+        out.push_back(static_cast<unsigned char>(type | bytes.size()));
+    } else {
+        out.push_back(static_cast<unsigned char>(type | 0x0f));
+        out.push_back(0x12);
+        amg_bench_put_be(out, bytes.size(), 4);
+    }
+    out.insert(out.end(), bytes.begin(), bytes.end());
+    return out;
+}
+
+static amg_bench_bytes_t amg_bench_bplist_string(const std::string &s)
+{
+    return amg_bench_bplist_blob(0x50, amg_bench_bytes_t(s.begin(), s.end()));
+}
+
+/*!
+ * A version 2 alias record to a file whose POSIX path is about \a size
+ * bytes long.
+ */
+static amg_bench_bytes_t amg_bench_alias(size_t index, size_t size)
+{
+    const std::string volume = "Macintosh HD";
+    const std::string target = "background-" + std::to_string(index) + ".png";
+    const std::string path = amg_bench_path(index, size);
+
+    amg_bench_bytes_t out;
+    amg_bench_put_be(out, 0, 4);          // creator code
+    amg_bench_put_be(out, 0, 2);          // record size, set below
+    amg_bench_put_be(out, 2, 2);          // version
+    amg_bench_put_be(out, 0, 2);          // kind
+    out.push_back(static_cast<unsigned char>(volume.size()));
+    amg_bench_put_string(out, volume);
+    out.insert(out.end(), 27 - volume.size(), 0);
+    amg_bench_put_be(out, 3456789012u, 4); // volume date
+    amg_bench_put_be(out, 0x482b, 2);     // 'H+'
+    amg_bench_put_be(out, 0, 2);          // disk type
+    amg_bench_put_be(out, 1000 + index, 4);
+    out.push_back(static_cast<unsigned char>(target.size()));
+    amg_bench_put_string(out, target);
+    out.insert(out.end(), 63 - target.size(), 0);
+    amg_bench_put_be(out, 2000 + index, 4);
+    amg_bench_put_be(out, 3456789012u, 4);
+    amg_bench_put_be(out, 0, 4);
+    amg_bench_put_be(out, 0, 4);
+    amg_bench_put_be(out, 0xffff, 2);
+    amg_bench_put_be(out, 0xffff, 2);
+    amg_bench_put_be(out, 0xd02, 4);
+    amg_bench_put_be(out, 0, 2);
+    out.insert(out.end(), 10, 0);
+
+    const auto entry = [&out](int16_t tag, const amg_bench_bytes_t &value) {
+        amg_bench_put_be(out, static_cast<uint16_t>(tag), 2);
+        amg_bench_put_be(out, value.size(), 2);
+        out.insert(out.end(), value.begin(), value.end());
+        if (value.size() % 2)
+            out.push_back(0);
+    };
+
+    amg_bench_bytes_t unicode_target;
+    amg_bench_put_be(unicode_target, target.size(), 2);
+    for (const char c : target)
+        amg_bench_put_be(unicode_target, static_cast<unsigned char>(c), 2);
+
+    amg_bench_bytes_t cnids;
+    for (uint32_t i = 0; i < 4; ++i)
+        amg_bench_put_be(cnids, 1000 + index - i, 4);
+
+    const size_t slash = path.rfind('/');
+    const size_t parent = path.rfind('/', slash - 1) + 1;
+    entry(0, amg_bench_bytes_t(path.begin() + parent, path.begin() + slash));
+    entry(1, cnids);
+    entry(14, unicode_target);
+    entry(18, amg_bench_bytes_t(path.begin(), path.end()));
+    entry(19, amg_bench_bytes_t(1, '/'));
+    entry(-1, amg_bench_bytes_t());
+
+    out[4] = static_cast<unsigned char>(out.size() >> 8);
+    out[5] = static_cast<unsigned char>(out.size());
+    return out;
+}
+
+/*!
+ * A bookmark with one table of contents naming the path components of a
+ * file, about \a size bytes in all.
+ */
+static amg_bench_bytes_t amg_bench_bookmark(size_t index, size_t size)
+{
+    static const uint32_t header_size = 48;
+    const std::string path = amg_bench_path(index, size);
+
+    // Items follow the table of contents offset at the start of the body
+    amg_bench_bytes_t body;
+    amg_bench_put_le(body, 0, 4);
+
+    std::vector<uint32_t> components;
+    for (size_t start = 1, end; start < path.size(); start = end + 1) {
+        end = std::min(path.find('/', start), path.size());
+        components.push_back(static_cast<uint32_t>(body.size()));
+        amg_bench_put_le(body, end - start, 4);
+        amg_bench_put_le(body, 0x0101, 4);
+        amg_bench_put_string(body, path.substr(start, end - start));
+        body.insert(body.end(), (4 - (end - start) % 4) % 4, 0);
+    }
+
+    const uint32_t array = static_cast<uint32_t>(body.size());
+    amg_bench_put_le(body, components.size() * 4, 4);
+    amg_bench_put_le(body, 0x0601, 4);
+    for (const uint32_t component : components)
+        amg_bench_put_le(body, component, 4);
+
+    const uint32_t volume = static_cast<uint32_t>(body.size());
+    amg_bench_put_le(body, 1, 4);
+    amg_bench_put_le(body, 0x0101, 4);
+    amg_bench_put_string(body, "/");
+    body.insert(body.end(), 3, 0);
+
+    const uint32_t toc = static_cast<uint32_t>(body.size());
+    amg_bench_put_le(body, 0, 4);
+    amg_bench_put_le(body, 0xfffffffe, 4);
+    amg_bench_put_le(body, 1, 4);
+    amg_bench_put_le(body, 0, 4);
+    amg_bench_put_le(body, 2, 4);
+    amg_bench_put_le(body, 0x1004, 4);
+    amg_bench_put_le(body, array, 4);
+    amg_bench_put_le(body, 0, 4);
+    amg_bench_put_le(body, 0x2002, 4);
+    amg_bench_put_le(body, volume, 4);
+    amg_bench_put_le(body, 0, 4);
+    for (size_t i = 0; i < 4; ++i)
+        body[i] = static_cast<unsigned char>(toc >> (8 * i));
+
+    amg_bench_bytes_t out;
+    amg_bench_put_string(out, "book");
+    amg_bench_put_le(out, header_size + body.size(), 4);
+    amg_bench_put_le(out, 0x10040000, 4);
+    amg_bench_put_le(out, header_size, 4);
+    out.insert(out.end(), header_size - out.size(), 0);
+    out.insert(out.end(), body.begin(), body.end());
+    return out;
+}
+
+static amg_bench_bytes_t amg_bench_blob(ds_record_type type, size_t index, size_t size, std::mt19937 &rng)
+{
+    amg_bench_bytes_t out;
+    switch (type) {
+        case ds_record_type_Iloc:
+        case ds_record_type_dilc:
+            amg_bench_put_be(out, rng() % 2000, 4);
+            amg_bench_put_be(out, rng() % 2000, 4);
+            amg_bench_put_be(out, 0xffffffffffff0000ull, 8);
+            return out;
+        case ds_record_type_fwi0:
+            amg_bench_put_be(out, 100, 2);
+            amg_bench_put_be(out, 100, 2);
+            amg_bench_put_be(out, 600, 2);
+            amg_bench_put_be(out, 900, 2);
+            amg_bench_put_be(out, FOUR_CHAR_CODE('icnv'), 4);
+            amg_bench_put_be(out, 0, 4);
+            return out;
+        case ds_record_type_BKGD:
+            amg_bench_put_be(out, FOUR_CHAR_CODE('DefB'), 4);
+            out.insert(out.end(), 8, 0);
+            return out;
+        case ds_record_type_pict:
+            return amg_bench_alias(index, size);
+        case ds_record_type_pBBk:
+            return amg_bench_bookmark(index, size);
+        case ds_record_type_icvp:
+            return amg_bench_bplist({
+                { "viewOptionsVersion", amg_bench_bplist_int(1) },
+                { "backgroundType", amg_bench_bplist_int(2) },
+                { "iconSize", amg_bench_bplist_real(64) },
+                { "gridSpacing", amg_bench_bplist_real(100) },
+                { "showItemInfo", amg_bench_bytes_t(1, 0x08) },
+                { "labelOnBottom", amg_bench_bytes_t(1, 0x09) },
+                { "arrangeBy", amg_bench_bplist_string("none") },
+                { "backgroundImageAlias", amg_bench_bplist_blob(0x40, amg_bench_alias(index, size)) },
+            });
+        case ds_record_type_bwsp:
+        case ds_record_type_icvP:
+        case ds_record_type_lsvp:
+        case ds_record_type_lsvP:
+            return amg_bench_bplist({
+                { "ShowStatusBar", amg_bench_bytes_t(1, 0x08) },
+                { "SidebarWidth", amg_bench_bplist_int(180) },
+                { "WindowBounds", amg_bench_bplist_string("{{" + std::to_string(rng() % 500) + ", 120}, {920, 436}}") },
+                { "Path", amg_bench_bplist_string(amg_bench_path(index, size)) },
+            });
+        default:
+            for (size_t i = 0; i < size; ++i)
+                out.push_back(static_cast<unsigned char>(rng()));
+            return out;
+    }
+}
+
+static void amg_bench_set_data(ds_record_t *record, ds_record_type type, size_t index, size_t size, std::mt19937 &rng)
+{
+    ds_record_data_type data_type = ds_record_data_type_for_record_type(type);
+    if (data_type == 0)
+        data_type = ds_record_data_type_blob;
+
+    ds_record_set_type(record, type);
+    ds_record_set_data_type(record, data_type);
+    switch (data_type) {
+        case ds_record_data_type_long:
+            ds_record_set_data_as_long(record, rng());
+            break;
+        case ds_record_data_type_shor:
+            ds_record_set_data_as_shor(record, static_cast<uint16_t>(rng() % 4));
+            break;
+        case ds_record_data_type_bool:
+            ds_record_set_data_as_bool(record, rng() % 2 != 0);
+            break;
+        case ds_record_data_type_type:
+            ds_record_set_data_as_type(record, FOUR_CHAR_CODE('icnv'));
+            break;
+        case ds_record_data_type_comp:
+            ds_record_set_data_as_comp(record, (static_cast<uint64_t>(rng()) << 8) | rng());
+            break;
+        case ds_record_data_type_dutc: {
+            UTCDateTime date;
+            const uint64_t ticks = (3456789012ull + rng() % 100000000) << 16;
+            memcpy(&date, &ticks, sizeof(date));
+            ds_record_set_data_as_dutc(record, date);
+            break;
+        }
+        case ds_record_data_type_ustr: {
+            std::basic_string<uint16_t> comment;
+            static const char words[] = "a comment about this file ";
+            for (size_t i = 0; comment.size() < std::max<size_t>(size / 2, 1); ++i)
+                comment.push_back(static_cast<uint16_t>(words[i % (sizeof(words) - 1)]));
+            ds_record_set_data_as_ustr(record, comment.data(), comment.size());
+            break;
+        }
+        case ds_record_data_type_blob: {
+            const amg_bench_bytes_t blob = amg_bench_blob(type, index, size, rng);
+            ds_record_set_data_as_blob(record, blob.data(), blob.size());
+            break;
+        }
+    }
+}
+
+static size_t amg_bench_encoded_size(ds_record_t *record)
+{
+    size_t size = 3 * sizeof(uint32_t) + 2 * ds_record_get_filename_len(record);
+    switch (ds_record_get_data_type(record)) {
+        case ds_record_data_type_blob:
+            return size + sizeof(uint32_t) + ds_record_get_data_as_blob_size(record);
+        case ds_record_data_type_ustr:
+            return size + sizeof(uint32_t) + 2 * ds_record_get_data_as_ustr_len(record);
+        case ds_record_data_type_shor:
+        case ds_record_data_type_long:
+        case ds_record_data_type_bool:
+        case ds_record_data_type_type:
+            return size + sizeof(uint32_t);
+        case ds_record_data_type_comp:
+        case ds_record_data_type_dutc:
+            return size + sizeof(uint64_t);
+    }
+    return size;
+}
+
+void amg_bench_corpus_options_init(amg_bench_corpus_options_t *options)
+{
+    options->record_count = 10000;
+    options->depth = 0;
+    options->blob_size = 128;
+    options->seed = 1;
+    options->mix = {
+        { ds_record_type_Iloc, 60 },
+        { ds_record_type_cmmt, 5 },
+        { ds_record_type_lg1S, 8 },
+        { ds_record_type_ph1S, 8 },
+        { ds_record_type_modD, 8 },
+        { ds_record_type_vSrn, 4 },
+        { ds_record_type_bwsp, 3 },
+        { ds_record_type_icvp, 2 },
+        { ds_record_type_pict, 1 },
+        { ds_record_type_pBBk, 1 },
+    };
+}
+
+int amg_bench_corpus_parse_mix(amg_bench_corpus_options_t *options, const char *mix)
+{
+    std::vector<std::pair<ds_record_type, unsigned>> parsed;
+    for (const char *p = mix; *p;) {
+        char *end = nullptr;
+        if (strlen(p) < 6 || p[4] != '=')
+            return 1;
+
+        const unsigned long weight = strtoul(p + 5, &end, 10);
+        if (end == p + 5 || weight > 1000000 || (*end != ',' && *end != '\0'))
+            return 1;
+
+        parsed.emplace_back(static_cast<ds_record_type>(uint32_from_be(reinterpret_cast<const unsigned char *>(p))), static_cast<unsigned>(weight));
+        p = *end == ',' ? end + 1 : end;
+    }
+
+    if (parsed.empty())
+        return 1;
+
+    options->mix = parsed;
+    return 0;
+}
+
+std::vector<ds_record_t *> amg_bench_corpus_generate(const amg_bench_corpus_options_t *options)
+{
+    std::mt19937 rng(options->seed);
+
+    std::vector<unsigned> weights;
+    for (const auto &type : options->mix)
+        weights.push_back(type.second);
+    std::discrete_distribution<size_t> pick(weights.begin(), weights.end());
+
+    // Payloads first, so that the filenames can be padded to reach the
+    // requested depth
+    std::vector<ds_record_t *> records;
+    records.reserve(options->record_count);
+    size_t total_size = 0;
+    for (size_t i = 0; i < options->record_count; ++i) {
+        ds_record_t *record = ds_record_create();
+        amg_bench_set_data(record, options->mix[pick(rng)].first, i, options->blob_size, rng);
+        total_size += amg_bench_encoded_size(record);
+        records.push_back(record);
+    }
+
+    // Full nodes of k records make a tree of height h hold up to about
+    // (k + 1)^h - 1 records, so aim between the fanouts that give h - 1 and
+    // h levels
+    size_t padding = 0;
+    if (options->depth > 0 && !records.empty()) {
+        const double n = static_cast<double>(records.size()) + 1;
+        const double h = options->depth;
+        const double fanout = h > 1 ? pow(n, (1 / h + 1 / (h - 1)) / 2) - 1 : n;
+        const double mean_size = static_cast<double>(total_size) / records.size() + 2 * amg_bench_filename_len;
+        const double target_size = (amg_bench_node_size - 2 * sizeof(uint32_t)) / std::max(fanout, 1.0);
+        if (target_size > mean_size)
+            padding = static_cast<size_t>((target_size - mean_size) / 2);
+    }
+
+    for (size_t i = 0; i < records.size(); ++i) {
+        char name[32];
+        snprintf(name, sizeof(name), "file-%08zu", i);
+
+        std::basic_string<uint16_t> filename(name, name + strlen(name));
+        filename.append(padding, '_');
+        filename += '.';
+        filename += 't';
+        filename += 'x';
+        filename += 't';
+
+        // Keep every record within a node, shrinking the payload of those
+        // that would not fit and replacing it if that is not enough
+        const size_t max_filename_len = amg_bench_max_record_size / 4;
+        if (filename.size() > max_filename_len)
+            filename.erase(max_filename_len - 4, filename.size() - max_filename_len);
+        ds_record_set_filename(records[i], filename.data(), filename.size());
+        if (amg_bench_encoded_size(records[i]) > amg_bench_max_record_size) {
+            std::mt19937 retry(options->seed + static_cast<uint32_t>(i));
+            amg_bench_set_data(records[i], ds_record_get_type(records[i]), i, amg_bench_max_record_size / 4, retry);
+            if (amg_bench_encoded_size(records[i]) > amg_bench_max_record_size)
+                amg_bench_set_data(records[i], ds_record_type_Iloc, i, 0, retry);
+        }
+    }
+
+    std::sort(records.begin(), records.end(), [](ds_record_t *a, ds_record_t *b) {
+        return ds_record_compare(a, b) < 0;
+    });
+    return records;
+}
+
+int amg_bench_corpus_write_store(const amg_bench_corpus_options_t *options, const char *path)
+{
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "error opening file %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    std::vector<ds_record_t *> records = amg_bench_corpus_generate(options);
+    int result = ds_store_fwrite_records(file, records.data(), records.size());
+    if (fclose(file) != 0)
+        result = 1;
+
+    for (ds_record_t *record : records)
+        ds_record_free(record);
+    return result;
+}
+
+int amg_bench_corpus_write_tree(const amg_bench_corpus_options_t *options, const char *directory, size_t count)
+{
+    if (mkdir(directory, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "error creating directory %s: %s\n", directory, strerror(errno));
+        return 1;
+    }
+
+    amg_bench_corpus_options_t store_options = *options;
+    for (size_t i = 0; i < count; ++i) {
+        const std::string folder = std::string(directory) + "/" + std::to_string(i);
+        if (mkdir(folder.c_str(), 0755) != 0 && errno != EEXIST) {
+            fprintf(stderr, "error creating directory %s: %s\n", folder.c_str(), strerror(errno));
+            return 1;
+        }
+
+        store_options.seed = options->seed + static_cast<uint32_t>(i);
+        if (amg_bench_corpus_write_store(&store_options, (folder + "/.DS_Store").c_str()) != 0)
+            return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2015 Jake Petroules. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AMALGAMATE_BENCH_CORPUS_H
+#define AMALGAMATE_BENCH_CORPUS_H
+
+#include "dsrecord.h"
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*!
+ * Shape of a synthetic store. Record types are drawn from \c mix in
+ * proportion to their weights. Blob payloads (comments, raw blobs, and the
+ * data members of property lists, aliases and bookmarks) are about
+ * \c blob_size bytes, cut down where a record would not fit in a node.
+ * A nonzero \c depth pads filenames until the tree is about that many nodes
+ * high, since record size decides how many records a node holds; padding
+ * only makes trees deeper than the record count alone would.
+ */
+typedef struct {
+    size_t record_count;
+    unsigned depth;
+    size_t blob_size;
+    uint32_t seed;
+    std::vector<std::pair<ds_record_type, unsigned>> mix;
+} amg_bench_corpus_options_t;
+
+/*!
+ * Sets \a options to a store of 10000 records in the mix found in typical
+ * folders: mostly icon locations, with some comments, sizes, dates, view
+ * settings, background aliases and bookmarks.
+ */
+void amg_bench_corpus_options_init(amg_bench_corpus_options_t *options);
+
+/*!
+ * Parses a mix such as "Iloc=8,cmmt=1,icvp=1" into \a options. Returns 0 if
+ * it is valid.
+ */
+int amg_bench_corpus_parse_mix(amg_bench_corpus_options_t *options, const char *mix);
+
+/*!
+ * Generates the records of a store described by \a options, sorted and
+ * ready for ds_store_fwrite_records. The caller frees them.
+ */
+std::vector<ds_record_t *> amg_bench_corpus_generate(const amg_bench_corpus_options_t *options);
+
+/*!
+ * Writes a store described by \a options to \a path.
+ */
+int amg_bench_corpus_write_store(const amg_bench_corpus_options_t *options, const char *path);
+
+/*!
+ * Writes \a count stores, each in a folder of its own, under \a directory.
+ * Each store uses the next seed after the last one.
+ */
+int amg_bench_corpus_write_tree(const amg_bench_corpus_options_t *options, const char *directory, size_t count);
+
+#endif // AMALGAMATE_BENCH_CORPUS_H
@@ -0,0 +1,414 @@
+/*
+ * Copyright (c) 2015 Jake Petroules. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "amg.h"
+#include "amgbenchcorpus.h"
+#include "dsrecord_p.h"
+
+/*!
+ * Every allocation made through operator new, which covers the containers
+ * in records, values and stores; allocations made with malloc are not seen.
+ */
+static std::atomic<uint64_t> amg_bench_allocations(0);
+
+void *operator new(size_t size)
+{
+    ++amg_bench_allocations;
+    if (void *p = malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    free(p);
+}
+
+typedef struct {
+    double min_time;
+    const char *filter;
+} amg_bench_options_t;
+
+static amg_bench_options_t amg_bench_options = { 0.5, nullptr };
+
+/*!
+ * Runs \a body once to warm up and then repeatedly for at least the minimum
+ * time, and reports the rates for \a records records and \a bytes bytes
+ * processed per run.
+ */
+template <typename Body>
+static void amg_bench_run(const std::string &name, size_t records, size_t bytes, Body body)
+{
+    if (amg_bench_options.filter && name.find(amg_bench_options.filter) == std::string::npos)
+        return;
+
+    typedef std::chrono::steady_clock clock;
+    body();
+
+    const uint64_t allocations = amg_bench_allocations;
+    const clock::time_point start = clock::now();
+    double elapsed = 0;
+    size_t iterations = 0;
+    do {
+        body();
+        ++iterations;
+        elapsed = std::chrono::duration<double>(clock::now() - start).count();
+    } while (elapsed < amg_bench_options.min_time);
+
+    const double total_records = static_cast<double>(records) * iterations;
+    const double total_bytes = static_cast<double>(bytes) * iterations;
+    fprintf(stdout, "%-24s %8zu runs %12.0f records/s %9.1f MB/s %8.2f allocs/record\n",
+            name.c_str(), iterations,
+            total_records / elapsed,
+            total_bytes / elapsed / 1e6,
+            total_records > 0 ? (amg_bench_allocations - allocations) / total_records : 0.0);
+}
+
+static size_t amg_bench_file_size(const char *path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 ? static_cast<size_t>(st.st_size) : 0;
+}
+
+static std::vector<ds_record_t *> amg_bench_read_records(ds_store_t *store)
+{
+    std::vector<ds_record_t *> records;
+    ds_store_enum_records_core(store, [&records](ds_record_t *record) {
+        ds_record_t *copy = ds_record_create();
+        std::vector<unsigned char> buf;
+        ds_record_mwrite(record, buf);
+        ds_membuf_t membuf = ds_membuf_make(buf.data(), buf.size());
+        ds_record_mread(copy, &membuf);
+        records.push_back(copy);
+    });
+    return records;
+}
+
+/*!
+ * Benchmarks decoding and converting single records, using the records of
+ * \a store laid out back to back as they are in node pages.
+ */
+static void amg_bench_records(const std::string &prefix, ds_store_t *store)
+{
+    std::vector<ds_record_t *> records = amg_bench_read_records(store);
+    std::vector<unsigned char> encoded;
+    for (ds_record_t *record : records)
+        ds_record_mwrite(record, encoded);
+
+    const size_t count = records.size();
+    const size_t bytes = encoded.size();
+
+    amg_bench_run(prefix + "record_mread", count, bytes, [&] {
+        ds_record_t *record = ds_record_create();
+        ds_membuf_t buf = ds_membuf_make(encoded.data(), encoded.size());
+        for (size_t i = 0; i < count; ++i)
+            ds_record_mread(record, &buf);
+        ds_record_free(record);
+    });
+
+    amg_bench_run(prefix + "record_view_mread", count, bytes, [&] {
+        ds_record_view_t view;
+        ds_membuf_t buf = ds_membuf_make(encoded.data(), encoded.size());
+        for (size_t i = 0; i < count; ++i)
+            ds_record_view_mread(&view, &buf);
+    });
+
+    FILE *file = tmpfile();
+    if (file && fwrite(encoded.data(), 1, encoded.size(), file) == encoded.size()) {
+        amg_bench_run(prefix + "record_fread", count, bytes, [&] {
+            ds_record_t *record = ds_record_create();
+            rewind(file);
+            for (size_t i = 0; i < count; ++i)
+                ds_record_fread(record, file);
+            ds_record_free(record);
+        });
+    }
+    if (file)
+        fclose(file);
+
+    amg_bench_run(prefix + "record_copy_value", count, bytes, [&] {
+        for (ds_record_t *record : records)
+            amg::value value = ds_record_copy_value(record);
+    });
+
+#if AMG_HAVE_COREFOUNDATION
+    amg_bench_run(prefix + "record_copy_dictionary", count, bytes, [&] {
+        for (ds_record_t *record : records) {
+            if (CFDictionaryRef dictionary = ds_record_copy_dictionary(record))
+                CFRelease(dictionary);
+        }
+    });
+#endif
+
+    FILE *null = fopen("/dev/null", "wb");
+    if (null) {
+        amg_bench_run(prefix + "record_convert", count, bytes, [&] {
+            for (ds_record_t *record : records)
+                amg_convert_record(record, "json", null);
+        });
+        fclose(null);
+    }
+
+    for (ds_record_t *record : records)
+        ds_record_free(record);
+}
+
+/*!
+ * Benchmarks reading, walking and converting the whole store at \a path.
+ */
+static int amg_bench_store(const std::string &prefix, const char *path)
+{
+    ds_store_t *store = ds_store_open_mapped(path);
+    if (!store)
+        return 1;
+
+    size_t count = 0;
+    ds_store_enum_record_views_core(store, [&count](const ds_record_view_t *) { ++count; });
+    const size_t bytes = amg_bench_file_size(path);
+
+    amg_bench_run(prefix + "store_fread", count, bytes, [&] {
+        if (FILE *file = fopen(path, "rb")) {
+            if (ds_store_t *read = ds_store_fread(file))
+                ds_store_free(read);
+            fclose(file);
+        }
+    });
+
+    amg_bench_run(prefix + "store_open_mapped", count, bytes, [&] {
+        if (ds_store_t *opened = ds_store_open_mapped(path))
+            ds_store_free(opened);
+    });
+
+    amg_bench_run(prefix + "enum_cursor", count, bytes, [&] {
+        ds_store_cursor_t *cursor = ds_store_cursor_create(store);
+        ds_record_t *record = ds_record_create();
+        while (ds_store_cursor_next(cursor, record) > 0)
+            ;
+        ds_record_free(record);
+        ds_store_cursor_free(cursor);
+    });
+
+    amg_bench_run(prefix + "enum_records", count, bytes, [&] {
+        ds_store_enum_records_core(store, [](ds_record_t *) { });
+    });
+
+    amg_bench_run(prefix + "enum_record_views", count, bytes, [&] {
+        ds_store_enum_record_views_core(store, [](const ds_record_view_t *) { });
+    });
+
+    amg_bench_run(prefix + "enum_records_parallel", count, bytes, [&] {
+        ds_store_enum_records_parallel_core(store, 0, [](ds_record_t *) { });
+    });
+
+    FILE *null = fopen("/dev/null", "wb");
+    if (null) {
+        amg_bench_run(prefix + "convert_ndjson", count, bytes, [&] {
+            amg_json_writer_t *writer = amg_json_writer_create(null, "ndjson");
+            ds_store_enum_records_core(store, [writer](ds_record_t *record) {
+                amg_json_writer_write_record(writer, record);
+            });
+            amg_json_writer_finish(writer);
+            amg_json_writer_free(writer);
+        });
+        fclose(null);
+    }
+
+    amg_bench_records(prefix, store);
+    ds_store_free(store);
+    return 0;
+}
+
+typedef struct {
+    size_t records;
+    size_t bytes;
+} amg_bench_scan_totals_t;
+
+static void *amg_bench_scan_visit(const char *path, ds_store_t *store, void *)
+{
+    amg_bench_scan_totals_t *totals = new amg_bench_scan_totals_t();
+    totals->bytes = amg_bench_file_size(path);
+    if (store)
+        ds_store_enum_record_views_core(store, [totals](const ds_record_view_t *) { ++totals->records; });
+    return totals;
+}
+
+static void amg_bench_scan_sink(const char *, void *result, void *context)
+{
+    amg_bench_scan_totals_t *totals = static_cast<amg_bench_scan_totals_t *>(result);
+    static_cast<amg_bench_scan_totals_t *>(context)->records += totals->records;
+    static_cast<amg_bench_scan_totals_t *>(context)->bytes += totals->bytes;
+    delete totals;
+}
+
+/*!
+ * Benchmarks reading every store under \a directory on all CPUs.
+ */
+static void amg_bench_corpus(const char *directory)
+{
+    amg_bench_scan_totals_t totals = { 0, 0 };
+    if (amg_scan(directory, 0, 0, amg_bench_scan_visit, amg_bench_scan_sink, &totals) != 0)
+        return;
+
+    fprintf(stdout, "%s\n", directory);
+    amg_bench_run("corpus_scan", totals.records, totals.bytes, [&] {
+        amg_bench_scan_totals_t scanned = { 0, 0 };
+        amg_scan(directory, 0, 0, amg_bench_scan_visit, amg_bench_scan_sink, &scanned);
+    });
+}
+
+static void amg_bench_usage(const char *program)
+{
+    fprintf(stderr,
+            "usage: %s [options] [file ...]\n"
+            "\n"
+            "Benchmarks the given stores, or a synthetic one if there are none.\n"
+            "\n"
+            "  --records N            records in a synthetic store (10000)\n"
+            "  --depth N              pad filenames until the tree is about N nodes high\n"
+            "  --blob-size N          payload size of comments, blobs, aliases and bookmarks (128)\n"
+            "  --mix TYPE=W,...       record types and their weights, e.g. Iloc=8,cmmt=1\n"
+            "  --seed N               random seed (1)\n"
+            "  --generate PATH        write a synthetic store to PATH and exit\n"
+            "  --generate-tree DIR N  write N synthetic stores under DIR and exit\n"
+            "  --corpus DIR           also benchmark scanning the stores under DIR\n"
+            "  --min-time SECONDS     minimum time per benchmark (0.5)\n"
+            "  --filter TEXT          only run benchmarks whose name contains TEXT\n",
+            program);
+}
+
+static bool amg_bench_parse_size(const char *s, size_t *value)
+{
+    char *end = nullptr;
+    errno = 0;
+    const unsigned long long parsed = strtoull(s, &end, 10);
+    if (end == s || *end != '\0' || errno != 0)
+        return false;
+    *value = static_cast<size_t>(parsed);
+    return true;
+}
+
+int main(int argc, const char *argv[])
+{
+    amg_bench_corpus_options_t corpus;
+    amg_bench_corpus_options_init(&corpus);
+
+    const char *generate = nullptr;
+    const char *generate_tree = nullptr;
+    size_t generate_tree_count = 0;
+    const char *corpus_directory = nullptr;
+    std::vector<const char *> files;
+
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        size_t value = 0;
+        if (arg == "--records" && has_value && amg_bench_parse_size(argv[i + 1], &value)) {
+            corpus.record_count = value;
+            ++i;
+        } else if (arg == "--depth" && has_value && amg_bench_parse_size(argv[i + 1], &value) && value <= 32) {
+            corpus.depth = static_cast<unsigned>(value);
+            ++i;
+        } else if (arg == "--blob-size" && has_value && amg_bench_parse_size(argv[i + 1], &value)) {
+            corpus.blob_size = value;
+            ++i;
+        } else if (arg == "--seed" && has_value && amg_bench_parse_size(argv[i + 1], &value)) {
+            corpus.seed = static_cast<uint32_t>(value);
+            ++i;
+        } else if (arg == "--mix" && has_value && amg_bench_corpus_parse_mix(&corpus, argv[i + 1]) == 0) {
+            ++i;
+        } else if (arg == "--generate" && has_value) {
+            generate = argv[++i];
+        } else if (arg == "--generate-tree" && i + 2 < argc && amg_bench_parse_size(argv[i + 2], &generate_tree_count)) {
+            generate_tree = argv[i + 1];
+            i += 2;
+        } else if (arg == "--corpus" && has_value) {
+            corpus_directory = argv[++i];
+        } else if (arg == "--min-time" && has_value) {
+            amg_bench_options.min_time = atof(argv[++i]);
+        } else if (arg == "--filter" && has_value) {
+            amg_bench_options.filter = argv[++i];
+        } else if (arg.compare(0, 2, "--") != 0) {
+            files.push_back(argv[i]);
+        } else {
+            amg_bench_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (generate)
+        return amg_bench_corpus_write_store(&corpus, generate);
+    if (generate_tree)
+        return amg_bench_corpus_write_tree(&corpus, generate_tree, generate_tree_count);
+
+    int result = 0;
+    if (files.empty()) {
+        const char *tmpdir = getenv("TMPDIR");
+        std::string path = std::string(tmpdir && *tmpdir ? tmpdir : "/tmp") + "/amalgamate-bench-XXXXXX";
+        const int fd = mkstemp(&path[0]);
+        if (fd == -1) {
+            fprintf(stderr, "error creating temporary file: %s\n", strerror(errno));
+            return 1;
+        }
+        close(fd);
+
+        fprintf(stdout, "synthetic store: %zu records, blob size %zu, depth %u, seed %u\n",
+                corpus.record_count, corpus.blob_size, corpus.depth, corpus.seed);
+        result = amg_bench_corpus_write_store(&corpus, path.c_str()) != 0
+              || amg_bench_store("", path.c_str()) != 0;
+        unlink(path.c_str());
+    }
+
+    for (const char *file : files) {
+        fprintf(stdout, "%s\n", file);
+        if (amg_bench_store("", file) != 0)
+            result = 1;
+    }
+
+    if (corpus_directory)
+        amg_bench_corpus(corpus_directory);
+
+    return result;
+}
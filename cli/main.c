@@ -24,17 +24,104 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "amg.h"
 
-int main(int argc, const char * argv[])
+static int amg_main(int argc, const char * argv[])
 {
     if (argc == 3 && strcmp(argv[1], "--dump") == 0) {
         return amg_dump_file(argv[2]);
     } else if (argc == 4 && strcmp(argv[1], "--convert") == 0) {
         return amg_convert_file(argv[3], argv[2]);
+    } else if ((argc == 3 || (argc == 5 && strcmp(argv[3], "-j") == 0)) && strcmp(argv[1], "--scan") == 0) {
+        char *end = NULL;
+        const unsigned long jobs = argc == 5 ? strtoul(argv[4], &end, 10) : 0;
+        if (argc == 5 && (*end != '\0' || jobs > 1024)) {
+            fprintf(stderr, "error: invalid job count '%s'\n", argv[4]);
+            return 1;
+        }
+
+        return amg_scan_directory(argv[2], (unsigned)jobs);
+    } else if ((argc == 4 || (argc == 6 && strcmp(argv[4], "-j") == 0)) && strcmp(argv[1], "--export-arrow") == 0) {
+        char *end = NULL;
+        const unsigned long jobs = argc == 6 ? strtoul(argv[5], &end, 10) : 0;
+        if (argc == 6 && (*end != '\0' || jobs > 1024)) {
+            fprintf(stderr, "error: invalid job count '%s'\n", argv[5]);
+            return 1;
+        }
+
+        return amg_export_arrow(argv[3], argv[2], (unsigned)jobs);
     }
 
     return 0;
 }
+
+int main(int argc, const char * argv[])
+{
+    // Options ahead of the command: --stats reports the work done reading
+    // stores, --trace writes a timeline of it to a file and --cache keeps
+    // the records of the stores opened in a file for the next run
+    int stats = 0;
+    const char *trace_path = NULL;
+    const char *cache_path = NULL;
+    for (;;) {
+        if (argc > 1 && strcmp(argv[1], "--stats") == 0) {
+            stats = 1;
+            --argc;
+            ++argv;
+        } else if (argc > 2 && strcmp(argv[1], "--trace") == 0) {
+            trace_path = argv[2];
+            argc -= 2;
+            argv += 2;
+        } else if (argc > 2 && strcmp(argv[1], "--cache") == 0) {
+            cache_path = argv[2];
+            argc -= 2;
+            argv += 2;
+        } else {
+            break;
+        }
+    }
+
+    if (stats)
+        ds_store_set_stats_enabled(1);
+    if (trace_path)
+        amg_trace_start(0);
+    if (cache_path && amg_parse_cache_enable(cache_path, 0) != 0)
+        return 1;
+
+    int result = amg_main(argc, argv);
+
+    if (stats) {
+        ds_store_stats_t totals;
+        ds_store_get_total_stats(&totals);
+        ds_store_stats_dump(&totals, stderr);
+    }
+
+    if (cache_path) {
+        if (stats) {
+            amg_parse_cache_stats_t cache_stats;
+            amg_parse_cache_get_stats(&cache_stats);
+            fprintf(stderr, "parse cache: %llu hits, %llu misses\n",
+                    (unsigned long long)cache_stats.hits, (unsigned long long)cache_stats.misses);
+        }
+
+        if (amg_parse_cache_save(1) != 0)
+            result = 1;
+        amg_parse_cache_disable();
+    }
+
+    if (trace_path) {
+        amg_trace_stop();
+        FILE *file = fopen(trace_path, "w");
+        if (!file || amg_trace_fwrite(file) != 0) {
+            fprintf(stderr, "error writing trace %s\n", trace_path);
+            result = 1;
+        }
+        if (file)
+            fclose(file);
+    }
+
+    return result;
+}
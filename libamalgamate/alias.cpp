@@ -23,9 +23,11 @@
  */
 
 #include "alias.h"
+#include "amgunicode.h"
 #include "dsio.h"
 #include <algorithm>
 #include <cassert>
+#include <string>
 #include <vector>
 
 typedef struct {
@@ -59,17 +61,28 @@ typedef struct {
 
 static const size_t alias_header_size = 150;
 
+/*!
+ * A metadata entry, located by the offset of its value within the alias.
+ */
 typedef struct {
     int16_t tag;
     uint16_t length;
-    unsigned char value[65536];
+    uint32_t offset;
 } metadata_entry_t;
 
 struct _alias {
     _alias();
     alias_header_t header;
+
+    /*!
+     * The alias as read; metadata values are decoded from here when asked
+     * for, so that an entry costs a few bytes whatever its length.
+     */
+    std::vector<unsigned char> data;
     std::vector<metadata_entry_t> metadata_entries;
 
+    const unsigned char *value(const metadata_entry_t &entry) const { return data.data() + entry.offset; }
+
 private:
     _alias(const _alias &) = delete;
     _alias &operator=(const _alias &) = delete;
@@ -89,11 +102,19 @@ alias_t *alias_create(void)
 alias_t *alias_create_from_data(const unsigned char *data, size_t size)
 {
     assert(data);
-    assert(size >= alias_header_size);
-    const unsigned char * const data_start = data;
+    if (size < alias_header_size) {
+        fprintf(stderr, "alias record of size %zu is smaller than its header\n", size);
+        return nullptr;
+    }
 
     alias_t *alias = alias_create();
 
+    // Keep a copy so the entries can refer into it however the caller's
+    // buffer is managed
+    alias->data.assign(data, data + size);
+    data = alias->data.data();
+    const unsigned char * const data_start = data;
+
     data = read_uint32_from_be(data, &alias->header.creator_code);
     data = read_uint16_from_be(data, &alias->header.record_size);
     if (alias->header.record_size != size) {
@@ -140,20 +161,21 @@ alias_t *alias_create_from_data(const unsigned char *data, size_t size)
 
     while ((data - data_start) <= alias->header.record_size - 4) {
         metadata_entry_t entry;
-        memset(&entry, 0, sizeof(entry));
         data = read_int16_from_be(data, &entry.tag);
         data = read_uint16_from_be(data, &entry.length);
+        entry.offset = static_cast<uint32_t>(data - data_start);
 
-        const uint16_t entry_length = entry.length % 2 == 0 ? entry.length : entry.length + 1;
-        if ((data - data_start) > alias->header.record_size - entry_length) {
+        // Values are padded to an even length
+        const size_t entry_length = entry.length + (entry.length % 2);
+        if (static_cast<size_t>(data - data_start) + entry_length > alias->header.record_size) {
             fprintf(stderr,
-                "effective alias metadata entry length %hu at offset %zd exceeds record size %hu\n",
+                "effective alias metadata entry length %zu at offset %zd exceeds record size %hu\n",
                 entry_length, data - data_start, alias->header.record_size);
             alias_free(alias);
             return nullptr;
         }
 
-        data = read_data_from(data, entry.value, entry_length);
+        data += entry_length;
 
         if (entry.tag == -1) {
             // this record should be the last one (and not be counted)
@@ -180,7 +202,123 @@ void alias_free(alias_t *alias)
     delete alias;
 }
 
-#ifdef __APPLE__
+size_t alias_get_metadata_count(const alias_t *alias)
+{
+    assert(alias);
+    return alias->metadata_entries.size();
+}
+
+int alias_get_metadata(const alias_t *alias, size_t index, int16_t *tag, const unsigned char **value, size_t *length)
+{
+    assert(alias);
+    if (index >= alias->metadata_entries.size())
+        return 1;
+
+    const metadata_entry_t &entry = alias->metadata_entries[index];
+    if (tag)
+        *tag = entry.tag;
+    if (value)
+        *value = alias->value(entry);
+    if (length)
+        *length = entry.length;
+    return 0;
+}
+
+static const metadata_entry_t *alias_find_entry(const alias_t *alias, int16_t tag)
+{
+    for (const auto &entry : alias->metadata_entries) {
+        if (entry.tag == tag)
+            return &entry;
+    }
+
+    return nullptr;
+}
+
+int alias_find_metadata(const alias_t *alias, int16_t tag, const unsigned char **value, size_t *length)
+{
+    assert(alias);
+    const metadata_entry_t *entry = alias_find_entry(alias, tag);
+    if (!entry)
+        return 0;
+
+    if (value)
+        *value = alias->value(*entry);
+    if (length)
+        *length = entry->length;
+    return 1;
+}
+
+/*!
+ * Decodes a length-prefixed big-endian UTF-16 value, as used by the
+ * Unicode filename and volume name entries.
+ */
+static bool alias_unicode_string(const unsigned char *value, size_t length, std::string *string)
+{
+    if (length < sizeof(uint16_t))
+        return false;
+
+    const size_t count = std::min<size_t>(uint16_from_be(value), (length - sizeof(uint16_t)) / sizeof(uint16_t));
+    *string = amg::utf8_from_utf16be(value + sizeof(uint16_t), count);
+    return true;
+}
+
+int alias_get_posix_path(const alias_t *alias, std::string *path)
+{
+    assert(alias && path);
+    const metadata_entry_t *entry = alias_find_entry(alias, alias_tag_posix_path);
+    if (!entry)
+        return 0;
+
+    // Unlike the names in the header, the POSIX path is UTF-8
+    const char *value = reinterpret_cast<const char *>(alias->value(*entry));
+    if (!amg_utf8_valid(value, entry->length))
+        return -1;
+
+    path->assign(value, entry->length);
+    return 1;
+}
+
+int alias_get_volume_name(const alias_t *alias, std::string *name)
+{
+    assert(alias && name);
+    if (const metadata_entry_t *entry = alias_find_entry(alias, alias_tag_unicode_volume_name))
+        return alias_unicode_string(alias->value(*entry), entry->length, name) ? 1 : -1;
+
+    *name = amg::utf8_from_mac_roman(alias->header.volume_name.data,
+                                     std::min<size_t>(alias->header.volume_name.length, sizeof(alias->header.volume_name.data)));
+    return 1;
+}
+
+int alias_get_filename(const alias_t *alias, std::string *name)
+{
+    assert(alias && name);
+    if (const metadata_entry_t *entry = alias_find_entry(alias, alias_tag_unicode_filename))
+        return alias_unicode_string(alias->value(*entry), entry->length, name) ? 1 : -1;
+
+    *name = amg::utf8_from_mac_roman(alias->header.target_name.data,
+                                     std::min<size_t>(alias->header.target_name.length, sizeof(alias->header.target_name.data)));
+    return 1;
+}
+
+int alias_get_cnid_path(const alias_t *alias, std::vector<uint32_t> *cnids)
+{
+    assert(alias && cnids);
+    const metadata_entry_t *entry = alias_find_entry(alias, alias_tag_cnid_path);
+    if (!entry)
+        return 0;
+
+    if (entry->length % sizeof(uint32_t) != 0)
+        return -1;
+
+    const unsigned char *value = alias->value(*entry);
+    cnids->clear();
+    cnids->reserve(entry->length / sizeof(uint32_t));
+    for (size_t i = 0; i < entry->length / sizeof(uint32_t); ++i)
+        cnids->push_back(uint32_from_be(value + (i * sizeof(uint32_t))));
+    return 1;
+}
+
+#if AMG_HAVE_COREFOUNDATION
 #include "cfutils.h"
 #include <CoreFoundation/CoreFoundation.h>
 
@@ -196,7 +334,7 @@ CFDictionaryRef _alias_copy_dictionary(const alias_t *pictRecord)
     AMGCFDictionarySetShortValue(pict, CFSTR("alias_kind"), pictRecord->header.alias_kind);
     AMGCFDictionarySetCStringValue(pict, CFSTR("volume_name"),
                                    pictRecord->header.volume_name.data,
-                                   pictRecord->header.volume_name.length);
+                                   std::min<size_t>(pictRecord->header.volume_name.length, sizeof(pictRecord->header.volume_name.data)));
     AMGCFDictionarySetMacDateValue(pict, CFSTR("volume_date"), pictRecord->header.volume_date);
 
     const uint16_t filesystem_type_n = htons(pictRecord->header.filesystem_type);
@@ -204,7 +342,7 @@ CFDictionaryRef _alias_copy_dictionary(const alias_t *pictRecord)
 
     AMGCFDictionarySetShortValue(pict, CFSTR("disk_type"), pictRecord->header.disk_type);
     AMGCFDictionarySetIntValue(pict, CFSTR("containing_folder_cnid"), pictRecord->header.containing_folder_cnid);
-    AMGCFDictionarySetCStringValue(pict, CFSTR("target_name"), reinterpret_cast<const char *>(pictRecord->header.target_name.data), pictRecord->header.target_name.length);
+    AMGCFDictionarySetCStringValue(pict, CFSTR("target_name"), reinterpret_cast<const char *>(pictRecord->header.target_name.data), std::min<size_t>(pictRecord->header.target_name.length, sizeof(pictRecord->header.target_name.data)));
     AMGCFDictionarySetIntValue(pict, CFSTR("target_cnid"), pictRecord->header.target_cnid);
     AMGCFDictionarySetMacDateValue(pict, CFSTR("target_creation_date"), pictRecord->header.target_creation_date);
     AMGCFDictionarySetFourCCValue(pict, CFSTR("target_creator_code"), pictRecord->header.target_creator_code);
@@ -219,6 +357,7 @@ CFDictionaryRef _alias_copy_dictionary(const alias_t *pictRecord)
                                                            &kCFTypeArrayCallBacks);
 
     for (const auto &entry : pictRecord->metadata_entries) {
+        const unsigned char *entry_value = pictRecord->value(entry);
         AMCFTypeRef<CFMutableDictionaryRef> metadata(CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
                                                                                &kCFTypeDictionaryKeyCallBacks,
                                                                                &kCFTypeDictionaryValueCallBacks));
@@ -231,34 +370,48 @@ CFDictionaryRef _alias_copy_dictionary(const alias_t *pictRecord)
             case 4:
             case 5:
             case 6:
-            case 18:
             case 19:
-                AMGCFDictionarySetCStringValue(metadata, CFSTR("value"), reinterpret_cast<const char *>(entry.value), static_cast<size_t>(entry.length));
+                AMGCFDictionarySetCStringValue(metadata, CFSTR("value"), reinterpret_cast<const char *>(entry_value), static_cast<size_t>(entry.length));
+                break;
+            case 18:
+                if (amg_utf8_valid(reinterpret_cast<const char *>(entry_value), entry.length)) {
+                    AMGCFDictionarySetUTF8StringValue(metadata, CFSTR("value"), reinterpret_cast<const char *>(entry_value), static_cast<size_t>(entry.length));
+                    break;
+                }
+                CFDictionarySetValue(metadata, CFSTR("value"), AMCFTypeRef<CFDataRef>(CFDataCreate(kCFAllocatorDefault, entry_value, entry.length)));
                 break;
             case 14:
             case 15:
                 // offset by 2 bytes (string length)
-                AMGCFDictionarySetHFSStringValue(metadata, CFSTR("value"), reinterpret_cast<const char *>(entry.value + sizeof(uint16_t)), static_cast<size_t>(std::min<uint16_t>(uint16_from_be(entry.value) * sizeof(uint16_t), entry.length)));
+                AMGCFDictionarySetHFSStringValue(metadata, CFSTR("value"), reinterpret_cast<const char *>(entry_value + sizeof(uint16_t)), static_cast<size_t>(std::min<uint16_t>(uint16_from_be(entry_value) * sizeof(uint16_t), entry.length)));
                 break;
             case 16:
-            case 17: {
-                const uint64_t value = uint64_from_be(entry.value);
-                AMGCFDictionarySetUTCDateValue(metadata, CFSTR("value"), reinterpret_cast<const UTCDateTime *>(&value));
+            case 17:
+                if (entry.length >= 8) {
+                    const uint64_t value = uint64_from_be(entry_value);
+                    AMGCFDictionarySetUTCDateValue(metadata, CFSTR("value"), reinterpret_cast<const UTCDateTime *>(&value));
+                    break;
+                }
+                CFDictionarySetValue(metadata, CFSTR("value"), AMCFTypeRef<CFDataRef>(CFDataCreate(kCFAllocatorDefault, entry_value, entry.length)));
                 break;
-            }
             case 20: {
-                const alias_t *recursiveAlias = alias_create_from_data(entry.value, entry.length);
-                CFDictionarySetValue(metadata, CFSTR("value"), AMCFTypeRef<CFDictionaryRef>(_alias_copy_dictionary(recursiveAlias)));
+                alias_t *recursiveAlias = alias_create_from_data(entry_value, entry.length);
+                if (recursiveAlias) {
+                    CFDictionarySetValue(metadata, CFSTR("value"), AMCFTypeRef<CFDictionaryRef>(_alias_copy_dictionary(recursiveAlias)));
+                    alias_free(recursiveAlias);
+                    break;
+                }
+                CFDictionarySetValue(metadata, CFSTR("value"), AMCFTypeRef<CFDataRef>(CFDataCreate(kCFAllocatorDefault, entry_value, entry.length)));
                 break;
             }
             case 1: {
                 if (entry.length % sizeof(uint32_t) == 0) {
                     CFMutableArrayRef cnids = CFArrayCreateMutable(kCFAllocatorDefault, 0, &kCFTypeArrayCallBacks);
                     for (size_t i = 0; i < entry.length / sizeof(uint32_t); ++i) {
-                        uint32_t value_n = ntohl(*reinterpret_cast<const uint32_t *>(entry.value + (i * sizeof(uint32_t))));
+                        const uint32_t cnid = uint32_from_be(entry_value + (i * sizeof(uint32_t)));
                         CFArrayAppendValue(cnids, AMCFTypeRef<CFNumberRef>(CFNumberCreate(kCFAllocatorDefault,
                                                                                           kCFNumberIntType,
-                                                                                          &value_n)));
+                                                                                          &cnid)));
                     }
 
                     CFDictionarySetValue(metadata, CFSTR("value"), cnids);
@@ -271,7 +424,7 @@ CFDictionaryRef _alias_copy_dictionary(const alias_t *pictRecord)
             case 10:
             case 21:
             default:
-                CFDictionarySetValue(metadata, CFSTR("value"), AMCFTypeRef<CFDataRef>(CFDataCreate(kCFAllocatorDefault, entry.value, entry.length)));
+                CFDictionarySetValue(metadata, CFSTR("value"), AMCFTypeRef<CFDataRef>(CFDataCreate(kCFAllocatorDefault, entry_value, entry.length)));
                 break;
         }
 
@@ -283,3 +436,108 @@ CFDictionaryRef _alias_copy_dictionary(const alias_t *pictRecord)
     return pict;
 }
 #endif
+
+static double alias_utc_date_seconds(const unsigned char *p)
+{
+    const uint64_t seconds = (static_cast<uint64_t>(uint16_from_be(p)) << 32) | uint32_from_be(p + 2);
+    return static_cast<double>(seconds) + uint16_from_be(p + 6) / 65536.0 - amg::seconds_from_1904_to_2001;
+}
+
+amg::value _alias_copy_value(const alias_t *pictRecord)
+{
+    assert(pictRecord);
+
+    amg::value pict = amg::value::map();
+    pict.set("creator_code", amg::fourcc_string(pictRecord->header.creator_code));
+    pict.set("record_size", pictRecord->header.record_size);
+    pict.set("version", pictRecord->header.version);
+    pict.set("alias_kind", pictRecord->header.alias_kind);
+    pict.set("volume_name", amg::utf8_from_mac_roman(pictRecord->header.volume_name.data,
+                                                     std::min<size_t>(pictRecord->header.volume_name.length, sizeof(pictRecord->header.volume_name.data))));
+    pict.set("volume_date", amg::value::date(pictRecord->header.volume_date - amg::seconds_from_1904_to_2001));
+
+    const char filesystem_type[2] = {
+        static_cast<char>(pictRecord->header.filesystem_type >> 8),
+        static_cast<char>(pictRecord->header.filesystem_type)
+    };
+    pict.set("filesystem_type", amg::utf8_from_mac_roman(filesystem_type, sizeof(filesystem_type)));
+
+    pict.set("disk_type", pictRecord->header.disk_type);
+    pict.set("containing_folder_cnid", pictRecord->header.containing_folder_cnid);
+    pict.set("target_name", amg::utf8_from_mac_roman(pictRecord->header.target_name.data,
+                                                     std::min<size_t>(pictRecord->header.target_name.length, sizeof(pictRecord->header.target_name.data))));
+    pict.set("target_cnid", pictRecord->header.target_cnid);
+    pict.set("target_creation_date", amg::value::date(pictRecord->header.target_creation_date - amg::seconds_from_1904_to_2001));
+    pict.set("target_creator_code", amg::fourcc_string(pictRecord->header.target_creator_code));
+    pict.set("target_type_code", pictRecord->header.target_type_code);
+    pict.set("alias_to_root_directory_depth", pictRecord->header.alias_to_root_directory_depth);
+    pict.set("root_to_target_directory_depth", pictRecord->header.root_to_target_directory_depth);
+    pict.set("volume_attributes", pictRecord->header.volume_attributes);
+    pict.set("volume_fsid", pictRecord->header.volume_fsid);
+
+    amg::value &metadataItems = pict.set("metadata", amg::value::array());
+    for (const auto &entry : pictRecord->metadata_entries) {
+        const unsigned char *entry_value = pictRecord->value(entry);
+        amg::value &metadata = metadataItems.append(amg::value::map());
+        metadata.set("tag", entry.tag);
+
+        switch (entry.tag) {
+            case 0:
+            case 2:
+            case 3:
+            case 4:
+            case 5:
+            case 6:
+            case 19:
+                metadata.set("value", amg::utf8_from_mac_roman(reinterpret_cast<const char *>(entry_value), entry.length));
+                continue;
+            case 18:
+                if (amg_utf8_valid(reinterpret_cast<const char *>(entry_value), entry.length)) {
+                    metadata.set("value", std::string(reinterpret_cast<const char *>(entry_value), entry.length));
+                    continue;
+                }
+                break;
+            case 14:
+            case 15:
+                // offset by 2 bytes (string length)
+                {
+                    std::string string;
+                    if (alias_unicode_string(entry_value, entry.length, &string)) {
+                        metadata.set("value", string);
+                        continue;
+                    }
+                }
+                break;
+            case 16:
+            case 17:
+                if (entry.length >= 8) {
+                    metadata.set("value", amg::value::date(alias_utc_date_seconds(entry_value)));
+                    continue;
+                }
+                break;
+            case 20: {
+                alias_t *recursiveAlias = alias_create_from_data(entry_value, entry.length);
+                if (recursiveAlias) {
+                    metadata.set("value", _alias_copy_value(recursiveAlias));
+                    alias_free(recursiveAlias);
+                    continue;
+                }
+                break;
+            }
+            case 1:
+                if (entry.length % sizeof(uint32_t) == 0) {
+                    amg::value &cnids = metadata.set("value", amg::value::array());
+                    for (size_t i = 0; i < entry.length / sizeof(uint32_t); ++i)
+                        cnids.append(uint32_from_be(entry_value + (i * sizeof(uint32_t))));
+                    continue;
+                }
+                break;
+            default:
+                break;
+        }
+
+        metadata.set("value", amg::value::data(entry_value, entry.length));
+    }
+
+    return pict;
+}
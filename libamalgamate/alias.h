@@ -23,14 +23,87 @@
  */
 
 #include "amgexport.h"
+#include "amgplatform.h"
 #include <stdlib.h>
 
+#ifdef __cplusplus
+#include "amgvalue.h"
+#include <string>
+#include <vector>
+#endif
+
 typedef struct _alias alias_t;
 
 AMG_EXPORT AMG_EXTERN alias_t *alias_create(void);
 AMG_EXPORT AMG_EXTERN alias_t *alias_create_from_data(const unsigned char *data, size_t size);
 AMG_EXPORT AMG_EXTERN void alias_free(alias_t *alias);
 
-typedef const struct __CFDictionary *CFDictionaryRef;
+/*!
+ * Tags of the variable-length metadata entries following the alias header.
+ */
+typedef enum {
+    alias_tag_parent_directory_name = 0,
+    alias_tag_cnid_path = 1,
+    alias_tag_carbon_path = 2,
+    alias_tag_appleshare_zone = 3,
+    alias_tag_appleshare_server_name = 4,
+    alias_tag_appleshare_user_name = 5,
+    alias_tag_driver_name = 6,
+    alias_tag_network_mount_info = 9,
+    alias_tag_dialup_info = 10,
+    alias_tag_unicode_filename = 14,
+    alias_tag_unicode_volume_name = 15,
+    alias_tag_high_res_volume_creation_date = 16,
+    alias_tag_high_res_creation_date = 17,
+    alias_tag_posix_path = 18,
+    alias_tag_posix_path_to_mount_point = 19,
+    alias_tag_recursive_alias = 20,
+    alias_tag_user_home_length_prefix = 21,
+    alias_tag_end = -1
+} alias_tag;
+
+AMG_EXPORT AMG_EXTERN size_t alias_get_metadata_count(const alias_t *alias);
+
+/*!
+ * Gets the tag and raw value of the metadata entry at \a index. The value
+ * points into the alias and is valid for as long as it is.
+ */
+AMG_EXPORT AMG_EXTERN int alias_get_metadata(const alias_t *alias, size_t index, int16_t *tag, const unsigned char **value, size_t *length);
+
+/*!
+ * Finds the first metadata entry with \a tag. Returns 1 if it was found,
+ * otherwise 0.
+ */
+AMG_EXPORT AMG_EXTERN int alias_find_metadata(const alias_t *alias, int16_t tag, const unsigned char **value, size_t *length);
 
+#if AMG_HAVE_COREFOUNDATION
 AMG_EXPORT AMG_EXTERN CFDictionaryRef _alias_copy_dictionary(const alias_t *alias);
+#endif
+
+#ifdef __cplusplus
+AMG_EXPORT extern amg::value _alias_copy_value(const alias_t *alias);
+
+/*!
+ * Typed accessors for the common metadata entries, decoded on each call.
+ * They return 1 if the value was found, 0 if the alias does not have it, or
+ * -1 if its entry is malformed.
+ */
+AMG_EXPORT extern int alias_get_posix_path(const alias_t *alias, std::string *path);
+
+/*!
+ * Gets the volume name in UTF-8, falling back to the Mac Roman name in the
+ * header when there is no Unicode one.
+ */
+AMG_EXPORT extern int alias_get_volume_name(const alias_t *alias, std::string *name);
+
+/*!
+ * Gets the target's filename in UTF-8, falling back to the Mac Roman name in
+ * the header when there is no Unicode one.
+ */
+AMG_EXPORT extern int alias_get_filename(const alias_t *alias, std::string *name);
+
+/*!
+ * Gets the CNIDs of the target's ancestors, starting with its parent.
+ */
+AMG_EXPORT extern int alias_get_cnid_path(const alias_t *alias, std::vector<uint32_t> *cnids);
+#endif
@@ -25,8 +25,17 @@
 #ifndef Amalgamate_amg_h
 #define Amalgamate_amg_h
 
+#include "alias.h"
+#include "amgcolumnar.h"
 #include "amgconvert.h"
+#include "amgdecodecache.h"
 #include "amgdump.h"
+#include "amgparsecache.h"
+#include "amgscan.h"
+#include "amgtrace.h"
+#include "amgunicode.h"
+#include "bookmark.h"
+#include "bplist.h"
 #include "dsio.h"
 #include "dsrecord.h"
 #include "dsstore.h"
@@ -0,0 +1,853 @@
+/*
+ * Copyright (c) 2015 Jake Petroules. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "amgcolumnar.h"
+#include "amgscan.h"
+#include "amgtrace.h"
+#include "amgunicode.h"
+#include "amgvalue.h"
+#include "dsrecord.h"
+#include <assert.h>
+#include <string.h>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// A minimal FlatBuffers encoder for the Arrow IPC metadata. Objects are laid
+// out front to back: a table is written after its vtable and before its
+// children, so every offset points forward as the format requires.
+
+class amg_fb_builder {
+public:
+    std::vector<unsigned char> buf;
+
+    size_t size() const { return buf.size(); }
+
+    void pad(size_t align)
+    {
+        while (buf.size() % align)
+            buf.push_back(0);
+    }
+
+    template <typename T> void put(T v)
+    {
+        for (size_t i = 0; i < sizeof(T); ++i)
+            buf.push_back(static_cast<unsigned char>(static_cast<uint64_t>(v) >> (8 * i)));
+    }
+
+    template <typename T> void put_at(size_t at, T v)
+    {
+        for (size_t i = 0; i < sizeof(T); ++i)
+            buf[at + i] = static_cast<unsigned char>(static_cast<uint64_t>(v) >> (8 * i));
+    }
+
+    void put_uoffset(size_t at, size_t target) { put_at<uint32_t>(at, static_cast<uint32_t>(target - at)); }
+};
+
+typedef std::function<size_t(amg_fb_builder &)> amg_fb_object;
+
+class amg_fb_table {
+public:
+    amg_fb_table &scalar(uint16_t slot, size_t size, uint64_t value)
+    {
+        _fields.push_back({ slot, size, value, amg_fb_object() });
+        return *this;
+    }
+
+    amg_fb_table &boolean(uint16_t slot, bool value) { return scalar(slot, 1, value); }
+
+    amg_fb_table &object(uint16_t slot, amg_fb_object child)
+    {
+        _fields.push_back({ slot, 4, 0, std::move(child) });
+        return *this;
+    }
+
+    size_t operator()(amg_fb_builder &b) const
+    {
+        // Widest fields first keeps them aligned with no padding in between
+        std::vector<const field *> order;
+        uint16_t slot_count = 0;
+        for (const auto &f : _fields) {
+            order.push_back(&f);
+            slot_count = std::max<uint16_t>(slot_count, f.slot + 1);
+        }
+        std::stable_sort(order.begin(), order.end(), [](const field *x, const field *y) { return x->size > y->size; });
+
+        std::vector<uint16_t> slots(slot_count, 0);
+        std::vector<size_t> positions(_fields.size());
+        size_t table_size = sizeof(int32_t);
+        for (const field *f : order) {
+            table_size = (table_size + f->size - 1) / f->size * f->size;
+            positions[f - _fields.data()] = table_size;
+            slots[f->slot] = static_cast<uint16_t>(table_size);
+            table_size += f->size;
+        }
+
+        b.pad(2);
+        const size_t vtable = b.size();
+        b.put<uint16_t>(static_cast<uint16_t>(4 + 2 * slot_count));
+        b.put<uint16_t>(static_cast<uint16_t>(table_size));
+        for (uint16_t offset : slots)
+            b.put<uint16_t>(offset);
+
+        b.pad(8);
+        const size_t table = b.size();
+        b.buf.resize(table + table_size, 0);
+        b.put_at<int32_t>(table, static_cast<int32_t>(table - vtable));
+        for (size_t i = 0; i < _fields.size(); ++i) {
+            if (!_fields[i].child) {
+                for (size_t k = 0; k < _fields[i].size; ++k)
+                    b.buf[table + positions[i] + k] = static_cast<unsigned char>(_fields[i].value >> (8 * k));
+            }
+        }
+
+        for (size_t i = 0; i < _fields.size(); ++i) {
+            if (_fields[i].child)
+                b.put_uoffset(table + positions[i], _fields[i].child(b));
+        }
+
+        return table;
+    }
+
+private:
+    struct field {
+        uint16_t slot;
+        size_t size;
+        uint64_t value;
+        amg_fb_object child;
+    };
+
+    std::vector<field> _fields;
+};
+
+static amg_fb_object amg_fb_string(const std::string &s)
+{
+    return [s](amg_fb_builder &b) {
+        b.pad(4);
+        const size_t pos = b.size();
+        b.put<uint32_t>(static_cast<uint32_t>(s.size()));
+        b.buf.insert(b.buf.end(), s.begin(), s.end());
+        b.buf.push_back(0);
+        return pos;
+    };
+}
+
+static amg_fb_object amg_fb_tables(const std::vector<amg_fb_table> &tables)
+{
+    return [tables](amg_fb_builder &b) {
+        b.pad(4);
+        const size_t pos = b.size();
+        b.put<uint32_t>(static_cast<uint32_t>(tables.size()));
+        for (size_t i = 0; i < tables.size(); ++i)
+            b.put<uint32_t>(0);
+        for (size_t i = 0; i < tables.size(); ++i)
+            b.put_uoffset(pos + 4 + 4 * i, tables[i](b));
+        return pos;
+    };
+}
+
+/*!
+ * A vector of structs whose members are all 64-bit; \a words holds them in
+ * order.
+ */
+static amg_fb_object amg_fb_structs(const std::vector<int64_t> &words, size_t words_per_struct)
+{
+    return [words, words_per_struct](amg_fb_builder &b) {
+        b.pad(4);
+        if ((b.size() + 4) % 8 != 0)
+            b.put<uint32_t>(0);
+        const size_t pos = b.size();
+        b.put<uint32_t>(static_cast<uint32_t>(words.size() / words_per_struct));
+        for (int64_t word : words)
+            b.put<int64_t>(word);
+        return pos;
+    };
+}
+
+static std::vector<unsigned char> amg_fb_finish(const amg_fb_table &root)
+{
+    amg_fb_builder b;
+    b.put<uint32_t>(0);
+    b.put_uoffset(0, root(b));
+    b.pad(8);
+    return std::move(b.buf);
+}
+
+// Arrow IPC metadata, from Schema.fbs and Message.fbs
+
+enum {
+    amg_arrow_metadata_v5 = 4,
+    amg_arrow_header_schema = 1,
+    amg_arrow_header_dictionary_batch = 2,
+    amg_arrow_header_record_batch = 3,
+    amg_arrow_type_int = 2,
+    amg_arrow_type_binary = 4,
+    amg_arrow_type_utf8 = 5,
+    amg_arrow_type_bool = 6,
+    amg_arrow_type_timestamp = 10,
+    amg_arrow_time_unit_microsecond = 2
+};
+
+static const char amg_arrow_magic[] = "ARROW1";
+
+/*!
+ * Seconds between the classic Mac OS epoch of 1904-01-01 and the Unix epoch.
+ */
+static const int64_t amg_unix_seconds_from_1904 = 2082844800;
+
+typedef enum {
+    amg_column_path,
+    amg_column_filename,
+    amg_column_record_type,
+    amg_column_data_type,
+    amg_column_long,
+    amg_column_shor,
+    amg_column_bool,
+    amg_column_type,
+    amg_column_ustr,
+    amg_column_comp,
+    amg_column_dutc,
+    amg_column_blob,
+    amg_column_count
+} amg_column;
+
+/*!
+ * Dictionary ids of the dictionary-encoded columns, in column order.
+ */
+typedef enum {
+    amg_dictionary_path,
+    amg_dictionary_record_type,
+    amg_dictionary_data_type,
+    amg_dictionary_type,
+    amg_dictionary_count
+} amg_dictionary;
+
+static const amg_column amg_dictionary_columns[amg_dictionary_count] = {
+    amg_column_path, amg_column_record_type, amg_column_data_type, amg_column_type
+};
+
+static amg_fb_table amg_arrow_int_type(int bit_width, bool is_signed)
+{
+    return amg_fb_table().scalar(0, 4, bit_width).boolean(1, is_signed);
+}
+
+static amg_fb_table amg_arrow_field(amg_column column)
+{
+    static const char *const names[amg_column_count] = {
+        "path", "filename", "record_type", "data_type",
+        "long", "shor", "bool", "type", "ustr", "comp", "dutc", "blob"
+    };
+
+    amg_fb_table field;
+    field.object(0, amg_fb_string(names[column]));
+    field.boolean(1, column > amg_column_data_type);
+    switch (column) {
+        case amg_column_long:
+            field.scalar(2, 1, amg_arrow_type_int).object(3, amg_arrow_int_type(32, false));
+            break;
+        case amg_column_shor:
+            field.scalar(2, 1, amg_arrow_type_int).object(3, amg_arrow_int_type(16, false));
+            break;
+        case amg_column_comp:
+            field.scalar(2, 1, amg_arrow_type_int).object(3, amg_arrow_int_type(64, false));
+            break;
+        case amg_column_bool:
+            field.scalar(2, 1, amg_arrow_type_bool).object(3, amg_fb_table());
+            break;
+        case amg_column_dutc:
+            field.scalar(2, 1, amg_arrow_type_timestamp)
+                 .object(3, amg_fb_table().scalar(0, 2, amg_arrow_time_unit_microsecond).object(1, amg_fb_string("UTC")));
+            break;
+        case amg_column_blob:
+            field.scalar(2, 1, amg_arrow_type_binary).object(3, amg_fb_table());
+            break;
+        default:
+            field.scalar(2, 1, amg_arrow_type_utf8).object(3, amg_fb_table());
+            break;
+    }
+
+    for (int id = 0; id < amg_dictionary_count; ++id) {
+        if (amg_dictionary_columns[id] == column)
+            field.object(4, amg_fb_table().scalar(0, 8, id).object(1, amg_arrow_int_type(32, true)));
+    }
+
+    field.object(5, amg_fb_tables(std::vector<amg_fb_table>()));
+    return field;
+}
+
+static amg_fb_table amg_arrow_schema()
+{
+    std::vector<amg_fb_table> fields;
+    for (int column = 0; column < amg_column_count; ++column)
+        fields.push_back(amg_arrow_field(static_cast<amg_column>(column)));
+    return amg_fb_table().scalar(0, 2, 0).object(1, amg_fb_tables(fields));
+}
+
+/*!
+ * The body of a record or dictionary batch: every buffer starts on an 8-byte
+ * boundary, and the field nodes and buffer locations go into the metadata.
+ */
+typedef struct {
+    std::vector<unsigned char> data;
+    std::vector<int64_t> nodes;
+    std::vector<int64_t> buffers;
+    int64_t length;
+
+    void add_node(size_t node_length, size_t null_count)
+    {
+        nodes.push_back(static_cast<int64_t>(node_length));
+        nodes.push_back(static_cast<int64_t>(null_count));
+    }
+
+    void add_buffer(const void *p, size_t n)
+    {
+        buffers.push_back(static_cast<int64_t>(data.size()));
+        buffers.push_back(static_cast<int64_t>(n));
+        if (n > 0)
+            data.insert(data.end(), static_cast<const unsigned char *>(p), static_cast<const unsigned char *>(p) + n);
+        data.resize((data.size() + 7) & ~size_t(7), 0);
+    }
+
+    template <typename T> void add_buffer(const std::vector<T> &v) { add_buffer(v.data(), v.size() * sizeof(T)); }
+
+    amg_fb_table record_batch() const
+    {
+        return amg_fb_table().scalar(0, 8, static_cast<uint64_t>(length)).object(1, amg_fb_structs(nodes, 2)).object(2, amg_fb_structs(buffers, 2));
+    }
+} amg_arrow_body_t;
+
+/*!
+ * A string column: int32 offsets into concatenated UTF-8 or binary data.
+ */
+typedef struct {
+    std::vector<int32_t> offsets;
+    std::string data;
+
+    void clear()
+    {
+        offsets.assign(1, 0);
+        data.clear();
+    }
+
+    void push_back(const char *p, size_t n)
+    {
+        data.append(p, n);
+        offsets.push_back(static_cast<int32_t>(data.size()));
+    }
+
+    void push_back(const std::string &s) { push_back(s.data(), s.size()); }
+
+    void push_back_utf16(const uint16_t *s, size_t n)
+    {
+        const size_t size = data.size();
+        data.resize(size + 3 * n);
+        data.resize(size + amg_utf8_from_utf16(&data[size], s, n));
+        offsets.push_back(static_cast<int32_t>(data.size()));
+    }
+    void push_null() { offsets.push_back(offsets.back()); }
+    size_t size() const { return offsets.size() - 1; }
+} amg_arrow_strings_t;
+
+/*!
+ * Rows as read, before dictionary encoding. Value columns hold a slot for
+ * every row; which one is set follows from data_type.
+ */
+typedef struct _amg_columnar_rows {
+    _amg_columnar_rows() { clear(); }
+
+    std::vector<int32_t> path;
+    amg_arrow_strings_t filename;
+    std::vector<uint32_t> record_type;
+    std::vector<uint32_t> data_type;
+    std::vector<uint32_t> llong;
+    std::vector<uint16_t> shor;
+    std::vector<uint8_t> bbool;
+    std::vector<uint32_t> type;
+    amg_arrow_strings_t ustr;
+    std::vector<uint64_t> comp;
+    std::vector<int64_t> dutc;
+    amg_arrow_strings_t blob;
+
+    size_t size() const { return record_type.size(); }
+    size_t data_size() const { return filename.data.size() + ustr.data.size() + blob.data.size(); }
+
+    void clear()
+    {
+        path.clear();
+        filename.clear();
+        record_type.clear();
+        data_type.clear();
+        llong.clear();
+        shor.clear();
+        bbool.clear();
+        type.clear();
+        ustr.clear();
+        comp.clear();
+        dutc.clear();
+        blob.clear();
+    }
+
+    void append(int32_t path_index, ds_record_t *record);
+    void append(int32_t path_index, const _amg_columnar_rows &rows, size_t begin, size_t end);
+} amg_columnar_rows_t;
+
+void amg_columnar_rows_t::append(int32_t path_index, ds_record_t *record)
+{
+    const ds_record_data_type record_data_type = ds_record_get_data_type(record);
+    path.push_back(path_index);
+    filename.push_back(ds_record_get_filename_utf8(record), ds_record_get_filename_utf8_len(record));
+    record_type.push_back(ds_record_get_type(record));
+    data_type.push_back(record_data_type);
+    llong.push_back(record_data_type == ds_record_data_type_long ? ds_record_get_data_as_long(record) : 0);
+    shor.push_back(record_data_type == ds_record_data_type_shor ? ds_record_get_data_as_shor(record) : 0);
+    bbool.push_back(record_data_type == ds_record_data_type_bool ? ds_record_get_data_as_bool(record) : 0);
+    type.push_back(record_data_type == ds_record_data_type_type ? ds_record_get_data_as_type(record) : 0);
+    comp.push_back(record_data_type == ds_record_data_type_comp ? ds_record_get_data_as_comp(record) : 0);
+
+    if (record_data_type == ds_record_data_type_ustr)
+        ustr.push_back_utf16(ds_record_get_data_as_ustr_ptr(record), ds_record_get_data_as_ustr_len(record));
+    else
+        ustr.push_null();
+
+    if (record_data_type == ds_record_data_type_blob)
+        blob.push_back(reinterpret_cast<const char *>(ds_record_get_data_as_blob_ptr(record)), ds_record_get_data_as_blob_size(record));
+    else
+        blob.push_null();
+
+    int64_t microseconds = 0;
+    if (record_data_type == ds_record_data_type_dutc) {
+        // 1/65536 second ticks since 1904
+        const UTCDateTime dutc = ds_record_get_data_as_dutc(record);
+        uint64_t ticks;
+        memcpy(&ticks, &dutc, sizeof(ticks));
+        microseconds = (static_cast<int64_t>(ticks >> 16) - amg_unix_seconds_from_1904) * 1000000
+            + static_cast<int64_t>((ticks & 0xFFFF) * 1000000 / 65536);
+    }
+    dutc.push_back(microseconds);
+}
+
+template <typename T> static void amg_append_range(std::vector<T> &to, const std::vector<T> &from, size_t begin, size_t end)
+{
+    to.insert(to.end(), from.begin() + begin, from.begin() + end);
+}
+
+static void amg_append_range(amg_arrow_strings_t &to, const amg_arrow_strings_t &from, size_t begin, size_t end)
+{
+    const int32_t base = to.offsets.back() - from.offsets[begin];
+    for (size_t i = begin + 1; i <= end; ++i)
+        to.offsets.push_back(base + from.offsets[i]);
+    to.data.append(from.data, from.offsets[begin], from.offsets[end] - from.offsets[begin]);
+}
+
+void amg_columnar_rows_t::append(int32_t path_index, const amg_columnar_rows_t &rows, size_t begin, size_t end)
+{
+    path.insert(path.end(), end - begin, path_index);
+    amg_append_range(filename, rows.filename, begin, end);
+    amg_append_range(record_type, rows.record_type, begin, end);
+    amg_append_range(data_type, rows.data_type, begin, end);
+    amg_append_range(llong, rows.llong, begin, end);
+    amg_append_range(shor, rows.shor, begin, end);
+    amg_append_range(bbool, rows.bbool, begin, end);
+    amg_append_range(type, rows.type, begin, end);
+    amg_append_range(ustr, rows.ustr, begin, end);
+    amg_append_range(comp, rows.comp, begin, end);
+    amg_append_range(dutc, rows.dutc, begin, end);
+    amg_append_range(blob, rows.blob, begin, end);
+}
+
+/*!
+ * Flush a batch early once its variable-length data reaches this size, well
+ * before the int32 offsets could overflow.
+ */
+static const size_t amg_columnar_batch_data_size = 256 * 1024 * 1024;
+
+/*!
+ * A dictionary of FourCC codes or paths. Entries not yet written go out as
+ * the next dictionary batch for the column.
+ */
+typedef struct {
+    std::unordered_map<uint32_t, int32_t> codes;
+    int32_t count;
+    amg_arrow_strings_t pending;
+    bool written;
+
+    int32_t add(const std::string &s)
+    {
+        pending.push_back(s);
+        return count++;
+    }
+
+    int32_t index(uint32_t code)
+    {
+        const auto it = codes.find(code);
+        if (it != codes.end())
+            return it->second;
+        return codes[code] = add(amg::fourcc_string(code));
+    }
+} amg_arrow_dictionary_t;
+
+struct _amg_columnar_writer {
+    FILE *file;
+    uint64_t offset;
+    bool failed;
+    bool finished;
+
+    amg_columnar_rows_t rows;
+    std::string last_path;
+    amg_arrow_dictionary_t dictionaries[amg_dictionary_count];
+
+    // File footer blocks: offset, metadata length and body length of each
+    // message, as in the Block struct
+    std::vector<int64_t> dictionary_blocks;
+    std::vector<int64_t> record_batch_blocks;
+
+    int32_t path_index(const char *path);
+    void write(const void *p, size_t n);
+    void write_message(const std::vector<unsigned char> &metadata, const std::vector<unsigned char> &body, std::vector<int64_t> *blocks);
+    void write_dictionaries();
+    void write_batch();
+    void maybe_write_batch();
+};
+
+int32_t amg_columnar_writer_t::path_index(const char *path)
+{
+    amg_arrow_dictionary_t &paths = dictionaries[amg_dictionary_path];
+    if (paths.count == 0 || last_path != path) {
+        last_path = path;
+        paths.add(last_path);
+    }
+
+    return paths.count - 1;
+}
+
+void amg_columnar_writer_t::write(const void *p, size_t n)
+{
+    if (!failed && n > 0 && fwrite(p, 1, n, file) != n)
+        failed = true;
+    offset += n;
+}
+
+void amg_columnar_writer_t::write_message(const std::vector<unsigned char> &metadata, const std::vector<unsigned char> &body, std::vector<int64_t> *blocks)
+{
+    const uint32_t prefix[2] = { 0xFFFFFFFF, static_cast<uint32_t>(metadata.size()) };
+    if (blocks) {
+        blocks->push_back(static_cast<int64_t>(offset));
+        blocks->push_back(static_cast<int64_t>(sizeof(prefix) + metadata.size()));
+        blocks->push_back(static_cast<int64_t>(body.size()));
+    }
+
+    write(prefix, sizeof(prefix));
+    write(metadata.data(), metadata.size());
+    write(body.data(), body.size());
+}
+
+void amg_columnar_writer_t::write_dictionaries()
+{
+    for (int id = 0; id < amg_dictionary_count; ++id) {
+        amg_arrow_dictionary_t &dictionary = dictionaries[id];
+        if (dictionary.written && dictionary.pending.size() == 0)
+            continue;
+
+        amg_arrow_body_t body;
+        body.length = static_cast<int64_t>(dictionary.pending.size());
+        body.add_node(dictionary.pending.size(), 0);
+        body.add_buffer(nullptr, 0);
+        body.add_buffer(dictionary.pending.offsets);
+        body.add_buffer(dictionary.pending.data.data(), dictionary.pending.data.size());
+
+        const amg_fb_table batch = amg_fb_table().scalar(0, 8, id).object(1, body.record_batch()).boolean(2, dictionary.written);
+        write_message(amg_fb_finish(amg_fb_table()
+            .scalar(0, 2, amg_arrow_metadata_v5)
+            .scalar(1, 1, amg_arrow_header_dictionary_batch)
+            .object(2, batch)
+            .scalar(3, 8, body.data.size())), body.data, &dictionary_blocks);
+
+        dictionary.pending.clear();
+        dictionary.written = true;
+    }
+}
+
+/*!
+ * Adds a validity bitmap for \a length rows, or an empty buffer if every row
+ * is valid, and returns the null count.
+ */
+static size_t amg_arrow_add_validity(amg_arrow_body_t &body, const std::vector<uint32_t> &data_types, ds_record_data_type valid_type)
+{
+    std::vector<uint8_t> bits((data_types.size() + 7) / 8, 0);
+    size_t null_count = 0;
+    for (size_t i = 0; i < data_types.size(); ++i) {
+        if (data_types[i] == valid_type)
+            bits[i / 8] |= 1 << (i % 8);
+        else
+            ++null_count;
+    }
+
+    if (null_count == 0)
+        bits.clear();
+    body.add_node(data_types.size(), null_count);
+    body.add_buffer(bits);
+    return null_count;
+}
+
+void amg_columnar_writer_t::write_batch()
+{
+    const size_t length = rows.size();
+    amg::trace_span span("amg_columnar_writer_write_batch", "output");
+    span.set_arg("rows", length);
+
+    std::vector<int32_t> record_types(length), data_types(length), types(length);
+    for (size_t i = 0; i < length; ++i) {
+        record_types[i] = dictionaries[amg_dictionary_record_type].index(rows.record_type[i]);
+        data_types[i] = dictionaries[amg_dictionary_data_type].index(rows.data_type[i]);
+        types[i] = rows.data_type[i] == ds_record_data_type_type ? dictionaries[amg_dictionary_type].index(rows.type[i]) : 0;
+    }
+
+    std::vector<uint8_t> bools((length + 7) / 8, 0);
+    for (size_t i = 0; i < length; ++i) {
+        if (rows.bbool[i])
+            bools[i / 8] |= 1 << (i % 8);
+    }
+
+    amg_arrow_body_t body;
+    body.length = static_cast<int64_t>(length);
+
+    body.add_node(length, 0);
+    body.add_buffer(nullptr, 0);
+    body.add_buffer(rows.path);
+
+    body.add_node(length, 0);
+    body.add_buffer(nullptr, 0);
+    body.add_buffer(rows.filename.offsets);
+    body.add_buffer(rows.filename.data.data(), rows.filename.data.size());
+
+    body.add_node(length, 0);
+    body.add_buffer(nullptr, 0);
+    body.add_buffer(record_types);
+
+    body.add_node(length, 0);
+    body.add_buffer(nullptr, 0);
+    body.add_buffer(data_types);
+
+    amg_arrow_add_validity(body, rows.data_type, ds_record_data_type_long);
+    body.add_buffer(rows.llong);
+    amg_arrow_add_validity(body, rows.data_type, ds_record_data_type_shor);
+    body.add_buffer(rows.shor);
+    amg_arrow_add_validity(body, rows.data_type, ds_record_data_type_bool);
+    body.add_buffer(bools);
+    amg_arrow_add_validity(body, rows.data_type, ds_record_data_type_type);
+    body.add_buffer(types);
+    amg_arrow_add_validity(body, rows.data_type, ds_record_data_type_ustr);
+    body.add_buffer(rows.ustr.offsets);
+    body.add_buffer(rows.ustr.data.data(), rows.ustr.data.size());
+    amg_arrow_add_validity(body, rows.data_type, ds_record_data_type_comp);
+    body.add_buffer(rows.comp);
+    amg_arrow_add_validity(body, rows.data_type, ds_record_data_type_dutc);
+    body.add_buffer(rows.dutc);
+    amg_arrow_add_validity(body, rows.data_type, ds_record_data_type_blob);
+    body.add_buffer(rows.blob.offsets);
+    body.add_buffer(rows.blob.data.data(), rows.blob.data.size());
+
+    // Dictionaries grow while the batch is encoded, so they go out after
+    write_dictionaries();
+    write_message(amg_fb_finish(amg_fb_table()
+        .scalar(0, 2, amg_arrow_metadata_v5)
+        .scalar(1, 1, amg_arrow_header_record_batch)
+        .object(2, body.record_batch())
+        .scalar(3, 8, body.data.size())), body.data, &record_batch_blocks);
+
+    rows.clear();
+}
+
+void amg_columnar_writer_t::maybe_write_batch()
+{
+    if (rows.size() >= amg_columnar_batch_rows || rows.data_size() >= amg_columnar_batch_data_size)
+        write_batch();
+}
+
+amg_columnar_writer_t *amg_columnar_writer_create(FILE *file)
+{
+    assert(file);
+
+    amg_columnar_writer_t *writer = new amg_columnar_writer_t();
+    writer->file = file;
+    writer->offset = 0;
+    writer->failed = false;
+    writer->finished = false;
+    for (auto &dictionary : writer->dictionaries) {
+        dictionary.count = 0;
+        dictionary.pending.clear();
+        dictionary.written = false;
+    }
+
+    const char magic[8] = { 'A', 'R', 'R', 'O', 'W', '1', 0, 0 };
+    writer->write(magic, sizeof(magic));
+    writer->write_message(amg_fb_finish(amg_fb_table()
+        .scalar(0, 2, amg_arrow_metadata_v5)
+        .scalar(1, 1, amg_arrow_header_schema)
+        .object(2, amg_arrow_schema())
+        .scalar(3, 8, 0)), std::vector<unsigned char>(), nullptr);
+    return writer;
+}
+
+int amg_columnar_writer_write_record(amg_columnar_writer_t *writer, const char *path, ds_record_t *record)
+{
+    assert(writer);
+    assert(path);
+    assert(record);
+    assert(!writer->finished);
+
+    writer->rows.append(writer->path_index(path), record);
+    writer->maybe_write_batch();
+    return writer->failed ? 1 : 0;
+}
+
+int amg_columnar_writer_write_store(amg_columnar_writer_t *writer, const char *path, ds_store_t *store)
+{
+    assert(writer);
+    assert(path);
+    assert(store);
+    assert(!writer->finished);
+
+    const int32_t path_index = writer->path_index(path);
+    if (ds_store_enum_records_core(store, [writer, path_index](ds_record_t *record) {
+        writer->rows.append(path_index, record);
+        writer->maybe_write_batch();
+    }) != 0)
+        return 1;
+
+    return writer->failed ? 1 : 0;
+}
+
+int amg_columnar_writer_finish(amg_columnar_writer_t *writer)
+{
+    assert(writer);
+    assert(!writer->finished);
+
+    if (writer->rows.size() > 0 || writer->record_batch_blocks.empty())
+        writer->write_batch();
+    writer->finished = true;
+
+    const uint32_t end_of_stream[2] = { 0xFFFFFFFF, 0 };
+    writer->write(end_of_stream, sizeof(end_of_stream));
+
+    // The Block struct is an int64 offset, an int32 metadata length padded
+    // to 8 bytes, then an int64 body length
+    const auto blocks = [](const std::vector<int64_t> &v) {
+        std::vector<int64_t> words(v);
+        for (size_t i = 1; i < words.size(); i += 3)
+            words[i] &= 0xFFFFFFFF;
+        return amg_fb_structs(words, 3);
+    };
+    const std::vector<unsigned char> footer = amg_fb_finish(amg_fb_table()
+        .scalar(0, 2, amg_arrow_metadata_v5)
+        .object(1, amg_arrow_schema())
+        .object(2, blocks(writer->dictionary_blocks))
+        .object(3, blocks(writer->record_batch_blocks)));
+    const uint32_t footer_size = static_cast<uint32_t>(footer.size());
+    writer->write(footer.data(), footer.size());
+    writer->write(&footer_size, sizeof(footer_size));
+    writer->write(amg_arrow_magic, strlen(amg_arrow_magic));
+
+    if (fflush(writer->file) != 0)
+        writer->failed = true;
+    return writer->failed ? 1 : 0;
+}
+
+void amg_columnar_writer_free(amg_columnar_writer_t *writer)
+{
+    delete writer;
+}
+
+typedef struct {
+    amg_columnar_writer_t *writer;
+    size_t errors;
+} amg_export_state_t;
+
+static void *amg_export_read_rows(const char *path, ds_store_t *store, void *context)
+{
+    (void)path;
+    (void)context;
+
+    if (!store)
+        return nullptr;
+
+    amg_columnar_rows_t *rows = new amg_columnar_rows_t();
+    if (ds_store_enum_records_core(store, [rows](ds_record_t *record) { rows->append(0, record); }) != 0) {
+        delete rows;
+        return nullptr;
+    }
+
+    return rows;
+}
+
+static void amg_export_write_rows(const char *path, void *result, void *context)
+{
+    amg::trace_span span("amg_export_write_rows", "output");
+    amg_export_state_t *state = static_cast<amg_export_state_t *>(context);
+    std::unique_ptr<amg_columnar_rows_t> rows(static_cast<amg_columnar_rows_t *>(result));
+    if (!rows) {
+        fprintf(stderr, "error: could not read %s\n", path);
+        ++state->errors;
+        return;
+    }
+
+    // Split the store across batches so that every batch but the last has
+    // the same number of rows
+    amg_columnar_writer_t *writer = state->writer;
+    const int32_t path_index = writer->path_index(path);
+    for (size_t begin = 0; begin < rows->size();) {
+        const size_t end = std::min(rows->size(), begin + amg_columnar_batch_rows - writer->rows.size());
+        writer->rows.append(path_index, *rows, begin, end);
+        writer->maybe_write_batch();
+        begin = end;
+    }
+}
+
+int amg_export_arrow(const char *directory, const char *output, unsigned thread_count)
+{
+    assert(directory);
+    assert(output);
+
+    FILE *file = fopen(output, "wb");
+    if (!file) {
+        fprintf(stderr, "error: could not open %s for writing\n", output);
+        return 1;
+    }
+
+    amg_export_state_t state;
+    state.writer = amg_columnar_writer_create(file);
+    state.errors = 0;
+    const int ret = amg_scan(directory, thread_count, 1, amg_export_read_rows, amg_export_write_rows, &state);
+    const int finished = amg_columnar_writer_finish(state.writer);
+    amg_columnar_writer_free(state.writer);
+    if (fclose(file) != 0 || finished != 0) {
+        fprintf(stderr, "error writing %s\n", output);
+        return 1;
+    }
+
+    return ret != 0 || state.errors > 0 ? 1 : 0;
+}
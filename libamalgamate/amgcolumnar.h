@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2015 Jake Petroules. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AMALGAMATE_COLUMNAR_H
+#define AMALGAMATE_COLUMNAR_H
+
+#include <stdio.h>
+#include "dsstore.h"
+
+/*!
+ * Writes records from any number of stores to an Apache Arrow IPC file, one
+ * row per record, in record batches of about amg_columnar_batch_rows rows.
+ *
+ * The columns are path (of the store), filename, record_type, data_type and
+ * one nullable value column per data type: long, shor, bool, type, ustr,
+ * comp, dutc (a UTC timestamp) and blob. Only the column matching a row's
+ * data type is set. The path and the FourCC columns are dictionary-encoded;
+ * new dictionary entries are written as deltas ahead of each batch.
+ */
+typedef struct _amg_columnar_writer amg_columnar_writer_t;
+
+static const size_t amg_columnar_batch_rows = 64 * 1024;
+
+/*!
+ * Creates a writer on \a file, which must be opened for binary writing and
+ * is not closed by the writer.
+ */
+AMG_EXPORT AMG_EXTERN amg_columnar_writer_t *amg_columnar_writer_create(FILE *file);
+
+/*!
+ * Appends \a record as a row of the store at \a path.
+ */
+AMG_EXPORT AMG_EXTERN int amg_columnar_writer_write_record(amg_columnar_writer_t *writer, const char *path, ds_record_t *record);
+
+/*!
+ * Appends every record of \a store as rows of the store at \a path.
+ */
+AMG_EXPORT AMG_EXTERN int amg_columnar_writer_write_store(amg_columnar_writer_t *writer, const char *path, ds_store_t *store);
+
+/*!
+ * Writes the last batch and the file footer. No rows can be added afterwards.
+ */
+AMG_EXPORT AMG_EXTERN int amg_columnar_writer_finish(amg_columnar_writer_t *writer);
+
+AMG_EXPORT AMG_EXTERN void amg_columnar_writer_free(amg_columnar_writer_t *writer);
+
+/*!
+ * Writes the records of every .DS_Store file under \a directory to the Arrow
+ * file \a output, reading the stores on up to \a thread_count threads (0 for
+ * one per CPU). Rows appear in the order the files were found.
+ */
+AMG_EXPORT AMG_EXTERN int amg_export_arrow(const char *directory, const char *output, unsigned thread_count);
+
+#endif // AMALGAMATE_COLUMNAR_H
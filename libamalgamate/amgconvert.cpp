@@ -23,51 +23,286 @@
  */
 
 #include "amgconvert.h"
-#include "amgmemory.h"
+#include "amgparsecache.h"
+#include "amgtrace.h"
+#include "amgvalue.h"
 #include "dsio.h"
 #include "dsrecord.h"
+#include <math.h>
+#include <string.h>
+#include <time.h>
+#include <memory>
+#include <string>
 
-typedef std::shared_ptr<std::FILE> shared_file_ptr;
-static shared_file_ptr make_shared_file(const char *filename, const char *flags) {
-    std::FILE *const fp = std::fopen(filename, flags);
-    return fp ? shared_file_ptr(fp, std::fclose) : shared_file_ptr();
+/*!
+ * Seconds between the Unix epoch and the CFAbsoluteTime epoch of 2001-01-01.
+ */
+static const double amg_unix_seconds_to_2001 = 978307200.0;
+
+static void amg_json_append_string(std::string &out, const std::string &s)
+{
+    static const char hex[] = "0123456789abcdef";
+    out += '"';
+    for (unsigned char c : s) {
+        switch (c) {
+            case '"':
+                out += "\\\"";
+                break;
+            case '\\':
+                out += "\\\\";
+                break;
+            case '\n':
+                out += "\\n";
+                break;
+            case '\r':
+                out += "\\r";
+                break;
+            case '\t':
+                out += "\\t";
+                break;
+            default:
+                if (c < 0x20) {
+                    out += "\\u00";
+                    out += hex[c >> 4];
+                    out += hex[c & 0xF];
+                } else {
+                    out += static_cast<char>(c);
+                }
+                break;
+        }
+    }
+    out += '"';
 }
 
-int amg_convert_file(const char *filename, const char *format) {
-    assert(filename);
+static void amg_json_append_base64(std::string &out, const std::vector<unsigned char> &data)
+{
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    out += '"';
+    size_t i = 0;
+    for (; i + 3 <= data.size(); i += 3) {
+        const uint32_t n = (uint32_t(data[i]) << 16) | (uint32_t(data[i + 1]) << 8) | data[i + 2];
+        out += alphabet[(n >> 18) & 0x3F];
+        out += alphabet[(n >> 12) & 0x3F];
+        out += alphabet[(n >> 6) & 0x3F];
+        out += alphabet[n & 0x3F];
+    }
+    if (i < data.size()) {
+        const uint32_t n = (uint32_t(data[i]) << 16) | (i + 1 < data.size() ? uint32_t(data[i + 1]) << 8 : 0);
+        out += alphabet[(n >> 18) & 0x3F];
+        out += alphabet[(n >> 12) & 0x3F];
+        out += i + 1 < data.size() ? alphabet[(n >> 6) & 0x3F] : '=';
+        out += '=';
+    }
+    out += '"';
+}
+
+static void amg_json_append_date(std::string &out, double seconds)
+{
+    const double unix_seconds = floor(seconds + amg_unix_seconds_to_2001);
+    const time_t t = static_cast<time_t>(unix_seconds);
+    struct tm tm;
+    char buf[64];
+    if (!isfinite(unix_seconds) || static_cast<double>(t) != unix_seconds || !gmtime_r(&t, &tm)
+        || strftime(buf, sizeof(buf), "\"%Y-%m-%dT%H:%M:%SZ\"", &tm) == 0) {
+        out += "null";
+        return;
+    }
+    out += buf;
+}
 
-    int ret = 0;
-    shared_file_ptr file = nullptr;
+static void amg_json_append_value(std::string &out, const amg::value &v)
+{
+    char buf[32];
+    switch (v.type()) {
+        case amg::value::null_type:
+            out += "null";
+            break;
+        case amg::value::bool_type:
+            out += v.as_bool() ? "true" : "false";
+            break;
+        case amg::value::int_type:
+            snprintf(buf, sizeof(buf), "%lld", static_cast<long long>(v.as_int()));
+            out += buf;
+            break;
+        case amg::value::real_type:
+            if (isfinite(v.as_real())) {
+                snprintf(buf, sizeof(buf), "%.17g", v.as_real());
+                out += buf;
+            } else {
+                out += "null";
+            }
+            break;
+        case amg::value::string_type:
+            amg_json_append_string(out, v.as_string());
+            break;
+        case amg::value::data_type:
+            amg_json_append_base64(out, v.as_data());
+            break;
+        case amg::value::date_type:
+            amg_json_append_date(out, v.as_date());
+            break;
+        case amg::value::array_type: {
+            out += '[';
+            bool first = true;
+            for (const auto &item : v.as_array()) {
+                if (!first)
+                    out += ',';
+                first = false;
+                amg_json_append_value(out, item);
+            }
+            out += ']';
+            break;
+        }
+        case amg::value::map_type: {
+            out += '{';
+            bool first = true;
+            for (const auto &member : v.as_map()) {
+                if (!first)
+                    out += ',';
+                first = false;
+                amg_json_append_string(out, member.first);
+                out += ':';
+                amg_json_append_value(out, member.second);
+            }
+            out += '}';
+            break;
+        }
+    }
+}
 
-    if (strcmp(format, "json") != 0) {
+static int amg_check_format(const char *format, bool *ndjson)
+{
+    assert(format);
+    if (strcmp(format, "json") == 0) {
+        *ndjson = false;
+    } else if (strcmp(format, "ndjson") == 0) {
+        *ndjson = true;
+    } else {
         fprintf(stderr, "error: format '%s' is not supported\n", format);
         return 1;
     }
 
-    file = make_shared_file(filename, "rb");
-    if (!file)
+    return 0;
+}
+
+/*!
+ * Size at which the output buffer is written out; large enough that writes
+ * are few, small enough that a reader sees records while the store is still
+ * being parsed.
+ */
+static const size_t amg_json_writer_flush_size = 1 << 20;
+
+struct _amg_json_writer {
+    FILE *file;
+    bool ndjson;
+    bool started;
+    bool failed;
+    std::string buf;
+
+    int flush()
     {
-        fprintf(stderr, "error opening file %s\n", filename);
-        return 1;
+        amg::trace_span span("amg_json_writer_flush", "output");
+        span.set_arg("bytes", buf.size());
+        if (!buf.empty() && fwrite(buf.data(), 1, buf.size(), file) != buf.size())
+            failed = true;
+        buf.clear();
+        return failed ? 1 : 0;
+    }
+};
+
+amg_json_writer_t *amg_json_writer_create(FILE *file, const char *format)
+{
+    assert(file);
+
+    bool ndjson;
+    if (amg_check_format(format, &ndjson) != 0)
+        return nullptr;
+
+    amg_json_writer_t *writer = new amg_json_writer_t();
+    writer->file = file;
+    writer->ndjson = ndjson;
+    writer->started = false;
+    writer->failed = false;
+    writer->buf.reserve(amg_json_writer_flush_size + (amg_json_writer_flush_size >> 2));
+    return writer;
+}
+
+int amg_json_writer_write_record(amg_json_writer_t *writer, ds_record_t *record)
+{
+    assert(writer);
+    assert(record);
+
+    amg::trace_span span("amg_json_writer_write_record", "output");
+    if (writer->ndjson) {
+        amg_json_append_value(writer->buf, ds_record_copy_value(record));
+        writer->buf += '\n';
+    } else {
+        writer->buf += writer->started ? ",\n" : "[\n";
+        amg_json_append_value(writer->buf, ds_record_copy_value(record));
     }
 
-    ds_store_t *store = ds_store_fread(file.get());
+    writer->started = true;
+    if (writer->buf.size() >= amg_json_writer_flush_size)
+        return writer->flush();
+    return writer->failed ? 1 : 0;
+}
+
+int amg_json_writer_finish(amg_json_writer_t *writer)
+{
+    assert(writer);
+
+    if (!writer->ndjson)
+        writer->buf += writer->started ? "\n]\n" : "[]\n";
+    writer->started = true;
+    if (writer->flush() != 0 || fflush(writer->file) != 0)
+        return 1;
+    return 0;
+}
+
+void amg_json_writer_free(amg_json_writer_t *writer)
+{
+    delete writer;
+}
+
+int amg_convert_record(ds_record_t *record, const char *format, FILE *file)
+{
+    assert(record);
+    assert(file);
+
+    bool ndjson;
+    if (amg_check_format(format, &ndjson) != 0)
+        return 1;
+
+    amg::trace_span span("amg_convert_record", "output");
+    std::string out;
+    amg_json_append_value(out, ds_record_copy_value(record));
+    return fwrite(out.data(), 1, out.size(), file) == out.size() ? 0 : 1;
+}
+
+int amg_convert_file(const char *filename, const char *format) {
+    assert(filename);
+
+    std::unique_ptr<amg_json_writer_t, void (*)(amg_json_writer_t *)> writer(amg_json_writer_create(stdout, format), amg_json_writer_free);
+    if (!writer)
+        return 1;
+
+    std::unique_ptr<ds_store_t, void (*)(ds_store_t *)> store(amg_parse_cache_open_store(filename), ds_store_free);
     if (!store) {
         return 1;
     }
 
-    AMCFTypeRef<CFMutableArrayRef> records(CFArrayCreateMutable(kCFAllocatorDefault, 0, &kCFTypeArrayCallBacks));
-
-    if (ds_store_enum_records_core(store, [&records](ds_record_t *record) {
-        CFArrayAppendValue(records, AMCFTypeRef<CFDictionaryRef>(ds_record_copy_dictionary(record)));
+    if (ds_store_enum_records_core(store.get(), [&writer](ds_record_t *record) {
+        amg_json_writer_write_record(writer.get(), record);
     }) != 0) {
         fprintf(stderr, "error enumerating records\n");
+        amg_json_writer_finish(writer.get());
         return 1;
     }
 
-    AMCFTypeRef<CFDataRef> data(CFPropertyListCreateData(kCFAllocatorDefault, records, kCFPropertyListXMLFormat_v1_0, 0, NULL));
-    fprintf(stdout, "%.*s\n", static_cast<int>(CFDataGetLength(data)), CFDataGetBytePtr(data));
+    if (amg_json_writer_finish(writer.get()) != 0) {
+        fprintf(stderr, "error writing output\n");
+        return 1;
+    }
 
-    return ret;
+    return 0;
 }
-
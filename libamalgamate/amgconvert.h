@@ -28,6 +28,41 @@
 #include <stdio.h>
 #include "dsstore.h"
 
+/*!
+ * Writes every record of the store at \a filename to standard output in
+ * \a format, as the records are enumerated.
+ *
+ * "json" writes an array of record objects as returned by
+ * ds_record_copy_value, with data as base64 strings and dates as ISO 8601
+ * strings. "ndjson" writes the same objects one per line.
+ */
 AMG_EXPORT AMG_EXTERN int amg_convert_file(const char *filename, const char *format);
 
+/*!
+ * Writes a single record to \a file in \a format, without a trailing newline.
+ */
+AMG_EXPORT AMG_EXTERN int amg_convert_record(ds_record_t *record, const char *format, FILE *file);
+
+/*!
+ * Streams records to a file in one of the formats of amg_convert_file.
+ * Records are encoded into a reusable buffer that is written out whenever it
+ * fills, so memory use does not depend on the number of records.
+ */
+typedef struct _amg_json_writer amg_json_writer_t;
+
+/*!
+ * Creates a writer for \a format on \a file, or returns NULL if the format
+ * is not supported. The file is not closed by the writer.
+ */
+AMG_EXPORT AMG_EXTERN amg_json_writer_t *amg_json_writer_create(FILE *file, const char *format);
+
+AMG_EXPORT AMG_EXTERN int amg_json_writer_write_record(amg_json_writer_t *writer, ds_record_t *record);
+
+/*!
+ * Closes the top-level array, if any, and writes out everything buffered.
+ */
+AMG_EXPORT AMG_EXTERN int amg_json_writer_finish(amg_json_writer_t *writer);
+
+AMG_EXPORT AMG_EXTERN void amg_json_writer_free(amg_json_writer_t *writer);
+
 #endif // AMALGAMATE_CONVERT_H
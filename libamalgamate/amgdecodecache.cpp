@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) 2015 Jake Petroules. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "amgdecodecache.h"
+#include <assert.h>
+#include <string.h>
+#include <atomic>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+typedef struct {
+    uint32_t kind;
+    uint64_t hash;
+    std::vector<unsigned char> data;
+    std::shared_ptr<const amg::value> value;
+    size_t bytes;
+} amg_decode_cache_entry_t;
+
+/*!
+ * Entries are kept most recently used first. Values are shared so that a
+ * hit can be copied out after the lock is released.
+ */
+struct amg_decode_cache
+{
+    amg_decode_cache() : mutex(), entries(), index(), max_bytes(), bytes(), hits(), misses() { }
+
+    std::mutex mutex;
+    std::list<amg_decode_cache_entry_t> entries;
+    std::unordered_multimap<uint64_t, std::list<amg_decode_cache_entry_t>::iterator> index;
+    size_t max_bytes;
+    size_t bytes;
+    uint64_t hits;
+    uint64_t misses;
+
+    void evict(size_t limit);
+};
+
+static amg_decode_cache amg_the_decode_cache;
+static std::atomic<bool> amg_decode_cache_enabled(false);
+
+void amg_decode_cache::evict(size_t limit)
+{
+    while (bytes > limit && !entries.empty()) {
+        const auto last = std::prev(entries.end());
+        const auto range = index.equal_range(last->hash);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (it->second == last) {
+                index.erase(it);
+                break;
+            }
+        }
+
+        bytes -= last->bytes;
+        entries.erase(last);
+    }
+}
+
+/*!
+ * A multiplicative hash over eight bytes at a time; collisions only cost a
+ * comparison, since entries are matched on their bytes.
+ */
+static uint64_t amg_decode_cache_hash(const unsigned char *data, size_t size)
+{
+    uint64_t hash = 0x9e3779b97f4a7c15ull ^ size;
+    uint64_t word;
+    for (; size >= sizeof(word); data += sizeof(word), size -= sizeof(word)) {
+        memcpy(&word, data, sizeof(word));
+        hash = (hash ^ word) * 0xff51afd7ed558ccdull;
+        hash ^= hash >> 32;
+    }
+
+    word = 0;
+    if (size > 0)
+        memcpy(&word, data, size);
+    hash = (hash ^ word) * 0xc4ceb9fe1a85ec53ull;
+    return hash ^ (hash >> 29);
+}
+
+static size_t amg_value_footprint(const amg::value &value)
+{
+    size_t bytes = sizeof(value) + value.as_string().capacity() + value.as_data().capacity();
+    for (const auto &element : value.as_array())
+        bytes += amg_value_footprint(element);
+    for (const auto &member : value.as_map())
+        bytes += member.first.capacity() + amg_value_footprint(member.second);
+    return bytes;
+}
+
+void amg_decode_cache_enable(size_t max_bytes)
+{
+    std::lock_guard<std::mutex> lock(amg_the_decode_cache.mutex);
+    amg_the_decode_cache.max_bytes = max_bytes;
+    amg_the_decode_cache.evict(max_bytes);
+    amg_decode_cache_enabled = true;
+}
+
+void amg_decode_cache_disable(void)
+{
+    std::lock_guard<std::mutex> lock(amg_the_decode_cache.mutex);
+    amg_decode_cache_enabled = false;
+    amg_the_decode_cache.evict(0);
+    amg_the_decode_cache.hits = 0;
+    amg_the_decode_cache.misses = 0;
+}
+
+void amg_decode_cache_get_stats(amg_decode_cache_stats_t *stats)
+{
+    assert(stats);
+    std::lock_guard<std::mutex> lock(amg_the_decode_cache.mutex);
+    stats->hits = amg_the_decode_cache.hits;
+    stats->misses = amg_the_decode_cache.misses;
+    stats->entries = amg_the_decode_cache.entries.size();
+    stats->bytes = amg_the_decode_cache.bytes;
+}
+
+int amg_decode_cache_find(uint32_t kind, const unsigned char *data, size_t size, amg::value *value)
+{
+    assert(data || size == 0);
+    assert(value);
+    if (!amg_decode_cache_enabled)
+        return 0;
+
+    const uint64_t hash = amg_decode_cache_hash(data, size);
+    std::shared_ptr<const amg::value> found;
+    {
+        std::lock_guard<std::mutex> lock(amg_the_decode_cache.mutex);
+        const auto range = amg_the_decode_cache.index.equal_range(hash);
+        for (auto it = range.first; it != range.second; ++it) {
+            const amg_decode_cache_entry_t &entry = *it->second;
+            if (entry.kind == kind && entry.data.size() == size && memcmp(entry.data.data(), data, size) == 0) {
+                amg_the_decode_cache.entries.splice(amg_the_decode_cache.entries.begin(), amg_the_decode_cache.entries, it->second);
+                found = entry.value;
+                break;
+            }
+        }
+
+        if (!found) {
+            ++amg_the_decode_cache.misses;
+            return 0;
+        }
+
+        ++amg_the_decode_cache.hits;
+    }
+
+    *value = *found;
+    return 1;
+}
+
+void amg_decode_cache_insert(uint32_t kind, const unsigned char *data, size_t size, const amg::value &value)
+{
+    assert(data || size == 0);
+    if (!amg_decode_cache_enabled)
+        return;
+
+    amg_decode_cache_entry_t entry;
+    entry.kind = kind;
+    entry.hash = amg_decode_cache_hash(data, size);
+    entry.data.assign(data, data + size);
+    entry.value = std::make_shared<const amg::value>(value);
+    entry.bytes = sizeof(entry) + size + amg_value_footprint(value);
+
+    std::lock_guard<std::mutex> lock(amg_the_decode_cache.mutex);
+    if (!amg_decode_cache_enabled || entry.bytes > amg_the_decode_cache.max_bytes)
+        return;
+
+    // Another thread may have decoded the same bytes in the meantime
+    const auto range = amg_the_decode_cache.index.equal_range(entry.hash);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (it->second->kind == kind && it->second->data == entry.data)
+            return;
+    }
+
+    amg_the_decode_cache.bytes += entry.bytes;
+    amg_the_decode_cache.entries.push_front(std::move(entry));
+    amg_the_decode_cache.index.emplace(amg_the_decode_cache.entries.front().hash, amg_the_decode_cache.entries.begin());
+    amg_the_decode_cache.evict(amg_the_decode_cache.max_bytes);
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2015 Jake Petroules. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AMALGAMATE_DECODE_CACHE_H
+#define AMALGAMATE_DECODE_CACHE_H
+
+#include "amgexport.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+#include "amgvalue.h"
+#endif
+
+/*!
+ * A process-wide cache of decoded blobs, keyed by their bytes. Aliases,
+ * bookmarks and property lists copied from template disk images and default
+ * Finder settings repeat across many stores, and the cache lets
+ * ds_record_copy_value decode each distinct one once. It is off until
+ * enabled and safe to use from several threads.
+ */
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t entries;
+    uint64_t bytes;
+} amg_decode_cache_stats_t;
+
+/*!
+ * Enables the cache, evicting the least recently used entries once their
+ * blobs and decoded values take up more than about \a max_bytes.
+ */
+AMG_EXPORT AMG_EXTERN void amg_decode_cache_enable(size_t max_bytes);
+
+/*!
+ * Disables the cache and frees its entries.
+ */
+AMG_EXPORT AMG_EXTERN void amg_decode_cache_disable(void);
+
+AMG_EXPORT AMG_EXTERN void amg_decode_cache_get_stats(amg_decode_cache_stats_t *stats);
+
+#ifdef __cplusplus
+/*!
+ * Looks up the value decoded from \a size bytes at \a data as \a kind, which
+ * tells apart decodings of the same bytes such as the record type they came
+ * from. Returns 1 if it was found, otherwise 0.
+ */
+AMG_EXPORT extern int amg_decode_cache_find(uint32_t kind, const unsigned char *data, size_t size, amg::value *value);
+
+/*!
+ * Adds a decoded value to the cache if it is enabled.
+ */
+AMG_EXPORT extern void amg_decode_cache_insert(uint32_t kind, const unsigned char *data, size_t size, const amg::value &value);
+#endif
+
+#endif // AMALGAMATE_DECODE_CACHE_H
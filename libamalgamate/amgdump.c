@@ -23,6 +23,7 @@
  */
 
 #include "alias.h"
+#include "amgconvert.h"
 #include "amgdump.h"
 #include "dsio.h"
 #include "dsrecord.h"
@@ -31,19 +32,9 @@ int amg_dump_file(const char *filename)
 {
     assert(filename);
 
-    ds_store_t *store = NULL;
-    int ret = 0;
-    FILE *file = fopen(filename, "rb");
-    if (!file) {
-        fprintf(stderr, "error opening file %s\n", filename);
-        ret = 1;
-        goto cleanup;
-    }
-
-    store = ds_store_fread(file);
+    ds_store_t *store = ds_store_open_mapped(filename);
     if (!store) {
-        ret = 1;
-        goto cleanup;
+        return 1;
     }
 
     ds_store_dump_header(store);
@@ -51,15 +42,13 @@ int amg_dump_file(const char *filename)
     dsstore_header_dumpblock(store);
 
     // Dump the root block...
-    //ds_store_enum_blocks(&allocator_state, &header_block, header_block.root_block_number, amg_dump_record, file);
-    ds_store_enum_records(store, amg_dump_record);
+    int ret = ds_store_enum_records(store, amg_dump_record);
 
-cleanup:
-    fclose(file);
     ds_store_free(store);
     return ret;
 }
 
+#if AMG_HAVE_COREFOUNDATION
 static inline void CFStringPrintToFile(FILE *file, CFStringRef str) {
     const CFStringEncoding encoding = kCFStringEncodingUTF8;
     const CFIndex filename_utf8_len = CFStringGetMaximumSizeForEncoding(CFStringGetLength(str), encoding);
@@ -93,3 +82,9 @@ CFPropertyListRef amg_ds_record_copy_icvp_display_plist(CFPropertyListRef plist)
 
     return plistCopy;
 }
+#else
+void amg_dump_record(ds_record_t *record) {
+    amg_convert_record(record, "json", stdout);
+    fprintf(stdout, "\n");
+}
+#endif
@@ -31,8 +31,10 @@
 AMG_EXPORT AMG_EXTERN int amg_dump_file(const char *filename);
 AMG_EXPORT AMG_EXTERN void amg_dump_record(ds_record_t *record);
 
+#if AMG_HAVE_COREFOUNDATION
 AMG_EXTERN CFStringRef AMGCopyRealDescription(CFTypeRef obj);
 
 AMG_EXTERN CFPropertyListRef amg_ds_record_copy_icvp_display_plist(CFPropertyListRef plist);
+#endif
 
 #endif // AMALGAMATE_DUMP_H
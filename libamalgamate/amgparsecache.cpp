@@ -0,0 +1,504 @@
+/*
+ * Copyright (c) 2015 Jake Petroules. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "amgparsecache.h"
+#include "amgtrace.h"
+#include "dsstore_p.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*!
+ * The cache file holds a header, the entries sorted by device and inode,
+ * and then the record data of every entry. It is written in host byte
+ * order and mapped as it is; a file from a host of the other byte order
+ * fails the byte order check and is ignored.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t entry_count;
+    uint64_t payload_offset;
+} amg_parse_cache_header_t;
+
+typedef struct {
+    uint64_t device;
+    uint64_t inode;
+    uint64_t size;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+    uint64_t content_hash; // 0 if the contents were not hashed
+    uint64_t payload_offset; // relative to the start of the record data
+    uint64_t payload_hash; // of the record data and count, checked on every hit
+    uint32_t payload_size;
+    uint32_t record_count;
+} amg_parse_cache_entry_t;
+
+static const char amg_parse_cache_magic[8] = { 'A', 'M', 'G', 'P', 'C', 'A', 'C', 'H' };
+static const uint32_t amg_parse_cache_version = 2;
+static const uint32_t amg_parse_cache_byte_order = 0x01020304;
+
+typedef std::pair<uint64_t, uint64_t> amg_parse_cache_key_t;
+
+/*!
+ * An entry added since the file was loaded, with its record data.
+ */
+typedef struct {
+    amg_parse_cache_entry_t entry;
+    std::vector<unsigned char> records;
+} amg_parse_cache_added_t;
+
+struct amg_parse_cache
+{
+    amg_parse_cache()
+        : mutex(), path(), flags(0), mapping(), entries(), entry_count(), payload(), payload_size(), used(), added(), hits(0), misses(0) { }
+
+    std::mutex mutex;
+    std::string path;
+    std::atomic<int> flags;
+
+    // The loaded cache file, kept mapped by stores being created from it
+    // while it is replaced
+    std::shared_ptr<void> mapping;
+    const amg_parse_cache_entry_t *entries;
+    size_t entry_count;
+    const unsigned char *payload;
+    size_t payload_size;
+    std::vector<bool> used;
+
+    std::map<amg_parse_cache_key_t, amg_parse_cache_added_t> added;
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+
+    int load();
+    void unload();
+    const amg_parse_cache_entry_t *find_loaded(const amg_parse_cache_key_t &key, size_t *index) const;
+};
+
+static amg_parse_cache amg_the_parse_cache;
+static std::atomic<bool> amg_parse_cache_enabled(false);
+
+static amg_parse_cache_key_t amg_parse_cache_entry_key(const amg_parse_cache_entry_t &entry)
+{
+    return amg_parse_cache_key_t(entry.device, entry.inode);
+}
+
+static bool amg_parse_cache_entry_less(const amg_parse_cache_entry_t &a, const amg_parse_cache_entry_t &b)
+{
+    return amg_parse_cache_entry_key(a) < amg_parse_cache_entry_key(b);
+}
+
+int amg_parse_cache::load()
+{
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        if (errno == ENOENT)
+            return 0;
+        fprintf(stderr, "error opening cache file %s: %s\n", path.c_str(), strerror(errno));
+        return 1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        fprintf(stderr, "error reading attributes of cache file %s: %s\n", path.c_str(), strerror(errno));
+        close(fd);
+        return 1;
+    }
+
+    const size_t size = static_cast<size_t>(st.st_size);
+    if (size < sizeof(amg_parse_cache_header_t)) {
+        close(fd);
+        fprintf(stderr, "warning: ignoring cache file %s, which is too short\n", path.c_str());
+        return 0;
+    }
+
+    void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "error mapping cache file %s: %s\n", path.c_str(), strerror(errno));
+        return 1;
+    }
+
+    const amg_parse_cache_header_t *header = static_cast<const amg_parse_cache_header_t *>(map);
+    const uint64_t max_entries = (size - sizeof(*header)) / sizeof(amg_parse_cache_entry_t);
+    if (memcmp(header->magic, amg_parse_cache_magic, sizeof(header->magic)) != 0 ||
+        header->version != amg_parse_cache_version ||
+        header->byte_order != amg_parse_cache_byte_order ||
+        header->entry_count > max_entries ||
+        header->payload_offset < sizeof(*header) + header->entry_count * sizeof(amg_parse_cache_entry_t) ||
+        header->payload_offset > size) {
+        fprintf(stderr, "warning: ignoring cache file %s, which is not a cache of this version\n", path.c_str());
+        munmap(map, size);
+        return 0;
+    }
+
+    mapping = std::shared_ptr<void>(map, [size](void *address) { munmap(address, size); });
+    entries = reinterpret_cast<const amg_parse_cache_entry_t *>(header + 1);
+    entry_count = static_cast<size_t>(header->entry_count);
+    payload = static_cast<const unsigned char *>(map) + header->payload_offset;
+    payload_size = size - static_cast<size_t>(header->payload_offset);
+    used.assign(entry_count, false);
+    return 0;
+}
+
+void amg_parse_cache::unload()
+{
+    mapping.reset();
+    entries = nullptr;
+    entry_count = 0;
+    payload = nullptr;
+    payload_size = 0;
+    used.clear();
+}
+
+const amg_parse_cache_entry_t *amg_parse_cache::find_loaded(const amg_parse_cache_key_t &key, size_t *index) const
+{
+    amg_parse_cache_entry_t probe;
+    memset(&probe, 0, sizeof(probe));
+    probe.device = key.first;
+    probe.inode = key.second;
+
+    const amg_parse_cache_entry_t *end = entries + entry_count;
+    const amg_parse_cache_entry_t *it = std::lower_bound(entries, end, probe, amg_parse_cache_entry_less);
+    if (it == end || amg_parse_cache_entry_key(*it) != key)
+        return nullptr;
+
+    // Record data outside the file means the file is damaged
+    if (it->payload_offset > payload_size || it->payload_size > payload_size - it->payload_offset)
+        return nullptr;
+
+    *index = static_cast<size_t>(it - entries);
+    return it;
+}
+
+static int64_t amg_parse_cache_time_ns(const struct timespec &ts)
+{
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static void amg_parse_cache_entry_from_stat(const struct stat &st, amg_parse_cache_entry_t *entry)
+{
+    memset(entry, 0, sizeof(*entry));
+    entry->device = static_cast<uint64_t>(st.st_dev);
+    entry->inode = static_cast<uint64_t>(st.st_ino);
+    entry->size = static_cast<uint64_t>(st.st_size);
+#if defined(__APPLE__)
+    entry->mtime_ns = amg_parse_cache_time_ns(st.st_mtimespec);
+    entry->ctime_ns = amg_parse_cache_time_ns(st.st_ctimespec);
+#else
+    entry->mtime_ns = amg_parse_cache_time_ns(st.st_mtim);
+    entry->ctime_ns = amg_parse_cache_time_ns(st.st_ctim);
+#endif
+}
+
+static bool amg_parse_cache_entry_current(const amg_parse_cache_entry_t &cached, const amg_parse_cache_entry_t &current)
+{
+    return cached.size == current.size
+        && cached.mtime_ns == current.mtime_ns
+        && cached.ctime_ns == current.ctime_ns
+        && cached.content_hash == current.content_hash;
+}
+
+/*!
+ * A hash of eight bytes at a time with a final avalanche step; never 0,
+ * which marks an entry without a hash.
+ */
+static uint64_t amg_parse_cache_hash(const unsigned char *data, size_t size)
+{
+    const uint64_t k1 = 0xff51afd7ed558ccdull, k2 = 0xc4ceb9fe1a85ec53ull;
+    uint64_t h = 0x9e3779b97f4a7c15ull ^ size;
+
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t w;
+        memcpy(&w, data + i, sizeof(w));
+        h ^= w * k1;
+        h = ((h << 27) | (h >> 37)) * k2;
+    }
+
+    uint64_t w = 0;
+    memcpy(&w, data + i, size - i);
+    h ^= w * k1;
+
+    h ^= h >> 33;
+    h *= k1;
+    h ^= h >> 33;
+    h *= k2;
+    h ^= h >> 33;
+    return h != 0 ? h : 1;
+}
+
+static uint64_t amg_parse_cache_payload_hash(const unsigned char *records, size_t size, uint32_t record_count)
+{
+    return amg_parse_cache_hash(records, size) ^ (record_count * 0x9e3779b97f4a7c15ull);
+}
+
+static int amg_parse_cache_hash_file(const char *path, uint64_t *hash)
+{
+    const int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return 1;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return 1;
+    }
+
+    const size_t size = static_cast<size_t>(st.st_size);
+    void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return 1;
+
+    *hash = amg_parse_cache_hash(static_cast<const unsigned char *>(map), size);
+    munmap(map, size);
+    return 0;
+}
+
+int amg_parse_cache_enable(const char *path, int flags)
+{
+    assert(path);
+
+    std::lock_guard<std::mutex> lock(amg_the_parse_cache.mutex);
+    amg_the_parse_cache.unload();
+    amg_the_parse_cache.added.clear();
+    amg_the_parse_cache.hits = 0;
+    amg_the_parse_cache.misses = 0;
+    amg_the_parse_cache.path = path;
+    amg_the_parse_cache.flags = flags;
+
+    if (amg_the_parse_cache.load() != 0)
+        return 1;
+
+    amg_parse_cache_enabled = true;
+    return 0;
+}
+
+int amg_parse_cache_save(int prune)
+{
+    std::lock_guard<std::mutex> lock(amg_the_parse_cache.mutex);
+    amg_parse_cache &cache = amg_the_parse_cache;
+    if (!amg_parse_cache_enabled) {
+        fprintf(stderr, "error: the parse cache is not enabled\n");
+        return 1;
+    }
+
+    // Rewriting a large cache costs about as much as a scan saves, so only
+    // do it if entries were added or are to be pruned
+    bool changed = !cache.added.empty();
+    for (size_t i = 0; !changed && prune && i < cache.entry_count; ++i)
+        changed = !cache.used[i];
+    if (!changed)
+        return 0;
+
+    // Loaded entries not superseded by (or pruned in favour of) new ones,
+    // then the new ones, with the record data of each
+    typedef std::pair<amg_parse_cache_entry_t, const unsigned char *> item_t;
+    std::vector<item_t> items;
+    for (size_t i = 0; i < cache.entry_count; ++i) {
+        const amg_parse_cache_entry_t &entry = cache.entries[i];
+        if ((prune && !cache.used[i]) || cache.added.count(amg_parse_cache_entry_key(entry)) != 0)
+            continue;
+        if (entry.payload_offset > cache.payload_size || entry.payload_size > cache.payload_size - entry.payload_offset)
+            continue;
+        items.push_back(item_t(entry, cache.payload + entry.payload_offset));
+    }
+
+    for (std::map<amg_parse_cache_key_t, amg_parse_cache_added_t>::const_iterator it = cache.added.begin(); it != cache.added.end(); ++it)
+        items.push_back(item_t(it->second.entry, it->second.records.data()));
+
+    std::sort(items.begin(), items.end(), [](const item_t &a, const item_t &b) {
+        return amg_parse_cache_entry_less(a.first, b.first);
+    });
+
+    amg_parse_cache_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, amg_parse_cache_magic, sizeof(header.magic));
+    header.version = amg_parse_cache_version;
+    header.byte_order = amg_parse_cache_byte_order;
+    header.entry_count = items.size();
+    header.payload_offset = sizeof(header) + items.size() * sizeof(amg_parse_cache_entry_t);
+
+    uint64_t offset = 0;
+    for (size_t i = 0; i < items.size(); ++i) {
+        items[i].first.payload_offset = offset;
+        offset += items[i].first.payload_size;
+    }
+
+    // Write next to the old file and move it into place, so that the cache
+    // file is always complete and its old mapping stays valid until then
+    const std::string temp_path = cache.path + ".tmp." + std::to_string(getpid());
+    FILE *file = fopen(temp_path.c_str(), "wb");
+    if (!file) {
+        fprintf(stderr, "error creating cache file %s: %s\n", temp_path.c_str(), strerror(errno));
+        return 1;
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (size_t i = 0; ok && i < items.size(); ++i)
+        ok = fwrite(&items[i].first, sizeof(items[i].first), 1, file) == 1;
+    for (size_t i = 0; ok && i < items.size(); ++i)
+        ok = items[i].first.payload_size == 0 || fwrite(items[i].second, items[i].first.payload_size, 1, file) == 1;
+    ok = fclose(file) == 0 && ok;
+
+    if (!ok || rename(temp_path.c_str(), cache.path.c_str()) != 0) {
+        fprintf(stderr, "error writing cache file %s: %s\n", cache.path.c_str(), strerror(errno));
+        unlink(temp_path.c_str());
+        return 1;
+    }
+
+    // Serve from the new file from now on
+    cache.unload();
+    cache.added.clear();
+    return cache.load();
+}
+
+void amg_parse_cache_disable(void)
+{
+    std::lock_guard<std::mutex> lock(amg_the_parse_cache.mutex);
+    amg_parse_cache_enabled = false;
+    amg_the_parse_cache.unload();
+    amg_the_parse_cache.added.clear();
+    amg_the_parse_cache.hits = 0;
+    amg_the_parse_cache.misses = 0;
+}
+
+void amg_parse_cache_get_stats(amg_parse_cache_stats_t *stats)
+{
+    assert(stats);
+
+    std::lock_guard<std::mutex> lock(amg_the_parse_cache.mutex);
+    const amg_parse_cache &cache = amg_the_parse_cache;
+    stats->hits = cache.hits;
+    stats->misses = cache.misses;
+    stats->entries = cache.entry_count;
+    stats->bytes = cache.payload_size;
+
+    for (std::map<amg_parse_cache_key_t, amg_parse_cache_added_t>::const_iterator it = cache.added.begin(); it != cache.added.end(); ++it) {
+        size_t index;
+        const amg_parse_cache_entry_t *loaded = cache.find_loaded(it->first, &index);
+        if (loaded) {
+            stats->bytes -= loaded->payload_size;
+        } else {
+            ++stats->entries;
+        }
+        stats->bytes += it->second.records.size();
+    }
+}
+
+ds_store_t *amg_parse_cache_open_store(const char *path)
+{
+    assert(path);
+
+    if (!amg_parse_cache_enabled)
+        return ds_store_open_mapped(path);
+
+    amg::trace_span span("amg_parse_cache_open_store", "io");
+
+    // Leave reporting errors to ds_store_open_mapped
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return ds_store_open_mapped(path);
+
+    amg_parse_cache_entry_t current;
+    amg_parse_cache_entry_from_stat(st, &current);
+    if ((amg_the_parse_cache.flags & AMG_PARSE_CACHE_VERIFY_CONTENT) && amg_parse_cache_hash_file(path, &current.content_hash) != 0)
+        return ds_store_open_mapped(path);
+
+    const amg_parse_cache_key_t key = amg_parse_cache_entry_key(current);
+    ds_store_t *store = nullptr;
+    std::shared_ptr<void> mapping;
+    const unsigned char *records = nullptr;
+    amg_parse_cache_entry_t cached;
+    {
+        std::lock_guard<std::mutex> lock(amg_the_parse_cache.mutex);
+        amg_parse_cache &cache = amg_the_parse_cache;
+
+        // Stores added during this run are rare enough to be created under
+        // the lock; loaded ones are created from the mapping once it is held
+        const std::map<amg_parse_cache_key_t, amg_parse_cache_added_t>::const_iterator added = cache.added.find(key);
+        size_t index;
+        const amg_parse_cache_entry_t *loaded;
+        if (added != cache.added.end()) {
+            if (amg_parse_cache_entry_current(added->second.entry, current))
+                store = ds_store_create_with_record_data(added->second.records.data(), added->second.records.size(), added->second.entry.record_count);
+        } else if ((loaded = cache.find_loaded(key, &index)) != nullptr && amg_parse_cache_entry_current(*loaded, current)) {
+            mapping = cache.mapping;
+            records = cache.payload + loaded->payload_offset;
+            cached = *loaded;
+            cache.used[index] = true;
+        }
+
+    }
+
+    // A damaged cache file must not be served as records
+    if (records && amg_parse_cache_payload_hash(records, cached.payload_size, cached.record_count) == cached.payload_hash)
+        store = ds_store_create_with_record_data(records, cached.payload_size, cached.record_count);
+    if (store) {
+        ++amg_the_parse_cache.hits;
+        span.set_arg("hit", 1);
+        return store;
+    }
+
+    ++amg_the_parse_cache.misses;
+
+    store = ds_store_open_mapped(path);
+    if (!store)
+        return nullptr;
+
+    // Cache the records only if the file did not change while being read
+    amg_parse_cache_added_t entry;
+    entry.entry = current;
+    struct stat after;
+    if (stat(path, &after) != 0 || ds_store_copy_record_data(store, entry.records, &entry.entry.record_count) != 0 || entry.records.size() > UINT32_MAX)
+        return store;
+
+    amg_parse_cache_entry_t check;
+    amg_parse_cache_entry_from_stat(after, &check);
+    check.content_hash = current.content_hash;
+    if (!amg_parse_cache_entry_current(check, current) || check.device != current.device || check.inode != current.inode)
+        return store;
+
+    entry.entry.payload_size = static_cast<uint32_t>(entry.records.size());
+    entry.entry.payload_hash = amg_parse_cache_payload_hash(entry.records.data(), entry.records.size(), entry.entry.record_count);
+
+    std::lock_guard<std::mutex> lock(amg_the_parse_cache.mutex);
+    if (amg_parse_cache_enabled)
+        amg_the_parse_cache.added[key] = std::move(entry);
+    return store;
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2015 Jake Petroules. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AMALGAMATE_PARSE_CACHE_H
+#define AMALGAMATE_PARSE_CACHE_H
+
+#include "amgexport.h"
+#include "dsstore.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*!
+ * A process-wide cache of the records of stores, kept in a file between
+ * runs. Stores are identified by device and inode and considered unchanged
+ * while their size, modification time and change time stay the same, so a
+ * repeated scan of mostly unchanged trees reads each unchanged store from
+ * the cache file instead of from its own file. It is off until enabled and
+ * safe to use from several threads.
+ */
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t entries;
+    uint64_t bytes;
+} amg_parse_cache_stats_t;
+
+/*!
+ * Additionally compare a hash of the contents of each store with the one
+ * recorded when it was cached, for file systems whose times cannot be
+ * trusted. Stores are then read on every hit; only the parsing is saved.
+ */
+#define AMG_PARSE_CACHE_VERIFY_CONTENT 1
+
+/*!
+ * Enables the cache, starting from the entries saved in the file at
+ * \a path if there is one. A file that is not a cache, or one written by an
+ * incompatible version, is ignored and replaced on save.
+ */
+AMG_EXPORT AMG_EXTERN int amg_parse_cache_enable(const char *path, int flags);
+
+/*!
+ * Writes the cache back to its file, replacing the file atomically. If
+ * \a prune is nonzero, entries for stores not opened since the cache was
+ * enabled are left out. The file is left alone if it would not change.
+ */
+AMG_EXPORT AMG_EXTERN int amg_parse_cache_save(int prune);
+
+/*!
+ * Disables the cache without saving it.
+ */
+AMG_EXPORT AMG_EXTERN void amg_parse_cache_disable(void);
+
+AMG_EXPORT AMG_EXTERN void amg_parse_cache_get_stats(amg_parse_cache_stats_t *stats);
+
+/*!
+ * Opens the store at \a path like ds_store_open_mapped. While the cache is
+ * enabled, an unchanged store is rebuilt from its cached records, and any
+ * other store is read from its file and added to the cache.
+ */
+AMG_EXPORT AMG_EXTERN ds_store_t *amg_parse_cache_open_store(const char *path);
+
+#endif // AMALGAMATE_PARSE_CACHE_H
@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2014 Petroules Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AMALGAMATE_PLATFORM_H
+#define AMALGAMATE_PLATFORM_H
+
+#include <stdint.h>
+
+/*!
+ * The core library needs nothing beyond standard C and C++. CoreFoundation is
+ * used where it is available, for the dictionary and property list APIs; a
+ * build for any other platform, or one with AMG_NO_COREFOUNDATION defined,
+ * leaves those out and provides the few Carbon types the core refers to.
+ */
+#if defined(__APPLE__) && !defined(AMG_NO_COREFOUNDATION)
+#define AMG_HAVE_COREFOUNDATION 1
+#else
+#define AMG_HAVE_COREFOUNDATION 0
+#endif
+
+#if AMG_HAVE_COREFOUNDATION
+#include <CoreServices/CoreServices.h>
+#else
+#ifndef __cplusplus
+#include <stdbool.h>
+#endif
+
+typedef uint32_t FourCharCode;
+#define FOUR_CHAR_CODE(x) (x)
+
+#pragma pack(push, 2)
+typedef struct {
+    uint16_t highSeconds;
+    uint32_t lowSeconds;
+    uint16_t fraction;
+} UTCDateTime;
+#pragma pack(pop)
+#endif
+
+#endif // AMALGAMATE_PLATFORM_H
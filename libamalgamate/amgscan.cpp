@@ -0,0 +1,247 @@
+/*
+ * Copyright (c) 2015 Jake Petroules. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "amgscan.h"
+#include "amgparsecache.h"
+#include "amgtrace.h"
+#include "dsio.h"
+#include "dsrecord.h"
+#include <errno.h>
+#include <fts.h>
+#include <string.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+static const char amg_scan_file_name[] = ".DS_Store";
+
+typedef struct {
+    size_t sequence;
+    std::string path;
+} amg_scan_file_t;
+
+/*!
+ * Shared state between the thread walking the directory tree, which queues
+ * files, and the workers that read them. In ordered mode finished results
+ * wait in \c pending until every earlier file has reached the sink.
+ */
+struct amg_scan_state
+{
+    amg_scan_state(unsigned thread_count, bool ordered, amg_scan_visit_func_t visit, amg_scan_sink_func_t sink, void *context);
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<amg_scan_file_t> queue;
+    std::map<size_t, std::pair<std::string, void *>> pending;
+    size_t queued;
+    size_t sunk;
+    bool finished;
+    bool failed;
+
+    const size_t window;
+    const bool ordered;
+    const amg_scan_visit_func_t visit;
+    const amg_scan_sink_func_t sink;
+    void *const context;
+
+    void work();
+    void deliver(const amg_scan_file_t &file, void *result);
+};
+
+amg_scan_state::amg_scan_state(unsigned thread_count, bool ordered, amg_scan_visit_func_t visit, amg_scan_sink_func_t sink, void *context)
+    : mutex(), changed(), queue(), pending(), queued(), sunk(), finished(), failed()
+    , window(thread_count * 16), ordered(ordered), visit(visit), sink(sink), context(context)
+{
+}
+
+void amg_scan_state::work()
+{
+    for (;;) {
+        amg_scan_file_t file;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [this]() { return finished || !queue.empty(); });
+            if (queue.empty())
+                return;
+
+            file = queue.front();
+            queue.pop_front();
+            changed.notify_all();
+        }
+
+        void *result;
+        {
+            amg::trace_span span("amg_scan_visit", "scan");
+            span.set_arg("sequence", file.sequence);
+
+            ds_store_t *store = amg_parse_cache_open_store(file.path.c_str());
+            result = visit ? visit(file.path.c_str(), store, context) : nullptr;
+
+            if (store) {
+                ds_store_free(store);
+            } else {
+                std::lock_guard<std::mutex> lock(mutex);
+                failed = true;
+            }
+        }
+
+        deliver(file, result);
+    }
+}
+
+void amg_scan_state::deliver(const amg_scan_file_t &file, void *result)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    amg::trace_span span("amg_scan_deliver", "output");
+
+    if (!ordered) {
+        if (sink)
+            sink(file.path.c_str(), result, context);
+        ++sunk;
+        changed.notify_all();
+        return;
+    }
+
+    pending[file.sequence] = std::make_pair(file.path, result);
+    for (std::map<size_t, std::pair<std::string, void *>>::iterator it = pending.begin(); it != pending.end() && it->first == sunk; it = pending.erase(it)) {
+        if (sink)
+            sink(it->second.first.c_str(), it->second.second, context);
+        ++sunk;
+    }
+    changed.notify_all();
+}
+
+static int amg_scan_compare_entries(const FTSENT **a, const FTSENT **b)
+{
+    return strcmp((*a)->fts_name, (*b)->fts_name);
+}
+
+int amg_scan(const char *directory, unsigned thread_count, int ordered, amg_scan_visit_func_t visit, amg_scan_sink_func_t sink, void *context)
+{
+    assert(directory);
+
+    if (thread_count == 0)
+        thread_count = std::max(1u, std::thread::hardware_concurrency());
+
+    char *paths[] = { const_cast<char *>(directory), nullptr };
+    FTS *fts = fts_open(paths, FTS_PHYSICAL | FTS_NOCHDIR, ordered ? amg_scan_compare_entries : nullptr);
+    if (!fts) {
+        fprintf(stderr, "error opening directory %s: %s\n", directory, strerror(errno));
+        return 1;
+    }
+
+    amg_scan_state state(thread_count, ordered != 0, visit, sink, context);
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < thread_count; ++i)
+        threads.push_back(std::thread(&amg_scan_state::work, &state));
+
+    // Walk on this thread, keeping the queue (and in ordered mode the
+    // results waiting for an earlier file) from growing without bound
+    bool walk_failed = false;
+    for (;;) {
+        errno = 0;
+        FTSENT *entry = fts_read(fts);
+        if (!entry)
+            break;
+
+        if (entry->fts_info == FTS_DNR || entry->fts_info == FTS_ERR || entry->fts_info == FTS_NS) {
+            fprintf(stderr, "error reading %s: %s\n", entry->fts_path, strerror(entry->fts_errno));
+            walk_failed = true;
+            continue;
+        }
+
+        if (entry->fts_info != FTS_F || strcmp(entry->fts_name, amg_scan_file_name) != 0)
+            continue;
+
+        std::unique_lock<std::mutex> lock(state.mutex);
+        state.changed.wait(lock, [&state]() { return state.queue.size() < state.window && state.queued - state.sunk < 2 * state.window; });
+
+        amg_scan_file_t file;
+        file.sequence = state.queued++;
+        file.path = entry->fts_path;
+        state.queue.push_back(file);
+        state.changed.notify_all();
+    }
+
+    if (errno != 0) {
+        fprintf(stderr, "error walking directory %s: %s\n", directory, strerror(errno));
+        walk_failed = true;
+    }
+
+    fts_close(fts);
+
+    {
+        std::lock_guard<std::mutex> lock(state.mutex);
+        state.finished = true;
+        state.changed.notify_all();
+    }
+
+    for (size_t i = 0; i < threads.size(); ++i)
+        threads[i].join();
+
+    return walk_failed || state.failed ? 1 : 0;
+}
+
+typedef struct {
+    size_t record_count;
+    int status;
+} amg_scan_summary_t;
+
+static void *amg_scan_summarize(const char *path, ds_store_t *store, void *context)
+{
+    (void)path;
+    (void)context;
+
+    // Counting the records decodes every one of them, which is the work the
+    // threads are there to share
+
+    amg_scan_summary_t *summary = new amg_scan_summary_t();
+    summary->status = store ? ds_store_enum_records_core(store, [summary](ds_record_t *) { ++summary->record_count; }) : 1;
+    return summary;
+}
+
+static void amg_scan_print_summary(const char *path, void *result, void *context)
+{
+    amg_scan_summary_t *summary = static_cast<amg_scan_summary_t *>(result);
+    if (summary->status == 0) {
+        fprintf(stdout, "%s\t%zu\n", path, summary->record_count);
+    } else {
+        fprintf(stdout, "%s\terror\n", path);
+        ++*static_cast<size_t *>(context);
+    }
+    delete summary;
+}
+
+int amg_scan_directory(const char *directory, unsigned thread_count)
+{
+    size_t errors = 0;
+    const int ret = amg_scan(directory, thread_count, 1, amg_scan_summarize, amg_scan_print_summary, &errors);
+    return ret != 0 || errors > 0 ? 1 : 0;
+}
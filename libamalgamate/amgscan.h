@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2015 Jake Petroules. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AMALGAMATE_SCAN_H
+#define AMALGAMATE_SCAN_H
+
+#include <stdio.h>
+#include "dsstore.h"
+
+/*!
+ * Called on a worker thread for every .DS_Store file found; \a store is NULL
+ * if the file could not be read. The store is freed once this returns, so
+ * anything needed later goes into the returned result.
+ */
+typedef void *(*amg_scan_visit_func_t)(const char *path, ds_store_t *store, void *context);
+
+/*!
+ * Receives the result of each visit, one call at a time. The sink owns the
+ * result.
+ */
+typedef void (*amg_scan_sink_func_t)(const char *path, void *result, void *context);
+
+/*!
+ * Walks the tree under \a directory and reads every .DS_Store file in it on
+ * up to \a thread_count threads (0 for one per CPU). Results reach \a sink in
+ * the order the files were found if \a ordered is nonzero, otherwise as soon
+ * as they are ready. Returns 1 if the walk failed or any file was unreadable.
+ */
+AMG_EXPORT AMG_EXTERN int amg_scan(const char *directory, unsigned thread_count, int ordered, amg_scan_visit_func_t visit, amg_scan_sink_func_t sink, void *context);
+
+/*!
+ * Prints the path and record count of every .DS_Store file under \a directory.
+ */
+AMG_EXPORT AMG_EXTERN int amg_scan_directory(const char *directory, unsigned thread_count);
+
+#endif // AMALGAMATE_SCAN_H
@@ -0,0 +1,293 @@
+/*
+ * Copyright (c) 2015 Jake Petroules. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "amgtrace.h"
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+typedef struct {
+    const char *name;
+    const char *category;
+    const char *arg_name;
+    uint64_t arg;
+    uint64_t start;
+    uint64_t duration;
+    bool arg_fourcc;
+} amg_trace_event_t;
+
+static const size_t amg_trace_chunk_events = 1024;
+static const size_t amg_trace_default_max_events = 1 << 22;
+
+/*!
+ * A run of events filled by one thread. \c count is published after each
+ * event is written, so a reader sees only complete events.
+ */
+struct amg_trace_chunk
+{
+    amg_trace_chunk() : count(0), next(nullptr) { }
+
+    amg_trace_event_t events[amg_trace_chunk_events];
+    std::atomic<size_t> count;
+    std::atomic<amg_trace_chunk *> next;
+};
+
+/*!
+ * The events of one thread during one trace. Only the owning thread
+ * appends; chunks are never freed before the buffer itself, which both
+ * the thread and the trace hold on to.
+ */
+struct amg_trace_buffer
+{
+    amg_trace_buffer(uint64_t generation, unsigned thread_id)
+        : generation(generation), thread_id(thread_id), head(nullptr), tail(nullptr), full(false), dropped(0) { }
+    ~amg_trace_buffer();
+
+    const uint64_t generation;
+    const unsigned thread_id;
+    std::atomic<amg_trace_chunk *> head;
+    amg_trace_chunk *tail;
+    bool full;
+    std::atomic<uint64_t> dropped;
+
+    void append(const amg_trace_event_t &event);
+};
+
+struct amg_trace_state
+{
+    amg_trace_state() : mutex(), buffers(), generation(0), start(0), next_thread_id(0), max_chunks(0), chunks(0) { }
+
+    std::mutex mutex;
+    std::vector<std::shared_ptr<amg_trace_buffer>> buffers;
+    std::atomic<uint64_t> generation;
+    uint64_t start;
+    unsigned next_thread_id;
+
+    // Chunks handed out in this trace, against the limit on events
+    std::atomic<size_t> max_chunks;
+    std::atomic<size_t> chunks;
+};
+
+std::atomic<bool> amg_trace_active(false);
+static amg_trace_state amg_the_trace;
+static thread_local std::shared_ptr<amg_trace_buffer> amg_trace_thread_buffer;
+
+uint64_t amg_trace_now(void)
+{
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+amg_trace_buffer::~amg_trace_buffer()
+{
+    for (amg_trace_chunk *chunk = head.load(); chunk;) {
+        amg_trace_chunk *next = chunk->next.load();
+        delete chunk;
+        chunk = next;
+    }
+}
+
+void amg_trace_buffer::append(const amg_trace_event_t &event)
+{
+    if (!tail || tail->count.load(std::memory_order_relaxed) == amg_trace_chunk_events) {
+        if (full || amg_the_trace.chunks.fetch_add(1, std::memory_order_relaxed) >= amg_the_trace.max_chunks.load(std::memory_order_relaxed)) {
+            full = true;
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        amg_trace_chunk *chunk = new amg_trace_chunk();
+        if (tail)
+            tail->next.store(chunk, std::memory_order_release);
+        else
+            head.store(chunk, std::memory_order_release);
+        tail = chunk;
+    }
+
+    const size_t count = tail->count.load(std::memory_order_relaxed);
+    tail->events[count] = event;
+    tail->count.store(count + 1, std::memory_order_release);
+}
+
+void amg::trace_span::end()
+{
+    const uint64_t generation = amg_the_trace.generation.load(std::memory_order_acquire);
+    if (!amg_trace_active.load(std::memory_order_relaxed))
+        return;
+
+    // A thread gets a new buffer the first time it records in each trace
+    std::shared_ptr<amg_trace_buffer> &buffer = amg_trace_thread_buffer;
+    if (!buffer || buffer->generation != generation) {
+        std::lock_guard<std::mutex> lock(amg_the_trace.mutex);
+        if (amg_the_trace.generation.load(std::memory_order_relaxed) != generation)
+            return;
+        buffer = std::make_shared<amg_trace_buffer>(generation, amg_the_trace.next_thread_id++);
+        amg_the_trace.buffers.push_back(buffer);
+    }
+
+    amg_trace_event_t event;
+    event.name = _name;
+    event.category = _category;
+    event.arg_name = _arg_name;
+    event.arg = _arg;
+    event.start = _start;
+    event.duration = amg_trace_now() - _start;
+    event.arg_fourcc = _arg_fourcc;
+    buffer->append(event);
+}
+
+void amg_trace_start(size_t max_events)
+{
+    if (max_events == 0)
+        max_events = amg_trace_default_max_events;
+
+    std::lock_guard<std::mutex> lock(amg_the_trace.mutex);
+    amg_the_trace.buffers.clear();
+    amg_the_trace.next_thread_id = 0;
+    amg_the_trace.max_chunks = (max_events + amg_trace_chunk_events - 1) / amg_trace_chunk_events;
+    amg_the_trace.chunks = 0;
+    amg_the_trace.start = amg_trace_now();
+    amg_the_trace.generation.fetch_add(1, std::memory_order_release);
+    amg_trace_active = true;
+}
+
+void amg_trace_stop(void)
+{
+    amg_trace_active = false;
+}
+
+static void amg_trace_append_string(std::string &out, const char *s, size_t length)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    out += '"';
+    for (size_t i = 0; i < length; ++i) {
+        const unsigned char c = static_cast<unsigned char>(s[i]);
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += static_cast<char>(c);
+        } else if (c < 0x20 || c >= 0x7f) {
+            out += "\\u00";
+            out += hex[c >> 4];
+            out += hex[c & 0xf];
+        } else {
+            out += static_cast<char>(c);
+        }
+    }
+    out += '"';
+}
+
+static void amg_trace_append_event(std::string &out, const amg_trace_event_t &event, uint64_t start, int pid, unsigned thread_id)
+{
+    char buf[128];
+
+    out += "{\"name\":";
+    amg_trace_append_string(out, event.name, strlen(event.name));
+    out += ",\"cat\":";
+    amg_trace_append_string(out, event.category, strlen(event.category));
+
+    // Timestamps are in microseconds, relative to the start of the trace
+    const uint64_t ts = event.start > start ? event.start - start : 0;
+    snprintf(buf, sizeof(buf), ",\"ph\":\"X\",\"ts\":%llu.%03u,\"dur\":%llu.%03u,\"pid\":%d,\"tid\":%u",
+             static_cast<unsigned long long>(ts / 1000), static_cast<unsigned>(ts % 1000),
+             static_cast<unsigned long long>(event.duration / 1000), static_cast<unsigned>(event.duration % 1000),
+             pid, thread_id);
+    out += buf;
+
+    if (event.arg_name) {
+        out += ",\"args\":{";
+        amg_trace_append_string(out, event.arg_name, strlen(event.arg_name));
+        out += ':';
+        if (event.arg_fourcc) {
+            const char code[4] = {
+                static_cast<char>(event.arg >> 24), static_cast<char>(event.arg >> 16),
+                static_cast<char>(event.arg >> 8), static_cast<char>(event.arg)
+            };
+            amg_trace_append_string(out, code, sizeof(code));
+        } else {
+            snprintf(buf, sizeof(buf), "%llu", static_cast<unsigned long long>(event.arg));
+            out += buf;
+        }
+        out += '}';
+    }
+
+    out += '}';
+}
+
+int amg_trace_fwrite(FILE *file)
+{
+    assert(file);
+
+    std::vector<std::shared_ptr<amg_trace_buffer>> buffers;
+    uint64_t start;
+    {
+        std::lock_guard<std::mutex> lock(amg_the_trace.mutex);
+        buffers = amg_the_trace.buffers;
+        start = amg_the_trace.start;
+    }
+
+    const int pid = static_cast<int>(getpid());
+    std::string out = "{\"traceEvents\":[\n";
+    uint64_t dropped = 0;
+    bool first = true;
+    bool failed = false;
+
+    for (size_t i = 0; i < buffers.size(); ++i) {
+        const amg_trace_buffer &buffer = *buffers[i];
+        dropped += buffer.dropped.load(std::memory_order_relaxed);
+
+        char buf[128];
+        snprintf(buf, sizeof(buf), "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,\"args\":{\"name\":\"thread %u\"}}",
+                 first ? "" : ",\n", pid, buffer.thread_id, buffer.thread_id);
+        out += buf;
+        first = false;
+
+        for (amg_trace_chunk *chunk = buffer.head.load(std::memory_order_acquire); chunk; chunk = chunk->next.load(std::memory_order_acquire)) {
+            const size_t count = chunk->count.load(std::memory_order_acquire);
+            for (size_t j = 0; j < count; ++j) {
+                out += ",\n";
+                amg_trace_append_event(out, chunk->events[j], start, pid, buffer.thread_id);
+            }
+
+            if (out.size() >= (1 << 20)) {
+                failed = failed || fwrite(out.data(), 1, out.size(), file) != out.size();
+                out.clear();
+            }
+        }
+    }
+
+    char buf[128];
+    snprintf(buf, sizeof(buf), "\n],\n\"displayTimeUnit\":\"ns\",\n\"otherData\":{\"dropped_events\":%llu}}\n", static_cast<unsigned long long>(dropped));
+    out += buf;
+    failed = failed || fwrite(out.data(), 1, out.size(), file) != out.size();
+
+    if (dropped > 0)
+        fprintf(stderr, "warning: trace dropped %llu events over its limit\n", static_cast<unsigned long long>(dropped));
+
+    return failed || fflush(file) != 0 ? 1 : 0;
+}
@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2015 Jake Petroules. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AMALGAMATE_TRACE_H
+#define AMALGAMATE_TRACE_H
+
+#include "amgexport.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+#include <atomic>
+#endif
+
+/*!
+ * An opt-in timeline of where reading time goes: opening stores, loading
+ * their allocator and header block, reading nodes, decoding records and
+ * encoding output. Each thread records spans into a buffer of its own
+ * without locking, and the whole timeline is written out at the end in the
+ * Chrome trace event format, which chrome://tracing and Perfetto open.
+ */
+
+/*!
+ * Discards any previous timeline and starts recording, keeping at most
+ * about \a max_events spans (0 for a default of about four million); spans
+ * beyond that are counted but dropped.
+ */
+AMG_EXPORT AMG_EXTERN void amg_trace_start(size_t max_events);
+
+/*!
+ * Stops recording; spans still open are dropped when they end.
+ */
+AMG_EXPORT AMG_EXTERN void amg_trace_stop(void);
+
+/*!
+ * Writes the spans recorded since amg_trace_start to \a file as Chrome
+ * trace JSON. Threads may still be running, but spans they end after the
+ * call has started may be left out.
+ */
+AMG_EXPORT AMG_EXTERN int amg_trace_fwrite(FILE *file);
+
+#ifdef __cplusplus
+AMG_EXPORT extern std::atomic<bool> amg_trace_active;
+
+AMG_EXPORT extern uint64_t amg_trace_now(void);
+
+namespace amg {
+
+/*!
+ * Records the time between its construction and destruction as a span
+ * while tracing is on. \a name, \a category and argument names must be
+ * string literals or otherwise outlive the trace.
+ */
+class AMG_EXPORT trace_span {
+public:
+    trace_span(const char *name, const char *category)
+        : _name(name), _category(category), _arg_name(nullptr), _arg(0), _arg_fourcc(false)
+        , _active(amg_trace_active.load(std::memory_order_relaxed)), _start(_active ? amg_trace_now() : 0) { }
+    ~trace_span() { if (_active) end(); }
+
+    /*!
+     * Attaches a number, or a four-character code, to the span.
+     */
+    void set_arg(const char *name, uint64_t value) { _arg_name = name; _arg = value; _arg_fourcc = false; }
+    void set_fourcc_arg(const char *name, uint32_t code) { _arg_name = name; _arg = code; _arg_fourcc = true; }
+
+private:
+    trace_span(const trace_span &);
+    trace_span &operator=(const trace_span &);
+
+    void end();
+
+    const char *_name;
+    const char *_category;
+    const char *_arg_name;
+    uint64_t _arg;
+    bool _arg_fourcc;
+    bool _active;
+    uint64_t _start;
+};
+
+} // namespace amg
+#endif
+
+#endif // AMALGAMATE_TRACE_H
@@ -0,0 +1,314 @@
+/*
+ * Copyright (c) 2015 Jake Petroules. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "amgunicode.h"
+#include <string.h>
+#include <algorithm>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define AMG_UNICODE_SSE2 1
+#endif
+
+static inline uint16_t amg_load_utf16be(const unsigned char *p)
+{
+    return static_cast<uint16_t>((p[0] << 8) | p[1]);
+}
+
+void amg_utf16_from_be(uint16_t *dst, const unsigned char *src, size_t len)
+{
+    size_t i = 0;
+    unsigned char *out = reinterpret_cast<unsigned char *>(dst);
+
+#if defined(__AVX2__)
+    for (; i + 16 <= len; i += 16) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + 2 * i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + 2 * i), _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8)));
+    }
+#endif
+#if defined(AMG_UNICODE_SSE2)
+    for (; i + 8 <= len; i += 8) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 2 * i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 2 * i), _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 8 <= len; i += 8)
+        vst1q_u8(out + 2 * i, vrev16q_u8(vld1q_u8(src + 2 * i)));
+#endif
+
+    for (; i < len; ++i) {
+        const uint16_t c = amg_load_utf16be(src + 2 * i);
+        memcpy(out + 2 * i, &c, sizeof(c));
+    }
+}
+
+/*!
+ * Encodes the code point starting at src[i], which may be a surrogate pair,
+ * and returns the index after it.
+ */
+static inline size_t amg_utf8_encode_one(char *&out, const uint16_t *src, size_t i, size_t len)
+{
+    uint32_t c = src[i++];
+    if (c >= 0xD800 && c < 0xDC00 && i < len && src[i] >= 0xDC00 && src[i] < 0xE000) {
+        c = 0x10000 + ((c - 0xD800) << 10) + (src[i++] - 0xDC00);
+    } else if (c >= 0xD800 && c < 0xE000) {
+        c = 0xFFFD;
+    }
+
+    if (c < 0x80) {
+        *out++ = static_cast<char>(c);
+    } else if (c < 0x800) {
+        *out++ = static_cast<char>(0xC0 | (c >> 6));
+        *out++ = static_cast<char>(0x80 | (c & 0x3F));
+    } else if (c < 0x10000) {
+        *out++ = static_cast<char>(0xE0 | (c >> 12));
+        *out++ = static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+        *out++ = static_cast<char>(0x80 | (c & 0x3F));
+    } else {
+        *out++ = static_cast<char>(0xF0 | (c >> 18));
+        *out++ = static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+        *out++ = static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+        *out++ = static_cast<char>(0x80 | (c & 0x3F));
+    }
+
+    return i;
+}
+
+size_t amg_utf8_from_utf16(char *dst, const uint16_t *src, size_t len)
+{
+    // Filenames are mostly ASCII, so whole blocks of it are narrowed at once
+    // and anything else goes through the scalar encoder
+    char *out = dst;
+    size_t i = 0;
+    while (i < len) {
+#if defined(__AVX2__)
+        if (i + 16 <= len) {
+            const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+            if (_mm256_testz_si256(v, _mm256_set1_epi16(static_cast<short>(0xFF80)))) {
+                const __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(v, v), 0xD8);
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(out), _mm256_castsi256_si128(packed));
+                out += 16;
+                i += 16;
+                continue;
+            }
+        }
+#endif
+#if defined(AMG_UNICODE_SSE2)
+        if (i + 8 <= len) {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+            const __m128i high = _mm_and_si128(v, _mm_set1_epi16(static_cast<short>(0xFF80)));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi16(high, _mm_setzero_si128())) == 0xFFFF) {
+                _mm_storel_epi64(reinterpret_cast<__m128i *>(out), _mm_packus_epi16(v, v));
+                out += 8;
+                i += 8;
+                continue;
+            }
+        }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+        if (i + 8 <= len) {
+            const uint16x8_t v = vld1q_u16(src + i);
+            if (vmaxvq_u16(v) < 0x80) {
+                vst1_u8(reinterpret_cast<uint8_t *>(out), vmovn_u16(v));
+                out += 8;
+                i += 8;
+                continue;
+            }
+        }
+#endif
+
+        // Encode up to the end of the block that failed the ASCII test
+        const size_t end = len - i < 8 ? len : i + 8;
+        while (i < end)
+            i = amg_utf8_encode_one(out, src, i, len);
+    }
+
+    return static_cast<size_t>(out - dst);
+}
+
+size_t amg_utf8_from_utf16be(char *dst, const unsigned char *src, size_t len)
+{
+    // Swap a block at a time into host order, never ending a block between
+    // the two halves of a surrogate pair
+    uint16_t units[256];
+    size_t written = 0;
+    while (len > 0) {
+        size_t n = len < 256 ? len : 256;
+        amg_utf16_from_be(units, src, n);
+        if (n < len && units[n - 1] >= 0xD800 && units[n - 1] < 0xDC00)
+            --n;
+
+        written += amg_utf8_from_utf16(dst + written, units, n);
+        src += 2 * n;
+        len -= n;
+    }
+
+    return written;
+}
+
+int amg_utf8_valid(const char *s, size_t len)
+{
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(s);
+    size_t i = 0;
+    while (i < len) {
+        const unsigned char c = p[i];
+        if (c < 0x80) {
+            ++i;
+            continue;
+        }
+
+        size_t n;
+        uint32_t code_point, min;
+        if ((c & 0xE0) == 0xC0) {
+            n = 1, code_point = c & 0x1F, min = 0x80;
+        } else if ((c & 0xF0) == 0xE0) {
+            n = 2, code_point = c & 0x0F, min = 0x800;
+        } else if ((c & 0xF8) == 0xF0) {
+            n = 3, code_point = c & 0x07, min = 0x10000;
+        } else {
+            return 0;
+        }
+
+        if (n >= len - i)
+            return 0;
+
+        for (size_t k = 1; k <= n; ++k) {
+            if ((p[i + k] & 0xC0) != 0x80)
+                return 0;
+            code_point = (code_point << 6) | (p[i + k] & 0x3F);
+        }
+
+        if (code_point < min || code_point > 0x10FFFF || (code_point >= 0xD800 && code_point < 0xE000))
+            return 0;
+
+        i += n + 1;
+    }
+
+    return 1;
+}
+
+/*!
+ * Simple case folding (the C and S mappings of CaseFolding.txt) of the
+ * Basic Multilingual Plane beyond ASCII, from Unicode 14.0. Each range maps
+ * every \c stride'th code unit from \c first to \c last by adding \c delta
+ * modulo 2^16. The ranges are sorted and do not overlap.
+ */
+typedef struct {
+    uint16_t first;
+    uint16_t last;
+    uint16_t delta;
+    uint16_t stride;
+} amg_case_fold_range_t;
+
+static const amg_case_fold_range_t amg_case_fold_ranges[] = {
+    { 0x00B5, 0x00B5, 0x0307, 1 }, { 0x00C0, 0x00D6, 0x0020, 1 }, { 0x00D8, 0x00DE, 0x0020, 1 },
+    { 0x0100, 0x012E, 0x0001, 2 }, { 0x0132, 0x0136, 0x0001, 2 }, { 0x0139, 0x0147, 0x0001, 2 },
+    { 0x014A, 0x0176, 0x0001, 2 }, { 0x0178, 0x0178, 0xFF87, 1 }, { 0x0179, 0x017D, 0x0001, 2 },
+    { 0x017F, 0x017F, 0xFEF4, 1 }, { 0x0181, 0x0181, 0x00D2, 1 }, { 0x0182, 0x0184, 0x0001, 2 },
+    { 0x0186, 0x0186, 0x00CE, 1 }, { 0x0187, 0x0187, 0x0001, 1 }, { 0x0189, 0x018A, 0x00CD, 1 },
+    { 0x018B, 0x018B, 0x0001, 1 }, { 0x018E, 0x018E, 0x004F, 1 }, { 0x018F, 0x018F, 0x00CA, 1 },
+    { 0x0190, 0x0190, 0x00CB, 1 }, { 0x0191, 0x0191, 0x0001, 1 }, { 0x0193, 0x0193, 0x00CD, 1 },
+    { 0x0194, 0x0194, 0x00CF, 1 }, { 0x0196, 0x0196, 0x00D3, 1 }, { 0x0197, 0x0197, 0x00D1, 1 },
+    { 0x0198, 0x0198, 0x0001, 1 }, { 0x019C, 0x019C, 0x00D3, 1 }, { 0x019D, 0x019D, 0x00D5, 1 },
+    { 0x019F, 0x019F, 0x00D6, 1 }, { 0x01A0, 0x01A4, 0x0001, 2 }, { 0x01A6, 0x01A6, 0x00DA, 1 },
+    { 0x01A7, 0x01A7, 0x0001, 1 }, { 0x01A9, 0x01A9, 0x00DA, 1 }, { 0x01AC, 0x01AC, 0x0001, 1 },
+    { 0x01AE, 0x01AE, 0x00DA, 1 }, { 0x01AF, 0x01AF, 0x0001, 1 }, { 0x01B1, 0x01B2, 0x00D9, 1 },
+    { 0x01B3, 0x01B5, 0x0001, 2 }, { 0x01B7, 0x01B7, 0x00DB, 1 }, { 0x01B8, 0x01B8, 0x0001, 1 },
+    { 0x01BC, 0x01BC, 0x0001, 1 }, { 0x01C4, 0x01C4, 0x0002, 1 }, { 0x01C5, 0x01C5, 0x0001, 1 },
+    { 0x01C7, 0x01C7, 0x0002, 1 }, { 0x01C8, 0x01C8, 0x0001, 1 }, { 0x01CA, 0x01CA, 0x0002, 1 },
+    { 0x01CB, 0x01DB, 0x0001, 2 }, { 0x01DE, 0x01EE, 0x0001, 2 }, { 0x01F1, 0x01F1, 0x0002, 1 },
+    { 0x01F2, 0x01F4, 0x0001, 2 }, { 0x01F6, 0x01F6, 0xFF9F, 1 }, { 0x01F7, 0x01F7, 0xFFC8, 1 },
+    { 0x01F8, 0x021E, 0x0001, 2 }, { 0x0220, 0x0220, 0xFF7E, 1 }, { 0x0222, 0x0232, 0x0001, 2 },
+    { 0x023A, 0x023A, 0x2A2B, 1 }, { 0x023B, 0x023B, 0x0001, 1 }, { 0x023D, 0x023D, 0xFF5D, 1 },
+    { 0x023E, 0x023E, 0x2A28, 1 }, { 0x0241, 0x0241, 0x0001, 1 }, { 0x0243, 0x0243, 0xFF3D, 1 },
+    { 0x0244, 0x0244, 0x0045, 1 }, { 0x0245, 0x0245, 0x0047, 1 }, { 0x0246, 0x024E, 0x0001, 2 },
+    { 0x0345, 0x0345, 0x0074, 1 }, { 0x0370, 0x0372, 0x0001, 2 }, { 0x0376, 0x0376, 0x0001, 1 },
+    { 0x037F, 0x037F, 0x0074, 1 }, { 0x0386, 0x0386, 0x0026, 1 }, { 0x0388, 0x038A, 0x0025, 1 },
+    { 0x038C, 0x038C, 0x0040, 1 }, { 0x038E, 0x038F, 0x003F, 1 }, { 0x0391, 0x03A1, 0x0020, 1 },
+    { 0x03A3, 0x03AB, 0x0020, 1 }, { 0x03C2, 0x03C2, 0x0001, 1 }, { 0x03CF, 0x03CF, 0x0008, 1 },
+    { 0x03D0, 0x03D0, 0xFFE2, 1 }, { 0x03D1, 0x03D1, 0xFFE7, 1 }, { 0x03D5, 0x03D5, 0xFFF1, 1 },
+    { 0x03D6, 0x03D6, 0xFFEA, 1 }, { 0x03D8, 0x03EE, 0x0001, 2 }, { 0x03F0, 0x03F0, 0xFFCA, 1 },
+    { 0x03F1, 0x03F1, 0xFFD0, 1 }, { 0x03F4, 0x03F4, 0xFFC4, 1 }, { 0x03F5, 0x03F5, 0xFFC0, 1 },
+    { 0x03F7, 0x03F7, 0x0001, 1 }, { 0x03F9, 0x03F9, 0xFFF9, 1 }, { 0x03FA, 0x03FA, 0x0001, 1 },
+    { 0x03FD, 0x03FF, 0xFF7E, 1 }, { 0x0400, 0x040F, 0x0050, 1 }, { 0x0410, 0x042F, 0x0020, 1 },
+    { 0x0460, 0x0480, 0x0001, 2 }, { 0x048A, 0x04BE, 0x0001, 2 }, { 0x04C0, 0x04C0, 0x000F, 1 },
+    { 0x04C1, 0x04CD, 0x0001, 2 }, { 0x04D0, 0x052E, 0x0001, 2 }, { 0x0531, 0x0556, 0x0030, 1 },
+    { 0x10A0, 0x10C5, 0x1C60, 1 }, { 0x10C7, 0x10C7, 0x1C60, 1 }, { 0x10CD, 0x10CD, 0x1C60, 1 },
+    { 0x13F8, 0x13FD, 0xFFF8, 1 }, { 0x1C80, 0x1C80, 0xE7B2, 1 }, { 0x1C81, 0x1C81, 0xE7B3, 1 },
+    { 0x1C82, 0x1C82, 0xE7BC, 1 }, { 0x1C83, 0x1C84, 0xE7BE, 1 }, { 0x1C85, 0x1C85, 0xE7BD, 1 },
+    { 0x1C86, 0x1C86, 0xE7C4, 1 }, { 0x1C87, 0x1C87, 0xE7DC, 1 }, { 0x1C88, 0x1C88, 0x89C3, 1 },
+    { 0x1C90, 0x1CBA, 0xF440, 1 }, { 0x1CBD, 0x1CBF, 0xF440, 1 }, { 0x1E00, 0x1E94, 0x0001, 2 },
+    { 0x1E9B, 0x1E9B, 0xFFC6, 1 }, { 0x1E9E, 0x1E9E, 0xE241, 1 }, { 0x1EA0, 0x1EFE, 0x0001, 2 },
+    { 0x1F08, 0x1F0F, 0xFFF8, 1 }, { 0x1F18, 0x1F1D, 0xFFF8, 1 }, { 0x1F28, 0x1F2F, 0xFFF8, 1 },
+    { 0x1F38, 0x1F3F, 0xFFF8, 1 }, { 0x1F48, 0x1F4D, 0xFFF8, 1 }, { 0x1F59, 0x1F5F, 0xFFF8, 2 },
+    { 0x1F68, 0x1F6F, 0xFFF8, 1 }, { 0x1F88, 0x1F8F, 0xFFF8, 1 }, { 0x1F98, 0x1F9F, 0xFFF8, 1 },
+    { 0x1FA8, 0x1FAF, 0xFFF8, 1 }, { 0x1FB8, 0x1FB9, 0xFFF8, 1 }, { 0x1FBA, 0x1FBB, 0xFFB6, 1 },
+    { 0x1FBC, 0x1FBC, 0xFFF7, 1 }, { 0x1FBE, 0x1FBE, 0xE3FB, 1 }, { 0x1FC8, 0x1FCB, 0xFFAA, 1 },
+    { 0x1FCC, 0x1FCC, 0xFFF7, 1 }, { 0x1FD8, 0x1FD9, 0xFFF8, 1 }, { 0x1FDA, 0x1FDB, 0xFF9C, 1 },
+    { 0x1FE8, 0x1FE9, 0xFFF8, 1 }, { 0x1FEA, 0x1FEB, 0xFF90, 1 }, { 0x1FEC, 0x1FEC, 0xFFF9, 1 },
+    { 0x1FF8, 0x1FF9, 0xFF80, 1 }, { 0x1FFA, 0x1FFB, 0xFF82, 1 }, { 0x1FFC, 0x1FFC, 0xFFF7, 1 },
+    { 0x2126, 0x2126, 0xE2A3, 1 }, { 0x212A, 0x212A, 0xDF41, 1 }, { 0x212B, 0x212B, 0xDFBA, 1 },
+    { 0x2132, 0x2132, 0x001C, 1 }, { 0x2160, 0x216F, 0x0010, 1 }, { 0x2183, 0x2183, 0x0001, 1 },
+    { 0x24B6, 0x24CF, 0x001A, 1 }, { 0x2C00, 0x2C2F, 0x0030, 1 }, { 0x2C60, 0x2C60, 0x0001, 1 },
+    { 0x2C62, 0x2C62, 0xD609, 1 }, { 0x2C63, 0x2C63, 0xF11A, 1 }, { 0x2C64, 0x2C64, 0xD619, 1 },
+    { 0x2C67, 0x2C6B, 0x0001, 2 }, { 0x2C6D, 0x2C6D, 0xD5E4, 1 }, { 0x2C6E, 0x2C6E, 0xD603, 1 },
+    { 0x2C6F, 0x2C6F, 0xD5E1, 1 }, { 0x2C70, 0x2C70, 0xD5E2, 1 }, { 0x2C72, 0x2C72, 0x0001, 1 },
+    { 0x2C75, 0x2C75, 0x0001, 1 }, { 0x2C7E, 0x2C7F, 0xD5C1, 1 }, { 0x2C80, 0x2CE2, 0x0001, 2 },
+    { 0x2CEB, 0x2CED, 0x0001, 2 }, { 0x2CF2, 0x2CF2, 0x0001, 1 }, { 0xA640, 0xA66C, 0x0001, 2 },
+    { 0xA680, 0xA69A, 0x0001, 2 }, { 0xA722, 0xA72E, 0x0001, 2 }, { 0xA732, 0xA76E, 0x0001, 2 },
+    { 0xA779, 0xA77B, 0x0001, 2 }, { 0xA77D, 0xA77D, 0x75FC, 1 }, { 0xA77E, 0xA786, 0x0001, 2 },
+    { 0xA78B, 0xA78B, 0x0001, 1 }, { 0xA78D, 0xA78D, 0x5AD8, 1 }, { 0xA790, 0xA792, 0x0001, 2 },
+    { 0xA796, 0xA7A8, 0x0001, 2 }, { 0xA7AA, 0xA7AA, 0x5ABC, 1 }, { 0xA7AB, 0xA7AB, 0x5AB1, 1 },
+    { 0xA7AC, 0xA7AC, 0x5AB5, 1 }, { 0xA7AD, 0xA7AD, 0x5ABF, 1 }, { 0xA7AE, 0xA7AE, 0x5ABC, 1 },
+    { 0xA7B0, 0xA7B0, 0x5AEE, 1 }, { 0xA7B1, 0xA7B1, 0x5AD6, 1 }, { 0xA7B2, 0xA7B2, 0x5AEB, 1 },
+    { 0xA7B3, 0xA7B3, 0x03A0, 1 }, { 0xA7B4, 0xA7C2, 0x0001, 2 }, { 0xA7C4, 0xA7C4, 0xFFD0, 1 },
+    { 0xA7C5, 0xA7C5, 0x5ABD, 1 }, { 0xA7C6, 0xA7C6, 0x75C8, 1 }, { 0xA7C7, 0xA7C9, 0x0001, 2 },
+    { 0xA7D0, 0xA7D0, 0x0001, 1 }, { 0xA7D6, 0xA7D8, 0x0001, 2 }, { 0xA7F5, 0xA7F5, 0x0001, 1 },
+    { 0xAB70, 0xABBF, 0x6830, 1 }, { 0xFF21, 0xFF3A, 0x0020, 1 },
+};
+
+uint16_t amg_utf16_fold_case(uint16_t c)
+{
+    if (c < 0x80)
+        return (c >= 'A' && c <= 'Z') ? static_cast<uint16_t>(c + ('a' - 'A')) : c;
+
+    const amg_case_fold_range_t *end = amg_case_fold_ranges + sizeof(amg_case_fold_ranges) / sizeof(amg_case_fold_ranges[0]);
+    const amg_case_fold_range_t *range = std::upper_bound(amg_case_fold_ranges, end, c, [](uint16_t value, const amg_case_fold_range_t &r) {
+        return value < r.first;
+    });
+    if (range == amg_case_fold_ranges)
+        return c;
+
+    --range;
+    if (c > range->last || (c - range->first) % range->stride != 0)
+        return c;
+
+    return static_cast<uint16_t>(c + range->delta);
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2015 Jake Petroules. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AMALGAMATE_UNICODE_H
+#define AMALGAMATE_UNICODE_H
+
+#include "amgexport.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*!
+ * Text kernels for the UTF-16 stored in filenames and ustr records. They use
+ * AVX2, SSE2 or NEON when the compiler targets them and plain loops
+ * otherwise, with the same results either way.
+ */
+
+/*!
+ * Converts \a len big-endian UTF-16 code units at \a src, which need not be
+ * aligned, to host order in \a dst. The two may be the same buffer.
+ */
+AMG_EXPORT AMG_EXTERN void amg_utf16_from_be(uint16_t *dst, const unsigned char *src, size_t len);
+
+/*!
+ * Converts \a len host-order UTF-16 code units to UTF-8 and returns the
+ * number of bytes written to \a dst, which must have room for 3 * \a len.
+ * Unpaired surrogates become U+FFFD.
+ */
+AMG_EXPORT AMG_EXTERN size_t amg_utf8_from_utf16(char *dst, const uint16_t *src, size_t len);
+
+/*!
+ * Like amg_utf8_from_utf16, for big-endian code units.
+ */
+AMG_EXPORT AMG_EXTERN size_t amg_utf8_from_utf16be(char *dst, const unsigned char *src, size_t len);
+
+/*!
+ * Returns 1 if the \a len bytes at \a s are well-formed UTF-8, without
+ * overlong forms, surrogates or code points beyond U+10FFFF, otherwise 0.
+ */
+AMG_EXPORT AMG_EXTERN int amg_utf8_valid(const char *s, size_t len);
+
+/*!
+ * Folds the host-order UTF-16 code unit \a c for case-insensitive
+ * comparison with Unicode's simple case folding, whatever the locale.
+ * Surrogates are returned unchanged.
+ */
+AMG_EXPORT AMG_EXTERN uint16_t amg_utf16_fold_case(uint16_t c);
+
+#endif // AMALGAMATE_UNICODE_H
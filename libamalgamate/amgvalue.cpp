@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) 2015 Jake Petroules. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "amgvalue.h"
+#include "amgunicode.h"
+#include <assert.h>
+
+namespace amg {
+
+value value::data(const unsigned char *bytes, size_t size)
+{
+    value v;
+    v._type = data_type;
+    if (size > 0)
+        v._data.assign(bytes, bytes + size);
+    return v;
+}
+
+value value::date(double seconds)
+{
+    value v;
+    v._type = date_type;
+    v._real = seconds;
+    return v;
+}
+
+value value::array()
+{
+    value v;
+    v._type = array_type;
+    return v;
+}
+
+value value::map()
+{
+    value v;
+    v._type = map_type;
+    return v;
+}
+
+value &value::append(value v)
+{
+    assert(_type == array_type);
+    _array.push_back(std::move(v));
+    return _array.back();
+}
+
+value &value::set(const std::string &key, value v)
+{
+    assert(_type == map_type);
+    for (auto &member : _map) {
+        if (member.first == key) {
+            member.second = std::move(v);
+            return member.second;
+        }
+    }
+
+    _map.emplace_back(key, std::move(v));
+    return _map.back().second;
+}
+
+const value *value::find(const std::string &key) const
+{
+    for (const auto &member : _map) {
+        if (member.first == key)
+            return &member.second;
+    }
+
+    return nullptr;
+}
+
+bool value::operator==(const value &other) const
+{
+    if (_type != other._type)
+        return false;
+
+    switch (_type) {
+        case null_type:
+            return true;
+        case bool_type:
+        case int_type:
+            return _int == other._int;
+        case real_type:
+        case date_type:
+            return _real == other._real;
+        case string_type:
+            return _string == other._string;
+        case data_type:
+            return _data == other._data;
+        case array_type:
+            return _array == other._array;
+        case map_type:
+            return _map == other._map;
+    }
+
+    return false;
+}
+
+static void utf8_append(std::string &out, uint32_t c)
+{
+    if (c < 0x80) {
+        out += static_cast<char>(c);
+    } else if (c < 0x800) {
+        out += static_cast<char>(0xC0 | (c >> 6));
+        out += static_cast<char>(0x80 | (c & 0x3F));
+    } else if (c < 0x10000) {
+        out += static_cast<char>(0xE0 | (c >> 12));
+        out += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (c & 0x3F));
+    } else {
+        out += static_cast<char>(0xF0 | (c >> 18));
+        out += static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+        out += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (c & 0x3F));
+    }
+}
+
+std::string utf8_from_utf16(const uint16_t *s, size_t len)
+{
+    std::string out(3 * len, '\0');
+    out.resize(amg_utf8_from_utf16(&out[0], s, len));
+    return out;
+}
+
+std::string utf8_from_utf16be(const unsigned char *s, size_t len)
+{
+    std::string out(3 * len, '\0');
+    out.resize(amg_utf8_from_utf16be(&out[0], s, len));
+    return out;
+}
+
+static const uint16_t mac_roman_high[128] = {
+    0x00C4, 0x00C5, 0x00C7, 0x00C9, 0x00D1, 0x00D6, 0x00DC, 0x00E1,
+    0x00E0, 0x00E2, 0x00E4, 0x00E3, 0x00E5, 0x00E7, 0x00E9, 0x00E8,
+    0x00EA, 0x00EB, 0x00ED, 0x00EC, 0x00EE, 0x00EF, 0x00F1, 0x00F3,
+    0x00F2, 0x00F4, 0x00F6, 0x00F5, 0x00FA, 0x00F9, 0x00FB, 0x00FC,
+    0x2020, 0x00B0, 0x00A2, 0x00A3, 0x00A7, 0x2022, 0x00B6, 0x00DF,
+    0x00AE, 0x00A9, 0x2122, 0x00B4, 0x00A8, 0x2260, 0x00C6, 0x00D8,
+    0x221E, 0x00B1, 0x2264, 0x2265, 0x00A5, 0x00B5, 0x2202, 0x2211,
+    0x220F, 0x03C0, 0x222B, 0x00AA, 0x00BA, 0x03A9, 0x00E6, 0x00F8,
+    0x00BF, 0x00A1, 0x00AC, 0x221A, 0x0192, 0x2248, 0x2206, 0x00AB,
+    0x00BB, 0x2026, 0x00A0, 0x00C0, 0x00C3, 0x00D5, 0x0152, 0x0153,
+    0x2013, 0x2014, 0x201C, 0x201D, 0x2018, 0x2019, 0x00F7, 0x25CA,
+    0x00FF, 0x0178, 0x2044, 0x20AC, 0x2039, 0x203A, 0xFB01, 0xFB02,
+    0x2021, 0x00B7, 0x201A, 0x201E, 0x2030, 0x00C2, 0x00CA, 0x00C1,
+    0x00CB, 0x00C8, 0x00CD, 0x00CE, 0x00CF, 0x00CC, 0x00D3, 0x00D4,
+    0xF8FF, 0x00D2, 0x00DA, 0x00DB, 0x00D9, 0x0131, 0x02C6, 0x02DC,
+    0x00AF, 0x02D8, 0x02D9, 0x02DA, 0x00B8, 0x02DD, 0x02DB, 0x02C7
+};
+
+std::string utf8_from_mac_roman(const char *s, size_t len)
+{
+    std::string out;
+    out.reserve(len);
+    for (size_t i = 0; i < len; ++i) {
+        const unsigned char c = static_cast<unsigned char>(s[i]);
+        utf8_append(out, c < 0x80 ? c : mac_roman_high[c - 0x80]);
+    }
+
+    return out;
+}
+
+std::string fourcc_string(uint32_t code)
+{
+    const char chars[4] = {
+        static_cast<char>(code >> 24),
+        static_cast<char>(code >> 16),
+        static_cast<char>(code >> 8),
+        static_cast<char>(code)
+    };
+    return utf8_from_mac_roman(chars, sizeof(chars));
+}
+
+} // namespace amg
@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2015 Jake Petroules. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AMALGAMATE_VALUE_H
+#define AMALGAMATE_VALUE_H
+
+#include "amgexport.h"
+
+#ifdef __cplusplus
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace amg {
+
+/*!
+ * A decoded field: a tree of integers, reals, strings, data, dates, arrays
+ * and maps in the shape ds_record_copy_dictionary produces with CF types, but
+ * built from standard containers only. Strings are UTF-8, dates are seconds
+ * relative to 2001-01-01 00:00:00 UTC like CFAbsoluteTime, and map members
+ * keep the order in which they were set.
+ */
+class AMG_EXPORT value {
+public:
+    typedef enum {
+        null_type,
+        bool_type,
+        int_type,
+        real_type,
+        string_type,
+        data_type,
+        date_type,
+        array_type,
+        map_type
+    } type_t;
+
+    typedef std::vector<value> array_t;
+    typedef std::vector<std::pair<std::string, value>> map_t;
+
+    value() : _type(null_type), _int(0), _real(0) { }
+    value(bool b) : _type(bool_type), _int(b), _real(0) { }
+    value(int i) : _type(int_type), _int(i), _real(0) { }
+    value(unsigned int i) : _type(int_type), _int(i), _real(0) { }
+    value(long i) : _type(int_type), _int(i), _real(0) { }
+    value(unsigned long i) : _type(int_type), _int(static_cast<int64_t>(i)), _real(0) { }
+    value(long long i) : _type(int_type), _int(i), _real(0) { }
+    value(unsigned long long i) : _type(int_type), _int(static_cast<int64_t>(i)), _real(0) { }
+    value(double d) : _type(real_type), _int(0), _real(d) { }
+    value(const char *s) : _type(string_type), _int(0), _real(0), _string(s) { }
+    value(std::string s) : _type(string_type), _int(0), _real(0), _string(std::move(s)) { }
+
+    static value data(const unsigned char *bytes, size_t size);
+    static value date(double seconds);
+    static value array();
+    static value map();
+
+    type_t type() const { return _type; }
+    bool is_null() const { return _type == null_type; }
+
+    bool as_bool() const { return _int != 0; }
+    int64_t as_int() const { return _int; }
+    double as_real() const { return _type == int_type ? static_cast<double>(_int) : _real; }
+    double as_date() const { return _real; }
+    const std::string &as_string() const { return _string; }
+    const std::vector<unsigned char> &as_data() const { return _data; }
+    const array_t &as_array() const { return _array; }
+    const map_t &as_map() const { return _map; }
+
+    /*!
+     * Appends \a v to an array and returns a reference to the stored element.
+     */
+    value &append(value v);
+
+    /*!
+     * Sets member \a key of a map, replacing an existing member of the same
+     * name, and returns a reference to the stored value.
+     */
+    value &set(const std::string &key, value v);
+
+    /*!
+     * Returns the member \a key of a map, or nullptr if there is none.
+     */
+    const value *find(const std::string &key) const;
+
+    bool operator==(const value &other) const;
+    bool operator!=(const value &other) const { return !(*this == other); }
+
+private:
+    type_t _type;
+    int64_t _int;
+    double _real;
+    std::string _string;
+    std::vector<unsigned char> _data;
+    array_t _array;
+    map_t _map;
+};
+
+/*!
+ * Text conversions used when building values from on-disk fields. The UTF-16
+ * variants take host-order and big-endian code units respectively; unpaired
+ * surrogates become U+FFFD.
+ */
+AMG_EXPORT std::string utf8_from_utf16(const uint16_t *s, size_t len);
+AMG_EXPORT std::string utf8_from_utf16be(const unsigned char *s, size_t len);
+AMG_EXPORT std::string utf8_from_mac_roman(const char *s, size_t len);
+AMG_EXPORT std::string fourcc_string(uint32_t code);
+
+/*!
+ * Seconds between the classic Mac OS epoch of 1904-01-01 and the
+ * CFAbsoluteTime epoch of 2001-01-01.
+ */
+static const double seconds_from_1904_to_2001 = 3061152000.0;
+
+} // namespace amg
+
+#endif
+
+#endif // AMALGAMATE_VALUE_H
@@ -0,0 +1,553 @@
+/*
+ * Copyright (c) 2015 Jake Petroules. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bookmark.h"
+#include "dsio.h"
+#include <algorithm>
+#include <string.h>
+
+#if AMG_HAVE_COREFOUNDATION
+#include "amgmemory.h"
+#include "cfutils.h"
+#endif
+
+static const size_t bookmark_toc_header_size = 5 * sizeof(uint32_t);
+static const size_t bookmark_toc_entry_size = 3 * sizeof(uint32_t);
+static const size_t bookmark_item_header_size = 2 * sizeof(uint32_t);
+
+/*!
+ * Deepest nesting of arrays the copy functions follow; an array can refer to
+ * itself, so there has to be one.
+ */
+static const size_t bookmark_max_depth = 32;
+
+/*!
+ * Arrays that share elements would expand exponentially, so the copy
+ * functions decode at most one item per four bytes of bookmark: as many as
+ * there can be references to items without any sharing.
+ */
+typedef struct {
+    const bookmark_t *bookmark;
+    size_t remaining_items;
+} bookmark_copy_context_t;
+
+static bookmark_copy_context_t bookmark_copy_context(const bookmark_t *bookmark)
+{
+    bookmark_copy_context_t context;
+    context.bookmark = bookmark;
+    context.remaining_items = bookmark->size / sizeof(uint32_t);
+    return context;
+}
+
+/*!
+ * Reads element \a index of \a array if the budget allows for another item.
+ */
+static bool bookmark_copy_array_element(bookmark_copy_context_t *context, const bookmark_item_t *array, uint32_t index, bookmark_item_t *element)
+{
+    if (context->remaining_items == 0 || bookmark_get_array_element(context->bookmark, array, index, element) != 0)
+        return false;
+    --context->remaining_items;
+    return true;
+}
+
+static uint64_t bookmark_read_le(const unsigned char *p, size_t size)
+{
+    uint64_t value = 0;
+    for (size_t i = size; i > 0; --i)
+        value = (value << 8) | p[i - 1];
+    return value;
+}
+
+template <typename T, typename U>
+static T bookmark_bit_cast(U bits)
+{
+    static_assert(sizeof(T) == sizeof(U), "size mismatch");
+    T value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+/*!
+ * Returns where \a size bytes at \a offset past the header start, or NULL if
+ * they do not lie entirely within the bookmark.
+ */
+static const unsigned char *bookmark_at(const bookmark_t *bookmark, uint64_t offset, uint64_t size)
+{
+    const uint64_t start = bookmark->header_size + offset;
+    if (start > bookmark->size || size > bookmark->size - start)
+        return nullptr;
+    return bookmark->data + start;
+}
+
+int bookmark_open(bookmark_t *bookmark, const unsigned char *data, size_t size)
+{
+    assert(bookmark);
+    memset(bookmark, 0, sizeof(*bookmark));
+
+    if (!data || size < 4 * sizeof(uint32_t))
+        return 1;
+
+    const uint32_t header_size = static_cast<uint32_t>(bookmark_read_le(data + 12, sizeof(uint32_t)));
+    if (header_size < 4 * sizeof(uint32_t) || header_size > size || size - header_size < sizeof(uint32_t))
+        return 1;
+
+    bookmark->data = data;
+    bookmark->size = size;
+    bookmark->magic = uint32_from_be(data);
+    bookmark->bookmark_size = static_cast<uint32_t>(bookmark_read_le(data + 4, sizeof(uint32_t)));
+    bookmark->unknown = static_cast<uint32_t>(bookmark_read_le(data + 8, sizeof(uint32_t)));
+    bookmark->header_size = header_size;
+    bookmark->toc_offset = static_cast<uint32_t>(bookmark_read_le(data + header_size, sizeof(uint32_t)));
+    return 0;
+}
+
+static int bookmark_read_toc(const bookmark_t *bookmark, uint32_t offset, uint32_t index, bookmark_toc_t *toc)
+{
+    const unsigned char *p = bookmark_at(bookmark, offset, bookmark_toc_header_size);
+    if (!p)
+        return -1;
+
+    bookmark_toc_t result;
+    result.offset = offset;
+    result.index = index;
+    result.size = static_cast<uint32_t>(bookmark_read_le(p, sizeof(uint32_t)));
+    result.magic = static_cast<uint32_t>(bookmark_read_le(p + 4, sizeof(uint32_t)));
+    result.identifier = static_cast<uint32_t>(bookmark_read_le(p + 8, sizeof(uint32_t)));
+    result.next_toc_offset = static_cast<uint32_t>(bookmark_read_le(p + 12, sizeof(uint32_t)));
+    result.count = static_cast<uint32_t>(bookmark_read_le(p + 16, sizeof(uint32_t)));
+
+    // Checking the entries here lets bookmark_get_toc_entry trust the count
+    if (!bookmark_at(bookmark, uint64_t(offset) + bookmark_toc_header_size, uint64_t(result.count) * bookmark_toc_entry_size))
+        return -1;
+
+    *toc = result;
+    return 1;
+}
+
+int bookmark_first_toc(const bookmark_t *bookmark, bookmark_toc_t *toc)
+{
+    assert(bookmark);
+    assert(toc);
+
+    if (bookmark->toc_offset == 0)
+        return 0;
+
+    return bookmark_read_toc(bookmark, bookmark->toc_offset, 0, toc);
+}
+
+int bookmark_next_toc(const bookmark_t *bookmark, const bookmark_toc_t *toc, bookmark_toc_t *next)
+{
+    assert(bookmark);
+    assert(toc);
+    assert(next);
+
+    if (toc->next_toc_offset == 0)
+        return 0;
+
+    // Distinct tables of contents cannot outnumber the headers that fit in
+    // the bookmark, so a longer chain has to loop
+    if (toc->next_toc_offset == toc->offset || toc->index + 1 > bookmark->size / bookmark_toc_header_size)
+        return -1;
+
+    return bookmark_read_toc(bookmark, toc->next_toc_offset, toc->index + 1, next);
+}
+
+int bookmark_get_toc_entry(const bookmark_t *bookmark, const bookmark_toc_t *toc, uint32_t index, bookmark_toc_entry_t *entry)
+{
+    assert(bookmark);
+    assert(toc);
+    assert(entry);
+
+    if (index >= toc->count)
+        return 1;
+
+    const unsigned char *p = bookmark_at(bookmark, uint64_t(toc->offset) + bookmark_toc_header_size + uint64_t(index) * bookmark_toc_entry_size, bookmark_toc_entry_size);
+    if (!p)
+        return 1;
+
+    entry->key = static_cast<uint32_t>(bookmark_read_le(p, sizeof(uint32_t)));
+    entry->offset = static_cast<uint32_t>(bookmark_read_le(p + 4, sizeof(uint32_t)));
+    entry->reserved = static_cast<uint32_t>(bookmark_read_le(p + 8, sizeof(uint32_t)));
+    return 0;
+}
+
+int bookmark_get_item(const bookmark_t *bookmark, uint32_t offset, bookmark_item_t *item)
+{
+    assert(bookmark);
+    assert(item);
+
+    const unsigned char *p = bookmark_at(bookmark, offset, bookmark_item_header_size);
+    if (!p)
+        return 1;
+
+    item->length = static_cast<uint32_t>(bookmark_read_le(p, sizeof(uint32_t)));
+    item->type = static_cast<uint32_t>(bookmark_read_le(p + 4, sizeof(uint32_t)));
+    item->value = p + bookmark_item_header_size;
+    item->value_size = std::min<size_t>(item->length, static_cast<size_t>(bookmark->data + bookmark->size - item->value));
+    return 0;
+}
+
+static bool bookmark_item_is_array(const bookmark_item_t *item)
+{
+    return item->type == pBBk_array && item->length % sizeof(uint32_t) == 0 && item->value_size == item->length;
+}
+
+int bookmark_get_array_element(const bookmark_t *bookmark, const bookmark_item_t *array, uint32_t index, bookmark_item_t *element)
+{
+    assert(bookmark);
+    assert(array);
+    assert(element);
+
+    if (!bookmark_item_is_array(array) || index >= array->length / sizeof(uint32_t))
+        return 1;
+
+    const uint32_t offset = static_cast<uint32_t>(bookmark_read_le(array->value + index * sizeof(uint32_t), sizeof(uint32_t)));
+    return bookmark_get_item(bookmark, offset, element);
+}
+
+int bookmark_find(const bookmark_t *bookmark, uint32_t key, bookmark_item_t *item)
+{
+    assert(bookmark);
+    assert(item);
+
+    bookmark_toc_t toc;
+    int status;
+    for (status = bookmark_first_toc(bookmark, &toc); status > 0; status = bookmark_next_toc(bookmark, &toc, &toc)) {
+        bookmark_toc_entry_t entry;
+        for (uint32_t i = 0; bookmark_get_toc_entry(bookmark, &toc, i, &entry) == 0; ++i) {
+            if (entry.key == key)
+                return bookmark_get_item(bookmark, entry.offset, item) == 0 ? 1 : -1;
+        }
+    }
+
+    return status;
+}
+
+/*!
+ * Reads the fixed-size value of a scalar item, returning false if the item
+ * is too short to hold one.
+ */
+static bool bookmark_item_scalar(const bookmark_item_t *item, size_t size, uint64_t *bits)
+{
+    if (item->value_size < size)
+        return false;
+    *bits = bookmark_read_le(item->value, size);
+    return true;
+}
+
+static const char *bookmark_item_type_name(pBBK_data_type data_type)
+{
+    switch (data_type) {
+        case pBBk_string: return "string";
+        case pBBk_data: return "data";
+        case pBBk_int8: return "int8";
+        case pBBk_int16: return "int16";
+        case pBBk_int32: return "int32";
+        case pBBk_int64: return "int64";
+        case pBBk_float32: return "float32";
+        case pBBk_float64: return "float64";
+        case pBBk_date: return "date";
+        case pBBk_false:
+        case pBBk_true: return "bool";
+        case pBBk_array: return "array";
+        case pBBk_uuid: return "uuid";
+        case pBBk_url: return "url";
+        default: return nullptr;
+    }
+}
+
+static amg::value bookmark_copy_item_value(bookmark_copy_context_t *context, const bookmark_item_t *item, size_t depth)
+{
+    amg::value entry = amg::value::map();
+    const pBBK_data_type data_type = pBBK_data_type(item->type);
+    const char *type_name = bookmark_item_type_name(data_type);
+
+    uint64_t bits;
+    switch (data_type) {
+        case pBBk_string:
+        case pBBk_url:
+            entry.set("data.type", type_name);
+            entry.set("data.value", std::string(reinterpret_cast<const char *>(item->value), item->value_size));
+            return entry;
+        case pBBk_int8:
+            if (!bookmark_item_scalar(item, sizeof(int8_t), &bits))
+                break;
+            entry.set("data.type", type_name);
+            entry.set("data.value", static_cast<int8_t>(bits));
+            return entry;
+        case pBBk_int16:
+            if (!bookmark_item_scalar(item, sizeof(int16_t), &bits))
+                break;
+            entry.set("data.type", type_name);
+            entry.set("data.value", static_cast<int16_t>(bits));
+            return entry;
+        case pBBk_int32:
+            if (!bookmark_item_scalar(item, sizeof(int32_t), &bits))
+                break;
+            entry.set("data.type", type_name);
+            entry.set("data.value", static_cast<int32_t>(bits));
+            return entry;
+        case pBBk_int64:
+            if (!bookmark_item_scalar(item, sizeof(int64_t), &bits))
+                break;
+            entry.set("data.type", type_name);
+            entry.set("data.value", static_cast<int64_t>(bits));
+            return entry;
+        case pBBk_float32:
+            if (!bookmark_item_scalar(item, sizeof(float), &bits))
+                break;
+            entry.set("data.type", type_name);
+            entry.set("data.value", static_cast<double>(bookmark_bit_cast<float>(static_cast<uint32_t>(bits))));
+            return entry;
+        case pBBk_float64:
+            if (!bookmark_item_scalar(item, sizeof(double), &bits))
+                break;
+            entry.set("data.type", type_name);
+            entry.set("data.value", bookmark_bit_cast<double>(bits));
+            return entry;
+        case pBBk_date:
+            // Unlike everything else in a bookmark, dates are big-endian
+            if (item->value_size < sizeof(double))
+                break;
+            entry.set("data.type", type_name);
+            entry.set("data.value", amg::value::date(bookmark_bit_cast<double>(uint64_from_be(item->value))));
+            return entry;
+        case pBBk_false:
+        case pBBk_true:
+            entry.set("data.type", type_name);
+            entry.set("data.value", data_type == pBBk_true);
+            return entry;
+        case pBBk_array:
+            if (!bookmark_item_is_array(item) || depth >= bookmark_max_depth)
+                break;
+            entry.set("data.type", type_name);
+            {
+                amg::value &arr = entry.set("data.value", amg::value::array());
+                bookmark_item_t element;
+                for (uint32_t k = 0; bookmark_copy_array_element(context, item, k, &element); ++k)
+                    arr.append(bookmark_copy_item_value(context, &element, depth + 1));
+            }
+            return entry;
+        default:
+            break;
+    }
+
+    if (data_type == pBBk_data || data_type == pBBk_uuid)
+        entry.set("data.type", type_name);
+    else
+        entry.set("data.type", item->type);
+    entry.set("data.value", amg::value::data(item->value, item->value_size));
+    return entry;
+}
+
+int bookmark_copy_value(const bookmark_t *bookmark, amg::value *value)
+{
+    assert(bookmark);
+    assert(value);
+
+    *value = amg::value::map();
+    value->set("magic", amg::fourcc_string(bookmark->magic));
+    value->set("bookmark_size", bookmark->bookmark_size);
+    value->set("unknown", bookmark->unknown);
+    value->set("header_size", bookmark->header_size);
+    value->set("toc_offset", bookmark->toc_offset);
+
+    amg::value &tocs = value->set("tocs", amg::value::array());
+    bookmark_copy_context_t context = bookmark_copy_context(bookmark);
+    bookmark_toc_t toc;
+    int status;
+    for (status = bookmark_first_toc(bookmark, &toc); status > 0; status = bookmark_next_toc(bookmark, &toc, &toc)) {
+        amg::value &toc_value = tocs.append(amg::value::map());
+        toc_value.set("size", toc.size);
+        toc_value.set("magic", toc.magic);
+        toc_value.set("identifier", toc.identifier);
+        toc_value.set("next_toc_offset", toc.next_toc_offset);
+
+        amg::value &entries = toc_value.set("entries", amg::value::array());
+        bookmark_toc_entry_t toc_entry;
+        for (uint32_t i = 0; bookmark_get_toc_entry(bookmark, &toc, i, &toc_entry) == 0; ++i) {
+            bookmark_item_t item;
+            if (bookmark_get_item(bookmark, toc_entry.offset, &item) != 0) {
+                status = -1;
+                continue;
+            }
+
+            amg::value &entry = entries.append(bookmark_copy_item_value(&context, &item, 0));
+            entry.set("key", toc_entry.key);
+            entry.set("offset", toc_entry.offset);
+            entry.set("reserved", toc_entry.reserved);
+            entry.set("data.length", item.length);
+        }
+
+        if (status < 0)
+            break;
+    }
+
+    return status < 0 ? 1 : 0;
+}
+
+#if AMG_HAVE_COREFOUNDATION
+static CFMutableDictionaryRef bookmark_copy_item_dictionary(bookmark_copy_context_t *context, const bookmark_item_t *item, size_t depth)
+{
+    CFMutableDictionaryRef entry(CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
+                                                           &kCFTypeDictionaryKeyCallBacks,
+                                                           &kCFTypeDictionaryValueCallBacks));
+
+    const pBBK_data_type data_type = pBBK_data_type(item->type);
+    const char *type_name = bookmark_item_type_name(data_type);
+    AMCFTypeRef<CFStringRef> type_string(type_name ? CFStringCreateWithCString(kCFAllocatorDefault, type_name, kCFStringEncodingUTF8) : NULL);
+
+    uint64_t bits;
+    switch (data_type) {
+        case pBBk_string:
+        case pBBk_url:
+            CFDictionarySetValue(entry, CFSTR("data.type"), type_string);
+            AMGCFDictionarySetUTF8StringValue(entry, CFSTR("data.value"),
+                                              reinterpret_cast<const char *>(item->value),
+                                              item->value_size);
+            return entry;
+        case pBBk_int8:
+            if (!bookmark_item_scalar(item, sizeof(int8_t), &bits))
+                break;
+            CFDictionarySetValue(entry, CFSTR("data.type"), type_string);
+            AMGCFDictionarySetSInt8Value(entry, CFSTR("data.value"), static_cast<int8_t>(bits));
+            return entry;
+        case pBBk_int16:
+            if (!bookmark_item_scalar(item, sizeof(int16_t), &bits))
+                break;
+            CFDictionarySetValue(entry, CFSTR("data.type"), type_string);
+            AMGCFDictionarySetSInt16Value(entry, CFSTR("data.value"), static_cast<int16_t>(bits));
+            return entry;
+        case pBBk_int32:
+            if (!bookmark_item_scalar(item, sizeof(int32_t), &bits))
+                break;
+            CFDictionarySetValue(entry, CFSTR("data.type"), type_string);
+            AMGCFDictionarySetSInt32Value(entry, CFSTR("data.value"), static_cast<int32_t>(bits));
+            return entry;
+        case pBBk_int64:
+            if (!bookmark_item_scalar(item, sizeof(int64_t), &bits))
+                break;
+            CFDictionarySetValue(entry, CFSTR("data.type"), type_string);
+            AMGCFDictionarySetSInt64Value(entry, CFSTR("data.value"), static_cast<int64_t>(bits));
+            return entry;
+        case pBBk_float32:
+            if (!bookmark_item_scalar(item, sizeof(float), &bits))
+                break;
+            CFDictionarySetValue(entry, CFSTR("data.type"), type_string);
+            AMGCFDictionarySetFloat32Value(entry, CFSTR("data.value"), bookmark_bit_cast<float>(static_cast<uint32_t>(bits)));
+            return entry;
+        case pBBk_float64:
+            if (!bookmark_item_scalar(item, sizeof(double), &bits))
+                break;
+            CFDictionarySetValue(entry, CFSTR("data.type"), type_string);
+            AMGCFDictionarySetFloat64Value(entry, CFSTR("data.value"), bookmark_bit_cast<double>(bits));
+            return entry;
+        case pBBk_date:
+            if (item->value_size < sizeof(double))
+                break;
+            CFDictionarySetValue(entry, CFSTR("data.type"), type_string);
+            AMGCFDictionarySetCFDateValue(entry, CFSTR("data.value"), bookmark_bit_cast<double>(uint64_from_be(item->value)));
+            return entry;
+        case pBBk_false:
+        case pBBk_true:
+            CFDictionarySetValue(entry, CFSTR("data.type"), type_string);
+            CFDictionarySetValue(entry, CFSTR("data.value"), data_type == pBBk_true ? kCFBooleanTrue : kCFBooleanFalse);
+            return entry;
+        case pBBk_array:
+            if (!bookmark_item_is_array(item) || depth >= bookmark_max_depth)
+                break;
+            CFDictionarySetValue(entry, CFSTR("data.type"), type_string);
+            {
+                AMCFTypeRef<CFMutableArrayRef> arr(CFArrayCreateMutable(kCFAllocatorDefault, 0, &kCFTypeArrayCallBacks));
+                bookmark_item_t element;
+                for (uint32_t k = 0; bookmark_copy_array_element(context, item, k, &element); ++k)
+                    CFArrayAppendValue(arr, AMCFTypeRef<CFMutableDictionaryRef>(bookmark_copy_item_dictionary(context, &element, depth + 1)));
+                CFDictionarySetValue(entry, CFSTR("data.value"), arr);
+            }
+            return entry;
+        default:
+            break;
+    }
+
+    if (data_type == pBBk_data || data_type == pBBk_uuid)
+        CFDictionarySetValue(entry, CFSTR("data.type"), type_string);
+    else
+        AMGCFDictionarySetIntValue(entry, CFSTR("data.type"), item->type);
+    CFDictionarySetValue(entry, CFSTR("data.value"),
+                         AMCFTypeRef<CFDataRef>(CFDataCreate(kCFAllocatorDefault,
+                                                             reinterpret_cast<const UInt8 *>(item->value),
+                                                             static_cast<CFIndex>(item->value_size))));
+    return entry;
+}
+
+CFDictionaryRef bookmark_copy_dictionary(const bookmark_t *bookmark)
+{
+    assert(bookmark);
+
+    CFMutableDictionaryRef pbbk(CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
+                                                          &kCFTypeDictionaryKeyCallBacks,
+                                                          &kCFTypeDictionaryValueCallBacks));
+
+    AMGCFDictionarySetFourCCValue(pbbk, CFSTR("magic"), bookmark->magic);
+    AMGCFDictionarySetIntValue(pbbk, CFSTR("bookmark_size"), bookmark->bookmark_size);
+    AMGCFDictionarySetIntValue(pbbk, CFSTR("unknown"), bookmark->unknown);
+    AMGCFDictionarySetIntValue(pbbk, CFSTR("header_size"), bookmark->header_size);
+    AMGCFDictionarySetIntValue(pbbk, CFSTR("toc_offset"), bookmark->toc_offset);
+
+    AMCFTypeRef<CFMutableArrayRef> tocs(CFArrayCreateMutable(kCFAllocatorDefault, 0, &kCFTypeArrayCallBacks));
+    bookmark_copy_context_t context = bookmark_copy_context(bookmark);
+    bookmark_toc_t toc;
+    for (int status = bookmark_first_toc(bookmark, &toc); status > 0; status = bookmark_next_toc(bookmark, &toc, &toc)) {
+        AMCFTypeRef<CFMutableDictionaryRef> toc_dict(CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
+                                                                               &kCFTypeDictionaryKeyCallBacks,
+                                                                               &kCFTypeDictionaryValueCallBacks));
+
+        AMGCFDictionarySetIntValue(toc_dict, CFSTR("size"), toc.size);
+        AMGCFDictionarySetIntValue(toc_dict, CFSTR("magic"), toc.magic);
+        AMGCFDictionarySetIntValue(toc_dict, CFSTR("identifier"), toc.identifier);
+        AMGCFDictionarySetIntValue(toc_dict, CFSTR("next_toc_offset"), toc.next_toc_offset);
+
+        AMCFTypeRef<CFMutableArrayRef> entries(CFArrayCreateMutable(kCFAllocatorDefault, 0, &kCFTypeArrayCallBacks));
+        bookmark_toc_entry_t toc_entry;
+        for (uint32_t i = 0; bookmark_get_toc_entry(bookmark, &toc, i, &toc_entry) == 0; ++i) {
+            bookmark_item_t item;
+            if (bookmark_get_item(bookmark, toc_entry.offset, &item) != 0)
+                continue;
+
+            AMCFTypeRef<CFMutableDictionaryRef> entry(bookmark_copy_item_dictionary(&context, &item, 0));
+            AMGCFDictionarySetIntValue(entry, CFSTR("key"), toc_entry.key);
+            AMGCFDictionarySetIntValue(entry, CFSTR("offset"), toc_entry.offset);
+            AMGCFDictionarySetIntValue(entry, CFSTR("reserved"), toc_entry.reserved);
+            AMGCFDictionarySetIntValue(entry, CFSTR("data.length"), item.length);
+            CFArrayAppendValue(entries, entry);
+        }
+
+        CFDictionarySetValue(toc_dict, CFSTR("entries"), entries);
+        CFArrayAppendValue(tocs, toc_dict);
+    }
+
+    CFDictionarySetValue(pbbk, CFSTR("tocs"), tocs);
+    return pbbk;
+}
+#endif
@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2015 Jake Petroules. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AMALGAMATE_BOOKMARK_H
+#define AMALGAMATE_BOOKMARK_H
+
+#include "amgexport.h"
+#include "amgplatform.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+#include "amgvalue.h"
+#endif
+
+/*!
+ * A bookmark ("book"), as stored in 'pBBk' records, read in place. Opening
+ * one only reads the header; tables of contents, their entries and the items
+ * they refer to are located and bounds-checked one at a time when asked for,
+ * so there is no limit on how many of them a bookmark has. The data must
+ * outlive the bookmark.
+ *
+ * Item offsets, and the offsets of tables of contents, are relative to the
+ * end of the header.
+ */
+typedef struct {
+    const unsigned char *data;
+    size_t size;
+    uint32_t magic;
+    uint32_t bookmark_size;
+    uint32_t unknown; // 0x10040000
+    uint32_t header_size;
+    uint32_t toc_offset;
+} bookmark_t;
+
+/*!
+ * A table of contents. \c offset is where it was read from, and \c index its
+ * position in the chain that starts at the bookmark's \c toc_offset.
+ */
+typedef struct {
+    uint32_t offset;
+    uint32_t index;
+    uint32_t size;
+    uint32_t magic;
+    uint32_t identifier;
+    uint32_t next_toc_offset;
+    uint32_t count;
+} bookmark_toc_t;
+
+typedef struct {
+    uint32_t key;
+    uint32_t offset;
+    uint32_t reserved; // 0x000000
+} bookmark_toc_entry_t;
+
+/*!
+ * An item: \c length is the length recorded in the bookmark, and \c value
+ * points at the \c value_size bytes of it that lie within the bookmark.
+ */
+typedef struct {
+    uint32_t length;
+    uint32_t type;
+    const unsigned char *value;
+    size_t value_size;
+} bookmark_item_t;
+
+typedef enum {
+    pBBk_string = 0x0101,
+    pBBk_data = 0x0201,
+    pBBk_int8 = 0x0301,
+    pBBk_int16 = 0x0302,
+    pBBk_int32 = 0x0303,
+    pBBk_int64 = 0x0304,
+    pBBk_float32 = 0x0305,
+    pBBk_float64 = 0x0306,
+    pBBk_date = 0x0400,
+    pBBk_false = 0x0500,
+    pBBk_true = 0x0501,
+    pBBk_array = 0x0601,
+    pBBk_dictionary = 0x0701,
+    pBBk_uuid = 0x0801,
+    pBBk_url = 0x0901,
+    pBBk_url_relative = 0x0902,
+} pBBK_data_type;
+
+/*!
+ * Reads the header of \a data. Returns 0 on success, or 1 if \a data is too
+ * short to be a bookmark or its header size is out of range.
+ */
+AMG_EXPORT AMG_EXTERN int bookmark_open(bookmark_t *bookmark, const unsigned char *data, size_t size);
+
+/*!
+ * Reads the first table of contents, or the one after \a toc. Returns 1 if
+ * there is one, 0 at the end of the chain, or -1 if it lies outside the
+ * bookmark or the chain loops.
+ */
+AMG_EXPORT AMG_EXTERN int bookmark_first_toc(const bookmark_t *bookmark, bookmark_toc_t *toc);
+AMG_EXPORT AMG_EXTERN int bookmark_next_toc(const bookmark_t *bookmark, const bookmark_toc_t *toc, bookmark_toc_t *next);
+
+/*!
+ * Reads entry \a index of \a toc. Returns 0 on success, or 1 if it is out of
+ * range.
+ */
+AMG_EXPORT AMG_EXTERN int bookmark_get_toc_entry(const bookmark_t *bookmark, const bookmark_toc_t *toc, uint32_t index, bookmark_toc_entry_t *entry);
+
+/*!
+ * Reads the item at \a offset. Returns 0 on success, or 1 if its header lies
+ * outside the bookmark.
+ */
+AMG_EXPORT AMG_EXTERN int bookmark_get_item(const bookmark_t *bookmark, uint32_t offset, bookmark_item_t *item);
+
+/*!
+ * Reads element \a index of an array item. Returns 0 on success, or 1 if
+ * \a array is not an array, \a index is out of range or the element is
+ * malformed.
+ */
+AMG_EXPORT AMG_EXTERN int bookmark_get_array_element(const bookmark_t *bookmark, const bookmark_item_t *array, uint32_t index, bookmark_item_t *element);
+
+/*!
+ * Looks up \a key in the tables of contents in chain order. Returns 1 if it
+ * is found, 0 if it is not, or -1 if the bookmark is malformed.
+ */
+AMG_EXPORT AMG_EXTERN int bookmark_find(const bookmark_t *bookmark, uint32_t key, bookmark_item_t *item);
+
+#ifdef __cplusplus
+/*!
+ * Decodes the header and every table of contents into \a value. Tables of
+ * contents and items that are malformed are left out.
+ */
+AMG_EXPORT extern int bookmark_copy_value(const bookmark_t *bookmark, amg::value *value);
+#endif
+
+#if AMG_HAVE_COREFOUNDATION
+AMG_EXPORT AMG_EXTERN CFDictionaryRef bookmark_copy_dictionary(const bookmark_t *bookmark);
+#endif
+
+#endif // AMALGAMATE_BOOKMARK_H
@@ -0,0 +1,512 @@
+/*
+ * Copyright (c) 2015 Jake Petroules. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bplist.h"
+#include "dsio.h"
+#include <algorithm>
+#include <string.h>
+#include <vector>
+
+static const char bplist_magic[] = "bplist00";
+static const size_t bplist_trailer_size = 32;
+
+/*!
+ * Deepest container nesting bplist_copy_value follows; Finder's plists are a
+ * handful of levels deep.
+ */
+static const size_t bplist_max_depth = 256;
+
+typedef struct {
+    uint8_t marker;
+    uint8_t info;
+    uint64_t length;
+    size_t payload;
+} bplist_object_header_t;
+
+static uint64_t bplist_read_uint(const unsigned char *p, size_t size)
+{
+    uint64_t value = 0;
+    for (size_t i = 0; i < size; ++i)
+        value = (value << 8) | p[i];
+    return value;
+}
+
+int bplist_open(bplist_t *plist, const unsigned char *data, size_t size)
+{
+    assert(plist);
+    memset(plist, 0, sizeof(*plist));
+
+    const size_t magic_size = sizeof(bplist_magic) - 1;
+    if (!data || size < magic_size + bplist_trailer_size || memcmp(data, bplist_magic, magic_size) != 0)
+        return 1;
+
+    const unsigned char *trailer = data + size - bplist_trailer_size;
+    plist->data = data;
+    plist->size = size;
+    plist->offset_int_size = trailer[6];
+    plist->object_ref_size = trailer[7];
+    plist->object_count = uint64_from_be(trailer + 8);
+    plist->top_object = uint64_from_be(trailer + 16);
+    plist->offset_table_offset = uint64_from_be(trailer + 24);
+
+    const uint64_t table_limit = size - bplist_trailer_size;
+    if (plist->offset_int_size < 1 || plist->offset_int_size > 8
+        || plist->object_ref_size < 1 || plist->object_ref_size > 8
+        || plist->object_count == 0 || plist->top_object >= plist->object_count
+        || plist->offset_table_offset < magic_size || plist->offset_table_offset > table_limit
+        || plist->object_count > (table_limit - plist->offset_table_offset) / plist->offset_int_size) {
+        fprintf(stderr, "malformed binary property list trailer\n");
+        memset(plist, 0, sizeof(*plist));
+        return 1;
+    }
+
+    return 0;
+}
+
+static int bplist_read_object_header(const bplist_t *plist, uint64_t object, bplist_object_header_t *header)
+{
+    assert(plist);
+    assert(header);
+
+    if (!plist->data || object >= plist->object_count)
+        return 1;
+
+    const uint64_t offset = bplist_read_uint(plist->data + plist->offset_table_offset + object * plist->offset_int_size,
+                                             plist->offset_int_size);
+    // Objects live between the magic and the offset table
+    const uint64_t limit = plist->offset_table_offset;
+    if (offset < sizeof(bplist_magic) - 1 || offset >= limit)
+        return 1;
+
+    header->marker = plist->data[offset] >> 4;
+    header->info = plist->data[offset] & 0x0F;
+    header->length = header->info;
+    header->payload = static_cast<size_t>(offset + 1);
+
+    uint64_t payload_size = 0;
+    switch (header->marker) {
+        case 0x0:
+            return header->info == 0x0 || header->info == 0x8 || header->info == 0x9 ? 0 : 1;
+        case 0x1:
+            if (header->info > 4)
+                return 1;
+            payload_size = 1u << header->info;
+            break;
+        case 0x2:
+            if (header->info != 2 && header->info != 3)
+                return 1;
+            payload_size = 1u << header->info;
+            break;
+        case 0x3:
+            if (header->info != 3)
+                return 1;
+            payload_size = 8;
+            break;
+        case 0x8:
+            payload_size = header->info + 1u;
+            break;
+        case 0x4:
+        case 0x5:
+        case 0x6:
+        case 0x7:
+        case 0xA:
+        case 0xC:
+        case 0xD: {
+            if (header->info == 0xF) {
+                // The length follows as an integer object
+                if (header->payload >= limit)
+                    return 1;
+                const uint8_t int_marker = plist->data[header->payload];
+                const size_t int_size = size_t(1) << (int_marker & 0x0F);
+                if ((int_marker >> 4) != 0x1 || int_size > 8 || int_size > limit - header->payload - 1)
+                    return 1;
+                header->length = bplist_read_uint(plist->data + header->payload + 1, int_size);
+                header->payload += 1 + int_size;
+            }
+
+            uint64_t unit = 1;
+            if (header->marker == 0x6)
+                unit = 2;
+            else if (header->marker == 0xA || header->marker == 0xC)
+                unit = plist->object_ref_size;
+            else if (header->marker == 0xD)
+                unit = 2u * plist->object_ref_size;
+            if (header->length > (limit - header->payload) / unit)
+                return 1;
+            payload_size = header->length * unit;
+            break;
+        }
+        default:
+            return 1;
+    }
+
+    return payload_size <= limit - header->payload ? 0 : 1;
+}
+
+static int bplist_read_ref(const bplist_t *plist, size_t offset, uint64_t *object)
+{
+    *object = bplist_read_uint(plist->data + offset, plist->object_ref_size);
+    return *object < plist->object_count ? 0 : 1;
+}
+
+bplist_type bplist_get_type(const bplist_t *plist, uint64_t object)
+{
+    bplist_object_header_t header;
+    if (bplist_read_object_header(plist, object, &header) != 0)
+        return bplist_type_invalid;
+
+    switch (header.marker) {
+        case 0x0:
+            return header.info == 0x0 ? bplist_type_null : bplist_type_bool;
+        case 0x1:
+            return bplist_type_int;
+        case 0x2:
+            return bplist_type_real;
+        case 0x3:
+            return bplist_type_date;
+        case 0x4:
+            return bplist_type_data;
+        case 0x5:
+        case 0x6:
+        case 0x7:
+            return bplist_type_string;
+        case 0x8:
+            return bplist_type_uid;
+        case 0xA:
+            return bplist_type_array;
+        case 0xC:
+            return bplist_type_set;
+        case 0xD:
+            return bplist_type_dict;
+    }
+
+    return bplist_type_invalid;
+}
+
+int bplist_get_count(const bplist_t *plist, uint64_t object, uint64_t *count)
+{
+    assert(count);
+
+    bplist_object_header_t header;
+    if (bplist_read_object_header(plist, object, &header) != 0
+        || (header.marker != 0xA && header.marker != 0xC && header.marker != 0xD))
+        return 1;
+
+    *count = header.length;
+    return 0;
+}
+
+int bplist_get_element(const bplist_t *plist, uint64_t object, uint64_t index, uint64_t *element)
+{
+    assert(element);
+
+    bplist_object_header_t header;
+    if (bplist_read_object_header(plist, object, &header) != 0
+        || (header.marker != 0xA && header.marker != 0xC) || index >= header.length)
+        return 1;
+
+    return bplist_read_ref(plist, header.payload + static_cast<size_t>(index) * plist->object_ref_size, element);
+}
+
+int bplist_get_entry(const bplist_t *plist, uint64_t object, uint64_t index, uint64_t *key, uint64_t *value)
+{
+    assert(key);
+    assert(value);
+
+    bplist_object_header_t header;
+    if (bplist_read_object_header(plist, object, &header) != 0 || header.marker != 0xD || index >= header.length)
+        return 1;
+
+    const size_t key_offset = header.payload + static_cast<size_t>(index) * plist->object_ref_size;
+    const size_t value_offset = key_offset + static_cast<size_t>(header.length) * plist->object_ref_size;
+    return bplist_read_ref(plist, key_offset, key) != 0 || bplist_read_ref(plist, value_offset, value) != 0 ? 1 : 0;
+}
+
+/*!
+ * Compares a string object against a UTF-8 key. Returns 1 if they are equal,
+ * 0 if not, or -1 if the object is not a string.
+ */
+static int bplist_string_equals(const bplist_t *plist, uint64_t object, const char *key, size_t key_len)
+{
+    bplist_object_header_t header;
+    if (bplist_read_object_header(plist, object, &header) != 0)
+        return -1;
+
+    const unsigned char *payload = plist->data + header.payload;
+    switch (header.marker) {
+        case 0x5:
+        case 0x7:
+            return header.length == key_len && memcmp(payload, key, key_len) == 0 ? 1 : 0;
+        case 0x6:
+            // A string never has more UTF-16 code units than UTF-8 bytes
+            if (header.length > key_len)
+                return 0;
+            return amg::utf8_from_utf16be(payload, static_cast<size_t>(header.length)) == std::string(key, key_len) ? 1 : 0;
+        default:
+            return -1;
+    }
+}
+
+int bplist_dict_find(const bplist_t *plist, uint64_t object, const char *key, uint64_t *value)
+{
+    assert(key);
+    assert(value);
+
+    bplist_object_header_t header;
+    if (bplist_read_object_header(plist, object, &header) != 0 || header.marker != 0xD)
+        return -1;
+
+    const size_t key_len = strlen(key);
+    for (uint64_t i = 0; i < header.length; ++i) {
+        uint64_t key_object;
+        if (bplist_read_ref(plist, header.payload + static_cast<size_t>(i) * plist->object_ref_size, &key_object) != 0)
+            return -1;
+
+        const int equal = bplist_string_equals(plist, key_object, key, key_len);
+        if (equal < 0)
+            return -1;
+        if (equal > 0) {
+            const size_t value_offset = header.payload + static_cast<size_t>(header.length + i) * plist->object_ref_size;
+            return bplist_read_ref(plist, value_offset, value) == 0 ? 1 : -1;
+        }
+    }
+
+    return 0;
+}
+
+int bplist_get_bool(const bplist_t *plist, uint64_t object, bool *value)
+{
+    assert(value);
+
+    bplist_object_header_t header;
+    if (bplist_read_object_header(plist, object, &header) != 0 || header.marker != 0x0 || header.info == 0x0)
+        return 1;
+
+    *value = header.info == 0x9;
+    return 0;
+}
+
+int bplist_get_int(const bplist_t *plist, uint64_t object, int64_t *value)
+{
+    assert(value);
+
+    bplist_object_header_t header;
+    if (bplist_read_object_header(plist, object, &header) != 0 || (header.marker != 0x1 && header.marker != 0x8))
+        return 1;
+
+    const size_t size = header.marker == 0x1 ? size_t(1) << header.info : header.info + 1u;
+    // Only the low 64 bits of a 16-byte integer are kept
+    const size_t skip = size > 8 ? size - 8 : 0;
+    *value = static_cast<int64_t>(bplist_read_uint(plist->data + header.payload + skip, size - skip));
+    return 0;
+}
+
+int bplist_get_real(const bplist_t *plist, uint64_t object, double *value)
+{
+    assert(value);
+
+    bplist_object_header_t header;
+    if (bplist_read_object_header(plist, object, &header) != 0)
+        return 1;
+
+    const unsigned char *payload = plist->data + header.payload;
+    if (header.marker == 0x2 && header.info == 2) {
+        const uint32_t bits = uint32_from_be(payload);
+        float f;
+        memcpy(&f, &bits, sizeof(f));
+        *value = f;
+        return 0;
+    } else if (header.marker == 0x2 || header.marker == 0x3) {
+        const uint64_t bits = uint64_from_be(payload);
+        memcpy(value, &bits, sizeof(*value));
+        return 0;
+    } else if (header.marker == 0x1) {
+        int64_t i;
+        if (bplist_get_int(plist, object, &i) != 0)
+            return 1;
+        *value = static_cast<double>(i);
+        return 0;
+    }
+
+    return 1;
+}
+
+int bplist_get_data(const bplist_t *plist, uint64_t object, const unsigned char **bytes, size_t *size)
+{
+    assert(bytes);
+    assert(size);
+
+    bplist_object_header_t header;
+    if (bplist_read_object_header(plist, object, &header) != 0 || header.marker != 0x4)
+        return 1;
+
+    *bytes = plist->data + header.payload;
+    *size = static_cast<size_t>(header.length);
+    return 0;
+}
+
+int bplist_get_string(const bplist_t *plist, uint64_t object, std::string *value)
+{
+    assert(value);
+
+    bplist_object_header_t header;
+    if (bplist_read_object_header(plist, object, &header) != 0)
+        return 1;
+
+    const unsigned char *payload = plist->data + header.payload;
+    const size_t length = static_cast<size_t>(header.length);
+    switch (header.marker) {
+        case 0x5:
+        case 0x7:
+            value->assign(reinterpret_cast<const char *>(payload), length);
+            return 0;
+        case 0x6:
+            *value = amg::utf8_from_utf16be(payload, length);
+            return 0;
+        default:
+            return 1;
+    }
+}
+
+/*!
+ * Containers that share objects would expand exponentially, so
+ * bplist_copy_value decodes at most one object per object reference the
+ * plist has room for: as many as it can refer to without any sharing.
+ */
+typedef struct {
+    const bplist_t *plist;
+    std::vector<uint64_t> ancestors;
+    size_t remaining_objects;
+} bplist_copy_context_t;
+
+static int bplist_copy_value_core(bplist_copy_context_t *context, uint64_t object, amg::value *value)
+{
+    const bplist_t *plist = context->plist;
+    std::vector<uint64_t> &ancestors = context->ancestors;
+    if (ancestors.size() >= bplist_max_depth
+        || std::find(ancestors.begin(), ancestors.end(), object) != ancestors.end()) {
+        fprintf(stderr, "binary property list nests too deeply or refers to itself\n");
+        return 1;
+    }
+
+    if (context->remaining_objects == 0) {
+        fprintf(stderr, "binary property list refers to more objects than it can hold\n");
+        return 1;
+    }
+    --context->remaining_objects;
+
+    switch (bplist_get_type(plist, object)) {
+        case bplist_type_invalid:
+            return 1;
+        case bplist_type_null:
+            *value = amg::value();
+            return 0;
+        case bplist_type_bool: {
+            bool b;
+            if (bplist_get_bool(plist, object, &b) != 0)
+                return 1;
+            *value = b;
+            return 0;
+        }
+        case bplist_type_int:
+        case bplist_type_uid: {
+            int64_t i;
+            if (bplist_get_int(plist, object, &i) != 0)
+                return 1;
+            *value = i;
+            return 0;
+        }
+        case bplist_type_real:
+        case bplist_type_date: {
+            double d;
+            if (bplist_get_real(plist, object, &d) != 0)
+                return 1;
+            *value = bplist_get_type(plist, object) == bplist_type_date ? amg::value::date(d) : amg::value(d);
+            return 0;
+        }
+        case bplist_type_data: {
+            const unsigned char *bytes;
+            size_t size;
+            if (bplist_get_data(plist, object, &bytes, &size) != 0)
+                return 1;
+            *value = amg::value::data(bytes, size);
+            return 0;
+        }
+        case bplist_type_string: {
+            std::string s;
+            if (bplist_get_string(plist, object, &s) != 0)
+                return 1;
+            *value = std::move(s);
+            return 0;
+        }
+        case bplist_type_array:
+        case bplist_type_set: {
+            uint64_t count;
+            if (bplist_get_count(plist, object, &count) != 0)
+                return 1;
+
+            *value = amg::value::array();
+            ancestors.push_back(object);
+            for (uint64_t i = 0; i < count; ++i) {
+                uint64_t element;
+                if (bplist_get_element(plist, object, i, &element) != 0
+                    || bplist_copy_value_core(context, element, &value->append(amg::value())) != 0)
+                    return 1;
+            }
+            ancestors.pop_back();
+            return 0;
+        }
+        case bplist_type_dict: {
+            uint64_t count;
+            if (bplist_get_count(plist, object, &count) != 0)
+                return 1;
+
+            *value = amg::value::map();
+            ancestors.push_back(object);
+            for (uint64_t i = 0; i < count; ++i) {
+                uint64_t key, element;
+                std::string key_string;
+                if (bplist_get_entry(plist, object, i, &key, &element) != 0
+                    || bplist_get_string(plist, key, &key_string) != 0
+                    || bplist_copy_value_core(context, element, &value->set(key_string, amg::value())) != 0)
+                    return 1;
+            }
+            ancestors.pop_back();
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+int bplist_copy_value(const bplist_t *plist, uint64_t object, amg::value *value)
+{
+    assert(plist);
+    assert(value);
+
+    bplist_copy_context_t context;
+    context.plist = plist;
+    context.remaining_objects = plist->size / plist->object_ref_size + 1;
+    return bplist_copy_value_core(&context, object, value);
+}
@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2015 Jake Petroules. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AMALGAMATE_BPLIST_H
+#define AMALGAMATE_BPLIST_H
+
+#include "amgexport.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef __cplusplus
+#include <stdbool.h>
+#endif
+
+#ifdef __cplusplus
+#include "amgvalue.h"
+#include <string>
+#endif
+
+/*!
+ * A binary property list ("bplist00") read in place. Opening one only checks
+ * the trailer; objects are located through the offset table and decoded one
+ * at a time when asked for, so looking up a single key of a dictionary does
+ * not touch the rest of the object graph. The data must outlive the bplist.
+ *
+ * Objects are identified by their index in the offset table.
+ */
+typedef struct {
+    const unsigned char *data;
+    size_t size;
+    uint8_t offset_int_size;
+    uint8_t object_ref_size;
+    uint64_t object_count;
+    uint64_t top_object;
+    uint64_t offset_table_offset;
+} bplist_t;
+
+typedef enum {
+    bplist_type_invalid,
+    bplist_type_null,
+    bplist_type_bool,
+    bplist_type_int,
+    bplist_type_real,
+    bplist_type_date,
+    bplist_type_data,
+    bplist_type_string,
+    bplist_type_uid,
+    bplist_type_array,
+    bplist_type_set,
+    bplist_type_dict
+} bplist_type;
+
+/*!
+ * Validates the header and trailer of \a data. Returns 0 on success, or 1 if
+ * \a data is not a well-formed binary property list.
+ */
+AMG_EXPORT AMG_EXTERN int bplist_open(bplist_t *plist, const unsigned char *data, size_t size);
+
+/*!
+ * Returns the type of \a object, or bplist_type_invalid if it is out of range
+ * or its marker is not understood.
+ */
+AMG_EXPORT AMG_EXTERN bplist_type bplist_get_type(const bplist_t *plist, uint64_t object);
+
+/*!
+ * Returns the number of elements of an array or set, or of key/value pairs
+ * of a dictionary, in \a count. Returns 0 on success or 1 on error.
+ */
+AMG_EXPORT AMG_EXTERN int bplist_get_count(const bplist_t *plist, uint64_t object, uint64_t *count);
+
+/*!
+ * Returns the \a index-th element of an array or set in \a element.
+ */
+AMG_EXPORT AMG_EXTERN int bplist_get_element(const bplist_t *plist, uint64_t object, uint64_t index, uint64_t *element);
+
+/*!
+ * Returns the \a index-th key and value of a dictionary.
+ */
+AMG_EXPORT AMG_EXTERN int bplist_get_entry(const bplist_t *plist, uint64_t object, uint64_t index, uint64_t *key, uint64_t *value);
+
+/*!
+ * Looks up \a key (UTF-8) in the dictionary \a object, comparing it against
+ * the encoded keys without decoding them. Returns 1 and sets \a value if the
+ * key was found, 0 if it was not, or -1 if the dictionary is malformed.
+ */
+AMG_EXPORT AMG_EXTERN int bplist_dict_find(const bplist_t *plist, uint64_t object, const char *key, uint64_t *value);
+
+AMG_EXPORT AMG_EXTERN int bplist_get_bool(const bplist_t *plist, uint64_t object, bool *value);
+AMG_EXPORT AMG_EXTERN int bplist_get_int(const bplist_t *plist, uint64_t object, int64_t *value);
+
+/*!
+ * Returns a real or an integer, or the seconds since 2001-01-01 of a date.
+ */
+AMG_EXPORT AMG_EXTERN int bplist_get_real(const bplist_t *plist, uint64_t object, double *value);
+
+/*!
+ * Points \a bytes at the payload of a data object inside the plist.
+ */
+AMG_EXPORT AMG_EXTERN int bplist_get_data(const bplist_t *plist, uint64_t object, const unsigned char **bytes, size_t *size);
+
+#ifdef __cplusplus
+/*!
+ * Returns an ASCII or UTF-16 string object as UTF-8.
+ */
+AMG_EXPORT extern int bplist_get_string(const bplist_t *plist, uint64_t object, std::string *value);
+
+/*!
+ * Decodes \a object and everything it refers to. UIDs become integers and
+ * sets become arrays. Fails on reference cycles and on nesting deeper than
+ * any real plist needs.
+ */
+AMG_EXPORT extern int bplist_copy_value(const bplist_t *plist, uint64_t object, amg::value *value);
+#endif
+
+#endif // AMALGAMATE_BPLIST_H
@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2015 Jake Petroules. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "dsstore_p.h"
+#include <algorithm>
+#include <vector>
+
+/*!
+ * Size of the address space managed by the buddy allocator, as a power of two.
+ */
+static const uint32_t dsstore_buddy_allocator_address_bits = 31;
+
+/*!
+ * Smallest block the buddy allocator hands out, as a power of two; the file
+ * header occupies the first such block.
+ */
+static const uint32_t dsstore_buddy_allocator_min_block_bits = 5;
+
+/*!
+ * The low bits of a block address hold the block size as a power of two.
+ */
+static const uint32_t dsstore_buddy_allocator_size_mask = 0x1f;
+
+static uint32_t dsstore_buddy_allocator_log2_ceil(uint32_t size)
+{
+    uint32_t bits = 0;
+    while (bits < 32 && (1u << bits) < size)
+        ++bits;
+    return bits;
+}
+
+static void dsstore_buddy_allocator_free_list_insert(dsstore_buddy_allocator_state_t *allocator, uint32_t bits, uint32_t offset)
+{
+    // Keep each list sorted so that allocation prefers low offsets
+    std::vector<uint32_t> &offsets = allocator->free_lists[bits];
+    offsets.insert(std::upper_bound(offsets.begin(), offsets.end(), offset), offset);
+}
+
+void dsstore_buddy_allocator_init(dsstore_buddy_allocator_state_t *allocator)
+{
+    *allocator = dsstore_buddy_allocator_state_t();
+    for (uint32_t bits = dsstore_buddy_allocator_min_block_bits; bits < dsstore_buddy_allocator_address_bits; ++bits)
+        dsstore_buddy_allocator_free_list_insert(allocator, bits, 1u << bits);
+}
+
+int dsstore_buddy_allocator_alloc(dsstore_buddy_allocator_state_t *allocator, uint32_t size, uint32_t *address)
+{
+    const uint32_t bits = std::max(dsstore_buddy_allocator_log2_ceil(size), dsstore_buddy_allocator_min_block_bits);
+
+    uint32_t available = bits;
+    while (available < dsstore_buddy_allocator_address_bits && allocator->free_lists[available].empty())
+        ++available;
+
+    if (available >= dsstore_buddy_allocator_address_bits) {
+        fprintf(stderr, "no free block of size %u\n", bits < 32 ? 1u << bits : 0);
+        return 1;
+    }
+
+    const uint32_t offset = allocator->free_lists[available].front();
+    allocator->free_lists[available].erase(allocator->free_lists[available].begin());
+
+    // Split the block, returning the upper halves to the free lists
+    while (available > bits) {
+        --available;
+        dsstore_buddy_allocator_free_list_insert(allocator, available, offset + (1u << available));
+    }
+
+    *address = offset | bits;
+    return 0;
+}
+
+int dsstore_buddy_allocator_free(dsstore_buddy_allocator_state_t *allocator, uint32_t address)
+{
+    uint32_t bits = address & dsstore_buddy_allocator_size_mask;
+    uint32_t offset = address & ~dsstore_buddy_allocator_size_mask;
+
+    if (bits < dsstore_buddy_allocator_min_block_bits || bits >= dsstore_buddy_allocator_address_bits || offset == 0 || (offset & ((1u << bits) - 1)) != 0) {
+        fprintf(stderr, "cannot free invalid block address 0x%08x\n", address);
+        return 1;
+    }
+
+    // Merge with the buddy for as long as it is free too; the lists are
+    // short enough that a linear search beats keeping an index of them
+    while (bits + 1 < dsstore_buddy_allocator_address_bits) {
+        const uint32_t buddy = offset ^ (1u << bits);
+        std::vector<uint32_t> &offsets = allocator->free_lists[bits];
+        const std::vector<uint32_t>::iterator it = std::find(offsets.begin(), offsets.end(), buddy);
+        if (it == offsets.end())
+            break;
+
+        offsets.erase(it);
+        offset = std::min(offset, buddy);
+        ++bits;
+    }
+
+    dsstore_buddy_allocator_free_list_insert(allocator, bits, offset);
+    return 0;
+}
+
+uint32_t dsstore_buddy_allocator_extent(const dsstore_buddy_allocator_state_t *allocator)
+{
+    uint32_t end = 1u << dsstore_buddy_allocator_min_block_bits;
+    for (size_t i = 0; i < allocator->block_addresses.size(); ++i) {
+        const uint32_t addr = allocator->block_addresses[i];
+        if (addr != 0)
+            end = std::max(end, dsstore_buddy_allocator_state_block_address_offset(addr) + dsstore_buddy_allocator_state_block_address_size(addr));
+    }
+    return end;
+}
+
+int dsstore_buddy_allocator_check(const dsstore_buddy_allocator_state_t *allocator)
+{
+    typedef struct {
+        uint32_t offset;
+        uint32_t bits;
+        int32_t block_number; // -1 for the file header, -2 for free space
+    } extent_t;
+
+    std::vector<extent_t> extents;
+    extent_t header = { 0, dsstore_buddy_allocator_min_block_bits, -1 };
+    extents.push_back(header);
+
+    for (size_t i = 0; i < allocator->block_addresses.size(); ++i) {
+        const uint32_t addr = allocator->block_addresses[i];
+        if (addr != 0) {
+            extent_t extent = { addr & ~dsstore_buddy_allocator_size_mask, addr & dsstore_buddy_allocator_size_mask, static_cast<int32_t>(i) };
+            extents.push_back(extent);
+        }
+    }
+
+    for (uint32_t bits = 0; bits < sizeof(allocator->free_lists) / sizeof(allocator->free_lists[0]); ++bits) {
+        for (size_t i = 0; i < allocator->free_lists[bits].size(); ++i) {
+            extent_t extent = { allocator->free_lists[bits][i], bits, -2 };
+            extents.push_back(extent);
+        }
+    }
+
+    for (size_t i = 0; i < extents.size(); ++i) {
+        const extent_t &e = extents[i];
+        if (e.bits < dsstore_buddy_allocator_min_block_bits || e.bits >= dsstore_buddy_allocator_address_bits || (e.offset & ((1u << e.bits) - 1)) != 0) {
+            fprintf(stderr, "block %d at offset 0x%08x has invalid size 2^%u\n", e.block_number, e.offset, e.bits);
+            return 1;
+        }
+    }
+
+    std::sort(extents.begin(), extents.end(), [](const extent_t &a, const extent_t &b) { return a.offset < b.offset; });
+
+    for (size_t i = 1; i < extents.size(); ++i) {
+        const extent_t &prev = extents[i - 1];
+        if (static_cast<uint64_t>(prev.offset) + (1u << prev.bits) > extents[i].offset) {
+            fprintf(stderr, "block %d at offset 0x%08x overlaps block %d at offset 0x%08x\n",
+                    prev.block_number, prev.offset, extents[i].block_number, extents[i].offset);
+            return 1;
+        }
+    }
+
+    return 0;
+}
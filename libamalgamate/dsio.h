@@ -29,8 +29,24 @@
 #include <memory.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <arpa/inet.h>
 
+#ifndef __APPLE__
+#ifndef _OSSwapInt32
+#define _OSSwapInt32(n) __builtin_bswap32(n)
+#endif
+#ifndef ntohll
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define ntohll(n) (n)
+#define htonll(n) (n)
+#else
+#define ntohll(n) __builtin_bswap64(n)
+#define htonll(n) __builtin_bswap64(n)
+#endif
+#endif
+#endif
+
 #define ltohs(n) (ntohs(0x0102) == 0x0102 ? _OSSwapInt32(n) : n)
 #define ltohl(n) (ntohl(0x01020304) == 0x01020304 ? _OSSwapInt32(n) : n)
 #define ltohll(n) (ntohl(0x0102030405060708) == 0x0102030405060708 ? _OSSwapInt32(n) : n)
@@ -117,6 +133,89 @@ inline static const unsigned char *read_data_from(const unsigned char *p, unsign
     return p + size;
 }
 
+/*!
+ * A read-only cursor over an in-memory buffer, such as a memory-mapped file.
+ * The mread_* functions mirror their fread_* counterparts, returning the
+ * number of elements read and never reading past the end of the buffer.
+ */
+typedef struct {
+    const unsigned char *data;
+    size_t size;
+    size_t offset;
+} ds_membuf_t;
+
+inline static ds_membuf_t ds_membuf_make(const unsigned char *data, size_t size)
+{
+    ds_membuf_t buf;
+    buf.data = data;
+    buf.size = size;
+    buf.offset = 0;
+    return buf;
+}
+
+inline static const unsigned char *ds_membuf_ptr(const ds_membuf_t *buf)
+{
+    assert(buf);
+    return buf->data + buf->offset;
+}
+
+inline static size_t ds_membuf_remaining(const ds_membuf_t *buf)
+{
+    assert(buf);
+    return buf->offset < buf->size ? buf->size - buf->offset : 0;
+}
+
+inline static int mseek(ds_membuf_t *buf, size_t offset)
+{
+    assert(buf);
+    if (offset > buf->size)
+        return -1;
+    buf->offset = offset;
+    return 0;
+}
+
+inline static size_t mread(void *ptr, size_t size, size_t nitems, ds_membuf_t *buf)
+{
+    assert(buf);
+    if (size == 0)
+        return 0;
+    const size_t n = ds_membuf_remaining(buf) / size < nitems ? ds_membuf_remaining(buf) / size : nitems;
+    if (ptr)
+        memcpy(ptr, ds_membuf_ptr(buf), n * size);
+    buf->offset += n * size;
+    return n;
+}
+
+inline static size_t mread_uint8(uint8_t *value, ds_membuf_t *buf)
+{
+    assert(value);
+    return mread(value, sizeof(*value), 1, buf);
+}
+
+inline static size_t mread_uint16_be(uint16_t *value, ds_membuf_t *buf)
+{
+    assert(value);
+    size_t count = mread(value, sizeof(*value), 1, buf);
+    *value = ntohs(*value);
+    return count;
+}
+
+inline static size_t mread_uint32_be(uint32_t *value, ds_membuf_t *buf)
+{
+    assert(value);
+    size_t count = mread(value, sizeof(*value), 1, buf);
+    *value = ntohl(*value);
+    return count;
+}
+
+inline static size_t mread_uint64_be(uint64_t *value, ds_membuf_t *buf)
+{
+    assert(value);
+    size_t count = mread(value, sizeof(*value), 1, buf);
+    *value = ntohll(*value);
+    return count;
+}
+
 inline static size_t fread_uint8(uint8_t *value, FILE *file)
 {
     assert(value);
@@ -182,6 +281,50 @@ inline static size_t fwrite_uint64_be(uint64_t *value, FILE *file)
     return fwrite(&value_n, sizeof(value_n), 1, file);
 }
 
+#ifdef __cplusplus
+#include <vector>
+
+/*!
+ * The mwrite_* functions append big-endian values to a growable buffer, for
+ * building page and file images in memory before writing them out at once.
+ */
+inline static void mwrite(const void *ptr, size_t size, std::vector<unsigned char> &buf)
+{
+    const unsigned char *p = static_cast<const unsigned char *>(ptr);
+    buf.insert(buf.end(), p, p + size);
+}
+
+inline static void mwrite_uint8(uint8_t value, std::vector<unsigned char> &buf)
+{
+    buf.push_back(value);
+}
+
+inline static void mwrite_uint16_be(uint16_t value, std::vector<unsigned char> &buf)
+{
+    const uint16_t value_n = htons(value);
+    mwrite(&value_n, sizeof(value_n), buf);
+}
+
+inline static void mwrite_uint32_be(uint32_t value, std::vector<unsigned char> &buf)
+{
+    const uint32_t value_n = htonl(value);
+    mwrite(&value_n, sizeof(value_n), buf);
+}
+
+inline static void mwrite_uint64_be(uint64_t value, std::vector<unsigned char> &buf)
+{
+    const uint64_t value_n = htonll(value);
+    mwrite(&value_n, sizeof(value_n), buf);
+}
+
+inline static void uint32_to_be(unsigned char *p, uint32_t value)
+{
+    assert(p);
+    const uint32_t value_n = htonl(value);
+    memcpy(p, &value_n, sizeof(value_n));
+}
+#endif
+
 #undef ltohs
 #undef ltohl
 #undef ltohll
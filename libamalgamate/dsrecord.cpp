@@ -23,189 +23,76 @@
  */
 
 #include "alias.h"
+#include "amgdecodecache.h"
+#include "amgtrace.h"
+#include "bplist.h"
 #include "dsio.h"
+#include "amgunicode.h"
 #include "dsrecord_p.h"
+#include <fnmatch.h>
+#include <string.h>
+#include <algorithm>
+
+#if AMG_HAVE_COREFOUNDATION
 #include "amgmemory.h"
 #include "cfutils.h"
 
 // HACK
 #include "amgdump.h"
+#endif
 
 _ds_record::_ds_record()
-: filename(), record_type(), data_type(), data(), data_blob(), data_ustr(), data_plist(), data_plist_ustr()
+: filename(), filename_utf8(), filename_utf8_valid(), record_type(), data_type(), data(), data_blob(), data_ustr()
+#if AMG_HAVE_COREFOUNDATION
+, data_plist(), data_plist_ustr(), data_plist_valid(), data_plist_ustr_valid()
+#endif
 {
 }
 
 _ds_record::~_ds_record() {
+#if AMG_HAVE_COREFOUNDATION
     if (data_plist) {
         CFRelease(data_plist);
     }
+#endif
 }
 
-ds_record_t *ds_record_create(void)
+void _ds_record::clear()
 {
-    return new _ds_record();
+    filename.clear();
+    filename_utf8_valid = false;
+    record_type = ds_record_type();
+    data_type = ds_record_data_type();
+    memset(&data, 0, sizeof(data));
+    data_blob.clear();
+    data_ustr.clear();
+    invalidate_plist();
 }
 
-void ds_record_free(ds_record_t *record)
+void _ds_record::invalidate_plist()
 {
-    delete record;
-}
-
-CFMutableDictionaryRef _pBBk_entry_data_copy_dictionary(const pBBk_entry_data_t *pbbkEntryData, const pBBk_t *pbbkRecord, const unsigned char *data, size_t len)
-{
-    CFMutableDictionaryRef entry(CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
-                                                           &kCFTypeDictionaryKeyCallBacks,
-                                                           &kCFTypeDictionaryValueCallBacks));
-
-    const pBBK_data_type data_type = pBBK_data_type(pbbkEntryData->type);
-    switch (data_type) {
-        case pBBk_string:
-        case pBBk_url:
-            CFDictionarySetValue(entry, CFSTR("data.type"), data_type == pBBk_url ? CFSTR("url") : CFSTR("string"));
-            AMGCFDictionarySetUTF8StringValue(entry, CFSTR("data.value"),
-                                              reinterpret_cast<const char *>(pbbkEntryData->value),
-                                              pbbkEntryData->length);
-            break;
-        case pBBk_int8:
-            CFDictionarySetValue(entry, CFSTR("data.type"), CFSTR("int8"));
-            AMGCFDictionarySetSInt8Value(entry, CFSTR("data.value"),
-                                         *reinterpret_cast<const int8_t *>(pbbkEntryData->value));
-            break;
-        case pBBk_int16:
-            CFDictionarySetValue(entry, CFSTR("data.type"), CFSTR("int16"));
-            AMGCFDictionarySetSInt16Value(entry, CFSTR("data.value"),
-                                          *reinterpret_cast<const int16_t *>(pbbkEntryData->value));
-            break;
-        case pBBk_int32:
-            CFDictionarySetValue(entry, CFSTR("data.type"), CFSTR("int32"));
-            AMGCFDictionarySetSInt32Value(entry, CFSTR("data.value"),
-                                          *reinterpret_cast<const int32_t *>(pbbkEntryData->value));
-            break;
-        case pBBk_int64:
-            CFDictionarySetValue(entry, CFSTR("data.type"), CFSTR("int64"));
-            AMGCFDictionarySetSInt64Value(entry, CFSTR("data.value"),
-                                          *reinterpret_cast<const int64_t *>(pbbkEntryData->value));
-            break;
-        case pBBk_float32:
-            CFDictionarySetValue(entry, CFSTR("data.type"), CFSTR("float32"));
-            AMGCFDictionarySetFloat32Value(entry, CFSTR("data.value"),
-                                           *reinterpret_cast<const float *>(pbbkEntryData->value));
-            break;
-        case pBBk_float64:
-            CFDictionarySetValue(entry, CFSTR("data.type"), CFSTR("float64"));
-            AMGCFDictionarySetFloat64Value(entry, CFSTR("data.value"),
-                                           *reinterpret_cast<const double *>(pbbkEntryData->value));
-            break;
-        case pBBk_date: {
-            CFDictionarySetValue(entry, CFSTR("data.type"), CFSTR("date"));
-            const uint64_t ivalue = ntohll(*reinterpret_cast<const uint64_t *>(pbbkEntryData->value));
-            const CFAbsoluteTime *value = reinterpret_cast<const double *>(&ivalue);
-            AMGCFDictionarySetCFDateValue(entry, CFSTR("data.value"), *value);
-            break;
-        }
-        case pBBk_false:
-            CFDictionarySetValue(entry, CFSTR("data.type"), CFSTR("bool"));
-            CFDictionarySetValue(entry, CFSTR("data.value"), kCFBooleanFalse);
-            break;
-        case pBBk_true:
-            CFDictionarySetValue(entry, CFSTR("data.type"), CFSTR("bool"));
-            CFDictionarySetValue(entry, CFSTR("data.value"), kCFBooleanTrue);
-            break;
-        case pBBk_array:
-            CFDictionarySetValue(entry, CFSTR("data.type"), CFSTR("array"));
-            if (pbbkEntryData->length % sizeof(uint32_t) == 0) {
-                CFMutableArrayRef arr = CFArrayCreateMutable(kCFAllocatorDefault, 0, &kCFTypeArrayCallBacks);
-
-                for (uint32_t k = 0; k < pbbkEntryData->length / sizeof(uint32_t); ++k) {
-                    const uint32_t off = uint32_from_le(pbbkEntryData->value + (sizeof(uint32_t) * k));
-
-                    pBBk_entry_data_t newEntry;
-                    memset(&newEntry, 0, sizeof(newEntry));
-
-                    const unsigned char *dt = data + 48 + off;
-                    dt = read_uint32_from_le(dt, &newEntry.length);
-                    dt = read_uint32_from_le(dt, &newEntry.type);
-                    dt = read_data_from(dt, newEntry.value, std::min<uint32_t>(newEntry.length, sizeof(newEntry.value)));
-
-                    CFArrayAppendValue(arr, _pBBk_entry_data_copy_dictionary(&newEntry, pbbkRecord, data, len));
-                }
-
-                CFDictionarySetValue(entry, CFSTR("data.value"), arr);
-
-                break;
-            } else {
-                [[clang::fallthrough]];
-            }
-        case pBBk_data:
-        case pBBk_uuid:
-        default:
-            if (data_type == pBBk_data)
-                CFDictionarySetValue(entry, CFSTR("data.type"), CFSTR("data"));
-            else if (data_type == pBBk_uuid)
-                CFDictionarySetValue(entry, CFSTR("data.type"), CFSTR("uuid"));
-            else
-                AMGCFDictionarySetIntValue(entry, CFSTR("data.type"), pbbkEntryData->type);
-            CFDictionarySetValue(entry, CFSTR("data.value"),
-                                 CFDataCreate(kCFAllocatorDefault,
-                                              reinterpret_cast<const UInt8 *>(pbbkEntryData->value),
-                                              static_cast<CFIndex>(pbbkEntryData->length)));
-            break;
+#if AMG_HAVE_COREFOUNDATION
+    if (data_plist) {
+        CFRelease(data_plist);
+        data_plist = nullptr;
     }
-
-    return entry;
+    data_plist_ustr.clear();
+    data_plist_valid = false;
+    data_plist_ustr_valid = false;
+#endif
 }
 
-CFDictionaryRef _pBBk_entry_copy_dictionary(const pBBk_entry_t *pbbkEntry, const pBBk_t *pbbkRecord, const unsigned char *data, size_t len)
+ds_record_t *ds_record_create(void)
 {
-    CFMutableDictionaryRef entry = _pBBk_entry_data_copy_dictionary(&pbbkEntry->data, pbbkRecord, data, len);
-    AMGCFDictionarySetIntValue(entry, CFSTR("key"), pbbkEntry->key);
-    AMGCFDictionarySetIntValue(entry, CFSTR("offset"), pbbkEntry->offset);
-    AMGCFDictionarySetIntValue(entry, CFSTR("reserved"), pbbkEntry->reserved);
-    AMGCFDictionarySetIntValue(entry, CFSTR("data.length"), pbbkEntry->data.length);
-    return entry;
+    return new _ds_record();
 }
 
-CFDictionaryRef _pBBk_record_copy_dictionary(const pBBk_t *pbbkRecord, const unsigned char *data, size_t len)
+void ds_record_free(ds_record_t *record)
 {
-    CFMutableDictionaryRef pbbk(CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
-                                                          &kCFTypeDictionaryKeyCallBacks,
-                                                          &kCFTypeDictionaryValueCallBacks));
-
-    AMGCFDictionarySetFourCCValue(pbbk, CFSTR("magic"), pbbkRecord->magic);
-    AMGCFDictionarySetIntValue(pbbk, CFSTR("bookmark_size"), pbbkRecord->bookmark_size);
-    AMGCFDictionarySetIntValue(pbbk, CFSTR("unknown"), pbbkRecord->unknown);
-    AMGCFDictionarySetIntValue(pbbk, CFSTR("header_size"), pbbkRecord->header_size);
-
-    AMGCFDictionarySetIntValue(pbbk, CFSTR("toc_offset"), pbbkRecord->toc_offset);
-
-    CFMutableArrayRef tocs = CFArrayCreateMutable(kCFAllocatorDefault, static_cast<CFIndex>(pbbkRecord->toc_count), &kCFTypeArrayCallBacks);
-    for (uint32_t i = 0; i < pbbkRecord->toc_count; ++i) {
-        CFMutableDictionaryRef toc(CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
-                                                             &kCFTypeDictionaryKeyCallBacks,
-                                                             &kCFTypeDictionaryValueCallBacks));
-
-        AMGCFDictionarySetIntValue(toc, CFSTR("size"), pbbkRecord->toc[i].size);
-        AMGCFDictionarySetIntValue(toc, CFSTR("magic"), pbbkRecord->toc[i].magic);
-        AMGCFDictionarySetIntValue(toc, CFSTR("identifier"), pbbkRecord->toc[i].identifier);
-        AMGCFDictionarySetIntValue(toc, CFSTR("next_toc_offset"), pbbkRecord->toc[i].next_toc_offset);
-
-        CFMutableArrayRef entries = CFArrayCreateMutable(kCFAllocatorDefault, static_cast<CFIndex>(pbbkRecord->toc[i].count), &kCFTypeArrayCallBacks);
-        for (uint32_t j = 0; j < pbbkRecord->toc[i].count; ++j) {
-            CFArrayAppendValue(entries, _pBBk_entry_copy_dictionary(&pbbkRecord->toc[i].entries[j], pbbkRecord, data, len));
-        }
-
-        CFDictionarySetValue(toc, CFSTR("entries"), entries);
-
-        CFArrayAppendValue(tocs, toc);
-    }
-
-    CFDictionarySetValue(pbbk, CFSTR("tocs"), tocs);
-    CFRelease(tocs);
-
-    return pbbk;
+    delete record;
 }
 
+#if AMG_HAVE_COREFOUNDATION
 CFDictionaryRef ds_record_copy_dictionary(ds_record_t *record)
 {
     CFMutableDictionaryRef dict = CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
@@ -327,11 +214,11 @@ CFDictionaryRef ds_record_copy_dictionary(ds_record_t *record)
                     fprintf(stderr, "warning: '%.4s' record is of wrong size %zu; expected 16\n", reinterpret_cast<const char *>(&record_type_n), size);
                 }
             } else if (ds_record_get_type(record) == ds_record_type_pBBk) {
-                if (size <= sizeof(pBBk_t)) {
-                    const pBBk_t pbbkRecord = ds_record_get_data_as_pBBk(record);
-                    CFDictionarySetValue(dict, CFSTR("data"), AMCFTypeRef<CFDictionaryRef>(_pBBk_record_copy_dictionary(&pbbkRecord, ds_record_get_data_as_blob_ptr(record), ds_record_get_data_as_blob_size(record))));
+                bookmark_t bookmark;
+                if (ds_record_get_data_as_pBBk(record, &bookmark) == 0) {
+                    CFDictionarySetValue(dict, CFSTR("data"), AMCFTypeRef<CFDictionaryRef>(bookmark_copy_dictionary(&bookmark)));
                 } else {
-                    fprintf(stderr, "warning: '%.4s' record is of too large size %zu; expected <= %zu", reinterpret_cast<const char *>(&record_type_n), size, sizeof(pBBk_t));
+                    fprintf(stderr, "warning: '%.4s' record of size %zu is not a bookmark\n", reinterpret_cast<const char *>(&record_type_n), size);
                 }
             } else if (ds_record_get_type(record) == ds_record_type_pict) {
                 alias_t *pictRecord = ds_record_copy_data_as_alias(record);
@@ -381,6 +268,160 @@ CFDictionaryRef ds_record_copy_dictionary(ds_record_t *record)
 
     return dict;
 }
+#endif
+
+/*!
+ * Decodes a bookmark, alias or property list blob. Returns 1 if \a value was
+ * decoded, 0 if it holds what could be salvaged of a malformed blob, or -1 if
+ * there is nothing to show.
+ */
+static int ds_record_decode_blob_value(ds_record_t *record, amg::value *value)
+{
+    const unsigned char *data = record->data_blob.data();
+    const size_t size = record->data_blob.size();
+
+    if (record->record_type == ds_record_type_pBBk) {
+        bookmark_t bookmark;
+        if (ds_record_get_data_as_pBBk(record, &bookmark) != 0) {
+            fprintf(stderr, "warning: '%s' record of size %zu is not a bookmark\n", amg::fourcc_string(record->record_type).c_str(), size);
+            return -1;
+        }
+
+        if (bookmark_copy_value(&bookmark, value) != 0) {
+            fprintf(stderr, "warning: '%s' record has a table of contents outside the bookmark\n", amg::fourcc_string(record->record_type).c_str());
+            return 0;
+        }
+
+        return 1;
+    }
+
+    if (record->record_type == ds_record_type_pict) {
+        alias_t *pictRecord = ds_record_copy_data_as_alias(record);
+        if (!pictRecord)
+            return -1;
+
+        *value = _alias_copy_value(pictRecord);
+        alias_free(pictRecord);
+        return 1;
+    }
+
+    bplist_t plist;
+    if (bplist_open(&plist, data, size) != 0 || bplist_copy_value(&plist, plist.top_object, value) != 0) {
+        *value = amg::value::data(data, size);
+        return 0;
+    }
+
+    if (record->record_type == ds_record_type_icvp && value->type() == amg::value::map_type) {
+        const amg::value *backgroundImageAlias = value->find("backgroundImageAlias");
+        if (backgroundImageAlias && backgroundImageAlias->type() == amg::value::data_type
+            && !backgroundImageAlias->as_data().empty()) {
+            alias_t *alias = alias_create_from_data(backgroundImageAlias->as_data().data(), backgroundImageAlias->as_data().size());
+            if (alias) {
+                value->set("backgroundImageAlias", _alias_copy_value(alias));
+                alias_free(alias);
+            }
+        }
+    }
+
+    return 1;
+}
+
+amg::value ds_record_copy_value(ds_record_t *record)
+{
+    assert(record);
+
+    amg::trace_span span("ds_record_copy_value", "decode");
+    span.set_fourcc_arg("type", record->record_type);
+    amg::value dict = amg::value::map();
+    dict.set("filename", std::string(ds_record_get_filename_utf8(record), ds_record_get_filename_utf8_len(record)));
+    dict.set("type", amg::fourcc_string(record->record_type));
+    dict.set("data_type", amg::fourcc_string(record->data_type));
+
+    switch (record->data_type) {
+        case ds_record_data_type_long:
+            dict.set("data", record->data.llong);
+            break;
+        case ds_record_data_type_shor:
+            dict.set("data", record->data.shor);
+            break;
+        case ds_record_data_type_bool:
+            dict.set("data", record->data.bbool);
+            break;
+        case ds_record_data_type_blob: {
+            const unsigned char *data = record->data_blob.data();
+            const size_t size = record->data_blob.size();
+
+            if (record->record_type == ds_record_type_BKGD) {
+                if (size == 12) {
+                    amg::value &bkgd = dict.set("data", amg::value::map());
+                    const uint32_t BKGDtype = uint32_from_be(data);
+                    if (BKGDtype == FOUR_CHAR_CODE('ClrB')) {
+                        bkgd.set("r", uint16_from_be(data + 4));
+                        bkgd.set("g", uint16_from_be(data + 6));
+                        bkgd.set("b", uint16_from_be(data + 8));
+                    } else if (BKGDtype == FOUR_CHAR_CODE('PctB')) {
+                        bkgd.set("pict", uint32_from_be(data + 4));
+                    }
+                } else {
+                    fprintf(stderr, "warning: '%s' record is of wrong size %zu; expected 12\n", amg::fourcc_string(record->record_type).c_str(), size);
+                }
+            } else if (record->record_type == ds_record_type_Iloc) {
+                if (size == 16) {
+                    const Iloc_t iconLocation = ds_record_get_data_as_Iloc(record);
+                    amg::value &iloc = dict.set("data", amg::value::map());
+                    iloc.set("x", iconLocation.x);
+                    iloc.set("y", iconLocation.y);
+                    iloc.set("unknown", amg::value::data(iconLocation.unknown, sizeof(iconLocation.unknown)));
+                } else {
+                    fprintf(stderr, "warning: '%s' record is of wrong size %zu; expected 16\n", amg::fourcc_string(record->record_type).c_str(), size);
+                }
+            } else if (record->record_type == ds_record_type_fwi0) {
+                if (size == 16) {
+                    const fwi0_t windowInfo = ds_record_get_data_as_fwi0(record);
+                    amg::value &fwi0 = dict.set("data", amg::value::map());
+                    fwi0.set("top", windowInfo.top);
+                    fwi0.set("left", windowInfo.left);
+                    fwi0.set("bottom", windowInfo.bottom);
+                    fwi0.set("right", windowInfo.right);
+                    fwi0.set("view", amg::fourcc_string(windowInfo.view));
+                    fwi0.set("unknown", amg::value::data(windowInfo.unknown, sizeof(windowInfo.unknown)));
+                } else {
+                    fprintf(stderr, "warning: '%s' record is of wrong size %zu; expected 16\n", amg::fourcc_string(record->record_type).c_str(), size);
+                }
+            } else {
+                amg::value value;
+                if (amg_decode_cache_find(record->record_type, data, size, &value) == 1) {
+                    dict.set("data", std::move(value));
+                } else {
+                    const int decoded = ds_record_decode_blob_value(record, &value);
+                    if (decoded == 1)
+                        amg_decode_cache_insert(record->record_type, data, size, value);
+                    if (decoded >= 0)
+                        dict.set("data", std::move(value));
+                }
+            }
+            break;
+        }
+        case ds_record_data_type_type:
+            dict.set("data", amg::fourcc_string(record->data.type));
+            break;
+        case ds_record_data_type_ustr:
+            dict.set("data", amg::utf8_from_utf16(record->data_ustr.data(), record->data_ustr.size()));
+            break;
+        case ds_record_data_type_comp:
+            dict.set("data", record->data.comp);
+            break;
+        case ds_record_data_type_dutc: {
+            // 1/65536 second ticks since 1904
+            uint64_t ticks;
+            memcpy(&ticks, &record->data.dutc, sizeof(ticks));
+            dict.set("data", amg::value::date(ticks / 65536.0 - amg::seconds_from_1904_to_2001));
+            break;
+        }
+    }
+
+    return dict;
+}
 
 size_t ds_record_get_filename_len(ds_record_t *record)
 {
@@ -402,6 +443,29 @@ const uint16_t *ds_record_get_filename_ptr(ds_record_t *record)
     return record->filename.data();
 }
 
+void _ds_record::update_filename_utf8()
+{
+    filename_utf8.resize(3 * filename.size());
+    filename_utf8.resize(amg_utf8_from_utf16(&filename_utf8[0], filename.data(), filename.size()));
+    filename_utf8_valid = true;
+}
+
+const char *ds_record_get_filename_utf8(ds_record_t *record)
+{
+    assert(record);
+    if (!record->filename_utf8_valid)
+        record->update_filename_utf8();
+    return record->filename_utf8.c_str();
+}
+
+size_t ds_record_get_filename_utf8_len(ds_record_t *record)
+{
+    assert(record);
+    if (!record->filename_utf8_valid)
+        record->update_filename_utf8();
+    return record->filename_utf8.size();
+}
+
 ds_record_type ds_record_get_type(ds_record_t *record)
 {
     assert(record);
@@ -512,98 +576,37 @@ fwi0_t ds_record_get_data_as_fwi0(ds_record_t *record)
     return windowInfo;
 }
 
-alias_t *ds_record_copy_data_as_alias(ds_record_t *record)
+int ds_record_find_plist_value(ds_record_t *record, const char *key, amg::value *value)
 {
     assert(record);
-    return alias_create_from_data(ds_record_get_data_as_blob_ptr(record),
-                                  ds_record_get_data_as_blob_size(record));
-}
+    assert(key);
+    assert(value);
 
-pBBk_t _ds_get_data_as_pBBk(const unsigned char *data, size_t len)
-{
-    assert(data);
-    const unsigned char * const data_start = data;
-    pBBk_t pBBk;
-    memset(&pBBk, 0, sizeof(pBBk_t));
-
-#if __DARWIN_BYTE_ORDER == __DARWIN_BIG_ENDIAN
-#define ltohl(n) (OSSwapInt32(n))
-#else
-#define ltohl(n) (n)
-#endif
-
-    pBBk.magic = ntohl(*reinterpret_cast<const uint32_t *>(data));
-    data += sizeof(pBBk.magic);
-    pBBk.bookmark_size = ltohl(*reinterpret_cast<const uint32_t *>(data));
-    data += sizeof(pBBk.bookmark_size);
-    pBBk.unknown = ltohl(*reinterpret_cast<const uint32_t *>(data));
-    data += sizeof(pBBk.unknown);
-    pBBk.header_size = ltohl(*reinterpret_cast<const uint32_t *>(data));
-    data += sizeof(pBBk.header_size);
-    assert(pBBk.header_size == 48);
-    memcpy(pBBk.reserved, data, sizeof(pBBk.reserved));
-    data += sizeof(pBBk.reserved);
-
-    const unsigned char * const toc_offset_origin = data;
-
-    pBBk.toc_offset = ltohl(*reinterpret_cast<const uint32_t *>(data));
-    data += sizeof(pBBk.toc_offset);
-
-    uint32_t toc_offset = pBBk.toc_offset;
-    uint32_t toc_index = 0;
-
-    while (toc_offset != 0) {
-        data = toc_offset_origin + pBBk.toc_offset;
-
-        pBBk.toc[toc_index].size = ltohl(*reinterpret_cast<const uint32_t *>(data));
-        data += sizeof(pBBk.toc[toc_index].size);
-        pBBk.toc[toc_index].magic = ltohl(*reinterpret_cast<const uint32_t *>(data));
-        data += sizeof(pBBk.toc[toc_index].magic);
-        pBBk.toc[toc_index].identifier = ltohl(*reinterpret_cast<const uint32_t *>(data));
-        data += sizeof(pBBk.toc[toc_index].identifier);
-        pBBk.toc[toc_index].next_toc_offset = ltohl(*reinterpret_cast<const uint32_t *>(data));
-        data += sizeof(pBBk.toc[toc_index].next_toc_offset);
-        pBBk.toc[toc_index].count = ltohl(*reinterpret_cast<const uint32_t *>(data));
-        data += sizeof(pBBk.toc[toc_index].count);
-
-        for (uint32_t i = 0; i < pBBk.toc[toc_index].count; ++i) {
-            pBBk.toc[toc_index].entries[i].key = ltohl(*reinterpret_cast<const uint32_t *>(data));
-            data += sizeof(pBBk.toc[toc_index].entries[i].key);
-            pBBk.toc[toc_index].entries[i].offset = ltohl(*reinterpret_cast<const uint32_t *>(data));
-            data += sizeof(pBBk.toc[toc_index].entries[i].offset);
-            pBBk.toc[toc_index].entries[i].reserved = ltohl(*reinterpret_cast<const uint32_t *>(data));
-            data += sizeof(pBBk.toc[toc_index].entries[i].reserved);
-
-            uint32_t key = pBBk.toc[toc_index].entries[i].key;
-            uint32_t string_offset = key & 0x7fffffff;
-
-            const unsigned char *entry_data = toc_offset_origin + pBBk.toc[toc_index].entries[i].offset;
-
-            pBBk.toc[toc_index].entries[i].data.length = ltohl(*reinterpret_cast<const uint32_t *>(entry_data));
-            entry_data += sizeof(pBBk.toc[toc_index].entries[i].data.length);
-            pBBk.toc[toc_index].entries[i].data.type = ltohl(*reinterpret_cast<const uint32_t *>(entry_data));
-            entry_data += sizeof(pBBk.toc[toc_index].entries[i].data.type);
-            memcpy(pBBk.toc[toc_index].entries[i].data.value, entry_data, sizeof(pBBk.toc[toc_index].entries[i].data.value));
-        }
-
-        toc_offset = pBBk.toc[toc_index].next_toc_offset;
-
-        ++toc_index;
-    }
+    bplist_t plist;
+    uint64_t object;
+    if (record->data_type != ds_record_data_type_blob
+        || bplist_open(&plist, record->data_blob.data(), record->data_blob.size()) != 0)
+        return -1;
 
-#undef ltohl
+    const int found = bplist_dict_find(&plist, plist.top_object, key, &object);
+    if (found <= 0)
+        return found;
 
-    pBBk.toc_count = toc_index;
+    return bplist_copy_value(&plist, object, value) == 0 ? 1 : -1;
+}
 
-    return pBBk;
+alias_t *ds_record_copy_data_as_alias(ds_record_t *record)
+{
+    assert(record);
+    return alias_create_from_data(ds_record_get_data_as_blob_ptr(record),
+                                  ds_record_get_data_as_blob_size(record));
 }
 
-pBBk_t ds_record_get_data_as_pBBk(ds_record_t *record)
+int ds_record_get_data_as_pBBk(ds_record_t *record, bookmark_t *bookmark)
 {
     assert(record);
-    assert(ds_record_get_data_as_blob_size(record) <= sizeof(pBBk_t));
-    return _ds_get_data_as_pBBk(ds_record_get_data_as_blob_ptr(record),
-                                ds_record_get_data_as_blob_size(record));
+    assert(bookmark);
+    return bookmark_open(bookmark, ds_record_get_data_as_blob_ptr(record), ds_record_get_data_as_blob_size(record));
 }
 
 uint64_t ds_record_get_data_as_comp(ds_record_t *record)
@@ -640,6 +643,7 @@ void ds_record_set_filename(ds_record_t *record, const uint16_t *ustr, size_t le
 {
     assert(record);
     record->filename = std::basic_string<uint16_t>(ustr, len);
+    record->filename_utf8_valid = false;
 }
 
 void ds_record_set_type(ds_record_t *record, ds_record_type type)
@@ -675,9 +679,8 @@ void ds_record_set_data_as_bool(ds_record_t *record, bool bbool)
 void ds_record_set_data_as_blob(ds_record_t *record, const unsigned char *blob, size_t len)
 {
     assert(record);
-    record->data_blob = std::vector<unsigned char>(len);
-    memcpy(record->data_blob.data(), blob, len);
-    record->update_plist_ustr();
+    record->data_blob.assign(blob, blob + len);
+    record->invalidate_plist();
 }
 
 void ds_record_set_data_as_type(ds_record_t *record, FourCharCode type)
@@ -708,12 +711,14 @@ void ds_record_set_filename_obj(ds_record_t *record, const std::basic_string<uin
 {
     assert(record);
     record->filename = filename;
+    record->filename_utf8_valid = false;
 }
 
 void ds_record_set_data_as_blob_obj(ds_record_t *record, const std::vector<unsigned char> &blob)
 {
     assert(record);
     record->data_blob = blob;
+    record->invalidate_plist();
 }
 
 void ds_record_set_data_as_ustr_obj(ds_record_t *record, const std::basic_string<uint16_t> &ustr)
@@ -722,11 +727,34 @@ void ds_record_set_data_as_ustr_obj(ds_record_t *record, const std::basic_string
     record->data_ustr = ustr;
 }
 
+static void ds_record_check_data_type(const ds_record_t *record)
+{
+    // If we encounter a seemingly incorrect data type for a particular record
+    // type we'll just warn instead of failing because technically we can still
+    // read the record if the data type is known to us
+    uint32_t data_type_n = htonl(record->data_type);
+    uint32_t record_type_n = htonl(record->record_type);
+    ds_record_data_type expected_data_type = ds_record_data_type_for_record_type(record->record_type);
+    uint32_t expected_data_type_n = htonl(static_cast<uint32_t>(expected_data_type));
+    if (expected_data_type == 0) {
+        fprintf(stderr, "warning: unknown record type '%.4s'\n",
+                reinterpret_cast<const char *>(&record_type_n));
+    } else if (expected_data_type != record->data_type) {
+        fprintf(stderr, "warning: unexpected data type '%.4s' for record type '%.4s'; expected '%.4s'\n",
+                reinterpret_cast<const char *>(&data_type_n),
+                reinterpret_cast<const char *>(&record_type_n),
+                reinterpret_cast<const char *>(&expected_data_type_n));
+    }
+}
+
 int ds_record_fread(ds_record_t *record, FILE *file)
 {
     assert(record);
     assert(file);
 
+    amg::trace_span span("ds_record_fread", "decode");
+    record->clear();
+
     uint32_t filename_length;
     if (fread_uint32_be(&filename_length, file) != 1)
     {
@@ -740,18 +768,16 @@ int ds_record_fread(ds_record_t *record, FILE *file)
         return 1;
     }
 
+    // Read straight into the record and swap in place
     size_t n;
-    std::vector<uint16_t> chars(filename_length);
-    if ((n = fread(chars.data(), sizeof(chars[0]), chars.size(), file)) != chars.size())
+    record->filename.resize(filename_length);
+    if ((n = fread(&record->filename[0], sizeof(uint16_t), filename_length, file)) != filename_length)
     {
-        fprintf(stderr, "error reading record filename (expected %zu characters, got %zu)\n", chars.size(), n);
+        fprintf(stderr, "error reading record filename (expected %u characters, got %zu)\n", filename_length, n);
         return 1;
     }
 
-    for (size_t i = 0; i < chars.size(); ++i)
-        chars[i] = ntohs(chars[i]);
-
-    record->filename = std::basic_string<uint16_t>(chars.data(), chars.size());
+    amg_utf16_from_be(&record->filename[0], reinterpret_cast<const unsigned char *>(record->filename.data()), filename_length);
 
     uint32_t record_type;
     if (fread_uint32_be(&record_type, file) != 1)
@@ -761,6 +787,7 @@ int ds_record_fread(ds_record_t *record, FILE *file)
     }
 
     record->record_type = static_cast<ds_record_type>(record_type);
+    span.set_fourcc_arg("type", record_type);
 
     uint32_t data_type;
     if (fread_uint32_be(&data_type, file) != 1)
@@ -771,22 +798,8 @@ int ds_record_fread(ds_record_t *record, FILE *file)
 
     record->data_type = static_cast<ds_record_data_type>(data_type);
 
-    // If we encounter a seemingly incorrect data type for a particular record
-    // type we'll just warn instead of failing because technically we can still
-    // read the record if the data type is known to us
-    uint32_t data_type_n = htonl(record->data_type);
-    uint32_t record_type_n = htonl(record->record_type);
-    ds_record_data_type expected_data_type = ds_record_data_type_for_record_type(record->record_type);
-    uint32_t expected_data_type_n = htonl(static_cast<uint32_t>(expected_data_type));
-    if (expected_data_type == 0) {
-        fprintf(stderr, "warning: unknown record type '%.4s'\n",
-                reinterpret_cast<const char *>(&record_type_n));
-    } else if (expected_data_type != record->data_type) {
-        fprintf(stderr, "warning: unexpected data type '%.4s' for record type '%.4s'; expected '%.4s'\n",
-                reinterpret_cast<const char *>(&data_type_n),
-                reinterpret_cast<const char *>(&record_type_n),
-                reinterpret_cast<const char *>(&expected_data_type_n));
-    }
+    ds_record_check_data_type(record);
+    const uint32_t data_type_n = htonl(record->data_type);
 
     uint32_t expected = 1; // expected elements (not bytes)
     switch (record->data_type)
@@ -839,15 +852,14 @@ int ds_record_fread(ds_record_t *record, FILE *file)
             if (record->data_type == ds_record_data_type_blob) {
                 record->data_blob.resize(expected);
                 n = fread(record->data_blob.data(), sizeof(record->data_blob[0]), record->data_blob.size(), file);
-                record->update_plist_ustr();
+                record->invalidate_plist();
             }
 
             if (record->data_type == ds_record_data_type_ustr) {
-                std::vector<uint16_t> ustr(expected);
-                n = fread(ustr.data(), sizeof(ustr[0]), ustr.size(), file);
-                for (size_t i = 0; i < ustr.size(); ++i)
-                    ustr[i] = ntohs(ustr[i]);
-                record->data_ustr = std::basic_string<uint16_t>(ustr.data(), ustr.size());
+                record->data_ustr.resize(expected);
+                n = fread(&record->data_ustr[0], sizeof(uint16_t), expected, file);
+                record->data_ustr.resize(n);
+                amg_utf16_from_be(&record->data_ustr[0], reinterpret_cast<const unsigned char *>(record->data_ustr.data()), n);
             }
 
             break;
@@ -867,6 +879,493 @@ int ds_record_fread(ds_record_t *record, FILE *file)
     return 0;
 }
 
+int ds_record_mwrite(ds_record_t *record, std::vector<unsigned char> &buf)
+{
+    assert(record);
+
+    if (record->filename.empty()) {
+        fprintf(stderr, "cannot write record with empty filename\n");
+        return 1;
+    }
+
+    // Readers reject empty blob and ustr data, so they are never written
+    if ((record->data_type == ds_record_data_type_blob && record->data_blob.empty()) ||
+        (record->data_type == ds_record_data_type_ustr && record->data_ustr.empty())) {
+        fprintf(stderr, "cannot write record with empty data\n");
+        return 1;
+    }
+
+    mwrite_uint32_be(static_cast<uint32_t>(record->filename.size()), buf);
+    for (uint16_t c : record->filename)
+        mwrite_uint16_be(c, buf);
+
+    mwrite_uint32_be(static_cast<uint32_t>(record->record_type), buf);
+    mwrite_uint32_be(static_cast<uint32_t>(record->data_type), buf);
+
+    switch (record->data_type)
+    {
+        case ds_record_data_type_bool:
+            mwrite_uint8(record->data.bbool ? 1 : 0, buf);
+            break;
+        case ds_record_data_type_comp:
+            mwrite_uint64_be(record->data.comp, buf);
+            break;
+        case ds_record_data_type_dutc: {
+            uint64_t dutc;
+            memcpy(&dutc, &record->data.dutc, sizeof(dutc));
+            mwrite_uint64_be(dutc, buf);
+            break;
+        }
+        case ds_record_data_type_long:
+            mwrite_uint32_be(record->data.llong, buf);
+            break;
+        case ds_record_data_type_shor:
+            // 'shor' is a 16-bit integer but physically stored as 32-bits
+            mwrite_uint32_be(record->data.shor, buf);
+            break;
+        case ds_record_data_type_type:
+            mwrite_uint32_be(static_cast<uint32_t>(record->data.type), buf);
+            break;
+        case ds_record_data_type_blob:
+            mwrite_uint32_be(static_cast<uint32_t>(record->data_blob.size()), buf);
+            mwrite(record->data_blob.data(), record->data_blob.size(), buf);
+            break;
+        case ds_record_data_type_ustr:
+            mwrite_uint32_be(static_cast<uint32_t>(record->data_ustr.size()), buf);
+            for (uint16_t c : record->data_ustr)
+                mwrite_uint16_be(c, buf);
+            break;
+        default: {
+            const uint32_t data_type_n = htonl(record->data_type);
+            fprintf(stderr, "cannot write unknown record data type '%.4s'\n",
+                    reinterpret_cast<const char *>(&data_type_n));
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int ds_record_mread_payload(ds_record_t *record, ds_membuf_t *buf);
+
+int ds_record_mread(ds_record_t *record, ds_membuf_t *buf)
+{
+    assert(record);
+    assert(buf);
+
+    amg::trace_span span("ds_record_mread", "decode");
+    record->clear();
+
+    uint32_t filename_length;
+    if (mread_uint32_be(&filename_length, buf) != 1)
+    {
+        fprintf(stderr, "error reading record filename length\n");
+        return 1;
+    }
+
+    if (filename_length == 0)
+    {
+        fprintf(stderr, "unexpected record filename length %u\n", filename_length);
+        return 1;
+    }
+
+    if (ds_membuf_remaining(buf) / sizeof(uint16_t) < filename_length)
+    {
+        fprintf(stderr, "error reading record filename (expected %u characters, got %zu)\n",
+                filename_length, ds_membuf_remaining(buf) / sizeof(uint16_t));
+        return 1;
+    }
+
+    // Decode straight out of the buffer; there is no need for a temporary copy
+    record->filename.resize(filename_length);
+    amg_utf16_from_be(&record->filename[0], ds_membuf_ptr(buf), filename_length);
+    buf->offset += filename_length * sizeof(uint16_t);
+
+    uint32_t record_type;
+    if (mread_uint32_be(&record_type, buf) != 1)
+    {
+        fprintf(stderr, "error reading record type\n");
+        return 1;
+    }
+
+    record->record_type = static_cast<ds_record_type>(record_type);
+    span.set_fourcc_arg("type", record_type);
+
+    uint32_t data_type;
+    if (mread_uint32_be(&data_type, buf) != 1)
+    {
+        fprintf(stderr, "error reading record data type\n");
+        return 1;
+    }
+
+    record->data_type = static_cast<ds_record_data_type>(data_type);
+
+    return ds_record_mread_payload(record, buf);
+}
+
+/*!
+ * Reads the payload of a record whose key has been read into \a record.
+ */
+static int ds_record_mread_payload(ds_record_t *record, ds_membuf_t *buf)
+{
+    ds_record_check_data_type(record);
+    const uint32_t data_type_n = htonl(record->data_type);
+
+    size_t n;
+    uint32_t expected = 1; // expected elements (not bytes)
+    switch (record->data_type)
+    {
+        case ds_record_data_type_bool:
+            n = mread(&record->data.bbool, sizeof(record->data.bbool), 1, buf);
+            break;
+        case ds_record_data_type_comp:
+            n = mread_uint64_be(&record->data.comp, buf);
+            break;
+        case ds_record_data_type_dutc:
+            n = mread_uint64_be(reinterpret_cast<uint64_t *>(&record->data.dutc), buf);
+            break;
+        case ds_record_data_type_long:
+            n = mread_uint32_be(&record->data.llong, buf);
+            break;
+        case ds_record_data_type_shor:
+        {
+            uint8_t c[2];
+            if (mread(c, sizeof(c[0]), 2, buf) != 2)
+            {
+                fprintf(stderr, "error reading record data\n");
+                return 1;
+            }
+
+            // 'shor' is a 16-bit integer but physically stored as 32-bits for some reason
+            if (c[0] != 0 || c[1] != 0)
+                fprintf(stderr, "warning: nonzero leading bytes in record data type '%.4s'\n",
+                        reinterpret_cast<const char *>(&data_type_n));
+
+            n = mread_uint16_be(&record->data.shor, buf);
+            break;
+        }
+        case ds_record_data_type_type:
+            n = mread_uint32_be(reinterpret_cast<uint32_t *>(&record->data.type), buf);
+            break;
+        case ds_record_data_type_blob:
+        case ds_record_data_type_ustr:
+        {
+            if ((mread_uint32_be(&expected, buf)) != 1) {
+                fprintf(stderr, "error reading record data size\n");
+                return 1;
+            }
+
+            if (expected == 0) {
+                fprintf(stderr, "unexpected record data length %u\n", expected);
+                return 1;
+            }
+
+            if (record->data_type == ds_record_data_type_blob) {
+                n = std::min<size_t>(expected, ds_membuf_remaining(buf));
+                record->data_blob.assign(ds_membuf_ptr(buf), ds_membuf_ptr(buf) + n);
+                buf->offset += n;
+                record->invalidate_plist();
+            }
+
+            if (record->data_type == ds_record_data_type_ustr) {
+                n = std::min<size_t>(expected, ds_membuf_remaining(buf) / sizeof(uint16_t));
+                record->data_ustr.resize(n);
+                amg_utf16_from_be(&record->data_ustr[0], ds_membuf_ptr(buf), n);
+                buf->offset += n * sizeof(uint16_t);
+            }
+
+            break;
+        }
+        default:
+            // We must fail on unknown data types because we cannot know their size
+            fprintf(stderr, "unknown record data type '%.4s'\n",
+                    reinterpret_cast<const char *>(&data_type_n));
+            return 1;
+    }
+
+    if (n != expected) {
+        fprintf(stderr, "wrong number of record data elements %zu, expected %u\n", n, expected);
+        return 1;
+    }
+
+    return 0;
+}
+
+static inline uint16_t ds_record_fold_case(uint16_t c)
+{
+    if (c < 0x80)
+        return (c >= 'A' && c <= 'Z') ? static_cast<uint16_t>(c + ('a' - 'A')) : c;
+    return amg_utf16_fold_case(c);
+}
+
+int ds_record_compare_filenames(const uint16_t *a, size_t a_len, const uint16_t *b, size_t b_len)
+{
+    const size_t len = std::min(a_len, b_len);
+    for (size_t i = 0; i < len; ++i) {
+        const uint16_t ca = ds_record_fold_case(a[i]);
+        const uint16_t cb = ds_record_fold_case(b[i]);
+        if (ca != cb)
+            return ca < cb ? -1 : 1;
+    }
+
+    return a_len == b_len ? 0 : (a_len < b_len ? -1 : 1);
+}
+
+int ds_record_compare_key(const uint16_t *filename, size_t filename_len, ds_record_type type, const ds_record_key_t *key)
+{
+    assert(key);
+
+    const size_t len = std::min(filename_len, key->filename_len);
+    for (size_t i = 0; i < len; ++i) {
+        const uint16_t ca = ds_record_fold_case(filename[i]);
+        const uint16_t cb = ds_record_fold_case(uint16_from_be(key->filename + (i * sizeof(uint16_t))));
+        if (ca != cb)
+            return ca < cb ? -1 : 1;
+    }
+
+    if (filename_len != key->filename_len)
+        return filename_len < key->filename_len ? -1 : 1;
+
+    if (type != key->record_type)
+        return static_cast<uint32_t>(type) < static_cast<uint32_t>(key->record_type) ? -1 : 1;
+
+    return 0;
+}
+
+int ds_record_compare(ds_record_t *a, ds_record_t *b)
+{
+    assert(a);
+    assert(b);
+
+    const int cmp = ds_record_compare_filenames(a->filename.data(), a->filename.size(),
+                                                b->filename.data(), b->filename.size());
+    if (cmp != 0)
+        return cmp;
+
+    if (a->record_type != b->record_type)
+        return static_cast<uint32_t>(a->record_type) < static_cast<uint32_t>(b->record_type) ? -1 : 1;
+
+    return 0;
+}
+
+int ds_record_mread_key(ds_record_key_t *key, ds_membuf_t *buf)
+{
+    return ds_record_view_mread(key, buf);
+}
+
+int ds_record_view_mread(ds_record_view_t *key, ds_membuf_t *buf)
+{
+    assert(key);
+    assert(buf);
+
+    uint32_t filename_length;
+    if (mread_uint32_be(&filename_length, buf) != 1 || filename_length == 0) {
+        fprintf(stderr, "error reading record filename length\n");
+        return 1;
+    }
+
+    if (ds_membuf_remaining(buf) / sizeof(uint16_t) < filename_length) {
+        fprintf(stderr, "error reading record filename\n");
+        return 1;
+    }
+
+    key->filename = ds_membuf_ptr(buf);
+    key->filename_len = filename_length;
+    buf->offset += filename_length * sizeof(uint16_t);
+
+    uint32_t record_type, data_type;
+    if (mread_uint32_be(&record_type, buf) != 1 || mread_uint32_be(&data_type, buf) != 1) {
+        fprintf(stderr, "error reading record type\n");
+        return 1;
+    }
+
+    key->record_type = static_cast<ds_record_type>(record_type);
+    key->data_type = static_cast<ds_record_data_type>(data_type);
+
+    // Skip the payload by length rather than decoding it
+    size_t size;
+    switch (key->data_type) {
+        case ds_record_data_type_bool:
+            size = 1;
+            break;
+        case ds_record_data_type_long:
+        case ds_record_data_type_shor:
+        case ds_record_data_type_type:
+            size = 4;
+            break;
+        case ds_record_data_type_comp:
+        case ds_record_data_type_dutc:
+            size = 8;
+            break;
+        case ds_record_data_type_blob:
+        case ds_record_data_type_ustr: {
+            uint32_t length;
+            if (mread_uint32_be(&length, buf) != 1) {
+                fprintf(stderr, "error reading record data size\n");
+                return 1;
+            }
+            size = key->data_type == ds_record_data_type_ustr ? length * sizeof(uint16_t) : length;
+            break;
+        }
+        default: {
+            const uint32_t data_type_n = htonl(data_type);
+            fprintf(stderr, "unknown record data type '%.4s'\n",
+                    reinterpret_cast<const char *>(&data_type_n));
+            return 1;
+        }
+    }
+
+    if (ds_membuf_remaining(buf) < size) {
+        fprintf(stderr, "error reading record data\n");
+        return 1;
+    }
+
+    key->data = ds_membuf_ptr(buf);
+    key->data_size = size;
+    buf->offset += size;
+    return 0;
+}
+
+uint32_t ds_record_view_get_data_as_long(const ds_record_view_t *view)
+{
+    assert(view);
+    assert(view->data_type == ds_record_data_type_long);
+    return uint32_from_be(view->data);
+}
+
+uint16_t ds_record_view_get_data_as_shor(const ds_record_view_t *view)
+{
+    assert(view);
+    assert(view->data_type == ds_record_data_type_shor);
+    // Stored in 32 bits like 'long'
+    return uint16_from_be(view->data + 2);
+}
+
+bool ds_record_view_get_data_as_bool(const ds_record_view_t *view)
+{
+    assert(view);
+    assert(view->data_type == ds_record_data_type_bool);
+    return view->data[0] != 0;
+}
+
+FourCharCode ds_record_view_get_data_as_type(const ds_record_view_t *view)
+{
+    assert(view);
+    assert(view->data_type == ds_record_data_type_type);
+    return uint32_from_be(view->data);
+}
+
+uint64_t ds_record_view_get_data_as_comp(const ds_record_view_t *view)
+{
+    assert(view);
+    assert(view->data_type == ds_record_data_type_comp || view->data_type == ds_record_data_type_dutc);
+    return uint64_from_be(view->data);
+}
+
+size_t ds_record_view_copy_filename_utf8(const ds_record_view_t *view, char *utf8)
+{
+    assert(view);
+    assert(utf8);
+    return amg_utf8_from_utf16be(utf8, view->filename, view->filename_len);
+}
+
+int ds_record_view_compare(const ds_record_view_t *a, const ds_record_view_t *b)
+{
+    assert(a);
+    assert(b);
+
+    const size_t len = std::min(a->filename_len, b->filename_len);
+    for (size_t i = 0; i < len; ++i) {
+        const uint16_t ca = ds_record_fold_case(uint16_from_be(a->filename + (i * sizeof(uint16_t))));
+        const uint16_t cb = ds_record_fold_case(uint16_from_be(b->filename + (i * sizeof(uint16_t))));
+        if (ca != cb)
+            return ca < cb ? -1 : 1;
+    }
+
+    if (a->filename_len != b->filename_len)
+        return a->filename_len < b->filename_len ? -1 : 1;
+
+    if (a->record_type != b->record_type)
+        return static_cast<uint32_t>(a->record_type) < static_cast<uint32_t>(b->record_type) ? -1 : 1;
+
+    return 0;
+}
+
+int ds_record_set_from_view(ds_record_t *record, const ds_record_view_t *view)
+{
+    assert(record);
+    assert(view);
+
+    // Views only come from pages the payload has already been bounds-checked
+    // in, so decoding it again cannot run off the end
+    ds_membuf_t buf = ds_membuf_make(view->filename - sizeof(uint32_t), static_cast<size_t>(view->data + view->data_size - view->filename) + sizeof(uint32_t));
+    return ds_record_mread(record, &buf);
+}
+
+void ds_record_filter_init(ds_record_filter_t *filter)
+{
+    assert(filter);
+    memset(filter, 0, sizeof(*filter));
+    filter->fields = ds_record_field_all;
+}
+
+int ds_record_filter_matches(const ds_record_filter_t *filter, const ds_record_key_t *key)
+{
+    assert(filter);
+    assert(key);
+
+    if (filter->record_types && std::find(filter->record_types, filter->record_types + filter->record_type_count, key->record_type) == filter->record_types + filter->record_type_count)
+        return 0;
+
+    if (filter->data_types && std::find(filter->data_types, filter->data_types + filter->data_type_count, key->data_type) == filter->data_types + filter->data_type_count)
+        return 0;
+
+    if (filter->filename_pattern) {
+        const std::string filename = amg::utf8_from_utf16be(key->filename, key->filename_len);
+        if (fnmatch(filter->filename_pattern, filename.c_str(), 0) != 0)
+            return 0;
+    }
+
+    return 1;
+}
+
+int ds_record_mread_filtered(ds_record_t *record, ds_membuf_t *buf, const ds_record_filter_t *filter)
+{
+    assert(record);
+    assert(buf);
+    assert(filter);
+
+    ds_record_key_t key;
+    if (ds_record_mread_key(&key, buf) != 0)
+        return -1;
+
+    if (!ds_record_filter_matches(filter, &key))
+        return 0;
+
+    amg::trace_span span("ds_record_mread_filtered", "decode");
+    span.set_fourcc_arg("type", key.record_type);
+
+    record->clear();
+    if (filter->fields & ds_record_field_filename) {
+        record->filename.resize(key.filename_len);
+        amg_utf16_from_be(&record->filename[0], key.filename, key.filename_len);
+    }
+
+    record->record_type = key.record_type;
+    record->data_type = key.data_type;
+
+    if (filter->fields & ds_record_field_data) {
+        // The key has been checked to be followed by a complete payload, so
+        // go back and decode it
+        ds_membuf_t payload = *buf;
+        payload.offset = static_cast<size_t>(key.filename - buf->data) + key.filename_len * sizeof(uint16_t) + 2 * sizeof(uint32_t);
+        if (ds_record_mread_payload(record, &payload) != 0)
+            return -1;
+    }
+
+    return 1;
+}
+
 ds_record_data_type ds_record_data_type_for_record_type(ds_record_type record_type)
 {
     switch (record_type)
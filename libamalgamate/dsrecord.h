@@ -26,15 +26,18 @@
 #define AMALGAMATE_DSRECORD_H
 
 #include "amgexport.h"
+#include "amgplatform.h"
+#include "bookmark.h"
+#include "dsio.h"
 #include <stddef.h>
 #include <stdio.h>
 
 #ifdef __cplusplus
+#include "amgvalue.h"
 #include <string>
 #include <vector>
 #endif
 
-#include <CoreServices/CoreServices.h> // HACK, for FOUR_CHAR_CODE
 
 /*!
  * An alias represents a Mac OS alias file.
@@ -106,12 +109,29 @@ typedef enum {
 AMG_EXPORT AMG_EXTERN ds_record_t *ds_record_create(void);
 AMG_EXPORT AMG_EXTERN void ds_record_free(ds_record_t *record);
 
+#if AMG_HAVE_COREFOUNDATION
 AMG_EXPORT AMG_EXTERN CFDictionaryRef ds_record_copy_dictionary(ds_record_t *record);
+#endif
+
+#ifdef __cplusplus
+/*!
+ * Returns the record as a native value tree with the same keys and decoded
+ * fields as ds_record_copy_dictionary, without going through CF.
+ */
+AMG_EXPORT extern amg::value ds_record_copy_value(ds_record_t *record);
+#endif
 
 AMG_EXPORT AMG_EXTERN size_t ds_record_get_filename_len(ds_record_t *record);
 AMG_EXPORT AMG_EXTERN void ds_record_copy_filename(ds_record_t *record, uint16_t *ustr);
 AMG_EXPORT AMG_EXTERN const uint16_t *ds_record_get_filename_ptr(ds_record_t *record);
 
+/*!
+ * Returns the filename as NUL-terminated UTF-8. It is converted on first use
+ * and cached, and the pointer stays valid until the filename changes.
+ */
+AMG_EXPORT AMG_EXTERN const char *ds_record_get_filename_utf8(ds_record_t *record);
+AMG_EXPORT AMG_EXTERN size_t ds_record_get_filename_utf8_len(ds_record_t *record);
+
 AMG_EXPORT AMG_EXTERN ds_record_type ds_record_get_type(ds_record_t *record);
 AMG_EXPORT AMG_EXTERN ds_record_data_type ds_record_get_data_type(ds_record_t *record);
 
@@ -132,11 +152,13 @@ AMG_EXPORT AMG_EXTERN size_t ds_record_get_data_as_ustr_len(ds_record_t *record)
 AMG_EXPORT AMG_EXTERN uint64_t ds_record_get_data_as_comp(ds_record_t *record);
 AMG_EXPORT AMG_EXTERN UTCDateTime ds_record_get_data_as_dutc(ds_record_t *record);
 
+#if AMG_HAVE_COREFOUNDATION
 AMG_EXPORT AMG_EXTERN CFPropertyListRef ds_record_get_data_as_plist(ds_record_t *record);
 
 AMG_EXPORT AMG_EXTERN void ds_record_copy_data_as_plist_ustr(ds_record_t *record, uint16_t *ustr);
 AMG_EXPORT AMG_EXTERN const uint16_t *ds_record_get_data_as_plist_ustr_ptr(ds_record_t *record);
 AMG_EXPORT AMG_EXTERN size_t ds_record_get_data_as_plist_ustr_len(ds_record_t *record);
+#endif
 
 typedef struct { uint32_t x, y; unsigned char unknown[8]; } Iloc_t;
 AMG_EXPORT AMG_EXTERN Iloc_t ds_record_get_data_as_Iloc(ds_record_t *record);
@@ -144,73 +166,32 @@ AMG_EXPORT AMG_EXTERN Iloc_t ds_record_get_data_as_Iloc(ds_record_t *record);
 typedef struct { uint16_t top, left, bottom, right; uint32_t view; unsigned char unknown[4]; } fwi0_t;
 AMG_EXPORT AMG_EXTERN fwi0_t ds_record_get_data_as_fwi0(ds_record_t *record);
 
-typedef struct {
-    uint32_t length;
-    uint32_t type;
-    unsigned char value[256];
-} pBBk_entry_data_t;
-
-typedef struct {
-    uint32_t key;
-    uint32_t offset;
-    uint32_t reserved; // 0x000000
-    pBBk_entry_data_t data;
-} pBBk_entry_t;
-
-typedef struct {
-    uint32_t magic;
-    uint32_t bookmark_size;
-    uint32_t unknown; // 0x10040000
-    uint32_t header_size;
-    unsigned char reserved[32];
-
-    uint32_t toc_offset;
-
-    uint32_t toc_count; // API only
-    struct {
-        uint32_t size;
-        uint32_t magic;
-        uint32_t identifier;
-        uint32_t next_toc_offset;
-        uint32_t count;
-        pBBk_entry_t entries[256];
-    } toc[16];
-} pBBk_t;
-
-typedef enum {
-    pBBk_string = 0x0101,
-    pBBk_data = 0x0201,
-    pBBk_int8 = 0x0301,
-    pBBk_int16 = 0x0302,
-    pBBk_int32 = 0x0303,
-    pBBk_int64 = 0x0304,
-    pBBk_float32 = 0x0305,
-    pBBk_float64 = 0x0306,
-    pBBk_date = 0x0400,
-    pBBk_false = 0x0500,
-    pBBk_true = 0x0501,
-    pBBk_array = 0x0601,
-    pBBk_dictionary = 0x0701,
-    pBBk_uuid = 0x0801,
-    pBBk_url = 0x0901,
-    pBBk_url_relative = 0x0902,
-} pBBK_data_type;
-
-AMG_EXPORT AMG_EXTERN pBBk_t ds_record_get_data_as_pBBk(ds_record_t *record);
-AMG_EXPORT AMG_EXTERN CFMutableDictionaryRef _pBBk_entry_data_copy_dictionary(const pBBk_entry_data_t *pbbkEntryData, const pBBk_t *pbbkRecord, const unsigned char *data, size_t len);
-AMG_EXPORT AMG_EXTERN CFDictionaryRef _pBBk_entry_copy_dictionary(const pBBk_entry_t *pbbkEntry, const pBBk_t *pbbkRecord, const unsigned char *data, size_t len);
-AMG_EXPORT AMG_EXTERN CFDictionaryRef _pBBk_record_copy_dictionary(const pBBk_t *, const unsigned char *data, size_t len);
-
-AMG_EXPORT AMG_EXTERN pBBk_t _ds_get_data_as_pBBk(const unsigned char *data, size_t len);
+/*!
+ * Opens the blob of a 'pBBk' record as a bookmark; see bookmark_open.
+ */
+AMG_EXPORT AMG_EXTERN int ds_record_get_data_as_pBBk(ds_record_t *record, bookmark_t *bookmark);
 
 AMG_EXPORT AMG_EXTERN alias_t *ds_record_copy_data_as_alias(ds_record_t *record);
 
+#ifdef __cplusplus
+/*!
+ * Decodes the value of a single top-level \a key of a record whose blob is a
+ * binary property list, such as \c icvp, \c bwsp or \c lsvp, leaving the
+ * rest of the plist untouched. Returns 1 if the key was found, 0 if it was
+ * not, or -1 if the blob is not a binary property list with a dictionary at
+ * its root.
+ */
+AMG_EXPORT extern int ds_record_find_plist_value(ds_record_t *record, const char *key, amg::value *value);
+#endif
+
 #ifdef __cplusplus
 AMG_EXPORT extern std::basic_string<uint16_t> ds_record_get_filename(ds_record_t *record);
 AMG_EXPORT extern std::vector<unsigned char> ds_record_get_data_as_blob(ds_record_t *record);
 AMG_EXPORT extern std::basic_string<uint16_t> ds_record_get_data_as_ustr(ds_record_t *record);
+#if AMG_HAVE_COREFOUNDATION
 AMG_EXPORT extern std::basic_string<uint16_t> ds_record_get_data_as_plist_ustr(ds_record_t *record);
 #endif
+#endif
 
 AMG_EXPORT AMG_EXTERN void ds_record_set_filename(ds_record_t *record, const uint16_t *ustr, size_t len);
 
@@ -233,9 +214,99 @@ AMG_EXPORT extern void ds_record_set_data_as_ustr_obj(ds_record_t *record, const
 #endif
 
 AMG_EXPORT AMG_EXTERN int ds_record_fread(ds_record_t *record, FILE *file);
+AMG_EXPORT AMG_EXTERN int ds_record_mread(ds_record_t *record, ds_membuf_t *buf);
+
+/*!
+ * Orders records the way they are stored in the B-tree: by filename, compared
+ * case-insensitively, then by record type.
+ */
+AMG_EXPORT AMG_EXTERN int ds_record_compare(ds_record_t *a, ds_record_t *b);
 
 AMG_EXPORT AMG_EXTERN ds_record_data_type ds_record_data_type_for_record_type(ds_record_type record_type);
 
+/*!
+ * A record read in place: the pointers refer into the node page it was read
+ * from, so nothing is copied or allocated, and the view is valid only while
+ * the store is open and unmodified.
+ *
+ * \c filename is big-endian UTF-16 of \c filename_len code units. \c data
+ * is the payload as stored: big-endian scalars, blob bytes or big-endian
+ * UTF-16, without the length that precedes blobs and strings.
+ */
+typedef struct {
+    const unsigned char *filename;
+    size_t filename_len;
+    ds_record_type record_type;
+    ds_record_data_type data_type;
+    const unsigned char *data;
+    size_t data_size;
+} ds_record_view_t;
+
+/*!
+ * Reads the record at the current position of \a buf into \a view and moves
+ * past it.
+ */
+AMG_EXPORT AMG_EXTERN int ds_record_view_mread(ds_record_view_t *view, ds_membuf_t *buf);
+
+AMG_EXPORT AMG_EXTERN uint32_t ds_record_view_get_data_as_long(const ds_record_view_t *view);
+AMG_EXPORT AMG_EXTERN uint16_t ds_record_view_get_data_as_shor(const ds_record_view_t *view);
+AMG_EXPORT AMG_EXTERN bool ds_record_view_get_data_as_bool(const ds_record_view_t *view);
+AMG_EXPORT AMG_EXTERN FourCharCode ds_record_view_get_data_as_type(const ds_record_view_t *view);
+
+/*!
+ * Returns a 'comp' payload, or the raw ticks of a 'dutc' one.
+ */
+AMG_EXPORT AMG_EXTERN uint64_t ds_record_view_get_data_as_comp(const ds_record_view_t *view);
+
+/*!
+ * Writes the filename as UTF-8 to \a utf8, which must have room for three
+ * bytes per code unit, and returns its length.
+ */
+AMG_EXPORT AMG_EXTERN size_t ds_record_view_copy_filename_utf8(const ds_record_view_t *view, char *utf8);
+
+/*!
+ * Orders views like ds_record_compare.
+ */
+AMG_EXPORT AMG_EXTERN int ds_record_view_compare(const ds_record_view_t *a, const ds_record_view_t *b);
+
+/*!
+ * Makes \a record an owning copy of a view read from a store.
+ */
+AMG_EXPORT AMG_EXTERN int ds_record_set_from_view(ds_record_t *record, const ds_record_view_t *view);
+
+/*!
+ * Parts of a record to decode when reading through a ds_record_filter_t.
+ */
+typedef enum {
+    ds_record_field_filename = 1 << 0,
+    ds_record_field_data = 1 << 1,
+    ds_record_field_all = ds_record_field_filename | ds_record_field_data
+} ds_record_field;
+
+/*!
+ * Selects records by their key as they are read. A record matches if its
+ * type is one of \c record_types, its data type is one of \c data_types and
+ * its filename, in UTF-8, matches the fnmatch pattern \c filename_pattern; a
+ * NULL list or pattern matches anything.
+ *
+ * The payload of a record that does not match is skipped by length without
+ * being decoded. Of a matching record only the \c fields are decoded and the
+ * others are left empty; the record and data types are always set.
+ */
+typedef struct {
+    const ds_record_type *record_types;
+    size_t record_type_count;
+    const ds_record_data_type *data_types;
+    size_t data_type_count;
+    const char *filename_pattern;
+    unsigned fields;
+} ds_record_filter_t;
+
+/*!
+ * Initializes \a filter to match every record and decode all fields.
+ */
+AMG_EXPORT AMG_EXTERN void ds_record_filter_init(ds_record_filter_t *filter);
+
 void dsstore_record_BKGD_init(ds_record_t *record, ds_record_type recordType);
 
 #endif // AMALGAMATE_DSRECORD_H
@@ -25,23 +25,55 @@
 #include "dsrecord_p.h"
 #import <Foundation/Foundation.h>
 
+/*!
+ * Whether \a blob starts like a binary or XML property list; anything else
+ * is not worth handing to the property list parser.
+ */
+static bool ds_record_blob_may_be_plist(const std::vector<unsigned char> &blob)
+{
+    static const char bplist_magic[] = "bplist";
+    if (blob.size() >= sizeof(bplist_magic) - 1 && memcmp(blob.data(), bplist_magic, sizeof(bplist_magic) - 1) == 0)
+        return true;
+
+    for (size_t i = 0; i < blob.size(); ++i) {
+        if (!isspace(blob[i]))
+            return blob[i] == '<';
+    }
+
+    return false;
+}
+
 void _ds_record::update_plist() {
     if (data_plist) {
         CFRelease(data_plist);
+        data_plist = nullptr;
     }
-    CFDataRef cfdata = CFDataCreate(kCFAllocatorDefault, data_blob.data(), static_cast<CFIndex>(data_blob.size()));
-    data_plist = CFPropertyListCreateWithData(kCFAllocatorDefault, cfdata, 0, NULL, NULL);
-    CFRelease(cfdata);
+
+    if (data_type == ds_record_data_type_blob && ds_record_blob_may_be_plist(data_blob)) {
+        CFDataRef cfdata = CFDataCreateWithBytesNoCopy(kCFAllocatorDefault, data_blob.data(), static_cast<CFIndex>(data_blob.size()), kCFAllocatorNull);
+        data_plist = CFPropertyListCreateWithData(kCFAllocatorDefault, cfdata, 0, NULL, NULL);
+        CFRelease(cfdata);
+    }
+
+    data_plist_valid = true;
 }
 
 void _ds_record::update_plist_ustr()
 {
+    if (!data_plist_valid)
+        update_plist();
+
+    data_plist_ustr_valid = true;
+    if (!data_plist) {
+        data_plist_ustr.clear();
+        return;
+    }
+
 #if __has_feature(objc_arc)
     @autoreleasepool {
 #else
     NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
 #endif
-    update_plist();
     NSString *str = [(__bridge id)data_plist description];
     if ([str length] > 0) {
         std::vector<uint16_t> bits;
@@ -60,6 +92,8 @@ void _ds_record::update_plist_ustr()
 
 CFPropertyListRef ds_record_get_data_as_plist(ds_record_t *record) {
     assert(record);
+    if (!record->data_plist_valid)
+        record->update_plist();
     return record->data_plist;
 }
 
@@ -68,23 +102,31 @@ void ds_record_copy_data_as_plist_ustr(ds_record_t *record, uint16_t *ustr)
     assert(record);
     assert(ustr);
 
+    if (!record->data_plist_ustr_valid)
+        record->update_plist_ustr();
     memcpy(ustr, record->data_plist_ustr.data(), record->data_plist_ustr.size());
 }
 
 const uint16_t *ds_record_get_data_as_plist_ustr_ptr(ds_record_t *record)
 {
     assert(record);
+    if (!record->data_plist_ustr_valid)
+        record->update_plist_ustr();
     return record->data_plist_ustr.data();
 }
 
 size_t ds_record_get_data_as_plist_ustr_len(ds_record_t *record)
 {
     assert(record);
+    if (!record->data_plist_ustr_valid)
+        record->update_plist_ustr();
     return record->data_plist_ustr.size();
 }
 
 std::basic_string<uint16_t> ds_record_get_data_as_plist_ustr(ds_record_t *record)
 {
     assert(record);
+    if (!record->data_plist_ustr_valid)
+        record->update_plist_ustr();
     return record->data_plist_ustr;
 }
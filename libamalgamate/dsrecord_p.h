@@ -37,6 +37,15 @@ struct _ds_record {
      * Filename, in big-endian UTF-16.
      */
     std::basic_string<uint16_t> filename;
+
+    /*!
+     * The filename in UTF-8, converted on first use and cached until the
+     * filename changes.
+     */
+    std::string filename_utf8;
+    bool filename_utf8_valid;
+    void update_filename_utf8();
+
     ds_record_type record_type;
     ds_record_data_type data_type;
 
@@ -51,11 +60,65 @@ struct _ds_record {
 
     std::vector<unsigned char> data_blob;
     std::basic_string<uint16_t> data_ustr;
+
+    /*!
+     * The blob decoded as a property list and its description. Both are
+     * computed on first use by the accessors and cached until the blob
+     * changes, since most blobs are never looked at as property lists.
+     */
+#if AMG_HAVE_COREFOUNDATION
     CFPropertyListRef data_plist;
     std::basic_string<uint16_t> data_plist_ustr;
+    bool data_plist_valid;
+    bool data_plist_ustr_valid;
 
     void update_plist();
     void update_plist_ustr();
+#endif
+    void invalidate_plist();
+
+    /*!
+     * Resets the record to its default state, keeping the capacity of its
+     * buffers so that a single instance can be reused for many reads.
+     */
+    void clear();
 };
 
+/*!
+ * Appends the on-disk encoding of \a record to \a buf.
+ */
+int ds_record_mwrite(ds_record_t *record, std::vector<unsigned char> &buf);
+
+/*!
+ * The sort key of a record as it appears in a node page. Reading one also
+ * locates the payload, so a key is a ds_record_view_t.
+ */
+typedef ds_record_view_t ds_record_key_t;
+
+/*!
+ * Reads a record's key and skips its payload without decoding it; the same
+ * as ds_record_view_mread.
+ */
+int ds_record_mread_key(ds_record_key_t *key, ds_membuf_t *buf);
+
+/*!
+ * Compares a host-order filename and record type against a key read by
+ * ds_record_mread_key, in B-tree order.
+ */
+int ds_record_compare_key(const uint16_t *filename, size_t filename_len, ds_record_type type, const ds_record_key_t *key);
+
+/*!
+ * Returns 1 if a record with \a key passes \a filter, otherwise 0.
+ */
+int ds_record_filter_matches(const ds_record_filter_t *filter, const ds_record_key_t *key);
+
+/*!
+ * Reads the next record if it passes \a filter, decoding only the fields it
+ * asks for, and otherwise skips it. Returns 1 if the record was read, 0 if
+ * it was skipped, or -1 if it is malformed.
+ */
+int ds_record_mread_filtered(ds_record_t *record, ds_membuf_t *buf, const ds_record_filter_t *filter);
+
+int ds_record_compare_filenames(const uint16_t *a, size_t a_len, const uint16_t *b, size_t b_len);
+
 #endif // AMALGAMATE_DSRECORD_P_H
@@ -22,59 +22,255 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include "amgtrace.h"
 #include "dsio.h"
 #include "dsrecord.h"
+#include "dsrecord_p.h"
 #include "dsstore.h"
 #include "dsstore_p.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*!
+ * Node pages held in memory by block number, superseding the file contents.
+ */
+typedef std::map<uint32_t, std::vector<unsigned char>> ds_store_page_map_t;
+
+static uint64_t ds_store_stats_now()
+{
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+/*!
+ * Statistics being gathered, with the per-type entries indexed by record
+ * type. A traversal counts into its own instance without synchronization
+ * and merges it into its store's when done.
+ */
+struct ds_store_stats_counters
+{
+    ds_store_stats_counters() { clear(); }
+
+    ds_store_stats_t stats;
+
+    // Open-addressed table of indexes into stats.types, plus one; 0 is empty
+    uint8_t type_index[DS_STORE_STATS_MAX_TYPES * 2];
+
+    void clear();
+    ds_store_type_stats_t *type_stats(ds_record_type type);
+    void add_record(ds_record_type type, size_t blob_bytes, uint64_t ns);
+    void add_record(const ds_record_t *record, uint64_t ns);
+    void add(const ds_store_stats_t &other);
+};
+
+void ds_store_stats_counters::clear()
+{
+    memset(&stats, 0, sizeof(stats));
+    memset(type_index, 0, sizeof(type_index));
+}
+
+ds_store_type_stats_t *ds_store_stats_counters::type_stats(ds_record_type type)
+{
+    const size_t mask = sizeof(type_index) - 1;
+    size_t slot = ((static_cast<uint32_t>(type) * 2654435761u) >> 16) & mask;
+    for (; type_index[slot] != 0; slot = (slot + 1) & mask) {
+        ds_store_type_stats_t *entry = &stats.types[type_index[slot] - 1];
+        if (entry->record_type == type)
+            return entry;
+    }
+
+    // The last entry collects the types that do not get one of their own
+    if (stats.type_count >= DS_STORE_STATS_MAX_TYPES - 1 && type != 0)
+        return type_stats(static_cast<ds_record_type>(0));
+
+    ds_store_type_stats_t *entry = &stats.types[stats.type_count++];
+    entry->record_type = type;
+    type_index[slot] = static_cast<uint8_t>(stats.type_count);
+    return entry;
+}
+
+void ds_store_stats_counters::add_record(ds_record_type type, size_t blob_bytes, uint64_t ns)
+{
+    ++stats.records_decoded;
+    stats.blob_bytes += blob_bytes;
+    stats.decode_ns += ns;
+
+    ds_store_type_stats_t *entry = type_stats(type);
+    ++entry->records;
+    entry->blob_bytes += blob_bytes;
+    entry->decode_ns += ns;
+}
+
+void ds_store_stats_counters::add_record(const ds_record_t *record, uint64_t ns)
+{
+    add_record(record->record_type, record->data_type == ds_record_data_type_blob ? record->data_blob.size() : 0, ns);
+}
+
+void ds_store_stats_counters::add(const ds_store_stats_t &other)
+{
+    stats.stores += other.stores;
+    stats.file_reads += other.file_reads;
+    stats.bytes_read += other.bytes_read;
+    stats.nodes_visited += other.nodes_visited;
+    stats.node_bytes += other.node_bytes;
+    stats.records_decoded += other.records_decoded;
+    stats.blob_bytes += other.blob_bytes;
+    stats.load_ns += other.load_ns;
+    stats.node_ns += other.node_ns;
+    stats.decode_ns += other.decode_ns;
+
+    for (size_t i = 0; i < other.type_count; ++i) {
+        ds_store_type_stats_t *entry = type_stats(other.types[i].record_type);
+        entry->records += other.types[i].records;
+        entry->blob_bytes += other.types[i].blob_bytes;
+        entry->decode_ns += other.types[i].decode_ns;
+    }
+}
+
+/*!
+ * The statistics of a store, or of all stores, shared between threads.
+ */
+struct ds_store_stats_collector
+{
+    std::mutex mutex;
+    ds_store_stats_counters counters;
+
+    void merge(ds_store_stats_counters *other);
+};
+
+void ds_store_stats_collector::merge(ds_store_stats_counters *other)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    counters.add(other->stats);
+}
+
+static std::atomic<bool> ds_store_stats_enabled(false);
+static ds_store_stats_collector ds_store_total_stats;
+
+/*!
+ * Counters for work outside a cursor, merged into \a collector (if any) at
+ * the end of the scope.
+ */
+struct ds_store_stats_scope
+{
+    explicit ds_store_stats_scope(ds_store_stats_collector *collector)
+        : collector(collector), counters(collector ? new ds_store_stats_counters() : nullptr) { }
+    ~ds_store_stats_scope() { if (collector) collector->merge(counters.get()); }
+
+    ds_store_stats_collector *collector;
+    std::unique_ptr<ds_store_stats_counters> counters;
+};
 
 struct _ds_store
 {
     _ds_store();
-    FILE *file;
+    ~_ds_store();
+
+    /*!
+     * The complete contents of the store, either read into \c buffer or
+     * mapped into memory at \c mapping.
+     */
+    ds_membuf_t data;
+    std::vector<unsigned char> buffer;
+    void *mapping;
+    size_t mapping_size;
+
     dsstore_header_t header;
     dsstore_buddy_allocator_state_t allocator;
     dsstore_header_block_t header_block;
     char padding[4];
 
+    /*!
+     * The block holding the header block, as named by the DSDB directory
+     * entry; usually 1, but not necessarily.
+     */
+    uint32_t header_block_number;
+
+    /*!
+     * Nodes changed since the store was read. Dirty pages are written to
+     * newly allocated blocks on commit and the blocks they replace, along
+     * with those of freed nodes, are then released.
+     */
+    ds_store_page_map_t pages;
+    std::set<uint32_t> dirty_blocks;
+    std::set<uint32_t> freed_blocks;
+    bool modified;
+
+    /*!
+     * Set for a store whose blocks were not read from a file, such as one
+     * rebuilt from cached records: no file holds its unchanged blocks, so
+     * the next commit writes them all.
+     */
+    bool detached;
+
+    /*!
+     * Statistics, if they were turned on when the store was opened.
+     */
+    std::unique_ptr<ds_store_stats_collector> stats;
+
 private:
     _ds_store(const _ds_store &);
     _ds_store &operator=(const _ds_store &);
 };
 
 _ds_store::_ds_store()
-    : file()
+    : data(), buffer(), mapping(), mapping_size(), allocator(), header_block_number(), pages(), dirty_blocks(), freed_blocks(), modified(), detached(), stats()
 {
+    memset(&header_block, 0, sizeof(header_block));
+
     header.version = 1;
     header.magic = kDSHeaderMagic;
     header.allocator_offset = 0;
     header.allocator_size = 0;
     header.allocator_offset_check = 0;
+    memset(header.padding, 0, sizeof(header.padding));
 }
 
-ds_store_t *ds_store_fread(FILE *file)
+_ds_store::~_ds_store()
 {
-    ds_store_t *store = ds_store_create();
-    store->file = file;
+    if (mapping) {
+        munmap(mapping, mapping_size);
+    }
+}
 
-    if (dsstore_header_fread(&store->header, file) != 0) {
-        ds_store_free(store);
-        return nullptr;
+static int ds_store_load(ds_store_t *store)
+{
+    ds_membuf_t buf = store->data;
+
+    if (dsstore_header_mread(&store->header, &buf) != 0) {
+        return 1;
     }
 
-    if (ds_store_seek_buddy_allocator(store, file) != 0) {
+    if (mseek(&buf, sizeof(store->header.version) + store->header.allocator_offset) != 0) {
         fprintf(stderr, "could not seek to buddy allocator offset\n");
-        return nullptr;
+        return 1;
     }
 
-    if (dsstore_buddy_allocator_state_fread(&store->allocator, file) != 0) {
-        ds_store_free(store);
-        return nullptr;
+    {
+        amg::trace_span span("dsstore_buddy_allocator_state_mread", "load");
+        if (dsstore_buddy_allocator_state_mread(&store->allocator, &buf) != 0) {
+            return 1;
+        }
     }
 
     // Find the DSDB directory entry...
     uint32_t header_block_number = UINT32_MAX;
     const uint32_t dsdb = htonl(FOUR_CHAR_CODE('DSDB'));
-    for (size_t i = 0; i < store->allocator.directory_count; ++i) {
+    for (size_t i = 0; i < store->allocator.directory_entries.size(); ++i) {
         if (memcmp(store->allocator.directory_entries[i].bytes, &dsdb, sizeof(uint32_t)) == 0) {
             header_block_number = store->allocator.directory_entries[i].block_number;
             break;
@@ -83,177 +279,2138 @@ ds_store_t *ds_store_fread(FILE *file)
 
     if (header_block_number == UINT32_MAX) {
         fprintf(stderr, "could not find the DSDB directory entry\n");
+        return 1;
+    }
+
+    if (header_block_number >= store->allocator.block_addresses.size()) {
+        fprintf(stderr, "header block number out of range\n");
+        return 1;
+    }
+
+    // Look up the offset of the header block
+    const uint32_t header_block_addr = store->allocator.block_addresses[header_block_number];
+    const uint32_t header_block_offset = dsstore_buddy_allocator_state_block_address_offset(header_block_addr);
+
+    if (mseek(&buf, sizeof(store->header.version) + header_block_offset) != 0) {
+        fprintf(stderr, "could not seek to header block offset\n");
+        return 1;
+    }
+
+    amg::trace_span span("dsstore_header_block_mread", "load");
+    if (dsstore_header_block_mread(&store->header_block, &buf) != 0) {
+        return 1;
+    }
+
+    store->header_block_number = header_block_number;
+    return 0;
+}
+
+static int ds_store_fread_contents(FILE *file, std::vector<unsigned char> &contents, ds_store_stats_t *stats = nullptr)
+{
+    amg::trace_span span("ds_store_fread_contents", "io");
+
+    // Read the whole store in as few calls as possible; node traversal then
+    // happens in memory rather than seeking around the stream for every node
+    struct stat st;
+    if (fstat(fileno(file), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        const long offset = ftell(file);
+        if (offset >= 0 && offset <= st.st_size) {
+            contents.reserve(static_cast<size_t>(st.st_size - offset));
+        }
+    }
+
+    unsigned char chunk[0x10000];
+    size_t n;
+    uint64_t reads = 1; // the call that finds the end of the file
+    while ((n = fread(chunk, sizeof(chunk[0]), sizeof(chunk), file)) > 0) {
+        contents.insert(contents.end(), chunk, chunk + n);
+        ++reads;
+    }
+
+    if (stats) {
+        stats->file_reads += reads;
+        stats->bytes_read += contents.size();
+    }
+
+    span.set_arg("bytes", contents.size());
+
+    if (ferror(file)) {
+        fprintf(stderr, "error reading store contents\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+ds_store_t *ds_store_fread(FILE *file)
+{
+    assert(file);
+
+    amg::trace_span span("ds_store_fread", "io");
+    ds_store_t *store = ds_store_create();
+    ds_store_stats_t *stats = store->stats ? &store->stats->counters.stats : nullptr;
+    const uint64_t start = stats ? ds_store_stats_now() : 0;
+
+    if (ds_store_fread_contents(file, store->buffer, stats) != 0) {
+        ds_store_free(store);
+        return nullptr;
+    }
+
+    store->data = ds_membuf_make(store->buffer.data(), store->buffer.size());
+
+    if (ds_store_load(store) != 0) {
+        ds_store_free(store);
+        return nullptr;
+    }
+
+    if (stats)
+        stats->load_ns += ds_store_stats_now() - start;
+
+    return store;
+}
+
+ds_store_t *ds_store_open_mapped(const char *path)
+{
+    assert(path);
+
+    amg::trace_span span("ds_store_open_mapped", "io");
+    const uint64_t start = ds_store_stats_enabled ? ds_store_stats_now() : 0;
+    const int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "error opening file %s: %s\n", path, strerror(errno));
+        return nullptr;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        fprintf(stderr, "error reading attributes of file %s: %s\n", path, strerror(errno));
+        close(fd);
+        return nullptr;
+    }
+
+    if (st.st_size <= 0) {
+        fprintf(stderr, "file %s is empty\n", path);
+        close(fd);
         return nullptr;
     }
 
-    if (header_block_number >= store->allocator.block_count) {
-        fprintf(stderr, "header block number out of range\n");
-        return nullptr;
+    const size_t size = static_cast<size_t>(st.st_size);
+    void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (mapping == MAP_FAILED) {
+        fprintf(stderr, "error mapping file %s: %s\n", path, strerror(errno));
+        return nullptr;
+    }
+
+    ds_store_t *store = ds_store_create();
+    store->mapping = mapping;
+    store->mapping_size = size;
+    store->data = ds_membuf_make(static_cast<const unsigned char *>(mapping), size);
+
+    if (ds_store_load(store) != 0) {
+        ds_store_free(store);
+        return nullptr;
+    }
+
+    if (store->stats) {
+        ds_store_stats_t *stats = &store->stats->counters.stats;
+        stats->bytes_read += size;
+        stats->load_ns += ds_store_stats_now() - start;
+    }
+
+    return store;
+}
+
+ds_store_t *ds_store_create(void)
+{
+    ds_store_t *store = new _ds_store();
+    if (ds_store_stats_enabled) {
+        store->stats.reset(new ds_store_stats_collector());
+        store->stats->counters.stats.stores = 1;
+    }
+
+    return store;
+}
+
+void ds_store_free(ds_store_t *store)
+{
+    if (store && store->stats)
+        ds_store_total_stats.merge(&store->stats->counters);
+    delete store;
+}
+
+void ds_store_set_stats_enabled(int enabled)
+{
+    ds_store_stats_enabled = enabled != 0;
+}
+
+int ds_store_get_stats(ds_store_t *store, ds_store_stats_t *stats)
+{
+    assert(store);
+    assert(stats);
+
+    if (!store->stats) {
+        memset(stats, 0, sizeof(*stats));
+        return 1;
+    }
+
+    std::lock_guard<std::mutex> lock(store->stats->mutex);
+    *stats = store->stats->counters.stats;
+    return 0;
+}
+
+void ds_store_get_total_stats(ds_store_stats_t *stats)
+{
+    assert(stats);
+
+    std::lock_guard<std::mutex> lock(ds_store_total_stats.mutex);
+    *stats = ds_store_total_stats.counters.stats;
+}
+
+void ds_store_reset_total_stats(void)
+{
+    std::lock_guard<std::mutex> lock(ds_store_total_stats.mutex);
+    ds_store_total_stats.counters.clear();
+}
+
+int ds_store_seek_buddy_allocator(ds_store_t *store, FILE *file)
+{
+    return fseek(file, static_cast<long>(sizeof(store->header.version) + store->header.allocator_offset), SEEK_SET);
+}
+
+/*!
+ * Upper bound on the depth of the B-tree; a 4 KiB page holds at least one
+ * child pointer per record, so real stores never come close to this.
+ */
+static const size_t ds_store_cursor_max_depth = 32;
+
+/*!
+ * Reads the header of the node in \a block_number, leaving \a buf positioned
+ * at its first entry. Pages in \a pages, if given, take precedence over \a data.
+ * The node is counted in \a counters, if given.
+ */
+static int ds_store_read_node(const dsstore_buddy_allocator_state_t *allocator, const ds_membuf_t *data, const ds_store_page_map_t *pages, uint32_t block_number, ds_membuf_t *buf, uint32_t *rightmost_child, uint32_t *count, ds_store_stats_counters *counters = nullptr)
+{
+    amg::trace_span span("ds_store_read_node", "node");
+    span.set_arg("block", block_number);
+
+    const uint64_t start = counters ? ds_store_stats_now() : 0;
+    size_t node_size;
+
+    ds_store_page_map_t::const_iterator page;
+    if (pages && (page = pages->find(block_number)) != pages->end()) {
+        *buf = ds_membuf_make(page->second.data(), page->second.size());
+        node_size = page->second.size();
+    } else if (block_number >= allocator->block_addresses.size()) {
+        fprintf(stderr, "node block number %u out of range\n", block_number);
+        return 1;
+    } else {
+        const uint32_t block_addr = allocator->block_addresses[block_number];
+        const uint32_t block_offset = dsstore_buddy_allocator_state_block_address_offset(block_addr);
+        node_size = dsstore_buddy_allocator_state_block_address_size(block_addr);
+
+        // The node is read within its block, so a record count larger than
+        // its contents fails rather than running into the next block
+        dsstore_header_t header; // for sizeof
+        const size_t offset = sizeof(header.version) + block_offset;
+        if (offset > data->size) {
+            fprintf(stderr, "could not seek to node block %u offset\n", block_number);
+            return 1;
+        }
+
+        *buf = ds_membuf_make(data->data + offset, std::min<size_t>(node_size, data->size - offset));
+    }
+
+    if (mread_uint32_be(rightmost_child, buf) != 1) {
+        fprintf(stderr, "error reading node type\n");
+        return 1;
+    }
+
+    if (mread_uint32_be(count, buf) != 1) {
+        fprintf(stderr, "error reading record count\n");
+        return 1;
+    }
+
+    if (counters) {
+        ++counters->stats.nodes_visited;
+        counters->stats.node_bytes += node_size;
+        counters->stats.node_ns += ds_store_stats_now() - start;
+    }
+
+    return 0;
+}
+
+typedef struct {
+    uint32_t block_number;
+    uint32_t rightmost_child; // the node "type"; 0 for leaf nodes
+    uint32_t count;
+    uint32_t index;
+    bool descended;
+    ds_membuf_t buf;
+} ds_store_cursor_frame_t;
+
+struct _ds_store_cursor
+{
+    _ds_store_cursor(const dsstore_buddy_allocator_state_t *allocator, const ds_membuf_t *data, const ds_store_page_map_t *pages, uint32_t root_block_number);
+    _ds_store_cursor(ds_store_t *store, uint32_t root_block_number);
+    ~_ds_store_cursor();
+
+    const dsstore_buddy_allocator_state_t *allocator;
+    const ds_membuf_t *data;
+    const ds_store_page_map_t *pages;
+    uint32_t root_block_number;
+
+    std::vector<ds_store_cursor_frame_t> stack;
+    std::vector<bool> visited;
+    bool started;
+    bool failed;
+
+    // Owned copy of the filter set with ds_store_cursor_set_filter; its
+    // pointers refer to the members below
+    bool filtered;
+    ds_record_filter_t filter;
+    std::vector<ds_record_type> filter_record_types;
+    std::vector<ds_record_data_type> filter_data_types;
+    std::string filter_filename_pattern;
+
+    // What this cursor has done since it last reported to the store
+    ds_store_stats_collector *stats_collector;
+    std::unique_ptr<ds_store_stats_counters> stats;
+
+    int push(uint32_t block_number);
+    void reset();
+    void set_filter(const ds_record_filter_t *filter);
+    void flush_stats();
+};
+
+_ds_store_cursor::_ds_store_cursor(const dsstore_buddy_allocator_state_t *allocator, const ds_membuf_t *data, const ds_store_page_map_t *pages, uint32_t root_block_number)
+    : allocator(allocator), data(data), pages(pages), root_block_number(root_block_number), stack(), visited(), started(), failed(), filtered(), stats_collector(), stats()
+{
+}
+
+_ds_store_cursor::_ds_store_cursor(ds_store_t *store, uint32_t root_block_number)
+    : _ds_store_cursor(&store->allocator, &store->data, &store->pages, root_block_number)
+{
+    stats_collector = store->stats.get();
+    if (stats_collector)
+        stats.reset(new ds_store_stats_counters());
+}
+
+_ds_store_cursor::~_ds_store_cursor()
+{
+    flush_stats();
+}
+
+void _ds_store_cursor::flush_stats()
+{
+    if (stats && (stats->stats.nodes_visited != 0 || stats->stats.records_decoded != 0)) {
+        stats_collector->merge(stats.get());
+        stats->clear();
+    }
+}
+
+void _ds_store_cursor::set_filter(const ds_record_filter_t *new_filter)
+{
+    filtered = new_filter != nullptr;
+    if (!filtered)
+        return;
+
+    filter = *new_filter;
+    if (new_filter->record_types) {
+        filter_record_types.assign(new_filter->record_types, new_filter->record_types + new_filter->record_type_count);
+        filter.record_types = filter_record_types.data();
+    }
+
+    if (new_filter->data_types) {
+        filter_data_types.assign(new_filter->data_types, new_filter->data_types + new_filter->data_type_count);
+        filter.data_types = filter_data_types.data();
+    }
+
+    if (new_filter->filename_pattern) {
+        filter_filename_pattern = new_filter->filename_pattern;
+        filter.filename_pattern = filter_filename_pattern.c_str();
+    }
+}
+
+int _ds_store_cursor::push(uint32_t block_number)
+{
+    if (block_number < visited.size()) {
+        // Every node is referenced exactly once, so seeing one twice means the
+        // tree contains a cycle (or shared subtrees, which is just as invalid)
+        if (visited[block_number]) {
+            fprintf(stderr, "node block number %u referenced more than once\n", block_number);
+            return 1;
+        }
+
+        visited[block_number] = true;
+    }
+
+    if (stack.size() >= ds_store_cursor_max_depth) {
+        fprintf(stderr, "node block number %u exceeds maximum tree depth %zu\n", block_number, ds_store_cursor_max_depth);
+        return 1;
+    }
+
+    ds_store_cursor_frame_t frame;
+    frame.block_number = block_number;
+    frame.index = 0;
+    frame.descended = false;
+
+    if (ds_store_read_node(allocator, data, pages, block_number, &frame.buf, &frame.rightmost_child, &frame.count, stats.get()) != 0) {
+        return 1;
+    }
+
+    stack.push_back(frame);
+    return 0;
+}
+
+void _ds_store_cursor::reset()
+{
+    stack.clear();
+    visited.assign(allocator->block_addresses.size(), false);
+    started = false;
+    failed = false;
+}
+
+/*!
+ * Moves the cursor to the next record in key order and reads it with
+ * \a read, which returns 1 if it produced a record, 0 if it skipped one, or
+ * -1 on error.
+ */
+template <typename Read>
+static int ds_store_cursor_advance(ds_store_cursor_t *cursor, Read read)
+{
+    if (cursor->failed) {
+        return -1;
+    }
+
+    if (!cursor->started) {
+        cursor->started = true;
+        if (cursor->push(cursor->root_block_number) != 0) {
+            cursor->failed = true;
+            return -1;
+        }
+    }
+
+    while (!cursor->stack.empty()) {
+        ds_store_cursor_frame_t &frame = cursor->stack.back();
+
+        if (frame.index < frame.count) {
+            // Internal nodes store each child's block number before the
+            // record that follows that child's subtree in key order
+            if (frame.rightmost_child != 0 && !frame.descended) {
+                uint32_t child;
+                if (mread_uint32_be(&child, &frame.buf) != 1) {
+                    fprintf(stderr, "error reading internal node block number\n");
+                    cursor->failed = true;
+                    return -1;
+                }
+
+                frame.descended = true;
+                if (cursor->push(child) != 0) {
+                    cursor->failed = true;
+                    return -1;
+                }
+
+                continue;
+            }
+
+            const int status = read(&frame.buf);
+            if (status < 0) {
+                cursor->failed = true;
+                return -1;
+            }
+
+            ++frame.index;
+            frame.descended = false;
+            if (status > 0)
+                return 1;
+            continue;
+        }
+
+        // The rightmost child replaces its exhausted parent on the stack
+        const uint32_t rightmost_child = frame.rightmost_child;
+        cursor->stack.pop_back();
+        if (rightmost_child != 0 && cursor->push(rightmost_child) != 0) {
+            cursor->failed = true;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int ds_store_cursor_read(ds_store_cursor_t *cursor, ds_record_t *record, ds_membuf_t *buf)
+{
+    if (cursor->filtered)
+        return ds_record_mread_filtered(record, buf, &cursor->filter);
+    return ds_record_mread(record, buf) == 0 ? 1 : -1;
+}
+
+static int ds_store_cursor_read_view(ds_store_cursor_t *cursor, ds_record_view_t *view, ds_membuf_t *buf)
+{
+    if (ds_record_view_mread(view, buf) != 0)
+        return -1;
+    return !cursor->filtered || ds_record_filter_matches(&cursor->filter, view) ? 1 : 0;
+}
+
+static int ds_store_cursor_next_core(ds_store_cursor_t *cursor, ds_record_t *record)
+{
+    if (!cursor->stats) {
+        return ds_store_cursor_advance(cursor, [cursor, record](ds_membuf_t *buf) {
+            return ds_store_cursor_read(cursor, record, buf);
+        });
+    }
+
+    const int status = ds_store_cursor_advance(cursor, [cursor, record](ds_membuf_t *buf) {
+        const uint64_t start = ds_store_stats_now();
+        const int status = ds_store_cursor_read(cursor, record, buf);
+        if (status > 0) {
+            cursor->stats->add_record(record, ds_store_stats_now() - start);
+        }
+        return status;
+    });
+
+    if (status <= 0)
+        cursor->flush_stats();
+    return status;
+}
+
+static int ds_store_cursor_next_view_core(ds_store_cursor_t *cursor, ds_record_view_t *view)
+{
+    if (!cursor->stats) {
+        return ds_store_cursor_advance(cursor, [cursor, view](ds_membuf_t *buf) {
+            return ds_store_cursor_read_view(cursor, view, buf);
+        });
+    }
+
+    const int status = ds_store_cursor_advance(cursor, [cursor, view](ds_membuf_t *buf) {
+        const uint64_t start = ds_store_stats_now();
+        const int status = ds_store_cursor_read_view(cursor, view, buf);
+        if (status > 0) {
+            const size_t blob_bytes = view->data_type == ds_record_data_type_blob ? view->data_size : 0;
+            cursor->stats->add_record(view->record_type, blob_bytes, ds_store_stats_now() - start);
+        }
+        return status;
+    });
+
+    if (status <= 0)
+        cursor->flush_stats();
+    return status;
+}
+
+ds_store_cursor_t *ds_store_cursor_create(ds_store_t *store)
+{
+    assert(store);
+
+    ds_store_cursor_t *cursor = new _ds_store_cursor(store, store->header_block.root_block_number);
+    cursor->reset();
+    return cursor;
+}
+
+void ds_store_cursor_free(ds_store_cursor_t *cursor)
+{
+    delete cursor;
+}
+
+void ds_store_cursor_reset(ds_store_cursor_t *cursor)
+{
+    assert(cursor);
+    cursor->reset();
+}
+
+int ds_store_cursor_next(ds_store_cursor_t *cursor, ds_record_t *record)
+{
+    assert(cursor);
+    assert(record);
+    return ds_store_cursor_next_core(cursor, record);
+}
+
+int ds_store_cursor_next_view(ds_store_cursor_t *cursor, ds_record_view_t *view)
+{
+    assert(cursor);
+    assert(view);
+    return ds_store_cursor_next_view_core(cursor, view);
+}
+
+void ds_store_cursor_set_filter(ds_store_cursor_t *cursor, const ds_record_filter_t *filter)
+{
+    assert(cursor);
+    cursor->set_filter(filter);
+}
+
+int ds_store_cursor_seek(ds_store_cursor_t *cursor, const uint16_t *filename, size_t filename_len, ds_record_type type)
+{
+    assert(cursor);
+    assert(filename || filename_len == 0);
+
+    cursor->reset();
+    cursor->started = true;
+
+    uint32_t block_number = cursor->root_block_number;
+    for (;;) {
+        if (cursor->push(block_number) != 0) {
+            cursor->failed = true;
+            return 1;
+        }
+
+        ds_store_cursor_frame_t &frame = cursor->stack.back();
+        const bool internal = frame.rightmost_child != 0;
+        bool descend = false;
+
+        for (; frame.index < frame.count; ++frame.index) {
+            uint32_t child = 0;
+            if (internal && mread_uint32_be(&child, &frame.buf) != 1) {
+                fprintf(stderr, "error reading internal node block number\n");
+                cursor->failed = true;
+                return 1;
+            }
+
+            ds_membuf_t record_buf = frame.buf;
+            ds_record_key_t key;
+            if (ds_record_mread_key(&key, &frame.buf) != 0) {
+                cursor->failed = true;
+                return 1;
+            }
+
+            const int cmp = ds_record_compare_key(filename, filename_len, type, &key);
+            if (cmp <= 0) {
+                // Park on this record; a smaller key can only be found in
+                // the subtree to its left, which is visited first
+                frame.buf = record_buf;
+                frame.descended = internal;
+                if (cmp < 0 && internal) {
+                    block_number = child;
+                    descend = true;
+                }
+                break;
+            }
+        }
+
+        if (descend) {
+            continue;
+        }
+
+        if (frame.index == frame.count && internal) {
+            // Every key in this node is smaller; continue in the rightmost subtree
+            block_number = frame.rightmost_child;
+            cursor->stack.pop_back();
+            continue;
+        }
+
+        return 0;
+    }
+}
+
+int ds_store_find(ds_store_t *store, const uint16_t *filename, size_t filename_len, ds_record_type type, ds_record_t *record)
+{
+    assert(store);
+    assert(filename || filename_len == 0);
+    assert(record);
+
+    amg::trace_span span("ds_store_find", "enum");
+    const dsstore_buddy_allocator_state_t *allocator = &store->allocator;
+    uint32_t block_number = store->header_block.root_block_number;
+    ds_store_stats_scope stats(store->stats.get());
+
+    // Each level moves one step down the tree, so a well-formed store never
+    // needs more iterations than this; a cyclic one gets cut off here
+    for (size_t depth = 0; depth < ds_store_cursor_max_depth; ++depth) {
+        ds_membuf_t buf;
+        uint32_t rightmost_child, count;
+        if (ds_store_read_node(allocator, &store->data, &store->pages, block_number, &buf, &rightmost_child, &count, stats.counters.get()) != 0) {
+            return -1;
+        }
+
+        const bool internal = rightmost_child != 0;
+        uint32_t next_block_number = rightmost_child;
+
+        for (uint32_t i = 0; i < count; ++i) {
+            uint32_t child = 0;
+            if (internal && mread_uint32_be(&child, &buf) != 1) {
+                fprintf(stderr, "error reading internal node block number\n");
+                return -1;
+            }
+
+            const ds_membuf_t record_buf = buf;
+            ds_record_key_t key;
+            if (ds_record_mread_key(&key, &buf) != 0) {
+                return -1;
+            }
+
+            const int cmp = ds_record_compare_key(filename, filename_len, type, &key);
+            if (cmp == 0) {
+                buf = record_buf;
+                const uint64_t start = stats.counters ? ds_store_stats_now() : 0;
+                if (ds_record_mread(record, &buf) != 0)
+                    return -1;
+                if (stats.counters)
+                    stats.counters->add_record(record, ds_store_stats_now() - start);
+                return 1;
+            }
+
+            if (cmp < 0) {
+                next_block_number = child;
+                break;
+            }
+        }
+
+        if (!internal) {
+            return 0;
+        }
+
+        block_number = next_block_number;
+    }
+
+    fprintf(stderr, "node block number %u exceeds maximum tree depth %zu\n", block_number, ds_store_cursor_max_depth);
+    return -1;
+}
+
+/*!
+ * Each thread keeps the record its last enumeration used, buffers and all,
+ * so that a crawl enumerating store after store reads every record into the
+ * same memory instead of going back to the shared allocator. Enumerations
+ * nested inside a callback find the slot empty and use a record of their own.
+ */
+struct ds_store_record_slot
+{
+    ds_store_record_slot() : record(nullptr) { }
+    ~ds_store_record_slot() { if (record) ds_record_free(record); }
+
+    ds_record_t *record;
+};
+
+static thread_local ds_store_record_slot ds_store_thread_record;
+
+static ds_record_t *ds_store_acquire_record()
+{
+    ds_record_t *record = ds_store_thread_record.record;
+    ds_store_thread_record.record = nullptr;
+    return record ? record : ds_record_create();
+}
+
+static void ds_store_release_record(ds_record_t *record)
+{
+    if (ds_store_thread_record.record) {
+        ds_record_free(record);
+        return;
+    }
+
+    // Drop whatever the last record referred to, but keep its capacity
+    record->clear();
+    ds_store_thread_record.record = record;
+}
+
+int ds_store_enum_records_with_prefix_core(ds_store_t *store, const uint16_t *prefix, size_t prefix_len, const std::function<void(ds_record_t *)> &func)
+{
+    assert(store);
+
+    ds_store_cursor_t *cursor = ds_store_cursor_create(store);
+
+    // The smallest key with a given filename has the all-zero record type
+    if (ds_store_cursor_seek(cursor, prefix, prefix_len, static_cast<ds_record_type>(0)) != 0) {
+        ds_store_cursor_free(cursor);
+        return 1;
+    }
+
+    ds_record_t *record = ds_store_acquire_record();
+
+    int status;
+    while ((status = ds_store_cursor_next_core(cursor, record)) > 0) {
+        if (record->filename.size() < prefix_len ||
+            ds_record_compare_filenames(record->filename.data(), prefix_len, prefix, prefix_len) != 0) {
+            status = 0;
+            break;
+        }
+
+        if (func) {
+            func(record);
+        }
+    }
+
+    ds_store_release_record(record);
+    ds_store_cursor_free(cursor);
+    return status < 0 ? 1 : 0;
+}
+
+int ds_store_enum_records_with_prefix(ds_store_t *store, const uint16_t *prefix, size_t prefix_len, ds_store_record_func_t func)
+{
+    return ds_store_enum_records_with_prefix_core(store, prefix, prefix_len, func);
+}
+
+static int ds_store_enum_cursor(ds_store_cursor_t *cursor, const std::function<void(ds_record_t *)> &record_func)
+{
+    // The callback only borrows the record, so one instance serves the whole traversal
+    ds_record_t *record = ds_store_acquire_record();
+
+    int status;
+    while ((status = ds_store_cursor_next_core(cursor, record)) > 0) {
+        if (record_func) {
+            record_func(record);
+        }
+    }
+
+    ds_store_release_record(record);
+    return status < 0 ? 1 : 0;
+}
+
+int ds_store_enum_blocks_core(dsstore_buddy_allocator_state_t *allocator, dsstore_header_block_t *header_block, uint32_t block_number, const std::function<void(ds_record_t *)> &record_func, const ds_membuf_t *data)
+{
+    if (header_block->root_block_number >= allocator->block_addresses.size()) {
+        fprintf(stderr, "root node block number out of range\n");
+        return 1;
+    }
+
+    amg::trace_span span("ds_store_enum_blocks_core", "enum");
+    _ds_store_cursor cursor(allocator, data, nullptr, block_number);
+    cursor.reset();
+    return ds_store_enum_cursor(&cursor, record_func);
+}
+
+int ds_store_enum_records(ds_store_t *store, ds_store_record_func_t func)
+{
+    return ds_store_enum_records_core(store, func);
+}
+
+int ds_store_enum_records_core(ds_store_t *store, const std::function<void(ds_record_t *)> &func)
+{
+    assert(store);
+
+    amg::trace_span span("ds_store_enum_records", "enum");
+    _ds_store_cursor cursor(store, store->header_block.root_block_number);
+    cursor.reset();
+    return ds_store_enum_cursor(&cursor, func);
+}
+
+int ds_store_enum_record_views(ds_store_t *store, ds_store_record_view_func_t func)
+{
+    return ds_store_enum_record_views_core(store, func);
+}
+
+int ds_store_enum_record_views_core(ds_store_t *store, const std::function<void(const ds_record_view_t *)> &func)
+{
+    assert(store);
+
+    amg::trace_span span("ds_store_enum_record_views", "enum");
+    _ds_store_cursor cursor(store, store->header_block.root_block_number);
+    cursor.reset();
+
+    ds_record_view_t view;
+    int status;
+    while ((status = ds_store_cursor_next_view_core(&cursor, &view)) > 0) {
+        if (func) {
+            func(&view);
+        }
+    }
+
+    return status < 0 ? 1 : 0;
+}
+
+int ds_store_enum_records_filtered(ds_store_t *store, const ds_record_filter_t *filter, ds_store_record_func_t func)
+{
+    return ds_store_enum_records_filtered_core(store, filter, func);
+}
+
+int ds_store_enum_records_filtered_core(ds_store_t *store, const ds_record_filter_t *filter, const std::function<void(ds_record_t *)> &func)
+{
+    assert(store);
+    assert(filter);
+
+    amg::trace_span span("ds_store_enum_records_filtered", "enum");
+    _ds_store_cursor cursor(store, store->header_block.root_block_number);
+    cursor.reset();
+    cursor.set_filter(filter);
+    return ds_store_enum_cursor(&cursor, func);
+}
+
+int ds_store_enum_blocks(dsstore_buddy_allocator_state_t *allocator, dsstore_header_block_t *header_block, uint32_t block_number, ds_store_record_func_t record_func, FILE *file)
+{
+    if (fseek(file, 0, SEEK_SET) != 0) {
+        fprintf(stderr, "could not seek to start of store\n");
+        return 1;
+    }
+
+    std::vector<unsigned char> contents;
+    if (ds_store_fread_contents(file, contents) != 0) {
+        return 1;
+    }
+
+    const ds_membuf_t data = ds_membuf_make(contents.data(), contents.size());
+    return ds_store_enum_blocks_core(allocator, header_block, block_number, record_func, &data);
+}
+
+/*!
+ * Builds the B-tree bottom-up from records supplied in key order. Each level
+ * keeps one open page; when an entry does not fit, the page's last entry is
+ * promoted to the level above as the separator and the page is closed, so
+ * every page (including the last one on each level) holds at least one entry.
+ */
+struct ds_store_tree_builder
+{
+    typedef struct {
+        std::vector<unsigned char> body;
+        std::vector<size_t> entry_offsets;
+        uint32_t last_child; // the child to the left of the entry being added
+    } level_t;
+
+    ds_store_tree_builder();
+
+    std::vector<level_t> levels;
+    std::vector<std::vector<unsigned char>> pages;
+    uint32_t record_count;
+    std::vector<unsigned char> scratch;
+
+    int add(ds_record_t *record);
+    int add_encoded(const unsigned char *record, size_t size);
+    int finish(uint32_t *root_page);
+
+private:
+    int add_entry(size_t level, uint32_t child, const unsigned char *entry, size_t size);
+    uint32_t close_page(size_t level, uint32_t rightmost_child);
+};
+
+/*!
+ * Largest record encoding accepted by the tree builder. Limiting records to
+ * half a page (less the child pointer) guarantees a full page always has an
+ * entry to promote while keeping one behind.
+ */
+static const size_t ds_store_max_record_size = (dsstore_header_block_tree_node_page_size - 2 * sizeof(uint32_t)) / 2 - sizeof(uint32_t);
+
+/*!
+ * Block numbers reserved for the allocator itself and the DSDB header block;
+ * tree pages are numbered from here on.
+ */
+static const uint32_t ds_store_first_page_block_number = 2;
+
+ds_store_tree_builder::ds_store_tree_builder()
+    : levels(1), pages(), record_count(), scratch()
+{
+}
+
+int ds_store_tree_builder::add(ds_record_t *record)
+{
+    assert(record);
+
+    scratch.clear();
+    if (ds_record_mwrite(record, scratch) != 0)
+        return 1;
+
+    return add_encoded(scratch.data(), scratch.size());
+}
+
+int ds_store_tree_builder::add_encoded(const unsigned char *record, size_t size)
+{
+    assert(record);
+
+    if (size > ds_store_max_record_size) {
+        fprintf(stderr, "record of %zu bytes exceeds the maximum of %zu bytes\n", size, ds_store_max_record_size);
+        return 1;
+    }
+
+    ++record_count;
+    return add_entry(0, 0, record, size);
+}
+
+int ds_store_tree_builder::add_entry(size_t level, uint32_t child, const unsigned char *entry, size_t size)
+{
+    level_t *l = &levels[level];
+    const size_t entry_size = (level > 0 ? sizeof(uint32_t) : 0) + size;
+    const size_t header_size = 2 * sizeof(uint32_t);
+
+    if (header_size + l->body.size() + entry_size > dsstore_header_block_tree_node_page_size) {
+        // Promote the last entry of the full page, which then closes with
+        // that entry's child as its rightmost child
+        assert(l->entry_offsets.size() >= 2);
+        const size_t last = l->entry_offsets.back();
+        l->entry_offsets.pop_back();
+
+        uint32_t promoted_child = 0;
+        size_t record_start = last;
+        if (level > 0) {
+            promoted_child = uint32_from_be(l->body.data() + last);
+            record_start += sizeof(uint32_t);
+        }
+
+        std::vector<unsigned char> promoted(l->body.begin() + static_cast<std::ptrdiff_t>(record_start), l->body.end());
+        l->body.resize(last);
+
+        const uint32_t page = close_page(level, promoted_child);
+        if (level + 1 == levels.size())
+            levels.resize(levels.size() + 1);
+
+        if (add_entry(level + 1, page, promoted.data(), promoted.size()) != 0)
+            return 1;
+
+        l = &levels[level];
+    }
+
+    l->entry_offsets.push_back(l->body.size());
+    if (level > 0)
+        mwrite_uint32_be(child, l->body);
+    mwrite(entry, size, l->body);
+    return 0;
+}
+
+uint32_t ds_store_tree_builder::close_page(size_t level, uint32_t rightmost_child)
+{
+    level_t &l = levels[level];
+
+    std::vector<unsigned char> page;
+    page.reserve(dsstore_header_block_tree_node_page_size);
+    mwrite_uint32_be(level > 0 ? rightmost_child : 0, page);
+    mwrite_uint32_be(static_cast<uint32_t>(l.entry_offsets.size()), page);
+    page.insert(page.end(), l.body.begin(), l.body.end());
+    page.resize(dsstore_header_block_tree_node_page_size);
+    pages.push_back(std::move(page));
+
+    l.body.clear();
+    l.entry_offsets.clear();
+    return ds_store_first_page_block_number + static_cast<uint32_t>(pages.size() - 1);
+}
+
+int ds_store_tree_builder::finish(uint32_t *root_page)
+{
+    uint32_t child = 0;
+    for (size_t level = 0; level < levels.size(); ++level)
+        child = close_page(level, child);
+
+    *root_page = child;
+    return 0;
+}
+
+/*!
+ * Adds the directory entry naming block 1 as the DSDB header block.
+ */
+static void ds_store_add_header_block_entry(dsstore_buddy_allocator_state_t *allocator)
+{
+    dsstore_buddy_allocator_directory_entry_t entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.count = 4;
+    memcpy(entry.bytes, "DSDB", 4);
+    entry.block_number = 1;
+    allocator->directory_entries.push_back(entry);
+}
+
+/*!
+ * Lays out the allocator block, DSDB header block and tree pages of
+ * \a page_sizes in a fresh buddy address space and builds the file image
+ * without the pages, which the caller copies to \a page_offsets. The root,
+ * levels and record count of the tree are taken from \a tree.
+ */
+static int ds_store_build_image(const std::vector<size_t> &page_sizes, const dsstore_header_block_t &tree, std::vector<unsigned char> &image, std::vector<size_t> &page_offsets)
+{
+    dsstore_buddy_allocator_state_t allocator_state;
+    dsstore_buddy_allocator_state_t *allocator = &allocator_state;
+    dsstore_buddy_allocator_init(allocator);
+
+    const size_t block_count = ds_store_first_page_block_number + page_sizes.size();
+    allocator->block_addresses.resize(block_count);
+    ds_store_add_header_block_entry(allocator);
+
+    // The allocator block has to be placed before its final contents are
+    // known, so reserve room for the padded address table and a generous
+    // number of free list entries (splitting adds at most one per size class)
+    const size_t factor = 256;
+    const size_t padded_block_count = (block_count + factor - 1) / factor * factor;
+    const size_t free_list_count = sizeof(allocator->free_lists) / sizeof(allocator->free_lists[0]);
+    const size_t allocator_size_estimate = 2 * sizeof(uint32_t)
+        + padded_block_count * sizeof(uint32_t)
+        + sizeof(uint32_t) + sizeof(uint8_t) + 4 + sizeof(uint32_t)
+        + free_list_count * sizeof(uint32_t) * 3;
+    const uint32_t allocator_size = std::max<uint32_t>(static_cast<uint32_t>(allocator_size_estimate), 2048);
+
+    dsstore_header_block_t header_block = tree;
+    header_block.node_count = static_cast<uint32_t>(page_sizes.size());
+    header_block.tree_node_page_size = dsstore_header_block_tree_node_page_size;
+
+    if (dsstore_buddy_allocator_alloc(allocator, sizeof(uint32_t) * 5, &allocator->block_addresses[1]) != 0 ||
+        dsstore_buddy_allocator_alloc(allocator, allocator_size, &allocator->block_addresses[0]) != 0) {
+        return 1;
+    }
+
+    for (size_t i = 0; i < page_sizes.size(); ++i) {
+        if (dsstore_buddy_allocator_alloc(allocator, static_cast<uint32_t>(page_sizes[i]), &allocator->block_addresses[ds_store_first_page_block_number + i]) != 0)
+            return 1;
+    }
+
+    std::vector<unsigned char> allocator_data;
+    dsstore_buddy_allocator_state_mwrite(allocator, allocator_data);
+    if (allocator_data.size() > dsstore_buddy_allocator_state_block_address_size(allocator->block_addresses[0])) {
+        fprintf(stderr, "allocator state of %zu bytes does not fit its block\n", allocator_data.size());
+        return 1;
+    }
+
+    std::vector<unsigned char> header_block_data;
+    dsstore_header_block_mwrite(&header_block, header_block_data);
+
+    dsstore_header_t header;
+    header.version = 1;
+    header.magic = kDSHeaderMagic;
+    header.allocator_offset = dsstore_buddy_allocator_state_block_address_offset(allocator->block_addresses[0]);
+    header.allocator_size = dsstore_buddy_allocator_state_block_address_size(allocator->block_addresses[0]);
+    header.allocator_offset_check = header.allocator_offset;
+    memset(header.padding, 0, sizeof(header.padding));
+
+    // Block offsets are relative to the end of the version field
+    const size_t end = dsstore_buddy_allocator_extent(allocator);
+
+    image.clear();
+    image.reserve(sizeof(header.version) + end);
+    dsstore_header_mwrite(&header, image);
+    image.resize(sizeof(header.version) + end);
+
+    const auto offset = [&header](uint32_t addr) {
+        return sizeof(header.version) + dsstore_buddy_allocator_state_block_address_offset(addr);
+    };
+
+    memcpy(image.data() + offset(allocator->block_addresses[0]), allocator_data.data(), allocator_data.size());
+    memcpy(image.data() + offset(allocator->block_addresses[1]), header_block_data.data(), header_block_data.size());
+
+    page_offsets.resize(page_sizes.size());
+    for (size_t i = 0; i < page_sizes.size(); ++i)
+        page_offsets[i] = offset(allocator->block_addresses[ds_store_first_page_block_number + i]);
+
+    return 0;
+}
+
+/*!
+ * Builds the complete store image of the tree built by \a builder.
+ */
+static int ds_store_build_tree_image(ds_store_tree_builder *builder, std::vector<unsigned char> &image)
+{
+    dsstore_header_block_t tree;
+    memset(&tree, 0, sizeof(tree));
+    if (builder->finish(&tree.root_block_number) != 0)
+        return 1;
+
+    tree.node_levels = static_cast<uint32_t>(builder->levels.size() - 1);
+    tree.record_count = builder->record_count;
+
+    std::vector<size_t> page_sizes, page_offsets;
+    for (size_t i = 0; i < builder->pages.size(); ++i)
+        page_sizes.push_back(builder->pages[i].size());
+
+    if (ds_store_build_image(page_sizes, tree, image, page_offsets) != 0)
+        return 1;
+
+    for (size_t i = 0; i < builder->pages.size(); ++i)
+        memcpy(image.data() + page_offsets[i], builder->pages[i].data(), builder->pages[i].size());
+
+    return 0;
+}
+
+/*!
+ * Writes the tree built by \a builder as a complete store with one write.
+ */
+static int ds_store_write_tree(ds_store_tree_builder *builder, FILE *file)
+{
+    std::vector<unsigned char> image;
+    if (ds_store_build_tree_image(builder, image) != 0)
+        return 1;
+
+    if (fwrite(image.data(), sizeof(image[0]), image.size(), file) != image.size()) {
+        fprintf(stderr, "error writing store\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+int ds_store_fwrite_records(FILE *file, ds_record_t *const *records, size_t count)
+{
+    assert(file);
+    assert(records || count == 0);
+
+    ds_store_tree_builder builder;
+    for (size_t i = 0; i < count; ++i) {
+        if (i > 0 && ds_record_compare(records[i - 1], records[i]) >= 0) {
+            fprintf(stderr, "records must be sorted and unique (record #%zu)\n", i);
+            return 1;
+        }
+
+        if (builder.add(records[i]) != 0)
+            return 1;
+    }
+
+    return ds_store_write_tree(&builder, file);
+}
+
+int ds_store_fwrite(ds_store_t *store, FILE *file)
+{
+    assert(store);
+    assert(file);
+
+    ds_store_tree_builder builder;
+
+    // A store with a tree is re-encoded record by record in key order; a
+    // newly created store has no tree yet and writes an empty one
+    if (!store->allocator.block_addresses.empty()) {
+        ds_store_cursor_t *cursor = ds_store_cursor_create(store);
+        ds_record_t *record = ds_store_acquire_record();
+
+        int status;
+        while ((status = ds_store_cursor_next_core(cursor, record)) > 0) {
+            if (builder.add(record) != 0) {
+                status = -1;
+                break;
+            }
+        }
+
+        ds_store_release_record(record);
+        ds_store_cursor_free(cursor);
+
+        if (status < 0)
+            return 1;
+    }
+
+    return ds_store_write_tree(&builder, file);
+}
+
+int ds_store_copy_record_data(ds_store_t *store, std::vector<unsigned char> &records, uint32_t *count)
+{
+    assert(store);
+    assert(count);
+
+    _ds_store_cursor cursor(store, store->header_block.root_block_number);
+    cursor.reset();
+
+    // Reading the key checks that the payload is complete, so the encoding
+    // can be copied as it is
+    uint32_t n = 0;
+    int status;
+    while ((status = ds_store_cursor_advance(&cursor, [&records](ds_membuf_t *buf) {
+        const size_t start = buf->offset;
+        ds_record_key_t key;
+        if (ds_record_mread_key(&key, buf) != 0)
+            return -1;
+        records.insert(records.end(), buf->data + start, buf->data + buf->offset);
+        return 1;
+    })) > 0) {
+        ++n;
+    }
+
+    *count = n;
+    return status < 0 ? 1 : 0;
+}
+
+ds_store_t *ds_store_create_with_record_data(const unsigned char *records, size_t size, uint32_t count)
+{
+    assert(records || size == 0);
+
+    // The records are laid out in pages like ds_store_fwrite_records does,
+    // so the store can be modified like one read from a file
+    ds_store_tree_builder builder;
+    ds_membuf_t buf = ds_membuf_make(records, size);
+    for (uint32_t i = 0; i < count; ++i) {
+        const size_t start = buf.offset;
+        ds_record_key_t key;
+        if (ds_record_mread_key(&key, &buf) != 0 || builder.add_encoded(records + start, buf.offset - start) != 0)
+            return nullptr;
+    }
+
+    if (buf.offset != size) {
+        fprintf(stderr, "record data holds more than %u records\n", count);
+        return nullptr;
+    }
+
+    ds_store_t *store = ds_store_create();
+    if (ds_store_build_tree_image(&builder, store->buffer) != 0) {
+        ds_store_free(store);
+        return nullptr;
+    }
+
+    store->data = ds_membuf_make(store->buffer.data(), store->buffer.size());
+    if (ds_store_load(store) != 0) {
+        ds_store_free(store);
+        return nullptr;
+    }
+
+    store->detached = true;
+    return store;
+}
+
+/*!
+ * A tree node decoded for modification. Records are kept in their on-disk
+ * encoding; \c children is empty for leaves and otherwise holds the child to
+ * the left of each record, with \c rightmost_child to the right of the last.
+ */
+struct ds_store_node
+{
+    ds_store_node();
+
+    uint32_t rightmost_child;
+    std::vector<uint32_t> children;
+    std::vector<std::vector<unsigned char>> records;
+
+    bool internal() const { return rightmost_child != 0; }
+    size_t size() const;
+    size_t entry_size(size_t i) const;
+    uint32_t child(size_t i) const { return i < children.size() ? children[i] : rightmost_child; }
+};
+
+ds_store_node::ds_store_node()
+    : rightmost_child(), children(), records()
+{
+}
+
+size_t ds_store_node::entry_size(size_t i) const
+{
+    return (internal() ? sizeof(uint32_t) : 0) + records[i].size();
+}
+
+size_t ds_store_node::size() const
+{
+    size_t size = 2 * sizeof(uint32_t);
+    for (size_t i = 0; i < records.size(); ++i)
+        size += entry_size(i);
+    return size;
+}
+
+/*!
+ * Nodes whose encoding falls below this size are merged with or borrow from
+ * a sibling after a deletion.
+ */
+static const size_t ds_store_node_min_size = dsstore_header_block_tree_node_page_size / 4;
+
+static int ds_store_node_load(ds_store_t *store, uint32_t block_number, ds_store_node *node, ds_store_stats_counters *counters = nullptr)
+{
+    ds_membuf_t buf;
+    uint32_t count;
+    if (ds_store_read_node(&store->allocator, &store->data, &store->pages, block_number, &buf, &node->rightmost_child, &count, counters) != 0)
+        return 1;
+
+    node->children.clear();
+    node->records.clear();
+
+    for (uint32_t i = 0; i < count; ++i) {
+        if (node->internal()) {
+            uint32_t child;
+            if (mread_uint32_be(&child, &buf) != 1) {
+                fprintf(stderr, "error reading internal node block number\n");
+                return 1;
+            }
+            node->children.push_back(child);
+        }
+
+        const unsigned char *start = ds_membuf_ptr(&buf);
+        ds_record_key_t key;
+        if (ds_record_mread_key(&key, &buf) != 0)
+            return 1;
+
+        node->records.push_back(std::vector<unsigned char>(start, ds_membuf_ptr(&buf)));
+    }
+
+    return 0;
+}
+
+static void ds_store_node_store(ds_store_t *store, uint32_t block_number, const ds_store_node &node)
+{
+    std::vector<unsigned char> &page = store->pages[block_number];
+    page.clear();
+    page.reserve(std::max<size_t>(node.size(), dsstore_header_block_tree_node_page_size));
+    mwrite_uint32_be(node.rightmost_child, page);
+    mwrite_uint32_be(static_cast<uint32_t>(node.records.size()), page);
+    for (size_t i = 0; i < node.records.size(); ++i) {
+        if (node.internal())
+            mwrite_uint32_be(node.children[i], page);
+        mwrite(node.records[i].data(), node.records[i].size(), page);
+    }
+    page.resize(std::max<size_t>(page.size(), dsstore_header_block_tree_node_page_size));
+
+    store->dirty_blocks.insert(block_number);
+    store->modified = true;
+}
+
+/*!
+ * Picks a block number for a new node: one whose node was released at an
+ * earlier commit, or else a new one at the end of the address table.
+ */
+static int ds_store_new_block(ds_store_t *store, uint32_t *block_number)
+{
+    dsstore_buddy_allocator_state_t *allocator = &store->allocator;
+    for (uint32_t i = ds_store_first_page_block_number; i < allocator->block_addresses.size(); ++i) {
+        if (allocator->block_addresses[i] == 0 && store->pages.count(i) == 0) {
+            *block_number = i;
+            return 0;
+        }
+    }
+
+    *block_number = static_cast<uint32_t>(allocator->block_addresses.size());
+    allocator->block_addresses.push_back(0);
+    return 0;
+}
+
+static void ds_store_release_block(ds_store_t *store, uint32_t block_number)
+{
+    store->pages.erase(block_number);
+    store->dirty_blocks.erase(block_number);
+
+    // Blocks that were never committed have nothing on disk to free
+    if (store->allocator.block_addresses[block_number] != 0)
+        store->freed_blocks.insert(block_number);
+}
+
+/*!
+ * Gives a newly created store an allocator, a DSDB header block and an empty
+ * root leaf so that records can be inserted into it.
+ */
+static int ds_store_init_tree(ds_store_t *store)
+{
+    if (!store->allocator.block_addresses.empty())
+        return 0;
+
+    dsstore_buddy_allocator_state_t *allocator = &store->allocator;
+    dsstore_buddy_allocator_init(allocator);
+    allocator->block_addresses.resize(ds_store_first_page_block_number);
+    ds_store_add_header_block_entry(allocator);
+
+    if (dsstore_buddy_allocator_alloc(allocator, sizeof(uint32_t) * 5, &allocator->block_addresses[1]) != 0)
+        return 1;
+
+    store->header_block_number = 1;
+
+    uint32_t root;
+    if (ds_store_new_block(store, &root) != 0)
+        return 1;
+
+    ds_store_node_store(store, root, ds_store_node());
+
+    store->header_block.root_block_number = root;
+    store->header_block.node_levels = 0;
+    store->header_block.record_count = 0;
+    store->header_block.node_count = 1;
+    store->header_block.tree_node_page_size = dsstore_header_block_tree_node_page_size;
+    return 0;
+}
+
+typedef struct {
+    uint32_t block_number;
+    size_t index; // of the matching entry, or of the child descended into
+} ds_store_path_entry_t;
+
+/*!
+ * Descends from the root towards the given key, recording each node visited.
+ * Returns 1 if the last node in \a path holds the key at its index, 0 if the
+ * key is absent (the path then ends at the leaf where it belongs), or -1 if
+ * the store is malformed.
+ */
+static int ds_store_find_path(ds_store_t *store, const uint16_t *filename, size_t filename_len, ds_record_type type, std::vector<ds_store_path_entry_t> *path)
+{
+    path->clear();
+
+    uint32_t block_number = store->header_block.root_block_number;
+    ds_store_node node;
+    for (size_t depth = 0; depth < ds_store_cursor_max_depth; ++depth) {
+        if (ds_store_node_load(store, block_number, &node) != 0)
+            return -1;
+
+        size_t i = 0;
+        int cmp = 1;
+        for (; i < node.records.size(); ++i) {
+            ds_membuf_t buf = ds_membuf_make(node.records[i].data(), node.records[i].size());
+            ds_record_key_t key;
+            if (ds_record_mread_key(&key, &buf) != 0)
+                return -1;
+
+            cmp = ds_record_compare_key(filename, filename_len, type, &key);
+            if (cmp <= 0)
+                break;
+        }
+
+        ds_store_path_entry_t entry = { block_number, i };
+        path->push_back(entry);
+
+        if (cmp == 0)
+            return 1;
+
+        if (!node.internal())
+            return 0;
+
+        block_number = node.child(i);
+    }
+
+    fprintf(stderr, "node block number %u exceeds maximum tree depth %zu\n", block_number, ds_store_cursor_max_depth);
+    return -1;
+}
+
+/*!
+ * Splits the entries of \a node around the one that best balances the bytes
+ * on either side. The entries before it stay in \a node, the entries after
+ * it move to \a right and the entry itself is returned through \a separator.
+ */
+static void ds_store_node_split(ds_store_node *node, ds_store_node *right, uint32_t *separator_child, std::vector<unsigned char> *separator)
+{
+    size_t total = 0;
+    for (size_t i = 0; i < node->records.size(); ++i)
+        total += node->entry_size(i);
+
+    size_t m = 0, left = 0;
+    while (m + 1 < node->records.size() && left + node->entry_size(m) <= total / 2) {
+        left += node->entry_size(m);
+        ++m;
+    }
+
+    right->rightmost_child = node->rightmost_child;
+    right->records.assign(node->records.begin() + static_cast<std::ptrdiff_t>(m) + 1, node->records.end());
+    if (node->internal())
+        right->children.assign(node->children.begin() + static_cast<std::ptrdiff_t>(m) + 1, node->children.end());
+
+    *separator = node->records[m];
+    *separator_child = node->internal() ? node->children[m] : 0;
+
+    node->records.resize(m);
+    if (node->internal()) {
+        node->rightmost_child = *separator_child;
+        node->children.resize(m);
+    }
+}
+
+/*!
+ * Restores the page size limits along \a path after its last node changed,
+ * splitting nodes that overflow and merging or rebalancing nodes that have
+ * become too small, up to and including the root.
+ */
+static int ds_store_rebalance(ds_store_t *store, const std::vector<ds_store_path_entry_t> &path)
+{
+    dsstore_header_block_t *header_block = &store->header_block;
+    ds_store_node node, parent, sibling;
+
+    for (size_t depth = path.size(); depth-- > 0;) {
+        const uint32_t block_number = path[depth].block_number;
+        if (ds_store_node_load(store, block_number, &node) != 0)
+            return 1;
+
+        if (node.size() > dsstore_header_block_tree_node_page_size) {
+            // The left half moves to a new block so that the parent's
+            // reference to this block stays valid for the right half
+            ds_store_node right;
+            uint32_t separator_child;
+            std::vector<unsigned char> separator;
+            ds_store_node_split(&node, &right, &separator_child, &separator);
+
+            if (node.size() > dsstore_header_block_tree_node_page_size || right.size() > dsstore_header_block_tree_node_page_size) {
+                fprintf(stderr, "node block %u cannot be split into two pages\n", block_number);
+                return 1;
+            }
+
+            uint32_t left_block;
+            if (ds_store_new_block(store, &left_block) != 0)
+                return 1;
+
+            ds_store_node_store(store, left_block, node);
+            ds_store_node_store(store, block_number, right);
+            ++header_block->node_count;
+
+            if (depth == 0) {
+                uint32_t root_block;
+                if (ds_store_new_block(store, &root_block) != 0)
+                    return 1;
+
+                ds_store_node root;
+                root.rightmost_child = block_number;
+                root.children.push_back(left_block);
+                root.records.push_back(separator);
+                ds_store_node_store(store, root_block, root);
+
+                header_block->root_block_number = root_block;
+                ++header_block->node_levels;
+                ++header_block->node_count;
+            } else {
+                const ds_store_path_entry_t &up = path[depth - 1];
+                if (ds_store_node_load(store, up.block_number, &parent) != 0)
+                    return 1;
+
+                parent.children.insert(parent.children.begin() + static_cast<std::ptrdiff_t>(up.index), left_block);
+                parent.records.insert(parent.records.begin() + static_cast<std::ptrdiff_t>(up.index), separator);
+                ds_store_node_store(store, up.block_number, parent);
+            }
+            continue;
+        }
+
+        if (depth == 0) {
+            // An internal root left without records hands over to its only child
+            if (node.internal() && node.records.empty()) {
+                ds_store_release_block(store, block_number);
+                header_block->root_block_number = node.rightmost_child;
+                --header_block->node_levels;
+                --header_block->node_count;
+            }
+            continue;
+        }
+
+        if (node.size() >= ds_store_node_min_size)
+            continue;
+
+        // Pair the node with its left sibling where it has one, otherwise
+        // with its right sibling; \c s is the separator between the two
+        const ds_store_path_entry_t &up = path[depth - 1];
+        if (ds_store_node_load(store, up.block_number, &parent) != 0)
+            return 1;
+
+        const size_t s = up.index > 0 ? up.index - 1 : 0;
+        if (s >= parent.records.size())
+            continue; // an only child has nothing to merge with
+
+        ds_store_node left;
+        const uint32_t left_block = parent.child(s), right_block = parent.child(s + 1);
+        if (ds_store_node_load(store, left_block, &left) != 0 || ds_store_node_load(store, right_block, &sibling) != 0)
+            return 1;
+
+        if (left.internal() != sibling.internal()) {
+            fprintf(stderr, "sibling nodes %u and %u are at different levels\n", left_block, right_block);
+            return 1;
+        }
+
+        // Concatenate both nodes with the separator between them
+        ds_store_node merged;
+        merged.rightmost_child = sibling.rightmost_child;
+        merged.records = left.records;
+        merged.records.push_back(parent.records[s]);
+        merged.records.insert(merged.records.end(), sibling.records.begin(), sibling.records.end());
+        if (left.internal()) {
+            merged.children = left.children;
+            merged.children.push_back(left.rightmost_child);
+            merged.children.insert(merged.children.end(), sibling.children.begin(), sibling.children.end());
+        }
+
+        if (merged.size() <= dsstore_header_block_tree_node_page_size) {
+            ds_store_node_store(store, right_block, merged);
+            ds_store_release_block(store, left_block);
+            --header_block->node_count;
+
+            parent.records.erase(parent.records.begin() + static_cast<std::ptrdiff_t>(s));
+            parent.children.erase(parent.children.begin() + static_cast<std::ptrdiff_t>(s));
+        } else {
+            ds_store_node right;
+            uint32_t separator_child;
+            ds_store_node_split(&merged, &right, &separator_child, &parent.records[s]);
+            ds_store_node_store(store, left_block, merged);
+            ds_store_node_store(store, right_block, right);
+        }
+
+        ds_store_node_store(store, up.block_number, parent);
+    }
+
+    return 0;
+}
+
+static int ds_store_encode_entry(ds_record_t *record, std::vector<unsigned char> *entry)
+{
+    entry->clear();
+    if (ds_record_mwrite(record, *entry) != 0)
+        return 1;
+
+    if (entry->size() > ds_store_max_record_size) {
+        fprintf(stderr, "record of %zu bytes exceeds the maximum of %zu bytes\n", entry->size(), ds_store_max_record_size);
+        return 1;
+    }
+
+    return 0;
+}
+
+int ds_store_insert_record(ds_store_t *store, ds_record_t *record)
+{
+    assert(store);
+    assert(record);
+
+    std::vector<unsigned char> entry;
+    if (ds_store_init_tree(store) != 0 || ds_store_encode_entry(record, &entry) != 0)
+        return 1;
+
+    std::vector<ds_store_path_entry_t> path;
+    const int found = ds_store_find_path(store, record->filename.data(), record->filename.size(), record->record_type, &path);
+    if (found < 0)
+        return 1;
+
+    if (found > 0) {
+        fprintf(stderr, "record already exists\n");
+        return 1;
+    }
+
+    ds_store_node leaf;
+    if (ds_store_node_load(store, path.back().block_number, &leaf) != 0)
+        return 1;
+
+    leaf.records.insert(leaf.records.begin() + static_cast<std::ptrdiff_t>(path.back().index), entry);
+    ds_store_node_store(store, path.back().block_number, leaf);
+    ++store->header_block.record_count;
+
+    return ds_store_rebalance(store, path);
+}
+
+int ds_store_replace_record(ds_store_t *store, ds_record_t *record)
+{
+    assert(store);
+    assert(record);
+
+    std::vector<unsigned char> entry;
+    if (store->allocator.block_addresses.empty() || ds_store_encode_entry(record, &entry) != 0)
+        return 1;
+
+    std::vector<ds_store_path_entry_t> path;
+    const int found = ds_store_find_path(store, record->filename.data(), record->filename.size(), record->record_type, &path);
+    if (found < 0)
+        return 1;
+
+    if (found == 0) {
+        fprintf(stderr, "record does not exist\n");
+        return 1;
+    }
+
+    ds_store_node node;
+    if (ds_store_node_load(store, path.back().block_number, &node) != 0)
+        return 1;
+
+    node.records[path.back().index].swap(entry);
+    ds_store_node_store(store, path.back().block_number, node);
+
+    return ds_store_rebalance(store, path);
+}
+
+int ds_store_delete_record(ds_store_t *store, const uint16_t *filename, size_t filename_len, ds_record_type type)
+{
+    assert(store);
+    assert(filename || filename_len == 0);
+
+    if (store->allocator.block_addresses.empty())
+        return 1;
+
+    std::vector<ds_store_path_entry_t> path;
+    const int found = ds_store_find_path(store, filename, filename_len, type, &path);
+    if (found < 0)
+        return 1;
+
+    if (found == 0) {
+        fprintf(stderr, "record does not exist\n");
+        return 1;
+    }
+
+    ds_store_node node;
+    const ds_store_path_entry_t target = path.back();
+    if (ds_store_node_load(store, target.block_number, &node) != 0)
+        return 1;
+
+    if (!node.internal()) {
+        node.records.erase(node.records.begin() + static_cast<std::ptrdiff_t>(target.index));
+        ds_store_node_store(store, target.block_number, node);
+    } else {
+        // Replace the record with its predecessor, the last record in the
+        // rightmost leaf of the subtree to its left
+        ds_store_node leaf;
+        uint32_t block_number = node.children[target.index];
+        for (;;) {
+            if (path.size() > ds_store_cursor_max_depth) {
+                fprintf(stderr, "node block number %u exceeds maximum tree depth %zu\n", block_number, ds_store_cursor_max_depth);
+                return 1;
+            }
+
+            if (ds_store_node_load(store, block_number, &leaf) != 0)
+                return 1;
+
+            ds_store_path_entry_t entry = { block_number, leaf.records.size() };
+            path.push_back(entry);
+
+            if (!leaf.internal())
+                break;
+
+            block_number = leaf.rightmost_child;
+        }
+
+        if (leaf.records.empty()) {
+            fprintf(stderr, "leaf node block %u is empty\n", block_number);
+            return 1;
+        }
+
+        node.records[target.index].swap(leaf.records.back());
+        leaf.records.pop_back();
+        ds_store_node_store(store, block_number, leaf);
+        ds_store_node_store(store, target.block_number, node);
+    }
+
+    --store->header_block.record_count;
+    return ds_store_rebalance(store, path);
+}
+
+/*!
+ * Size to reserve for the allocator block given its current contents:
+ * allocating the block itself can split up to one block per size class and
+ * each of \a pending_frees adds one more free list entry.
+ */
+static uint32_t ds_store_allocator_block_size(dsstore_buddy_allocator_state_t *allocator, size_t pending_frees)
+{
+    std::vector<unsigned char> data;
+    dsstore_buddy_allocator_state_mwrite(allocator, data);
+
+    const size_t free_list_count = sizeof(allocator->free_lists) / sizeof(allocator->free_lists[0]);
+    const size_t size = data.size() + (free_list_count + pending_frees) * sizeof(uint32_t);
+    return std::max<uint32_t>(static_cast<uint32_t>(size), 2048);
+}
+
+int ds_store_fcommit(ds_store_t *store, FILE *file)
+{
+    assert(store);
+    assert(file);
+
+    if (!store->modified && !store->detached)
+        return 0;
+
+    // Allocation runs on a copy that only replaces the store's allocator once
+    // the file header refers to it, so a failed commit can be retried
+    dsstore_buddy_allocator_state_t allocator_state = store->allocator;
+    dsstore_buddy_allocator_state_t *allocator = &allocator_state;
+
+    // Dirty pages go to new blocks; the blocks they replace are only freed
+    // once everything else has been placed, so nothing the previous version
+    // of the tree refers to is overwritten while pages are written
+    std::vector<uint32_t> stale;
+    for (std::set<uint32_t>::const_iterator it = store->freed_blocks.begin(); it != store->freed_blocks.end(); ++it) {
+        stale.push_back(allocator->block_addresses[*it]);
+        allocator->block_addresses[*it] = 0;
+    }
+
+    for (std::set<uint32_t>::const_iterator it = store->dirty_blocks.begin(); it != store->dirty_blocks.end(); ++it) {
+        if (allocator->block_addresses[*it] != 0)
+            stale.push_back(allocator->block_addresses[*it]);
+
+        const uint32_t size = static_cast<uint32_t>(store->pages[*it].size());
+        if (dsstore_buddy_allocator_alloc(allocator, size, &allocator->block_addresses[*it]) != 0)
+            return 1;
+    }
+
+    // The header block moves as well, so that the previous header block
+    // still describes the previous tree until the file header is switched
+    if (store->header_block_number == 0) {
+        fprintf(stderr, "header block number refers to the allocator block\n");
+        return 1;
     }
 
-    // Look up the offset of the header block
-    const uint32_t header_block_addr = store->allocator.block_addresses[header_block_number];
-    const uint32_t header_block_offset = dsstore_buddy_allocator_state_block_address_offset(header_block_addr);
+    std::vector<unsigned char> header_block_data;
+    dsstore_header_block_mwrite(&store->header_block, header_block_data);
 
-    if (fseek(file, static_cast<long>(sizeof(store->header.version) + header_block_offset), SEEK_SET) != 0) {
-        fprintf(stderr, "could not seek to header block offset\n");
-        return nullptr;
-    }
+    uint32_t &header_block_address = allocator->block_addresses[store->header_block_number];
+    if (header_block_address != 0)
+        stale.push_back(header_block_address);
 
-    if (dsstore_header_block_fread(&store->header_block, file) != 0) {
-        ds_store_free(store);
-        return nullptr;
+    if (dsstore_buddy_allocator_alloc(allocator, static_cast<uint32_t>(header_block_data.size()), &header_block_address) != 0)
+        return 1;
+
+    if (allocator->block_addresses[0] != 0)
+        stale.push_back(allocator->block_addresses[0]);
+
+    if (dsstore_buddy_allocator_alloc(allocator, ds_store_allocator_block_size(allocator, stale.size()), &allocator->block_addresses[0]) != 0)
+        return 1;
+
+    for (size_t i = 0; i < stale.size(); ++i) {
+        if (dsstore_buddy_allocator_free(allocator, stale[i]) != 0)
+            return 1;
     }
 
-    return store;
-}
+    if (dsstore_buddy_allocator_check(allocator) != 0)
+        return 1;
 
-int ds_store_fwrite(ds_store_t *store, FILE *file) {
-    if (dsstore_header_fwrite(&store->header, file) != 0) {
+    std::vector<unsigned char> allocator_data;
+    dsstore_buddy_allocator_state_mwrite(allocator, allocator_data);
+    if (allocator_data.size() > dsstore_buddy_allocator_state_block_address_size(allocator->block_addresses[0])) {
+        fprintf(stderr, "allocator state of %zu bytes does not fit its block\n", allocator_data.size());
         return 1;
     }
 
-    if (ds_store_seek_buddy_allocator(store, file) != 0) {
-        fprintf(stderr, "could not seek to buddy allocator offset\n");
+    dsstore_header_t header_state = store->header;
+    dsstore_header_t *header = &header_state;
+    header->version = 1;
+    header->magic = kDSHeaderMagic;
+    header->allocator_offset = dsstore_buddy_allocator_state_block_address_offset(allocator->block_addresses[0]);
+    header->allocator_size = dsstore_buddy_allocator_state_block_address_size(allocator->block_addresses[0]);
+    header->allocator_offset_check = header->allocator_offset;
+
+    std::vector<unsigned char> header_data;
+    dsstore_header_mwrite(header, header_data);
+
+    // Block offsets are relative to the end of the version field
+    const auto place = [file, header](uint32_t addr, const std::vector<unsigned char> &contents) {
+        const long offset = static_cast<long>(sizeof(header->version) + dsstore_buddy_allocator_state_block_address_offset(addr));
+        return fseek(file, offset, SEEK_SET) == 0 && fwrite(contents.data(), sizeof(contents[0]), contents.size(), file) == contents.size();
+    };
+
+    bool ok = true;
+    for (std::set<uint32_t>::const_iterator it = store->dirty_blocks.begin(); ok && it != store->dirty_blocks.end(); ++it)
+        ok = place(allocator->block_addresses[*it], store->pages[*it]);
+
+    // Unchanged blocks of a detached store only exist in its data
+    for (uint32_t i = 1; ok && store->detached && i < allocator->block_addresses.size(); ++i) {
+        const uint32_t addr = allocator->block_addresses[i];
+        if (addr == 0 || i == store->header_block_number || store->dirty_blocks.count(i) != 0)
+            continue;
+
+        const size_t offset = sizeof(header->version) + dsstore_buddy_allocator_state_block_address_offset(addr);
+        const size_t size = dsstore_buddy_allocator_state_block_address_size(addr);
+        if (offset > store->data.size || size > store->data.size - offset) {
+            fprintf(stderr, "block %u lies outside the store\n", i);
+            return 1;
+        }
+
+        ok = place(addr, std::vector<unsigned char>(store->data.data + offset, store->data.data + offset + size));
+    }
+
+    // The file header goes last so that it only points at the new allocator
+    // once everything it describes is in place
+    ok = ok && place(allocator->block_addresses[store->header_block_number], header_block_data)
+            && place(allocator->block_addresses[0], allocator_data)
+            && fseek(file, 0, SEEK_SET) == 0
+            && fwrite(header_data.data(), sizeof(header_data[0]), header_data.size(), file) == header_data.size()
+            && fflush(file) == 0;
+
+    if (!ok) {
+        fprintf(stderr, "error writing store: %s\n", strerror(errno));
         return 1;
     }
 
-    if (dsstore_buddy_allocator_state_fwrite(&store->allocator, file) != 0) {
+    // Pages stay cached: the data the store was read from no longer matches
+    store->allocator = std::move(allocator_state);
+    store->header = header_state;
+    store->dirty_blocks.clear();
+    store->freed_blocks.clear();
+    store->modified = false;
+    store->detached = false;
+
+    // Blocks are written wherever the allocator places them, which grows the
+    // file as needed; free space left at the end is given back
+    const off_t size = static_cast<off_t>(sizeof(header->version) + dsstore_buddy_allocator_extent(&store->allocator));
+    struct stat st;
+    if (fstat(fileno(file), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > size && ftruncate(fileno(file), size) != 0) {
+        fprintf(stderr, "error truncating store: %s\n", strerror(errno));
         return 1;
     }
 
-    fprintf(stderr, "NOT YET IMPLEMENTED\n");
-    return 1;
+    return 0;
 }
 
-ds_store_t *ds_store_create(void)
+/*!
+ * One step of a parallel traversal, in key order: either a subtree to be
+ * decoded by a worker or a separator record from an internal node above the
+ * subtrees, which the consumer decodes itself.
+ */
+struct ds_store_traversal_item
 {
-    return new _ds_store();
-}
+    ds_store_traversal_item();
 
-void ds_store_free(ds_store_t *store)
-{
-    delete store;
-}
+    uint32_t block_number; // 0 for a separator
+    std::vector<unsigned char> separator;
 
-int ds_store_seek_buddy_allocator(ds_store_t *store, FILE *file)
+    // Filled in by the worker that decoded the subtree
+    std::vector<ds_record_t *> records;
+    bool done;
+    bool failed;
+};
+
+ds_store_traversal_item::ds_store_traversal_item()
+    : block_number(), separator(), records(), done(), failed()
 {
-    return fseek(file, static_cast<long>(sizeof(store->header.version) + store->header.allocator_offset), SEEK_SET);
 }
 
-int ds_store_enum_blocks_core(dsstore_buddy_allocator_state_t *allocator, dsstore_header_block_t *header_block, uint32_t block_number, const std::function<void(ds_record_t *)> &record_func, FILE *file)
+/*!
+ * Splits the tree into at least \a target subtrees where it is deep enough,
+ * expanding internal nodes one level at a time so that the subtrees and the
+ * separators between them stay in key order.
+ */
+static int ds_store_split_subtrees(ds_store_t *store, size_t target, std::vector<ds_store_traversal_item> *items)
 {
+    items->assign(1, ds_store_traversal_item());
+    items->front().block_number = store->header_block.root_block_number;
+    ds_store_stats_scope stats(store->stats.get());
+
+    for (size_t depth = 0; depth < ds_store_cursor_max_depth; ++depth) {
+        std::vector<ds_store_traversal_item> expanded;
+        size_t subtrees = 0;
+        bool internal = false;
+        ds_store_node node;
+
+        for (size_t i = 0; i < items->size(); ++i) {
+            ds_store_traversal_item &item = (*items)[i];
+            if (item.block_number == 0) {
+                expanded.push_back(std::move(item));
+                continue;
+            }
 
-    int ret = 0, status = 0;
+            if (ds_store_node_load(store, item.block_number, &node, stats.counters.get()) != 0)
+                return 1;
 
-    if (header_block->root_block_number >= allocator->block_count) {
-        fprintf(stderr, "root node block number out of range\n");
-        ret = 1;
-        return ret;
-    }
+            if (!node.internal()) {
+                expanded.push_back(std::move(item));
+                ++subtrees;
+                continue;
+            }
 
-    // Look up the offset of the root node
-    const uint32_t root_block_addr = allocator->block_addresses[block_number];
-    const uint32_t root_block_offset = dsstore_buddy_allocator_state_block_address_offset(root_block_addr);
+            internal = true;
+            for (size_t j = 0; j <= node.records.size(); ++j) {
+                ds_store_traversal_item child;
+                child.block_number = node.child(j);
+                expanded.push_back(std::move(child));
+                ++subtrees;
+
+                if (j < node.records.size()) {
+                    ds_store_traversal_item separator;
+                    separator.separator.swap(node.records[j]);
+                    expanded.push_back(std::move(separator));
+                }
+            }
+        }
 
-    off_t stream_offset = ftell(file);
-    dsstore_header_t header; // for sizeof
-    if (fseek(file, static_cast<long>(sizeof(header.version) + root_block_offset), SEEK_SET) != 0) {
-        fprintf(stderr, "could not seek to root block (records) offset\n");
-        ret = 1;
-        goto cleanup;
+        items->swap(expanded);
+        if (!internal || subtrees >= target)
+            return 0;
     }
 
-    uint32_t node_type;
-    if (fread_uint32_be(&node_type, file) != 1) {
-        fprintf(stderr, "error reading node type\n");
-        ret = 1;
-        goto cleanup;
-    }
+    fprintf(stderr, "tree exceeds maximum depth %zu\n", ds_store_cursor_max_depth);
+    return 1;
+}
 
-    uint32_t record_count;
-    if (fread_uint32_be(&record_count, file) != 1) {
-        fprintf(stderr, "error reading record count\n");
-        ret = 1;
-        goto cleanup;
-    }
+static void ds_store_free_records(std::vector<ds_record_t *> *records)
+{
+    for (size_t i = 0; i < records->size(); ++i)
+        ds_record_free((*records)[i]);
+    records->clear();
+}
 
-    //fprintf(stdout, "record count: %u\n", record_count);
+int ds_store_enum_records_parallel_core(ds_store_t *store, unsigned thread_count, const std::function<void(ds_record_t *)> &func)
+{
+    assert(store);
+
+    amg::trace_span span("ds_store_enum_records_parallel", "enum");
+    if (thread_count == 0)
+        thread_count = std::max(1u, std::thread::hardware_concurrency());
+
+    // Several subtrees per thread keep every thread busy when subtrees
+    // differ in size; workers claim the next subtree as they finish one
+    std::vector<ds_store_traversal_item> items;
+    if (thread_count < 2 || ds_store_split_subtrees(store, thread_count * 8, &items) != 0 || items.size() < 2)
+        return ds_store_enum_records_core(store, func);
+
+    std::vector<size_t> subtrees;
+    for (size_t i = 0; i < items.size(); ++i) {
+        if (items[i].block_number != 0)
+            subtrees.push_back(i);
+    }
 
-    // Leaf node
-    if (node_type == 0) {
-        for (size_t i = 0; i < record_count; ++i) {
-            ds_record_t *record = ds_record_create();
-            if ((status = ds_record_fread(record, file)) != 0) {
-                ds_record_free(record);
-                ret = 1;
-                goto cleanup;
+    // Workers stay at most this many subtrees ahead of the consumer, which
+    // bounds the number of decoded records held in memory
+    const size_t window = thread_count * 4;
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    size_t next_subtree = 0, consumed_subtrees = 0;
+    bool abort = false;
+
+    // Records the consumer is done with go back to the workers, so once the
+    // window has filled the traversal stops allocating records
+    std::vector<ds_record_t *> recycled;
+
+    const auto worker = [&]() {
+        std::vector<ds_record_t *> spare;
+        for (;;) {
+            size_t index;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [&]() { return abort || next_subtree >= subtrees.size() || next_subtree < consumed_subtrees + window; });
+                if (abort || next_subtree >= subtrees.size())
+                    break;
+                index = subtrees[next_subtree++];
+
+                spare.insert(spare.end(), recycled.begin(), recycled.end());
+                recycled.clear();
             }
 
-            if (record_func) {
-                record_func(record);
+            ds_store_traversal_item &item = items[index];
+            amg::trace_span span("ds_store_enum_subtree", "enum");
+            span.set_arg("block", item.block_number);
+            _ds_store_cursor cursor(store, item.block_number);
+            cursor.reset();
+
+            int status = 0;
+            for (;;) {
+                if (spare.empty())
+                    spare.push_back(ds_record_create());
+                if ((status = ds_store_cursor_next_core(&cursor, spare.back())) <= 0)
+                    break;
+                item.records.push_back(spare.back());
+                spare.pop_back();
             }
 
-            ds_record_free(record);
+            std::lock_guard<std::mutex> lock(mutex);
+            item.failed = status < 0;
+            item.done = true;
+            changed.notify_all();
         }
-    } else {
-        // Internal node...
-        for (size_t i = 0; i < record_count; ++i) {
-            if (fread_uint32_be(&block_number, file) != 1) {
-                fprintf(stderr, "error reading internal node block number\n");
-                ret = 1;
-                goto cleanup;
-            }
 
-            if (ds_store_enum_blocks_core(allocator, header_block, block_number, record_func, file) != 0) {
-                ret = 1;
-                goto cleanup;
+        ds_store_free_records(&spare);
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < std::min<size_t>(thread_count, subtrees.size()); ++i)
+        threads.push_back(std::thread(worker));
+
+    // Hand records to the consumer on this thread, in key order
+    int result = 0;
+    ds_record_t *separator = ds_store_acquire_record();
+    ds_store_stats_scope stats(store->stats.get());
+    for (size_t i = 0; i < items.size() && result == 0; ++i) {
+        ds_store_traversal_item &item = items[i];
+        if (item.block_number == 0) {
+            ds_membuf_t buf = ds_membuf_make(item.separator.data(), item.separator.size());
+            const uint64_t start = stats.counters ? ds_store_stats_now() : 0;
+            if (ds_record_mread(separator, &buf) != 0) {
+                result = 1;
+                continue;
             }
 
-            ds_record_t *record = ds_record_create();
-            if ((status = ds_record_fread(record, file)) != 0) {
-                ds_record_free(record);
-                ret = 1;
-                goto cleanup;
-            }
+            if (stats.counters)
+                stats.counters->add_record(separator, ds_store_stats_now() - start);
 
-            if (record_func) {
-                record_func(record);
+            if (func) {
+                func(separator);
             }
+            continue;
+        }
 
-            ds_record_free(record);
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [&]() { return item.done; });
         }
 
-        if (ds_store_enum_blocks_core(allocator, header_block, node_type, record_func, file) != 0) {
-            ret = 1;
-            goto cleanup;
+        if (item.failed) {
+            result = 1;
+        } else if (func) {
+            for (size_t j = 0; j < item.records.size(); ++j)
+                func(item.records[j]);
         }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        recycled.insert(recycled.end(), item.records.begin(), item.records.end());
+        item.records.clear();
+        ++consumed_subtrees;
+        changed.notify_all();
     }
+    ds_store_release_record(separator);
 
-    // Restore stream offset
-    if (fseek(file, static_cast<long>(stream_offset), SEEK_SET) != 0) {
-        fprintf(stderr, "failed to restore original stream offset after reading block\n");
-        ret = 1;
-        goto cleanup;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        abort = true;
+        changed.notify_all();
     }
 
-cleanup:
-    return ret;
-}
+    for (size_t i = 0; i < threads.size(); ++i)
+        threads[i].join();
 
-int ds_store_enum_records(ds_store_t *store, ds_store_record_func_t func)
-{
-    return ds_store_enum_blocks_core(&store->allocator, &store->header_block, store->header_block.root_block_number, func, store->file);
-}
+    for (size_t i = 0; i < items.size(); ++i)
+        ds_store_free_records(&items[i].records);
+    ds_store_free_records(&recycled);
 
-int ds_store_enum_records_core(ds_store_t *store, const std::function<void(ds_record_t *)> &func)
-{
-    return ds_store_enum_blocks_core(&store->allocator, &store->header_block, store->header_block.root_block_number, func, store->file);
+    return result;
 }
 
-int ds_store_enum_blocks(dsstore_buddy_allocator_state_t *allocator, dsstore_header_block_t *header_block, uint32_t block_number, ds_store_record_func_t record_func, FILE *file)
+int ds_store_enum_records_parallel(ds_store_t *store, unsigned thread_count, ds_store_record_func_t func)
 {
-    return ds_store_enum_blocks_core(allocator, header_block, block_number, record_func, file);
+    return ds_store_enum_records_parallel_core(store, thread_count, func);
 }
 
 void dsstore_header_dump(dsstore_header_t *header)
@@ -274,10 +2431,10 @@ void dsstore_header_dump(dsstore_header_t *header)
 
 void dsstore_buddy_allocator_state_dump(dsstore_buddy_allocator_state_t *allocator_state)
 {
-    fprintf(stdout, "allocator block count: %u\n", allocator_state->block_count);
+    fprintf(stdout, "allocator block count: %zu\n", allocator_state->block_addresses.size());
     fprintf(stdout, "allocator unknown?: %u\n", allocator_state->unknown);
     fprintf(stdout, "allocator block addresses:");
-    for (size_t i = 0; i < allocator_state->block_count; ++i) {
+    for (size_t i = 0; i < allocator_state->block_addresses.size(); ++i) {
         // Each address is a packed offset and size...
         const uint32_t addr = allocator_state->block_addresses[i];
         const uint32_t offset = dsstore_buddy_allocator_state_block_address_offset(addr);
@@ -286,18 +2443,18 @@ void dsstore_buddy_allocator_state_dump(dsstore_buddy_allocator_state_t *allocat
     }
     fprintf(stdout, "\n");
 
-    fprintf(stdout, "allocator directory entry count: %u\n", allocator_state->directory_count);
-    for (size_t i = 0; i < allocator_state->directory_count; ++i) {
+    fprintf(stdout, "allocator directory entry count: %zu\n", allocator_state->directory_entries.size());
+    for (size_t i = 0; i < allocator_state->directory_entries.size(); ++i) {
         fprintf(stdout, "\tcount: %u\n", allocator_state->directory_entries[i].count);
-        fprintf(stdout, "\tname: %.255s\n", allocator_state->directory_entries[i].bytes);
+        fprintf(stdout, "\tname: %.*s\n", static_cast<int>(allocator_state->directory_entries[i].count), allocator_state->directory_entries[i].bytes);
         fprintf(stdout, "\tblock number: %u\n", allocator_state->directory_entries[i].block_number);
     }
 
     const size_t free_list_count = sizeof(allocator_state->free_lists) / sizeof(allocator_state->free_lists[0]);
     for (size_t i = 0; i < free_list_count; ++i) {
         fprintf(stdout, "free list #%zu:", i);
-        for (size_t j = 0; j < allocator_state->free_lists[i].count; ++j)
-            fprintf(stdout, " %u", allocator_state->free_lists[i].offsets[j]);
+        for (size_t j = 0; j < allocator_state->free_lists[i].size(); ++j)
+            fprintf(stdout, " %u", allocator_state->free_lists[i][j]);
         fprintf(stdout, "\n");
     }
 }
@@ -316,6 +2473,40 @@ void ds_store_dump_header(ds_store_t *store)
     dsstore_header_dump(&store->header);
 }
 
+void ds_store_stats_dump(const ds_store_stats_t *stats, FILE *file)
+{
+    assert(stats);
+    assert(file);
+
+    fprintf(file, "stores: %llu\n", static_cast<unsigned long long>(stats->stores));
+    fprintf(file, "file reads: %llu (%llu bytes)\n",
+            static_cast<unsigned long long>(stats->file_reads),
+            static_cast<unsigned long long>(stats->bytes_read));
+    fprintf(file, "nodes visited: %llu (%llu bytes)\n",
+            static_cast<unsigned long long>(stats->nodes_visited),
+            static_cast<unsigned long long>(stats->node_bytes));
+    fprintf(file, "records decoded: %llu (%llu blob bytes)\n",
+            static_cast<unsigned long long>(stats->records_decoded),
+            static_cast<unsigned long long>(stats->blob_bytes));
+    fprintf(file, "load: %.3f ms, nodes: %.3f ms, decode: %.3f ms\n",
+            stats->load_ns / 1e6, stats->node_ns / 1e6, stats->decode_ns / 1e6);
+
+    // Most expensive types first
+    std::vector<ds_store_type_stats_t> types(stats->types, stats->types + std::min<size_t>(stats->type_count, DS_STORE_STATS_MAX_TYPES));
+    std::sort(types.begin(), types.end(), [](const ds_store_type_stats_t &a, const ds_store_type_stats_t &b) {
+        return a.decode_ns > b.decode_ns;
+    });
+
+    for (size_t i = 0; i < types.size(); ++i) {
+        const uint32_t type_n = htonl(types[i].record_type);
+        fprintf(file, "  '%.4s': %llu records, %llu blob bytes, %.3f ms\n",
+                types[i].record_type != 0 ? reinterpret_cast<const char *>(&type_n) : "????",
+                static_cast<unsigned long long>(types[i].records),
+                static_cast<unsigned long long>(types[i].blob_bytes),
+                types[i].decode_ns / 1e6);
+    }
+}
+
 void ds_store_dump_allocator_state(ds_store_t *store)
 {
     dsstore_buddy_allocator_state_dump(&store->allocator);
@@ -452,12 +2643,19 @@ int dsstore_buddy_allocator_state_fread(dsstore_buddy_allocator_state_t *allocat
     assert(allocator_state);
     assert(file);
 
-    if (fread_uint32_be(&allocator_state->block_count, file) != 1)
+    uint32_t block_count;
+    if (fread_uint32_be(&block_count, file) != 1)
     {
         fprintf(stderr, "error reading allocator block count\n");
         return 1;
     }
 
+    if (block_count > dsstore_buddy_allocator_max_blocks)
+    {
+        fprintf(stderr, "allocator block count %u out of range\n", block_count);
+        return 1;
+    }
+
     if (fread_uint32_be(&allocator_state->unknown, file) != 1)
     {
         fprintf(stderr, "error reading allocator ????\n");
@@ -471,51 +2669,69 @@ int dsstore_buddy_allocator_state_fread(dsstore_buddy_allocator_state_t *allocat
 
     // The list of addresses is always padded with zeros to a multiple of 256 entries
     const size_t factor = 256;
-    const size_t block_count_to_read = allocator_state->block_count + factor - 1 - (allocator_state->block_count - 1) % factor;
+    const size_t block_count_to_read = (block_count + factor - 1) / factor * factor;
 
+    allocator_state->block_addresses.assign(block_count, 0);
     for (size_t i = 0; i < block_count_to_read; ++i)
     {
-        if (fread_uint32_be(&allocator_state->block_addresses[i], file) != 1)
+        uint32_t addr;
+        if (fread_uint32_be(&addr, file) != 1)
         {
             fprintf(stderr, "error reading allocator block address #%zu\n", i);
             return 1;
         }
+
+        if (i < block_count)
+            allocator_state->block_addresses[i] = addr;
     }
 
-    if (fread_uint32_be(&allocator_state->directory_count, file) != 1) {
+    uint32_t directory_count;
+    if (fread_uint32_be(&directory_count, file) != 1) {
         fprintf(stderr, "error reading allocator directory count\n");
         return 1;
     }
 
-    for (size_t i = 0; i < allocator_state->directory_count; ++i) {
-        if (fread_uint8(&allocator_state->directory_entries[i].count, file) != 1) {
+    // Entries are added as they are read, so a bogus count fails at the end
+    // of the file rather than allocating up front
+    allocator_state->directory_entries.clear();
+    for (size_t i = 0; i < directory_count; ++i) {
+        dsstore_buddy_allocator_directory_entry_t entry;
+        memset(&entry, 0, sizeof(entry));
+        if (fread_uint8(&entry.count, file) != 1) {
             fprintf(stderr, "error reading allocator directory entry #%zu data size\n", i);
             return 1;
         }
 
-        if (fread(&allocator_state->directory_entries[i].bytes, sizeof(allocator_state->directory_entries[i].bytes[0]), allocator_state->directory_entries[i].count, file) != allocator_state->directory_entries[i].count) {
+        if (fread(&entry.bytes, sizeof(entry.bytes[0]), entry.count, file) != entry.count) {
             fprintf(stderr, "error reading allocator directory entry #%zu data\n", i);
             return 1;
         }
 
-        if (fread_uint32_be(&allocator_state->directory_entries[i].block_number, file) != 1) {
+        if (fread_uint32_be(&entry.block_number, file) != 1) {
             fprintf(stderr, "error reading allocator directory entry #%zu block number\n", i);
             return 1;
         }
+
+        allocator_state->directory_entries.push_back(entry);
     }
 
     const size_t free_list_count = sizeof(allocator_state->free_lists) / sizeof(allocator_state->free_lists[0]);
     for (size_t i = 0; i < free_list_count; ++i) {
-        if (fread_uint32_be(&allocator_state->free_lists[i].count, file) != 1) {
+        uint32_t count;
+        if (fread_uint32_be(&count, file) != 1) {
             fprintf(stderr, "error reading allocator free list #%zu offset count\n", i);
             return 1;
         }
 
-        for (size_t j = 0; j < allocator_state->free_lists[i].count; ++j) {
-            if (fread_uint32_be(&allocator_state->free_lists[i].offsets[j], file) != 1) {
+        allocator_state->free_lists[i].clear();
+        for (size_t j = 0; j < count; ++j) {
+            uint32_t offset;
+            if (fread_uint32_be(&offset, file) != 1) {
                 fprintf(stderr, "error reading allocator free list #%zu offset #%zu\n", i, j);
                 return 1;
             }
+
+            allocator_state->free_lists[i].push_back(offset);
         }
     }
 
@@ -527,57 +2743,216 @@ int dsstore_buddy_allocator_state_fwrite(dsstore_buddy_allocator_state_t *alloca
     assert(allocator_state);
     assert(file);
 
-    if (fwrite_uint32_be(&allocator_state->block_count, file) != 1)
+    std::vector<unsigned char> buf;
+    dsstore_buddy_allocator_state_mwrite(allocator_state, buf);
+
+    if (fwrite(buf.data(), sizeof(buf[0]), buf.size(), file) != buf.size()) {
+        fprintf(stderr, "error writing allocator state\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+int dsstore_header_block_fread(dsstore_header_block_t *header_block, FILE *file)
+{
+    assert(header_block);
+    assert(file);
+
+    if (fread_uint32_be(&header_block->root_block_number, file) != 1) {
+        fprintf(stderr, "error reading root block number\n");
+        return 1;
+    }
+
+    if (fread_uint32_be(&header_block->node_levels, file) != 1) {
+        fprintf(stderr, "error reading node level count\n");
+        return 1;
+    }
+
+    if (fread_uint32_be(&header_block->record_count, file) != 1) {
+        fprintf(stderr, "error reading record count\n");
+        return 1;
+    }
+
+    if (fread_uint32_be(&header_block->node_count, file) != 1) {
+        fprintf(stderr, "error reading node count\n");
+        return 1;
+    }
+
+    if (fread_uint32_be(&header_block->tree_node_page_size, file) != 1) {
+        fprintf(stderr, "error reading node page size\n");
+        return 1;
+    }
+
+    if (header_block->tree_node_page_size != dsstore_header_block_tree_node_page_size) {
+        fprintf(stderr, "warning: unexpected node page size %u; expected 0x%x\n",
+                header_block->tree_node_page_size,
+                dsstore_header_block_tree_node_page_size);
+        return 1;
+    }
+    
+    return 0;
+}
+
+int dsstore_header_mread(dsstore_header_t *header, ds_membuf_t *buf)
+{
+    assert(header);
+    assert(buf);
+
+    if (mread_uint32_be(&header->version, buf) != 1) {
+        fprintf(stderr, "error reading version\n");
+        return 1;
+    }
+
+    if (header->version != 1) {
+        fprintf(stderr, "wrong version %u\n", header->version);
+        return 1;
+    }
+
+    uint32_t magic;
+    if (mread_uint32_be(&magic, buf) != 1) {
+        fprintf(stderr, "error reading magic\n");
+        return 1;
+    }
+
+    header->magic = static_cast<FourCharCode>(magic);
+
+    if (header->magic != kDSHeaderMagic) {
+        fprintf(stderr, "wrong magic '%u', expected '%u'\n",
+                static_cast<unsigned int>(header->magic),
+                static_cast<unsigned int>(kDSHeaderMagic));
+        return 1;
+    }
+
+    if (mread_uint32_be(&header->allocator_offset, buf) != 1) {
+        fprintf(stderr, "error reading allocator offset\n");
+        return 1;
+    }
+
+    if (mread_uint32_be(&header->allocator_size, buf) != 1) {
+        fprintf(stderr, "error reading allocator size\n");
+        return 1;
+    }
+
+    if (mread_uint32_be(&header->allocator_offset_check, buf) != 1) {
+        fprintf(stderr, "error reading allocator offset copy\n");
+        return 1;
+    }
+
+    if (header->allocator_offset != header->allocator_offset_check) {
+        // "invalid storage type bad root address"
+        fprintf(stderr, "allocator offset %u does not match check copy %u\n",
+                header->allocator_offset, header->allocator_offset_check);
+        return 1;
+    }
+
+    const size_t unknown_size = sizeof(header->padding);
+    size_t n;
+    if ((n = mread(&header->padding, sizeof(header->padding[0]), unknown_size, buf)) != unknown_size) {
+        fprintf(stderr, "wrong number of unknown header bytes %zu, expected %zu", n, unknown_size);
+        return 1;
+    }
+
+    return 0;
+}
+
+int dsstore_buddy_allocator_state_mread(dsstore_buddy_allocator_state_t *allocator_state, ds_membuf_t *buf)
+{
+    assert(allocator_state);
+    assert(buf);
+
+    uint32_t block_count;
+    if (mread_uint32_be(&block_count, buf) != 1)
+    {
+        fprintf(stderr, "error reading allocator block count\n");
+        return 1;
+    }
+
+    if (mread_uint32_be(&allocator_state->unknown, buf) != 1)
     {
-        fprintf(stderr, "error writing allocator block count\n");
+        fprintf(stderr, "error reading allocator ????\n");
         return 1;
     }
 
-    if (fwrite_uint32_be(&allocator_state->unknown, file) != 1)
+    if (allocator_state->unknown != 0)
+    {
+        fprintf(stderr, "warning: expected allocator unknown bytes to be 0, got %u\n", allocator_state->unknown);
+    }
+
+    // The list of addresses is always padded with zeros to a multiple of 256 entries
+    const size_t factor = 256;
+    const size_t block_count_to_read = (static_cast<size_t>(block_count) + factor - 1) / factor * factor;
+
+    // Check every count against the bytes that remain before sizing a table
+    if (block_count > dsstore_buddy_allocator_max_blocks || block_count_to_read > ds_membuf_remaining(buf) / sizeof(uint32_t))
     {
-        fprintf(stderr, "error writing allocator ????\n");
+        fprintf(stderr, "allocator block count %u out of range\n", block_count);
         return 1;
     }
 
-    for (size_t i = 0; i < 256; ++i) {
-        if (fwrite_uint32_be(&allocator_state->block_addresses[i], file) != 1) {
-            fprintf(stderr, "error writing allocator block address #%zu\n", i);
+    allocator_state->block_addresses.resize(block_count);
+    for (size_t i = 0; i < block_count_to_read; ++i)
+    {
+        uint32_t addr;
+        if (mread_uint32_be(&addr, buf) != 1)
+        {
+            fprintf(stderr, "error reading allocator block address #%zu\n", i);
             return 1;
         }
+
+        if (i < block_count)
+            allocator_state->block_addresses[i] = addr;
+    }
+
+    uint32_t directory_count;
+    if (mread_uint32_be(&directory_count, buf) != 1) {
+        fprintf(stderr, "error reading allocator directory count\n");
+        return 1;
     }
 
-    if (fwrite_uint32_be(&allocator_state->directory_count, file) != 1) {
-        fprintf(stderr, "error writing allocator directory count\n");
+    const size_t min_directory_entry_size = sizeof(uint8_t) + sizeof(uint32_t);
+    if (directory_count > ds_membuf_remaining(buf) / min_directory_entry_size) {
+        fprintf(stderr, "allocator directory count %u out of range\n", directory_count);
         return 1;
     }
 
-    for (size_t i = 0; i < allocator_state->directory_count; ++i) {
-        if (fwrite_uint8(&allocator_state->directory_entries[i].count, file) != 1) {
-            fprintf(stderr, "error writing allocator directory entry #%zu data size\n", i);
+    allocator_state->directory_entries.resize(directory_count);
+    for (size_t i = 0; i < directory_count; ++i) {
+        dsstore_buddy_allocator_directory_entry_t &entry = allocator_state->directory_entries[i];
+        memset(&entry, 0, sizeof(entry));
+        if (mread_uint8(&entry.count, buf) != 1) {
+            fprintf(stderr, "error reading allocator directory entry #%zu data size\n", i);
             return 1;
         }
 
-        if (fwrite(&allocator_state->directory_entries[i].bytes, sizeof(allocator_state->directory_entries[i].bytes[0]), allocator_state->directory_entries[i].count, file) != allocator_state->directory_entries[i].count) {
-            fprintf(stderr, "error writing allocator directory entry #%zu data\n", i);
+        if (mread(&entry.bytes, sizeof(entry.bytes[0]), entry.count, buf) != entry.count) {
+            fprintf(stderr, "error reading allocator directory entry #%zu data\n", i);
             return 1;
         }
 
-        if (fwrite_uint32_be(&allocator_state->directory_entries[i].block_number, file) != 1) {
-            fprintf(stderr, "error writing allocator directory entry #%zu block number\n", i);
+        if (mread_uint32_be(&entry.block_number, buf) != 1) {
+            fprintf(stderr, "error reading allocator directory entry #%zu block number\n", i);
             return 1;
         }
     }
 
     const size_t free_list_count = sizeof(allocator_state->free_lists) / sizeof(allocator_state->free_lists[0]);
     for (size_t i = 0; i < free_list_count; ++i) {
-        if (fwrite_uint32_be(&allocator_state->free_lists[i].count, file) != 1) {
-            fprintf(stderr, "error writing allocator free list #%zu offset count\n", i);
+        uint32_t count;
+        if (mread_uint32_be(&count, buf) != 1) {
+            fprintf(stderr, "error reading allocator free list #%zu offset count\n", i);
             return 1;
         }
 
-        for (size_t j = 0; j < allocator_state->free_lists[i].count; ++j) {
-            if (fwrite_uint32_be(&allocator_state->free_lists[i].offsets[j], file) != 1) {
-                fprintf(stderr, "error writing allocator free list #%zu offset #%zu\n", i, j);
+        if (count > ds_membuf_remaining(buf) / sizeof(uint32_t)) {
+            fprintf(stderr, "allocator free list #%zu offset count %u out of range\n", i, count);
+            return 1;
+        }
+
+        allocator_state->free_lists[i].resize(count);
+        for (size_t j = 0; j < count; ++j) {
+            if (mread_uint32_be(&allocator_state->free_lists[i][j], buf) != 1) {
+                fprintf(stderr, "error reading allocator free list #%zu offset #%zu\n", i, j);
                 return 1;
             }
         }
@@ -586,32 +2961,32 @@ int dsstore_buddy_allocator_state_fwrite(dsstore_buddy_allocator_state_t *alloca
     return 0;
 }
 
-int dsstore_header_block_fread(dsstore_header_block_t *header_block, FILE *file)
+int dsstore_header_block_mread(dsstore_header_block_t *header_block, ds_membuf_t *buf)
 {
     assert(header_block);
-    assert(file);
+    assert(buf);
 
-    if (fread_uint32_be(&header_block->root_block_number, file) != 1) {
+    if (mread_uint32_be(&header_block->root_block_number, buf) != 1) {
         fprintf(stderr, "error reading root block number\n");
         return 1;
     }
 
-    if (fread_uint32_be(&header_block->node_levels, file) != 1) {
+    if (mread_uint32_be(&header_block->node_levels, buf) != 1) {
         fprintf(stderr, "error reading node level count\n");
         return 1;
     }
 
-    if (fread_uint32_be(&header_block->record_count, file) != 1) {
+    if (mread_uint32_be(&header_block->record_count, buf) != 1) {
         fprintf(stderr, "error reading record count\n");
         return 1;
     }
 
-    if (fread_uint32_be(&header_block->node_count, file) != 1) {
+    if (mread_uint32_be(&header_block->node_count, buf) != 1) {
         fprintf(stderr, "error reading node count\n");
         return 1;
     }
 
-    if (fread_uint32_be(&header_block->tree_node_page_size, file) != 1) {
+    if (mread_uint32_be(&header_block->tree_node_page_size, buf) != 1) {
         fprintf(stderr, "error reading node page size\n");
         return 1;
     }
@@ -622,6 +2997,58 @@ int dsstore_header_block_fread(dsstore_header_block_t *header_block, FILE *file)
                 dsstore_header_block_tree_node_page_size);
         return 1;
     }
-    
+
     return 0;
 }
+
+void dsstore_header_mwrite(dsstore_header_t *header, std::vector<unsigned char> &buf)
+{
+    assert(header);
+
+    mwrite_uint32_be(header->version, buf);
+    mwrite_uint32_be(static_cast<uint32_t>(header->magic), buf);
+    mwrite_uint32_be(header->allocator_offset, buf);
+    mwrite_uint32_be(header->allocator_size, buf);
+    mwrite_uint32_be(header->allocator_offset_check, buf);
+    mwrite(header->padding, sizeof(header->padding), buf);
+}
+
+void dsstore_buddy_allocator_state_mwrite(dsstore_buddy_allocator_state_t *allocator_state, std::vector<unsigned char> &buf)
+{
+    assert(allocator_state);
+
+    const size_t block_count = allocator_state->block_addresses.size();
+    mwrite_uint32_be(static_cast<uint32_t>(block_count), buf);
+    mwrite_uint32_be(allocator_state->unknown, buf);
+
+    // The list of addresses is always padded with zeros to a multiple of 256 entries
+    const size_t factor = 256;
+    const size_t block_count_to_write = (block_count + factor - 1) / factor * factor;
+    for (size_t i = 0; i < block_count_to_write; ++i)
+        mwrite_uint32_be(i < block_count ? allocator_state->block_addresses[i] : 0, buf);
+
+    mwrite_uint32_be(static_cast<uint32_t>(allocator_state->directory_entries.size()), buf);
+    for (size_t i = 0; i < allocator_state->directory_entries.size(); ++i) {
+        mwrite_uint8(allocator_state->directory_entries[i].count, buf);
+        mwrite(allocator_state->directory_entries[i].bytes, allocator_state->directory_entries[i].count, buf);
+        mwrite_uint32_be(allocator_state->directory_entries[i].block_number, buf);
+    }
+
+    const size_t free_list_count = sizeof(allocator_state->free_lists) / sizeof(allocator_state->free_lists[0]);
+    for (size_t i = 0; i < free_list_count; ++i) {
+        mwrite_uint32_be(static_cast<uint32_t>(allocator_state->free_lists[i].size()), buf);
+        for (size_t j = 0; j < allocator_state->free_lists[i].size(); ++j)
+            mwrite_uint32_be(allocator_state->free_lists[i][j], buf);
+    }
+}
+
+void dsstore_header_block_mwrite(dsstore_header_block_t *header_block, std::vector<unsigned char> &buf)
+{
+    assert(header_block);
+
+    mwrite_uint32_be(header_block->root_block_number, buf);
+    mwrite_uint32_be(header_block->node_levels, buf);
+    mwrite_uint32_be(header_block->record_count, buf);
+    mwrite_uint32_be(header_block->node_count, buf);
+    mwrite_uint32_be(header_block->tree_node_page_size, buf);
+}
@@ -40,8 +40,8 @@
 // http://cpansearch.perl.org/src/WIML/Mac-Alias-Parse-0.20/Parse.pm
 
 #include "amgexport.h"
+#include "dsrecord.h"
 #include <stddef.h>
-#include <CoreServices/CoreServices.h>
 
 #ifdef __cplusplus
 #include <functional>
@@ -53,17 +53,188 @@ typedef struct _ds_record ds_record_t;
 
 typedef struct _ds_store ds_store_t;
 typedef void (*ds_store_record_func_t)(ds_record_t *record);
+typedef void (*ds_store_record_view_func_t)(const ds_record_view_t *view);
+
+/*!
+ * A cursor walks the records of a store in key order, one record per call,
+ * without recursion. The store must outlive the cursor.
+ */
+typedef struct _ds_store_cursor ds_store_cursor_t;
 
 AMG_EXPORT AMG_EXTERN ds_store_t *ds_store_fread(FILE *file);
+AMG_EXPORT AMG_EXTERN ds_store_t *ds_store_open_mapped(const char *path);
 AMG_EXPORT AMG_EXTERN int ds_store_fwrite(ds_store_t *store, FILE *file);
+
+/*!
+ * Writes a new store containing \a records, which must be sorted as by
+ * ds_record_compare and unique. The tree is bulk-loaded bottom-up into full
+ * node pages and the file is emitted with a single write.
+ */
+AMG_EXPORT AMG_EXTERN int ds_store_fwrite_records(FILE *file, ds_record_t *const *records, size_t count);
+
+/*!
+ * Inserts \a record, which must not already be in the store. Changes are
+ * kept in memory until ds_store_fcommit.
+ */
+AMG_EXPORT AMG_EXTERN int ds_store_insert_record(ds_store_t *store, ds_record_t *record);
+
+/*!
+ * Replaces the record with the same filename and type as \a record.
+ */
+AMG_EXPORT AMG_EXTERN int ds_store_replace_record(ds_store_t *store, ds_record_t *record);
+AMG_EXPORT AMG_EXTERN int ds_store_delete_record(ds_store_t *store, const uint16_t *filename, size_t filename_len, ds_record_type type);
+
+/*!
+ * Writes the changes made since the store was read back to \a file, which
+ * must hold the same store (opened for update) or be empty for a store made
+ * with ds_store_create. Only modified node pages, the DSDB header block, the
+ * allocator and the file header are written; modified pages go to newly
+ * allocated blocks, and the blocks they replace are freed afterwards. A
+ * store served from the parse cache has no blocks in any file, so its first
+ * commit writes all of them.
+ */
+AMG_EXPORT AMG_EXTERN int ds_store_fcommit(ds_store_t *store, FILE *file);
 AMG_EXPORT AMG_EXTERN ds_store_t *ds_store_create(void);
 AMG_EXPORT AMG_EXTERN void ds_store_free(ds_store_t *store);
+
+/*!
+ * Enumerates all records in key order. The record passed to \a func is only
+ * borrowed for the call: one record per thread is reused across calls, so a
+ * steady-state scan does not allocate records.
+ */
 AMG_EXPORT AMG_EXTERN int ds_store_enum_records(ds_store_t *store, ds_store_record_func_t func);
 
+AMG_EXPORT AMG_EXTERN ds_store_cursor_t *ds_store_cursor_create(ds_store_t *store);
+AMG_EXPORT AMG_EXTERN void ds_store_cursor_free(ds_store_cursor_t *cursor);
+AMG_EXPORT AMG_EXTERN void ds_store_cursor_reset(ds_store_cursor_t *cursor);
+
+/*!
+ * Reads the next record into \a record, which may be reused across calls.
+ * Returns 1 if a record was read, 0 once all records have been read, or -1
+ * if the store is malformed (after which the cursor stays failed until reset).
+ */
+AMG_EXPORT AMG_EXTERN int ds_store_cursor_next(ds_store_cursor_t *cursor, ds_record_t *record);
+
+/*!
+ * Like ds_store_cursor_next, but reads the record in place into \a view
+ * without copying or allocating anything.
+ */
+AMG_EXPORT AMG_EXTERN int ds_store_cursor_next_view(ds_store_cursor_t *cursor, ds_record_view_t *view);
+
+/*!
+ * Makes ds_store_cursor_next and ds_store_cursor_next_view skip records that do not pass \a filter and
+ * decode only the fields it asks for, or removes the filter if \a filter is
+ * NULL. The filter and its lists are copied.
+ */
+AMG_EXPORT AMG_EXTERN void ds_store_cursor_set_filter(ds_store_cursor_t *cursor, const ds_record_filter_t *filter);
+
+/*!
+ * Positions the cursor so that the next call to ds_store_cursor_next returns
+ * the first record whose key is not less than \a filename and \a type.
+ * Returns 0 on success or 1 if the store is malformed.
+ */
+AMG_EXPORT AMG_EXTERN int ds_store_cursor_seek(ds_store_cursor_t *cursor, const uint16_t *filename, size_t filename_len, ds_record_type type);
+
+/*!
+ * Looks up a single record by descending the B-tree, decoding only the
+ * matching record into \a record. Returns 1 if the record was found, 0 if
+ * it was not, or -1 if the store is malformed.
+ */
+AMG_EXPORT AMG_EXTERN int ds_store_find(ds_store_t *store, const uint16_t *filename, size_t filename_len, ds_record_type type, ds_record_t *record);
+
+/*!
+ * Enumerates, in key order, the records whose filename starts with \a prefix;
+ * passing a complete filename enumerates all records for that file.
+ */
+AMG_EXPORT AMG_EXTERN int ds_store_enum_records_with_prefix(ds_store_t *store, const uint16_t *prefix, size_t prefix_len, ds_store_record_func_t func);
+
+/*!
+ * Enumerates all records in key order as views into the store's pages. The
+ * view passed to \a func is only valid during the call.
+ */
+AMG_EXPORT AMG_EXTERN int ds_store_enum_record_views(ds_store_t *store, ds_store_record_view_func_t func);
+
+/*!
+ * Enumerates, in key order, the records that pass \a filter. The payloads of
+ * other records are skipped without being decoded.
+ */
+AMG_EXPORT AMG_EXTERN int ds_store_enum_records_filtered(ds_store_t *store, const ds_record_filter_t *filter, ds_store_record_func_t func);
+
+/*!
+ * Enumerates all records like ds_store_enum_records, decoding subtrees of
+ * large stores on up to \a thread_count threads (0 for one per CPU). Records
+ * still reach \a func in key order, on the calling thread.
+ */
+AMG_EXPORT AMG_EXTERN int ds_store_enum_records_parallel(ds_store_t *store, unsigned thread_count, ds_store_record_func_t func);
+
 #ifdef __cplusplus
 AMG_EXPORT AMG_EXTERN int ds_store_enum_records_core(ds_store_t *store, const std::function<void(ds_record_t *)> &func);
+AMG_EXPORT AMG_EXTERN int ds_store_enum_records_parallel_core(ds_store_t *store, unsigned thread_count, const std::function<void(ds_record_t *)> &func);
+AMG_EXPORT AMG_EXTERN int ds_store_enum_record_views_core(ds_store_t *store, const std::function<void(const ds_record_view_t *)> &func);
+AMG_EXPORT AMG_EXTERN int ds_store_enum_records_filtered_core(ds_store_t *store, const ds_record_filter_t *filter, const std::function<void(ds_record_t *)> &func);
+AMG_EXPORT AMG_EXTERN int ds_store_enum_records_with_prefix_core(ds_store_t *store, const uint16_t *prefix, size_t prefix_len, const std::function<void(ds_record_t *)> &func);
 #endif
 
+/*!
+ * Upper bound on the number of record types counted separately; records of
+ * any further types are added to an entry with record type 0.
+ */
+#define DS_STORE_STATS_MAX_TYPES 64
+
+typedef struct {
+    ds_record_type record_type;
+    uint64_t records;
+    uint64_t blob_bytes;
+    uint64_t decode_ns;
+} ds_store_type_stats_t;
+
+/*!
+ * Work done reading stores. The file is read in one pass or mapped and
+ * nodes are then located in memory, so reading never seeks the file; each
+ * node visited stands for what would otherwise be a seek and a page read.
+ * Records are counted when they are decoded by enumeration, cursors or
+ * ds_store_find; records a filter skips are not.
+ */
+typedef struct {
+    uint64_t stores;
+    uint64_t file_reads;    // read calls; 0 for mapped stores
+    uint64_t bytes_read;    // bytes read from the file, or mapped
+    uint64_t nodes_visited;
+    uint64_t node_bytes;
+    uint64_t records_decoded;
+    uint64_t blob_bytes;
+
+    // Cumulative time per stage: loading the header and allocator (and
+    // reading the file), locating node pages, and decoding records
+    uint64_t load_ns;
+    uint64_t node_ns;
+    uint64_t decode_ns;
+
+    size_t type_count;
+    ds_store_type_stats_t types[DS_STORE_STATS_MAX_TYPES];
+} ds_store_stats_t;
+
+/*!
+ * Turns collecting statistics on or off for stores opened or created
+ * afterwards. Collecting is off by default and costs nothing while off.
+ */
+AMG_EXPORT AMG_EXTERN void ds_store_set_stats_enabled(int enabled);
+
+/*!
+ * Fills \a stats with the work done on \a store so far; traversals count
+ * once they finish or their cursor is freed. Returns 1 if the store was
+ * opened while statistics were off.
+ */
+AMG_EXPORT AMG_EXTERN int ds_store_get_stats(ds_store_t *store, ds_store_stats_t *stats);
+
+/*!
+ * Fills \a stats with the totals of all stores freed since statistics were
+ * turned on.
+ */
+AMG_EXPORT AMG_EXTERN void ds_store_get_total_stats(ds_store_stats_t *stats);
+AMG_EXPORT AMG_EXTERN void ds_store_reset_total_stats(void);
+AMG_EXPORT AMG_EXTERN void ds_store_stats_dump(const ds_store_stats_t *stats, FILE *file);
+
 AMG_EXPORT AMG_EXTERN void ds_store_dump_header(ds_store_t *store);
 AMG_EXPORT AMG_EXTERN void ds_store_dump_allocator_state(ds_store_t *store);
 AMG_EXPORT AMG_EXTERN void dsstore_header_dumpblock(ds_store_t *store);
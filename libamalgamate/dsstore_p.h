@@ -25,7 +25,9 @@
 #ifndef AMALGAMATE_DSSTORE_P_H
 #define AMALGAMATE_DSSTORE_P_H
 
+#include "dsio.h"
 #include "dsstore.h"
+#include <vector>
 
 typedef struct {
     uint32_t version;
@@ -38,24 +40,61 @@ typedef struct {
 } dsstore_header_t;
 
 typedef struct {
-    uint32_t block_count;
+    uint8_t count;
+    uint8_t bytes[255];
+    uint32_t block_number;
+} dsstore_buddy_allocator_directory_entry_t;
+
+/*!
+ * Upper bound on the number of blocks: the buddy address space of 2^31 bytes
+ * holds at most this many blocks of the minimum size of 32 bytes.
+ */
+static const uint32_t dsstore_buddy_allocator_max_blocks = 1u << 26;
+
+/*!
+ * Tables are sized to the store rather than to a fixed maximum: the block
+ * count, directory count and free list counts are the sizes of the vectors.
+ */
+typedef struct {
     uint32_t unknown;
-    uint32_t block_addresses[256 * sizeof(uint32_t)];
-    uint32_t directory_count;
-    struct {
-        uint8_t count;
-        uint8_t bytes[255];
-        uint32_t block_number;
-    } directory_entries[256];
-    struct {
-        uint32_t count;
-        uint32_t offsets[256];
-    } free_lists[32];
+    std::vector<uint32_t> block_addresses;
+    std::vector<dsstore_buddy_allocator_directory_entry_t> directory_entries;
+    std::vector<uint32_t> free_lists[32];
 } dsstore_buddy_allocator_state_t;
 
 AMG_EXPORT AMG_EXTERN uint32_t dsstore_buddy_allocator_state_block_address_offset(uint32_t a);
 AMG_EXPORT AMG_EXTERN uint32_t dsstore_buddy_allocator_state_block_address_size(uint32_t a);
 
+/*!
+ * Resets \a allocator to an empty address space in which only the file
+ * header block at offset 0 is in use.
+ */
+AMG_EXPORT AMG_EXTERN void dsstore_buddy_allocator_init(dsstore_buddy_allocator_state_t *allocator);
+
+/*!
+ * Allocates a block of at least \a size bytes from the smallest free block
+ * that fits, splitting it as needed, and returns its packed address.
+ */
+AMG_EXPORT AMG_EXTERN int dsstore_buddy_allocator_alloc(dsstore_buddy_allocator_state_t *allocator, uint32_t size, uint32_t *address);
+
+/*!
+ * Returns the block at packed \a address to the free lists, merging it with
+ * its buddy for as long as that is free as well.
+ */
+AMG_EXPORT AMG_EXTERN int dsstore_buddy_allocator_free(dsstore_buddy_allocator_state_t *allocator, uint32_t address);
+
+/*!
+ * Returns the end of the last block in use, relative to the end of the
+ * header's version field; the file needs to extend at least this far.
+ */
+AMG_EXPORT AMG_EXTERN uint32_t dsstore_buddy_allocator_extent(const dsstore_buddy_allocator_state_t *allocator);
+
+/*!
+ * Verifies that every allocated and free block is aligned to its size and
+ * that no two blocks overlap. Returns 0 if the allocator is consistent.
+ */
+AMG_EXPORT AMG_EXTERN int dsstore_buddy_allocator_check(const dsstore_buddy_allocator_state_t *allocator);
+
 typedef struct {
     uint32_t root_block_number;
     uint32_t node_levels;
@@ -74,10 +113,32 @@ AMG_EXPORT AMG_EXTERN int dsstore_buddy_allocator_state_fread(dsstore_buddy_allo
 AMG_EXPORT AMG_EXTERN int dsstore_buddy_allocator_state_fwrite(dsstore_buddy_allocator_state_t *allocator_state, FILE *file);
 AMG_EXPORT AMG_EXTERN int dsstore_header_block_fread(dsstore_header_block_t *header_block, FILE *file);
 
+AMG_EXPORT AMG_EXTERN int dsstore_header_mread(dsstore_header_t *header, ds_membuf_t *buf);
+AMG_EXPORT AMG_EXTERN int dsstore_buddy_allocator_state_mread(dsstore_buddy_allocator_state_t *allocator_state, ds_membuf_t *buf);
+AMG_EXPORT AMG_EXTERN int dsstore_header_block_mread(dsstore_header_block_t *header_block, ds_membuf_t *buf);
+
+#ifdef __cplusplus
+AMG_EXPORT extern void dsstore_header_mwrite(dsstore_header_t *header, std::vector<unsigned char> &buf);
+AMG_EXPORT extern void dsstore_buddy_allocator_state_mwrite(dsstore_buddy_allocator_state_t *allocator_state, std::vector<unsigned char> &buf);
+AMG_EXPORT extern void dsstore_header_block_mwrite(dsstore_header_block_t *header_block, std::vector<unsigned char> &buf);
+
+/*!
+ * Appends the encodings of all records in \a store to \a records in key
+ * order, without decoding them, and sets \a count to their number.
+ */
+AMG_EXPORT extern int ds_store_copy_record_data(ds_store_t *store, std::vector<unsigned char> &records, uint32_t *count);
+
+/*!
+ * Creates a store from record encodings in key order, as copied by
+ * ds_store_copy_record_data, laid out in pages as ds_store_fwrite_records does.
+ */
+AMG_EXPORT extern ds_store_t *ds_store_create_with_record_data(const unsigned char *records, size_t size, uint32_t count);
+#endif
+
 // Debugging
 
 #ifdef __cplusplus
-AMG_EXPORT AMG_EXTERN int ds_store_enum_blocks_core(dsstore_buddy_allocator_state_t *allocator, dsstore_header_block_t *header_block, uint32_t block_number, const std::function<void(ds_record_t *)> &record_func, FILE *file);
+AMG_EXPORT AMG_EXTERN int ds_store_enum_blocks_core(dsstore_buddy_allocator_state_t *allocator, dsstore_header_block_t *header_block, uint32_t block_number, const std::function<void(ds_record_t *)> &record_func, const ds_membuf_t *data);
 #endif
 
 AMG_EXPORT AMG_EXTERN int ds_store_enum_blocks(dsstore_buddy_allocator_state_t *allocator, dsstore_header_block_t *header_block, uint32_t block_number, ds_store_record_func_t record_func, FILE *file);